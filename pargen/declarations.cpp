@@ -72,6 +72,9 @@ PhrasePart::toString ()
 
 	    return st_makeString ("Label ", phrase_part__label->label_name);
 	} break;
+	case PhrasePart::t_Cut: {
+	    return st_grab (new (std::nothrow) String ("Cut"));
+	} break;
 	default:
 	  // No-op
 	    ;
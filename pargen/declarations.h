@@ -35,7 +35,8 @@ class Declaration : public StReferenced
 public:
     enum Type {
 	t_Phrases,
-	t_Callbacks
+	t_Callbacks,
+	t_TokenClass
     };
 
     const Type declaration_type;
@@ -59,6 +60,39 @@ public:
     StRef<String> callback_name;
 };
 
+// Declaration
+//     Declaration_TokenClass
+
+// Token class ("name ~ pattern"), referred to as "{name}" in phrases.
+// The pattern is compiled into a DFA by compileTokenDfa().
+class Declaration_TokenClass : public Declaration
+{
+public:
+    StRef<String> pattern;
+
+    // See TokenDfa for the meaning of these fields.
+    Size num_states;
+    Uint16 *tranzitions;
+    Byte *accepting;
+    Uint32 first_bytes [8];
+
+    Declaration_TokenClass ()
+	: Declaration (Declaration::t_TokenClass),
+	  num_states (0),
+	  tranzitions (NULL),
+	  accepting (NULL)
+    {
+	for (unsigned i = 0; i < 8; ++i)
+	    first_bytes [i] = 0;
+    }
+
+    ~Declaration_TokenClass ()
+    {
+	delete[] tranzitions;
+	delete[] accepting;
+    }
+};
+
 // Declaration
 //      Declaration_Phrases
 
@@ -81,6 +115,21 @@ public:
 
     List< StRef<PhraseRecord> > phrases;
 
+    // Operator-precedence declarations ("name % operand") are represented
+    // with two phrases: "Operand" (a single operand) and "Binary"
+    // ("left <operator> right"). The parser handles them with a single
+    // precedence-climbing grammar built from 'precedence_levels'.
+    class PrecedenceLevel : public StReferenced
+    {
+    public:
+	Bool right_assoc;
+	List< StRef<String> > operators;
+    };
+
+    Bool is_precedence;
+    // From the lowest precedence to the highest one.
+    List< StRef<PrecedenceLevel> > precedence_levels;
+
     // Used for detecting infinite grammar loops when linking upwards anchors.
     Size loop_id;
     Size decl_loop_id;
@@ -132,7 +181,8 @@ public:
 	t_AcceptCb,
 	t_UniversalAcceptCb,
 	t_UpwardsAnchor,
-	t_Label
+	t_Label,
+	t_Cut
     };
 
     const Type phrase_part_type;
@@ -181,9 +231,18 @@ public:
     // If null, then any token matches.
     StRef<String> token;
     StRef<String> token_match_cb;
+    // "{pure cb}": the result of 'token_match_cb' depends on the token only,
+    // so it may be memoized per token position.
+    Bool token_match_cb_pure;
+    // Set when linking if 'token_match_cb' names a token class.
+    StRef<Declaration_TokenClass> token_class;
+    // Index of the literal 'token' in PargenTask::literal_tokens plus 1,
+    // 0 if this is not a literal token.
+    Uint32 token_id;
 
     PhrasePart_Token ()
-	: PhrasePart (PhrasePart::t_Token)
+	: PhrasePart (PhrasePart::t_Token),
+	  token_id (0)
     {
     }
 };
@@ -266,6 +325,25 @@ public:
     }
 };
 
+// Declaration
+//     Declaration_Phrases
+//         Phrase
+//             PhrasePart
+//                 PhrasePart_Cut
+
+// Cut ("!"): once the parser gets past this point, it never backtracks
+// to the alternatives of the phrase which contains the cut. A failure of
+// the rest of the phrase fails the whole parse with a syntax error,
+// hence enclosing phrases don't get to try their alternatives either.
+class PhrasePart_Cut : public PhrasePart
+{
+public:
+    PhrasePart_Cut ()
+	: PhrasePart (PhrasePart::t_Cut)
+    {
+    }
+};
+
 // Declaration
 //     Declaration_Callbacks
 
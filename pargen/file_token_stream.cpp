@@ -213,35 +213,6 @@ FileTokenStream::getNextToken (ConstMemory * const ret_mem)
     return Result::Failure;
 }
 
-mt_throws Result
-FileTokenStream::getPosition (PositionMarker * const mt_nonnull ret_pmark)
-{
-    if (!file->tell (&ret_pmark->body.offset))
-        return Result::Failure;
-
-    ret_pmark->body.cur_line = cur_line;
-    ret_pmark->body.cur_line_start = cur_line_start;
-    return Result::Success;
-}
-
-mt_throws Result
-FileTokenStream::setPosition (PositionMarker const * const mt_nonnull pmark)
-{
-  DEBUG_FLO (
-    errs->println (_func_);
-  )
-
-    cur_line = pmark->body.cur_line;
-    cur_line_start = pmark->body.cur_line_start;
-    cur_char_pos = pmark->body.offset;
-
-//	file->seekSet (pmark->body.offset);
-    if (!file->seek (pmark->body.offset, SeekOrigin::Beg))
-        return Result::Failure;
-
-    return Result::Success;
-}
-
 mt_throws Result
 FileTokenStream::getFilePosition (FilePosition * const ret_fpos)
 {
@@ -254,6 +225,15 @@ FileTokenStream::getFilePosition (FilePosition * const ret_fpos)
     return Result::Success;
 }
 
+void
+FileTokenStream::getTokenSpan (FileSize * const mt_nonnull ret_begin,
+                               FileSize * const mt_nonnull ret_end)
+{
+    // Tokens are not unescaped, hence 'token_len' is their length in the file.
+    *ret_begin = cur_char_pos;
+    *ret_end   = cur_char_pos + token_len;
+}
+
 #if 0
 unsigned long
 FileTokenStream::getLine ()
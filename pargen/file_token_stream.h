@@ -51,12 +51,23 @@ public:
   mt_iface (TokenStream)
     mt_throws Result getNextToken (ConstMemory *ret_mem);
 
-    mt_throws Result getPosition (PositionMarker * mt_nonnull ret_pmark);
-
-    mt_throws Result setPosition (PositionMarker const *pmark);
+    // Position methods are inline: the parser has an instantiation
+    // which calls them non-virtually for file token streams.
+    mt_throws Result getPosition (PositionMarker * const mt_nonnull ret_pmark)
+    {
+        return getPositionBody (&ret_pmark->body);
+    }
+
+    mt_throws Result setPosition (PositionMarker const * const mt_nonnull pmark)
+    {
+        return setPositionBody (&pmark->body);
+    }
 
     mt_throws Result getFilePosition (FilePosition *ret_fpos);
 
+    void getTokenSpan (FileSize * mt_nonnull ret_begin,
+                       FileSize * mt_nonnull ret_end);
+
 #if 0
     unsigned long getLine ();
 
@@ -65,6 +76,29 @@ public:
 #endif
   mt_iface_end
 
+    // Positions without a PositionMarker around them.
+    mt_throws Result getPositionBody (PositionMarker::Body * const mt_nonnull ret_body)
+    {
+        if (!file->tell (&ret_body->offset))
+            return Result::Failure;
+
+        ret_body->cur_line = cur_line;
+        ret_body->cur_line_start = cur_line_start;
+        return Result::Success;
+    }
+
+    mt_throws Result setPositionBody (PositionMarker::Body const * const mt_nonnull body)
+    {
+        cur_line = body->cur_line;
+        cur_line_start = body->cur_line_start;
+        cur_char_pos = body->offset;
+
+        if (!file->seek (body->offset, SeekOrigin::Beg))
+            return Result::Failure;
+
+        return Result::Success;
+    }
+
     FileTokenStream (File * mt_nonnull file,
 		     bool  report_newlines = false,
                      bool  minus_is_alpha  = false,
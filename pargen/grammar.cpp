@@ -35,6 +35,28 @@ SwitchGrammarEntry::~SwitchGrammarEntry ()
 	TranzitionEntry * const tranzition_entry = tranzition_entries.iter_next (iter);
 	delete tranzition_entry;
     }
+
+    delete[] tranzition_token_ids;
+}
+
+void
+SwitchGrammarEntry::addTranzitionTokenId (Uint32 const token_id)
+{
+    Size const word = token_id >> 5;
+    if (word >= num_tranzition_token_id_words) {
+	Size const new_num_words = word + 1;
+	Uint32 * const new_ids = new (std::nothrow) Uint32 [new_num_words];
+	assert (new_ids);
+
+	for (Size i = 0; i < new_num_words; ++i)
+	    new_ids [i] = (i < num_tranzition_token_id_words ? tranzition_token_ids [i] : 0);
+
+	delete[] tranzition_token_ids;
+	tranzition_token_ids = new_ids;
+	num_tranzition_token_id_words = new_num_words;
+    }
+
+    tranzition_token_ids [word] |= (Uint32) 1 << (token_id & 31);
 }
 
 StRef<String>
@@ -49,11 +71,92 @@ Grammar_Compound::toString ()
     return name;
 }
 
+void
+Grammar_Compound::freeze ()
+{
+    if (frozen)
+	return;
+
+    first_subgrammar_entry = getFirstSubgrammarEntry ();
+    second_subgrammar_el = getSecondSubgrammarElement ();
+
+    List< StRef<CompoundGrammarEntry> >::DataIterator iter (grammar_entries);
+    while (!iter.done ()) {
+	StRef<CompoundGrammarEntry> &entry = iter.next ();
+	if (!entry->is_jump)
+	    continue;
+
+	assert (entry->jump_grammar->grammar_type == Grammar::t_Switch);
+	Grammar_Switch * const grammar__switch = static_cast <Grammar_Switch*> (entry->jump_grammar);
+
+	if (entry->jump_switch_grammar_entry == NULL) {
+	    entry->jump_switch_grammar_entry =
+		    grammar__switch->grammar_entries.getIthElement (entry->jump_switch_grammar_index);
+	}
+
+	SwitchGrammarEntry * const switch_ge = entry->jump_switch_grammar_entry->data;
+	assert (switch_ge->grammar->grammar_type == Grammar::t_Compound);
+	Grammar_Compound * const grammar__compound = static_cast <Grammar_Compound*> (switch_ge->grammar.ptr ());
+
+	if (entry->jump_compound_grammar_entry == NULL &&
+	    grammar__compound->grammar_entries.getNumElements () != entry->jump_compound_grammar_index)
+	{
+	    entry->jump_compound_grammar_entry =
+		    grammar__compound->grammar_entries.getIthElement (entry->jump_compound_grammar_index);
+	}
+    }
+
+    frozen = true;
+}
+
 StRef<String>
 Grammar_Switch::toString ()
 {
     return name;
 }
 
+Grammar_Switch::~Grammar_Switch ()
+{
+    PredictEntryHash::iter iter (predict_entries);
+    while (!predict_entries.iter_done (iter)) {
+	PredictEntry * const predict_entry = predict_entries.iter_next (iter);
+	delete predict_entry;
+    }
+
+    delete[] predict_by_id;
+}
+
+bool
+Grammar_Precedence::addOperator (ConstMemory const token,
+				 Uint32      const precedence,
+				 bool        const right_assoc)
+{
+    if (operators.lookup (token))
+	return false;
+
+    Operator * const op = new (std::nothrow) Operator;
+    assert (op);
+    op->token = st_grab (new (std::nothrow) String (token));
+    op->precedence = precedence;
+    op->right_assoc = right_assoc;
+    operators.add (op);
+    return true;
+}
+
+StRef<String>
+Grammar_Precedence::toString ()
+{
+    return name;
+}
+
+Grammar_Precedence::~Grammar_Precedence ()
+{
+    OperatorHash::iter iter (operators);
+    while (!operators.iter_done (iter)) {
+	Operator * const op = operators.iter_next (iter);
+	delete op;
+    }
+}
+
 }
 
@@ -25,6 +25,7 @@
 
 #include <pargen/parser_element.h>
 #include <pargen/acceptor.h>
+#include <pargen/token_dfa.h>
 
 
 namespace Pargen {
@@ -62,11 +63,16 @@ public:
     typedef bool (*JumpFunc) (ParserElement *parser_element,
 			      void          *data);
 
+    // Maps a token to the id of the literal token of the grammar
+    // which it equals to, or to 0 if there's no such literal.
+    typedef Uint32 (*TokenClassifyFunc) (ConstMemory const &token);
+
     enum Type {
 	t_Immediate,
 	t_Compound,
 	t_Switch,
-	t_Alias
+	t_Alias,
+	t_Precedence
     };
 
     const Type grammar_type;
@@ -82,11 +88,15 @@ public:
     // and chosen as the preferred one among the alternatives.
     AcceptFunc accept_func;
 
-    // Used for detecting infinite grammar loops when optimizing.
+    // Index of the grammar plus 1 while optimizeGrammar() or
+    // saveGrammarSnapshot() numbers grammars, 0 otherwise.
     Size loop_id;
 
     Bool optimized;
 
+    // Generated keyword recognizer. Set for the top-level grammar only.
+    TokenClassifyFunc token_classify_func;
+
     // Returns string representation of the grammar for debugging output.
     virtual StRef<String> toString () = 0;
 
@@ -97,10 +107,65 @@ public:
 	match_func = NULL;
 	accept_func = NULL;
 
+	token_classify_func = NULL;
+
 	loop_id = 0;
     }
 };
 
+// Reference from a grammar to its subgrammar. Owning by default.
+// Non-owning references point back to grammars which own the referring
+// one, so that recursive grammars don't form reference cycles
+// (see CompoundGrammarEntry::jump_grammar as well).
+class GrammarRef
+{
+private:
+    StRef<Grammar> owned_grammar;
+    Grammar *grammar;
+
+public:
+    Grammar* ptr () const
+    {
+	return grammar;
+    }
+
+    operator Grammar* () const
+    {
+	return grammar;
+    }
+
+    Grammar* operator -> () const
+    {
+	return grammar;
+    }
+
+    void setNonOwning (Grammar * const mt_nonnull new_grammar)
+    {
+	owned_grammar = NULL;
+	grammar = new_grammar;
+    }
+
+    template <class T>
+    GrammarRef& operator = (StRef<T> const &new_grammar)
+    {
+	owned_grammar = new_grammar;
+	grammar = owned_grammar;
+	return *this;
+    }
+
+    GrammarRef& operator = (Grammar * const new_grammar)
+    {
+	owned_grammar = new_grammar;
+	grammar = new_grammar;
+	return *this;
+    }
+
+    GrammarRef ()
+	: grammar (NULL)
+    {
+    }
+};
+
 // FIXME Grammar_Immediate_SingleToken should become Grammar_Immediate.
 //       Currently, this is assumed when we do optimizations.
 class Grammar_Immediate : public Grammar
@@ -128,8 +193,18 @@ public:
 					void        *user_data);
 
     TokenMatchCallback token_match_cb;
+    // If set, then the result of 'token_match_cb' depends on the token only
+    // (including 'token_user_ptr'), and the parser calls it at most once
+    // for every token position.
+    Bool token_match_cb_pure;
+    // Token class. Unlike 'token_match_cb', it is transparent for
+    // optimizeGrammar().
+    TokenDfa const *token_dfa;
     // For debug dumps.
     StRef<String> token_match_cb_name;
+    // Id of the literal 'token' as returned by Grammar::TokenClassifyFunc,
+    // 0 if not assigned.
+    Uint32 token_id;
 
 protected:
     // If null, then any token matches.
@@ -147,6 +222,9 @@ public:
 		void        * const token_user_ptr,
 		void        * const user_data)
     {
+	if (token_dfa)
+	    return token_dfa->match (t);
+
 	if (token_match_cb)
 	    return token_match_cb (t, token_user_ptr, user_data);
 
@@ -159,18 +237,35 @@ public:
     // If token is NULL, then any token matches.
     Grammar_Immediate_SingleToken (char const * const token)
 	: token_match_cb (NULL),
+          token_dfa (NULL),
+          token_id (0),
           token (st_grab (new String (token)))
     {
     }
+
+    // Shares 'token' with the caller. Generated grammars pass the same
+    // string for all occurrences of a literal token.
+    Grammar_Immediate_SingleToken (StRef<String> const &token)
+	: token_match_cb (NULL),
+          token_dfa (NULL),
+          token_id (0),
+          token (token)
+    {
+    }
 };
 
 class TranzitionMatchEntry : public StReferenced
 {
 public:
+    // Either 'token_dfa' or 'token_match_cb' is non-null.
+    TokenDfa const *token_dfa;
     Grammar_Immediate_SingleToken::TokenMatchCallback token_match_cb;
+    // See Grammar_Immediate_SingleToken::token_match_cb_pure.
+    Bool token_match_cb_pure;
 
     TranzitionMatchEntry ()
-	: token_match_cb (NULL)
+	: token_dfa (NULL),
+	  token_match_cb (NULL)
     {
     }
 };
@@ -182,7 +277,7 @@ public:
 	Dominating = 0x1 // Currently unused
     };
 
-    StRef<Grammar> grammar;
+    GrammarRef grammar;
     Uint32 flags;
 
     List< StRef<String> > variants;
@@ -212,9 +307,50 @@ public:
     List< StRef<TranzitionMatchEntry> > tranzition_match_entries;
     bool any_tranzition;
 
+    // Bitmap of ids of literal tokens in 'tranzition_entries'.
+    // Used instead of a hash lookup when the grammar has a token classifier.
+    // If 'tranzition_ids_incomplete' is set, then some of the literals
+    // have no ids, and the bitmap can't be relied upon.
+    Uint32 *tranzition_token_ids;
+    Size num_tranzition_token_id_words;
+    bool tranzition_ids_incomplete;
+
+    void addTranzitionTokenId (Uint32 token_id);
+
+    bool hasTranzitionTokenId (Uint32 const token_id) const
+    {
+	Size const word = token_id >> 5;
+	if (word >= num_tranzition_token_id_words)
+	    return false;
+
+	return tranzition_token_ids [word] & ((Uint32) 1 << (token_id & 31));
+    }
+
+    // Set by optimizeGrammar() for compound grammars which start with
+    // a reference to the parent switch grammar.
+    Bool left_recursive;
+    // For left-recursive entries: possible tranzitions for the tail
+    // of the compound grammar, i.e. for what follows the left-recursive
+    // reference. Set by optimizeGrammar().
+    StRef<SwitchGrammarEntry> lr_tail;
+
+    enum { MaxSharedPrefixLen = 4 };
+
+    // Number of leading subgrammars which this compound grammar shares
+    // with the next entry of the switch grammar (left factoring).
+    // When the entry fails after the shared prefix has been matched,
+    // the parser hands the prefix over to the next entry instead of
+    // parsing it again. Set by optimizeGrammar() for non-left-recursive
+    // entries, not greater than MaxSharedPrefixLen.
+    Size shared_prefix_len;
+
     SwitchGrammarEntry ()
 	: flags (0),
-	  any_tranzition (false)
+	  any_tranzition (false),
+	  tranzition_token_ids (NULL),
+	  num_tranzition_token_id_words (0),
+	  tranzition_ids_incomplete (false),
+	  shared_prefix_len (0)
     {
     }
 
@@ -232,25 +368,33 @@ public:
     protected:
 	AssignmentFunc assignment_func;
 	ParserElement *compound_element;
+	// If non-null, then the subelement is stored here as well.
+	ParserElement **record_subel;
 
     public:
 	void setParserElement (ParserElement * const parser_element)
 	{
+	    if (record_subel)
+		*record_subel = parser_element;
+
 	    if (assignment_func != NULL)
 		assignment_func (compound_element, parser_element);
 	}
 
 	void init (AssignmentFunc   const assignment_func,
-		   ParserElement  * const compound_element /* non-null */)
+		   ParserElement  * const compound_element /* non-null */,
+		   ParserElement ** const record_subel = NULL)
 	{
 	    this->assignment_func = assignment_func;
 	    this->compound_element = compound_element;
+	    this->record_subel = record_subel;
 	}
 
 	Acceptor (AssignmentFunc   const assignment_func,
 		  ParserElement  * const mt_nonnull compound_element)
             : assignment_func  (assignment_func),
-              compound_element (compound_element)
+              compound_element (compound_element),
+              record_subel     (NULL)
 	{
 	    assert (compound_element);
 	}
@@ -282,23 +426,28 @@ public:
     Size jump_compound_grammar_index;
     List< StRef<CompoundGrammarEntry> >::Element *jump_compound_grammar_entry;
 
+    // Cut ("!" in .par). If 'is_cut' is true, then all other fields
+    // should be considered invalid.
+    Bool is_cut;
+
     // If inline_match_func is non-null, then all other fields
     // should be considered invalid.
     Grammar::InlineMatchFunc inline_match_func;
 
-    StRef<Grammar> grammar;
+    GrammarRef grammar;
     Uint32 flags;
 
     AssignmentFunc assignment_func;
 
     static VSlab<Acceptor> acceptor_slab;
 
-    VSlabRef<Acceptor> createAcceptorFor (ParserElement *compound_element)
+    VSlabRef<Acceptor> createAcceptorFor (ParserElement  *compound_element,
+					  ParserElement **record_subel = NULL)
     {
-	// TODO If assignment_func is NULL, then there's probably no need
-	// in allocating the acceptor at all.
+	// Note: the parser doesn't use acceptors for compound entries,
+	// it calls 'assignment_func' directly.
 	VSlabRef<Acceptor> acceptor = VSlabRef<Acceptor>::forRef <Acceptor> (acceptor_slab.alloc ());
-	acceptor->init (assignment_func, compound_element);
+	acceptor->init (assignment_func, compound_element, record_subel);
 	return acceptor;
     }
 
@@ -326,14 +475,42 @@ public:
     ElementCreationFunc elem_creation_func;
     List< StRef<CompoundGrammarEntry> > grammar_entries;
 
+    // Set by optimizeGrammar() for right-recursive grammars which end with
+    // an optional reference to themselves ("list: item list_opt").
+    // The parser handles such references as iterations of the same step.
+    Bool tail_iteration;
+
+    // Set by freeze(). The grammar must not be changed afterwards.
+    Bool frozen;
+    CompoundGrammarEntry *first_subgrammar_entry;
+    List< StRef<CompoundGrammarEntry> >::Element *second_subgrammar_el;
+
     StRef<String> toString ();
 
+    // Caches getFirstSubgrammarEntry() and getSecondSubgrammarElement(),
+    // and resolves the targets of upwards jumps, so that the parser neither
+    // walks nor modifies the entries. Called by optimizeGrammar().
+    //
+    // Entries stay in 'grammar_entries': parsing steps, position markers,
+    // jump targets and switch prediction tables refer to list elements.
+    // The parser goes to the next entry with a single 'next' load, and an
+    // array of entries would save only the load of 'data'.
+    void freeze ();
+
     List< StRef<CompoundGrammarEntry> >::Element* getSecondSubgrammarElement ()
     {
+	if (frozen)
+	    return second_subgrammar_el;
+
 	Size i = 0;
 	List< StRef<CompoundGrammarEntry> >::Iterator ge_iter (grammar_entries);
 	while (!ge_iter.done ()) {
 	    List< StRef<CompoundGrammarEntry> >::Element &ge_el = ge_iter.next ();
+	    if (ge_el.data->is_cut) {
+		// A cut right after the first subgrammar must not be skipped.
+		if (i > 0)
+		    return &ge_el;
+	    } else
 	    if (ge_el.data->inline_match_func == NULL) {
 		i ++;
 		if (i > 1)
@@ -346,11 +523,17 @@ public:
 
     CompoundGrammarEntry* getFirstSubgrammarEntry ()
     {
+	if (frozen)
+	    return first_subgrammar_entry;
+
 	List< StRef<CompoundGrammarEntry> >::DataIterator ge_iter (grammar_entries);
 	while (!ge_iter.done ()) {
 	    StRef<CompoundGrammarEntry> &ge = ge_iter.next ();
-	    if (ge->inline_match_func == NULL)
+	    if (ge->inline_match_func == NULL &&
+		!ge->is_cut)
+	    {
 		return ge;
+	    }
 	}
 
 	return NULL;
@@ -371,7 +554,9 @@ public:
     }
 
     Grammar_Compound (ElementCreationFunc elem_creation_func)
-	: Grammar (Grammar::t_Compound)
+	: Grammar (Grammar::t_Compound),
+	  first_subgrammar_entry (NULL),
+	  second_subgrammar_el (NULL)
     {
 	this->elem_creation_func = elem_creation_func;
     }
@@ -384,12 +569,55 @@ public:
 
     List< StRef<SwitchGrammarEntry> > grammar_entries;
 
+    // Left-recursive entries of 'grammar_entries', in the same order.
+    // Valid only if 'lr_entries_ready' is true, see optimizeGrammar().
+    List< StRef<SwitchGrammarEntry> > lr_grammar_entries;
+    Bool lr_entries_ready;
+
+    // Set by optimizeGrammar() if the non-left-recursive entry to try
+    // can be predicted by the next token: the entries start with literal
+    // tokens only, none of them matches an empty sequence, and the sets
+    // of first tokens of the entries are disjoint.
+    Bool predictive;
+
+    class PredictEntry : public M::HashEntry<>
+    {
+    public:
+	StRef<String> token;
+	List< StRef<SwitchGrammarEntry> >::Element *entry_el;
+    };
+
+    typedef M::Hash< PredictEntry,
+		     Memory,
+		     MemberExtractor< PredictEntry,
+				      StRef<String>,
+				      &PredictEntry::token,
+				      Memory,
+				      AccessorExtractor< String,
+							 Memory,
+							 &String::mem > >,
+		     MemoryComparator<> >
+	    PredictEntryHash;
+
+    // First token -> entry to try.
+    PredictEntryHash predict_entries;
+
+    // Same as 'predict_entries', indexed by token id (see
+    // Grammar::TokenClassifyFunc). Null if some of the first tokens
+    // have no ids.
+    List< StRef<SwitchGrammarEntry> >::Element **predict_by_id;
+    Size num_predict_ids;
+
     StRef<String> toString ();
 
     Grammar_Switch ()
-	: Grammar (Grammar::t_Switch)
+	: Grammar (Grammar::t_Switch),
+	  predict_by_id (NULL),
+	  num_predict_ids (0)
     {
     }
+
+    ~Grammar_Switch ();
 };
 
 class Grammar_Alias : public Grammar
@@ -397,7 +625,7 @@ class Grammar_Alias : public Grammar
 public:
     StRef<String> name;
 
-    StRef<Grammar> aliased_grammar;
+    GrammarRef aliased_grammar;
 
     StRef<String> toString ()
     {
@@ -411,6 +639,68 @@ public:
     }
 };
 
+// Operator-precedence grammar ("name % operand" in .par).
+// Parses sequences of the form "operand (operator operand)*" with precedence
+// climbing instead of going through a chain of switch grammars, one per
+// precedence level. The resulting tree consists of the usual elements
+// created by 'binary_grammar' ("left <operator> right") with the operands
+// matched by 'operand_grammar' at the leaves.
+class Grammar_Precedence : public Grammar
+{
+public:
+    class Operator : public M::HashEntry<>
+    {
+    public:
+	StRef<String> token;
+	// Greater values bind tighter.
+	Uint32 precedence;
+	Bool right_assoc;
+    };
+
+    typedef M::Hash< Operator,
+		     Memory,
+		     MemberExtractor< Operator,
+				      StRef<String>,
+				      &Operator::token,
+				      Memory,
+				      AccessorExtractor< String,
+							 Memory,
+							 &String::mem > >,
+		     MemoryComparator<> >
+	    OperatorHash;
+
+    StRef<String> name;
+
+    GrammarRef operand_grammar;
+    // Compound grammar "<left> * <right>". Its entries' assignment functions
+    // are used to fill in the elements when reducing. Its match_func() and
+    // accept_func() are called for each reduced element; a rejected element
+    // fails the whole phrase.
+    GrammarRef binary_grammar;
+
+    OperatorHash operators;
+
+    // Returns false if there's an operator with the same token already.
+    // The operator is not added then.
+    bool addOperator (ConstMemory token,
+		      Uint32      precedence,
+		      bool        right_assoc);
+
+    Operator* lookupOperator (ConstMemory const token)
+    {
+	return operators.lookup (token);
+    }
+
+    StRef<String> toString ();
+
+    Grammar_Precedence ()
+	: Grammar (Grammar::t_Precedence)
+    {
+    }
+
+    ~Grammar_Precedence ();
+};
+
 }
 
 
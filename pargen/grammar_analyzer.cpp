@@ -0,0 +1,1237 @@
+/*  Pargen - Flexible parser generator
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#include <pargen/token_dfa.h>
+#include <pargen/parsing_exception.h>
+
+#include <pargen/grammar_analyzer.h>
+
+
+using namespace M;
+
+namespace Pargen {
+
+namespace {
+
+// Terminals are what a phrase may start with. Terminal 0 is "any token",
+// literal tokens go next (their indices are token ids), then token classes,
+// then token match callbacks.
+class Terminal
+{
+public:
+    enum Kind {
+	AnyToken,
+	Literal,
+	TokenClass,
+	Callback
+    };
+
+    Kind kind;
+    StRef<String> name;
+    Declaration_TokenClass *token_class;
+
+    Terminal ()
+	: kind (AnyToken),
+	  token_class (NULL)
+    {
+    }
+};
+
+class TerminalSet
+{
+public:
+    Uint32 *words;
+    Size num_words;
+
+    void init (Size const num_terminals)
+    {
+	num_words = num_terminals / 32 + 1;
+	words = new (std::nothrow) Uint32 [num_words];
+	assert (words);
+	for (Size i = 0; i < num_words; ++i)
+	    words [i] = 0;
+    }
+
+    bool contains (Size const i) const
+    {
+	return words [i >> 5] & ((Uint32) 1 << (i & 31));
+    }
+
+    // Returns 'true' if the set has changed.
+    bool add (Size const i)
+    {
+	Uint32 const bit = (Uint32) 1 << (i & 31);
+	if (words [i >> 5] & bit)
+	    return false;
+
+	words [i >> 5] |= bit;
+	return true;
+    }
+
+    // Returns 'true' if the set has changed.
+    bool addSet (TerminalSet const &set)
+    {
+	bool changed = false;
+	for (Size i = 0; i < num_words; ++i) {
+	    Uint32 const new_word = words [i] | set.words [i];
+	    if (new_word != words [i]) {
+		words [i] = new_word;
+		changed = true;
+	    }
+	}
+
+	return changed;
+    }
+
+    bool isEmpty () const
+    {
+	for (Size i = 0; i < num_words; ++i) {
+	    if (words [i])
+		return false;
+	}
+
+	return true;
+    }
+
+    TerminalSet ()
+	: words (NULL),
+	  num_words (0)
+    {
+    }
+
+    ~TerminalSet ()
+    {
+	delete[] words;
+    }
+};
+
+// A phrase part which matters for the analysis: either a reference
+// to a declaration or a terminal.
+class Item
+{
+public:
+    bool is_decl;
+    Size index;
+    bool opt;
+};
+
+class Alternative
+{
+public:
+    // Holds 'phrase' while decl->phrases is being rebuilt,
+    // see reorderAlternatives().
+    StRef<Declaration_Phrases::PhraseRecord> phrase_record;
+    Phrase *phrase;
+
+    Item *items;
+    Size num_items;
+
+    TerminalSet first;
+    bool nullable;
+
+    // From the profile, see applyGrammarProfile().
+    Uint64 num_hits;
+
+    Alternative ()
+	: phrase (NULL),
+	  items (NULL),
+	  num_items (0),
+	  nullable (false),
+	  num_hits (0)
+    {
+    }
+
+    ~Alternative ()
+    {
+	delete[] items;
+    }
+};
+
+class DeclInfo
+{
+public:
+    Declaration_Phrases *decl;
+
+    Alternative *alts;
+    Size num_alts;
+
+    TerminalSet first;
+    bool nullable;
+
+    // Declarations which may be parsed at the same position
+    // as this one starts at ("left edges").
+    List<Size> left_decls;
+
+    bool reachable;
+
+    // Estimated number of alternatives which may be tried for one token.
+    Size width;
+
+    // For the backtracking depth search.
+    bool depth_visiting;
+    bool depth_done;
+    Size depth;
+    Size depth_next;
+
+    DeclInfo ()
+	: decl (NULL),
+	  alts (NULL),
+	  num_alts (0),
+	  nullable (false),
+	  reachable (false),
+	  width (1),
+	  depth_visiting (false),
+	  depth_done (false),
+	  depth (0),
+	  depth_next (0)
+    {
+    }
+
+    ~DeclInfo ()
+    {
+	delete[] alts;
+    }
+};
+
+class Analyzer
+{
+public:
+    OutputStream *outs;
+
+    Terminal *terminals;
+    Size num_terminals;
+    Size num_literals;
+
+    DeclInfo *decls;
+    Size num_decls;
+
+    Size findDecl (Declaration_Phrases * const decl)
+    {
+	for (Size i = 0; i < num_decls; ++i) {
+	    if (decls [i].decl == decl)
+		return i;
+	}
+
+	unreachable ();
+	return 0;
+    }
+
+    Size findTerminal (PhrasePart_Token * const mt_nonnull phrase_part__token)
+    {
+	if (phrase_part__token->token_id != 0)
+	    return phrase_part__token->token_id;
+
+	for (Size i = num_literals + 1; i < num_terminals; ++i) {
+	    Terminal * const terminal = &terminals [i];
+	    if (phrase_part__token->token_class) {
+		if (terminal->token_class == phrase_part__token->token_class.ptr())
+		    return i;
+	    } else
+	    if (phrase_part__token->token_match_cb &&
+		phrase_part__token->token_match_cb->len() > 0)
+	    {
+		if (terminal->kind == Terminal::Callback &&
+		    equal (terminal->name->mem(), phrase_part__token->token_match_cb->mem()))
+		{
+		    return i;
+		}
+	    }
+	}
+
+	return 0;
+    }
+
+    void collectTerminals (PargenTask * mt_nonnull pargen_task);
+
+    void collectDecls (PargenTask * mt_nonnull pargen_task);
+
+    void computeFirstSets ();
+
+    void computeLeftEdges ();
+
+    void computeReachability ();
+
+    bool terminalsOverlap (Size a,
+			   Size b);
+
+    bool alternativesOverlap (Alternative * mt_nonnull left,
+			      Alternative * mt_nonnull right,
+			      bool         print);
+
+    bool sameItems (Alternative * mt_nonnull left,
+		    Alternative * mt_nonnull right);
+
+    bool isLeftRecursive (DeclInfo * mt_nonnull info,
+			  Alternative * mt_nonnull alt);
+
+    bool findLeftCycle (Size  from,
+			Size  target,
+			bool *visited);
+
+    void computeDepth (Size index);
+
+    void reportOverlaps ();
+
+    void reportNullable ();
+
+    void reportLeftRecursion ();
+
+    void reportDeadAlternatives ();
+
+    void reportUnreachable ();
+
+    void reportDepth ();
+
+    mt_throws Result readProfile (TokenStream * mt_nonnull profile_stream);
+
+    bool canSwap (DeclInfo    * mt_nonnull info,
+		  Alternative * mt_nonnull left,
+		  Alternative * mt_nonnull right);
+
+    void markAnchoredDecls (PargenTask * mt_nonnull pargen_task,
+			    bool       *anchored);
+
+    void reorderAlternatives (DeclInfo * mt_nonnull info);
+
+    Analyzer (OutputStream * const mt_nonnull outs)
+	: outs (outs),
+	  terminals (NULL),
+	  num_terminals (0),
+	  num_literals (0),
+	  decls (NULL),
+	  num_decls (0)
+    {
+    }
+
+    ~Analyzer ()
+    {
+	delete[] terminals;
+	delete[] decls;
+    }
+};
+
+static ConstMemory
+altName (Alternative * const mt_nonnull alt)
+{
+    if (alt->phrase->phrase_name)
+	return alt->phrase->phrase_name->mem();
+
+    return ConstMemory ("(default)");
+}
+
+void
+Analyzer::collectTerminals (PargenTask * const mt_nonnull pargen_task)
+{
+    num_literals = pargen_task->literal_tokens.getNumElements();
+
+    Size num_classes = 0;
+    Size num_callbacks = 0;
+    {
+	List< StRef<Declaration> >::DataIterator decl_iter (pargen_task->decls);
+	while (!decl_iter.done()) {
+	    StRef<Declaration> &decl = decl_iter.next ();
+	    if (decl->declaration_type == Declaration::t_TokenClass) {
+		++num_classes;
+		continue;
+	    }
+
+	    if (decl->declaration_type != Declaration::t_Phrases)
+		continue;
+
+	    Declaration_Phrases * const decl_phrases = static_cast <Declaration_Phrases*> (decl.ptr());
+	    List< StRef<Declaration_Phrases::PhraseRecord> >::DataIterator phrase_iter (decl_phrases->phrases);
+	    while (!phrase_iter.done ()) {
+		StRef<Declaration_Phrases::PhraseRecord> &phrase_record = phrase_iter.next ();
+		List< StRef<PhrasePart> >::DataIterator part_iter (phrase_record->phrase->phrase_parts);
+		while (!part_iter.done ()) {
+		    StRef<PhrasePart> &phrase_part = part_iter.next ();
+		    if (phrase_part->phrase_part_type != PhrasePart::t_Token)
+			continue;
+
+		    PhrasePart_Token * const phrase_part__token =
+			    static_cast <PhrasePart_Token*> (phrase_part.ptr());
+		    if (!phrase_part__token->token_class &&
+			phrase_part__token->token_match_cb &&
+			phrase_part__token->token_match_cb->len() > 0)
+		    {
+			// Duplicates are harmless: findTerminal() picks the first one.
+			++num_callbacks;
+		    }
+		}
+	    }
+	}
+    }
+
+    num_terminals = 1 + num_literals + num_classes + num_callbacks;
+    terminals = new (std::nothrow) Terminal [num_terminals];
+    assert (terminals);
+
+    Size i = 1;
+    {
+	List< StRef<String> >::DataIterator literal_iter (pargen_task->literal_tokens);
+	while (!literal_iter.done ()) {
+	    StRef<String> &literal = literal_iter.next ();
+	    terminals [i].kind = Terminal::Literal;
+	    terminals [i].name = literal;
+	    ++i;
+	}
+    }
+
+    List< StRef<Declaration> >::DataIterator decl_iter (pargen_task->decls);
+    while (!decl_iter.done()) {
+	StRef<Declaration> &decl = decl_iter.next ();
+	if (decl->declaration_type == Declaration::t_TokenClass) {
+	    terminals [i].kind = Terminal::TokenClass;
+	    terminals [i].name = decl->lowercase_declaration_name;
+	    terminals [i].token_class = static_cast <Declaration_TokenClass*> (decl.ptr());
+	    ++i;
+	    continue;
+	}
+
+	if (decl->declaration_type != Declaration::t_Phrases)
+	    continue;
+
+	Declaration_Phrases * const decl_phrases = static_cast <Declaration_Phrases*> (decl.ptr());
+	List< StRef<Declaration_Phrases::PhraseRecord> >::DataIterator phrase_iter (decl_phrases->phrases);
+	while (!phrase_iter.done ()) {
+	    StRef<Declaration_Phrases::PhraseRecord> &phrase_record = phrase_iter.next ();
+	    List< StRef<PhrasePart> >::DataIterator part_iter (phrase_record->phrase->phrase_parts);
+	    while (!part_iter.done ()) {
+		StRef<PhrasePart> &phrase_part = part_iter.next ();
+		if (phrase_part->phrase_part_type != PhrasePart::t_Token)
+		    continue;
+
+		PhrasePart_Token * const phrase_part__token =
+			static_cast <PhrasePart_Token*> (phrase_part.ptr());
+		if (!phrase_part__token->token_class &&
+		    phrase_part__token->token_match_cb &&
+		    phrase_part__token->token_match_cb->len() > 0)
+		{
+		    terminals [i].kind = Terminal::Callback;
+		    terminals [i].name = phrase_part__token->token_match_cb;
+		    ++i;
+		}
+	    }
+	}
+    }
+
+    assert (i == num_terminals);
+}
+
+void
+Analyzer::collectDecls (PargenTask * const mt_nonnull pargen_task)
+{
+    num_decls = 0;
+    {
+	List< StRef<Declaration> >::DataIterator decl_iter (pargen_task->decls);
+	while (!decl_iter.done()) {
+	    StRef<Declaration> &decl = decl_iter.next ();
+	    if (decl->declaration_type == Declaration::t_Phrases &&
+		!static_cast <Declaration_Phrases*> (decl.ptr())->is_alias)
+	    {
+		++num_decls;
+	    }
+	}
+    }
+
+    decls = new (std::nothrow) DeclInfo [num_decls];
+    assert (decls);
+
+    {
+	Size i = 0;
+	List< StRef<Declaration> >::DataIterator decl_iter (pargen_task->decls);
+	while (!decl_iter.done()) {
+	    StRef<Declaration> &decl = decl_iter.next ();
+	    if (decl->declaration_type == Declaration::t_Phrases &&
+		!static_cast <Declaration_Phrases*> (decl.ptr())->is_alias)
+	    {
+		decls [i].decl = static_cast <Declaration_Phrases*> (decl.ptr());
+		++i;
+	    }
+	}
+    }
+
+    for (Size i = 0; i < num_decls; ++i) {
+	DeclInfo * const info = &decls [i];
+	info->first.init (num_terminals);
+
+	info->num_alts = info->decl->phrases.getNumElements();
+	info->alts = new (std::nothrow) Alternative [info->num_alts];
+	assert (info->alts);
+
+	Size alt_idx = 0;
+	List< StRef<Declaration_Phrases::PhraseRecord> >::DataIterator phrase_iter (info->decl->phrases);
+	while (!phrase_iter.done ()) {
+	    StRef<Declaration_Phrases::PhraseRecord> &phrase_record = phrase_iter.next ();
+	    Alternative * const alt = &info->alts [alt_idx];
+	    ++alt_idx;
+
+	    alt->phrase_record = phrase_record;
+	    alt->phrase = phrase_record->phrase;
+	    alt->first.init (num_terminals);
+
+	    alt->items = new (std::nothrow) Item [alt->phrase->phrase_parts.getNumElements() + 1];
+	    assert (alt->items);
+
+	    List< StRef<PhrasePart> >::DataIterator part_iter (alt->phrase->phrase_parts);
+	    while (!part_iter.done ()) {
+		StRef<PhrasePart> &phrase_part = part_iter.next ();
+
+		Item * const item = &alt->items [alt->num_items];
+		item->opt = phrase_part->opt;
+
+		if (phrase_part->phrase_part_type == PhrasePart::t_Phrase) {
+		    PhrasePart_Phrase * const phrase_part__phrase =
+			    static_cast <PhrasePart_Phrase*> (phrase_part.ptr());
+		    assert (phrase_part__phrase->decl_phrases);
+		    item->is_decl = true;
+		    item->index = findDecl (phrase_part__phrase->decl_phrases);
+		    ++alt->num_items;
+		} else
+		if (phrase_part->phrase_part_type == PhrasePart::t_Token) {
+		    item->is_decl = false;
+		    item->index = findTerminal (static_cast <PhrasePart_Token*> (phrase_part.ptr()));
+		    ++alt->num_items;
+		}
+	    }
+	}
+    }
+}
+
+// Nullable flags and sets of first terminals grow monotonically,
+// hence the fixpoint.
+void
+Analyzer::computeFirstSets ()
+{
+    bool changed;
+    do {
+	changed = false;
+
+	for (Size i = 0; i < num_decls; ++i) {
+	    DeclInfo * const info = &decls [i];
+
+	    for (Size j = 0; j < info->num_alts; ++j) {
+		Alternative * const alt = &info->alts [j];
+
+		bool nullable = true;
+		for (Size k = 0; k < alt->num_items; ++k) {
+		    Item * const item = &alt->items [k];
+
+		    bool item_nullable;
+		    if (item->is_decl) {
+			DeclInfo * const item_info = &decls [item->index];
+			if (alt->first.addSet (item_info->first))
+			    changed = true;
+
+			item_nullable = item_info->nullable;
+		    } else {
+			if (alt->first.add (item->index))
+			    changed = true;
+
+			item_nullable = false;
+		    }
+
+		    if (!item_nullable && !item->opt) {
+			nullable = false;
+			break;
+		    }
+		}
+
+		if (nullable && !alt->nullable) {
+		    alt->nullable = true;
+		    changed = true;
+		}
+
+		// Precedence declarations start with an operand:
+		// the "Binary" phrase is never entered directly.
+		if (info->decl->is_precedence && j > 0)
+		    continue;
+
+		if (info->first.addSet (alt->first))
+		    changed = true;
+
+		if (alt->nullable && !info->nullable) {
+		    info->nullable = true;
+		    changed = true;
+		}
+	    }
+	}
+    } while (changed);
+}
+
+void
+Analyzer::computeLeftEdges ()
+{
+    for (Size i = 0; i < num_decls; ++i) {
+	DeclInfo * const info = &decls [i];
+
+	for (Size j = 0; j < info->num_alts; ++j) {
+	    Alternative * const alt = &info->alts [j];
+
+	    for (Size k = 0; k < alt->num_items; ++k) {
+		Item * const item = &alt->items [k];
+		if (!item->is_decl)
+		    break;
+
+		info->left_decls.append (item->index);
+
+		if (!item->opt && !decls [item->index].nullable)
+		    break;
+	    }
+	}
+    }
+}
+
+void
+Analyzer::computeReachability ()
+{
+    Size * const queue = new (std::nothrow) Size [num_decls + 1];
+    assert (queue);
+    Size queue_head = 0;
+    Size queue_tail = 0;
+
+    for (Size i = 0; i < num_decls; ++i) {
+	if (equal (decls [i].decl->declaration_name->mem(), "*")) {
+	    decls [i].reachable = true;
+	    queue [queue_tail++] = i;
+	}
+    }
+
+    while (queue_head < queue_tail) {
+	DeclInfo * const info = &decls [queue [queue_head++]];
+	for (Size j = 0; j < info->num_alts; ++j) {
+	    Alternative * const alt = &info->alts [j];
+	    for (Size k = 0; k < alt->num_items; ++k) {
+		Item * const item = &alt->items [k];
+		if (!item->is_decl || decls [item->index].reachable)
+		    continue;
+
+		decls [item->index].reachable = true;
+		queue [queue_tail++] = item->index;
+	    }
+	}
+    }
+
+    delete[] queue;
+}
+
+// Conservative: callbacks may match anything.
+bool
+Analyzer::terminalsOverlap (Size const a,
+			    Size const b)
+{
+    if (a == b)
+	return true;
+
+    Terminal * const ta = &terminals [a];
+    Terminal * const tb = &terminals [b];
+
+    if (ta->kind == Terminal::AnyToken || tb->kind == Terminal::AnyToken ||
+	ta->kind == Terminal::Callback || tb->kind == Terminal::Callback)
+    {
+	return true;
+    }
+
+    if (ta->kind == Terminal::Literal && tb->kind == Terminal::Literal)
+	return false;
+
+    if (ta->kind == Terminal::TokenClass && tb->kind == Terminal::TokenClass)
+	return true;
+
+    Terminal * const class_terminal = (ta->kind == Terminal::TokenClass ? ta : tb);
+    Terminal * const literal_terminal = (ta->kind == Terminal::TokenClass ? tb : ta);
+
+    Declaration_TokenClass * const token_class = class_terminal->token_class;
+    TokenDfa dfa;
+    dfa.num_states = token_class->num_states;
+    dfa.tranzitions = token_class->tranzitions;
+    dfa.accepting = token_class->accepting;
+    for (unsigned i = 0; i < 8; ++i)
+	dfa.first_bytes [i] = token_class->first_bytes [i];
+
+    return dfa.match (literal_terminal->name->mem());
+}
+
+bool
+Analyzer::alternativesOverlap (Alternative * const mt_nonnull left,
+			       Alternative * const mt_nonnull right,
+			       bool          const print)
+{
+    bool overlap = false;
+    for (Size a = 0; a < num_terminals; ++a) {
+	if (!left->first.contains (a))
+	    continue;
+
+	for (Size b = 0; b < num_terminals; ++b) {
+	    if (!right->first.contains (b) || !terminalsOverlap (a, b))
+		continue;
+
+	    if (!print)
+		return true;
+
+	    if (!overlap)
+		outs->print ("   ");
+
+	    Terminal * const terminal = &terminals [(a == b || terminals [a].kind == Terminal::Literal) ? a : b];
+	    switch (terminal->kind) {
+		case Terminal::AnyToken:
+		    outs->print (" *");
+		    break;
+		case Terminal::Literal:
+		    outs->print (" [", terminal->name, "]");
+		    break;
+		case Terminal::TokenClass:
+		case Terminal::Callback:
+		    outs->print (" {", terminal->name, "}");
+		    break;
+	    }
+
+	    overlap = true;
+	    // One token per pair of terminal sets is enough.
+	    break;
+	}
+    }
+
+    if (overlap)
+	outs->print ("\n");
+
+    return overlap;
+}
+
+bool
+Analyzer::sameItems (Alternative * const mt_nonnull left,
+		     Alternative * const mt_nonnull right)
+{
+    if (left->num_items != right->num_items)
+	return false;
+
+    for (Size i = 0; i < left->num_items; ++i) {
+	if (left->items [i].is_decl != right->items [i].is_decl ||
+	    left->items [i].index   != right->items [i].index   ||
+	    left->items [i].opt     != right->items [i].opt)
+	{
+	    return false;
+	}
+    }
+
+    return true;
+}
+
+bool
+Analyzer::isLeftRecursive (DeclInfo    * const mt_nonnull info,
+			   Alternative * const mt_nonnull alt)
+{
+    for (Size k = 0; k < alt->num_items; ++k) {
+	Item * const item = &alt->items [k];
+	if (!item->is_decl)
+	    return false;
+
+	if (&decls [item->index] == info)
+	    return true;
+
+	if (!item->opt && !decls [item->index].nullable)
+	    return false;
+    }
+
+    return false;
+}
+
+bool
+Analyzer::findLeftCycle (Size   const from,
+			 Size   const target,
+			 bool * const visited)
+{
+    List<Size>::DataIterator iter (decls [from].left_decls);
+    while (!iter.done ()) {
+	Size const next = iter.next ();
+	if (next == target)
+	    return from != target;
+
+	if (visited [next])
+	    continue;
+
+	visited [next] = true;
+	if (findLeftCycle (next, target, visited))
+	    return true;
+    }
+
+    return false;
+}
+
+// Longest chain of nested backtracking points along left edges.
+// Cycles are cut.
+void
+Analyzer::computeDepth (Size const index)
+{
+    DeclInfo * const info = &decls [index];
+    if (info->depth_done || info->depth_visiting)
+	return;
+
+    info->depth_visiting = true;
+
+    Size max_depth = 0;
+    Size max_next = index;
+    List<Size>::DataIterator iter (info->left_decls);
+    while (!iter.done ()) {
+	Size const next = iter.next ();
+	computeDepth (next);
+	if (decls [next].depth_done && decls [next].depth > max_depth) {
+	    max_depth = decls [next].depth;
+	    max_next = next;
+	}
+    }
+
+    info->depth = max_depth + (info->width > 1 ? 1 : 0);
+    info->depth_next = max_next;
+    info->depth_visiting = false;
+    info->depth_done = true;
+}
+
+void
+Analyzer::reportOverlaps ()
+{
+    outs->print ("Overlapping alternatives (backtracking points):\n");
+
+    bool got_any = false;
+    for (Size i = 0; i < num_decls; ++i) {
+	DeclInfo * const info = &decls [i];
+	if (info->decl->is_precedence)
+	    continue;
+
+	for (Size j = 0; j < info->num_alts; ++j) {
+	    Alternative * const left = &info->alts [j];
+	    if (isLeftRecursive (info, left))
+		continue;
+
+	    Size num_overlapping = 0;
+	    for (Size k = 0; k < info->num_alts; ++k) {
+		Alternative * const right = &info->alts [k];
+		if (k == j || isLeftRecursive (info, right))
+		    continue;
+
+		if (k > j) {
+		    if (!alternativesOverlap (left, right, false /* print */))
+			continue;
+
+		    outs->print ("    ", info->decl->declaration_name, ": ",
+				 altName (left), " / ", altName (right), ":");
+		    alternativesOverlap (left, right, true /* print */);
+		    got_any = true;
+		    ++num_overlapping;
+		} else
+		if (alternativesOverlap (left, right, false /* print */)) {
+		    ++num_overlapping;
+		}
+	    }
+
+	    if (num_overlapping + 1 > info->width)
+		info->width = num_overlapping + 1;
+	}
+    }
+
+    if (!got_any)
+	outs->print ("    none\n");
+}
+
+void
+Analyzer::reportNullable ()
+{
+    outs->print ("Nullable alternatives (not upwards-optimized):\n");
+
+    bool got_any = false;
+    for (Size i = 0; i < num_decls; ++i) {
+	DeclInfo * const info = &decls [i];
+	if (info->num_alts < 2 || info->decl->is_precedence)
+	    continue;
+
+	for (Size j = 0; j < info->num_alts; ++j) {
+	    Alternative * const alt = &info->alts [j];
+	    if (alt->nullable) {
+		outs->print ("    ", info->decl->declaration_name, ": ", altName (alt), "\n");
+		got_any = true;
+	    }
+	}
+    }
+
+    if (!got_any)
+	outs->print ("    none\n");
+}
+
+void
+Analyzer::reportLeftRecursion ()
+{
+    outs->print ("Left recursion:\n");
+
+    bool * const visited = new (std::nothrow) bool [num_decls + 1];
+    assert (visited);
+
+    bool got_any = false;
+    for (Size i = 0; i < num_decls; ++i) {
+	DeclInfo * const info = &decls [i];
+
+	for (Size j = 0; j < info->num_alts; ++j) {
+	    Alternative * const alt = &info->alts [j];
+	    if (!info->decl->is_precedence && isLeftRecursive (info, alt)) {
+		outs->print ("    ", info->decl->declaration_name, ": ", altName (alt), " (direct)\n");
+		got_any = true;
+	    }
+	}
+
+	for (Size j = 0; j < num_decls; ++j)
+	    visited [j] = false;
+
+	if (findLeftCycle (i, i, visited)) {
+	    outs->print ("    ", info->decl->declaration_name, " (indirect, not supported by the parser)\n");
+	    got_any = true;
+	}
+    }
+
+    delete[] visited;
+
+    if (!got_any)
+	outs->print ("    none\n");
+}
+
+void
+Analyzer::reportDeadAlternatives ()
+{
+    outs->print ("Alternatives which never match:\n");
+
+    bool got_any = false;
+    for (Size i = 0; i < num_decls; ++i) {
+	DeclInfo * const info = &decls [i];
+	if (info->decl->is_precedence)
+	    continue;
+
+	for (Size j = 0; j < info->num_alts; ++j) {
+	    Alternative * const alt = &info->alts [j];
+
+	    if (!alt->nullable && alt->first.isEmpty()) {
+		outs->print ("    ", info->decl->declaration_name, ": ", altName (alt),
+			     " (can't start with any token)\n");
+		got_any = true;
+		continue;
+	    }
+
+	    for (Size k = 0; k < j; ++k) {
+		if (sameItems (&info->alts [k], alt)) {
+		    outs->print ("    ", info->decl->declaration_name, ": ", altName (alt),
+				 " (same as ", altName (&info->alts [k]), ")\n");
+		    got_any = true;
+		    break;
+		}
+	    }
+	}
+    }
+
+    if (!got_any)
+	outs->print ("    none\n");
+}
+
+void
+Analyzer::reportUnreachable ()
+{
+    outs->print ("Unreachable declarations:\n");
+
+    bool got_any = false;
+    for (Size i = 0; i < num_decls; ++i) {
+	if (!decls [i].reachable) {
+	    outs->print ("    ", decls [i].decl->declaration_name, "\n");
+	    got_any = true;
+	}
+    }
+
+    if (!got_any)
+	outs->print ("    none\n");
+}
+
+void
+Analyzer::reportDepth ()
+{
+    Size max_depth = 0;
+    Size max_index = 0;
+    for (Size i = 0; i < num_decls; ++i) {
+	computeDepth (i);
+	if (decls [i].depth > max_depth) {
+	    max_depth = decls [i].depth;
+	    max_index = i;
+	}
+    }
+
+    outs->print ("Worst-case backtracking depth: ", max_depth);
+    if (max_depth > 0) {
+	outs->print (" (");
+	Size index = max_index;
+	for (;;) {
+	    outs->print (decls [index].decl->declaration_name);
+	    if (decls [index].depth_next == index)
+		break;
+
+	    index = decls [index].depth_next;
+	    outs->print (" -> ");
+	}
+	outs->print (")");
+    }
+    outs->print ("\n");
+}
+
+// Name of the switch grammar for the declaration in generated code.
+static ConstMemory
+switchGrammarName (Declaration_Phrases * const mt_nonnull decl)
+{
+    if (equal (decl->declaration_name->mem(), "*"))
+	return ConstMemory ("Grammar");
+
+    return decl->declaration_name->mem();
+}
+
+static mt_throws Result
+profileSyntaxError (TokenStream * const mt_nonnull profile_stream)
+{
+    FilePosition fpos;
+    if (!profile_stream->getFilePosition (&fpos))
+	return Result::Failure;
+
+    exc_throw (ParsingException, fpos, st_makeString ("bad profile entry"));
+    return Result::Failure;
+}
+
+// Entries for unknown grammars are ignored: the profile may have been
+// recorded with a different version of the grammar.
+mt_throws Result
+Analyzer::readProfile (TokenStream * const mt_nonnull profile_stream)
+{
+    for (;;) {
+	ConstMemory token;
+	if (!profile_stream->getNextToken (&token))
+	    return Result::Failure;
+
+	if (token.len() == 0)
+	    break;
+
+	StRef<String> const switch_name = st_grab (new (std::nothrow) String (token));
+
+	if (!profile_stream->getNextToken (&token))
+	    return Result::Failure;
+
+	if (token.len() == 0)
+	    return profileSyntaxError (profile_stream);
+
+	StRef<String> const alt_name = st_grab (new (std::nothrow) String (token));
+
+	if (!profile_stream->getNextToken (&token))
+	    return Result::Failure;
+
+	if (token.len() == 0)
+	    return profileSyntaxError (profile_stream);
+
+	Uint64 num_hits = 0;
+	for (Size i = 0; i < token.len(); ++i) {
+	    Byte const c = token.mem() [i];
+	    if (c < '0' || c > '9')
+		return profileSyntaxError (profile_stream);
+
+	    num_hits = num_hits * 10 + (c - '0');
+	}
+
+	for (Size i = 0; i < num_decls; ++i) {
+	    DeclInfo * const info = &decls [i];
+	    if (!equal (switchGrammarName (info->decl), switch_name->mem()))
+		continue;
+
+	    for (Size j = 0; j < info->num_alts; ++j) {
+		Alternative * const alt = &info->alts [j];
+		if (!alt->phrase->phrase_name)
+		    continue;
+
+		StRef<String> const phrase_grammar_name =
+			st_makeString (switchGrammarName (info->decl), "_", alt->phrase->phrase_name);
+		if (equal (phrase_grammar_name->mem(), alt_name->mem()))
+		    alt->num_hits += num_hits;
+	    }
+	}
+    }
+
+    return Result::Success;
+}
+
+// Two alternatives may be swapped only if they never match at the same
+// position, which makes their relative order meaningless.
+bool
+Analyzer::canSwap (DeclInfo    * const mt_nonnull info,
+		   Alternative * const mt_nonnull left,
+		   Alternative * const mt_nonnull right)
+{
+    if (left->nullable || right->nullable)
+	return false;
+
+    // Left-recursive alternatives are tried after all of the others.
+    if (isLeftRecursive (info, left) || isLeftRecursive (info, right))
+	return false;
+
+    return !alternativesOverlap (left, right, false /* print */);
+}
+
+// Upwards anchors refer to phrases by their indices.
+void
+Analyzer::markAnchoredDecls (PargenTask * const mt_nonnull pargen_task,
+			     bool       * const anchored)
+{
+    List< StRef<Declaration> >::DataIterator decl_iter (pargen_task->decls);
+    while (!decl_iter.done()) {
+	StRef<Declaration> &decl = decl_iter.next ();
+	if (decl->declaration_type != Declaration::t_Phrases)
+	    continue;
+
+	List< StRef<Declaration_Phrases::PhraseRecord> >::DataIterator phrase_iter (
+		static_cast <Declaration_Phrases*> (decl.ptr())->phrases);
+	while (!phrase_iter.done ()) {
+	    StRef<Declaration_Phrases::PhraseRecord> &phrase_record = phrase_iter.next ();
+
+	    List< StRef<PhrasePart> >::DataIterator part_iter (phrase_record->phrase->phrase_parts);
+	    while (!part_iter.done ()) {
+		StRef<PhrasePart> &phrase_part = part_iter.next ();
+		if (phrase_part->phrase_part_type != PhrasePart::t_UpwardsAnchor)
+		    continue;
+
+		PhrasePart_UpwardsAnchor * const phrase_part__upwards_anchor =
+			static_cast <PhrasePart_UpwardsAnchor*> (phrase_part.ptr());
+
+		List< StRef<Declaration> >::DataIterator target_iter (pargen_task->decls);
+		while (!target_iter.done()) {
+		    StRef<Declaration> &target = target_iter.next ();
+		    if (target->declaration_type != Declaration::t_Phrases ||
+			!equal (target->declaration_name->mem(),
+				phrase_part__upwards_anchor->declaration_name->mem()))
+		    {
+			continue;
+		    }
+
+		    Declaration_Phrases *target_phrases = static_cast <Declaration_Phrases*> (target.ptr());
+		    while (target_phrases && target_phrases->is_alias)
+			target_phrases = target_phrases->aliased_decl;
+
+		    if (target_phrases)
+			anchored [findDecl (target_phrases)] = true;
+		}
+	    }
+	}
+    }
+}
+
+// Insertion sort by descending number of hits which moves an alternative
+// ahead only over the ones it can be swapped with. Ties keep the order
+// of declaration.
+void
+Analyzer::reorderAlternatives (DeclInfo * const mt_nonnull info)
+{
+    Alternative ** const order = new (std::nothrow) Alternative* [info->num_alts];
+    assert (order);
+
+    bool changed = false;
+    for (Size i = 0; i < info->num_alts; ++i) {
+	order [i] = &info->alts [i];
+
+	for (Size j = i; j > 0; --j) {
+	    Alternative * const left = order [j - 1];
+	    Alternative * const right = order [j];
+	    if (right->num_hits <= left->num_hits ||
+		!canSwap (info, left, right))
+	    {
+		break;
+	    }
+
+	    order [j - 1] = right;
+	    order [j] = left;
+	    changed = true;
+	}
+    }
+
+    if (changed) {
+      // Alternatives hold references to the records, hence it's safe to clear
+      // the list.
+	info->decl->phrases.clear ();
+	for (Size i = 0; i < info->num_alts; ++i)
+	    info->decl->phrases.append (order [i]->phrase_record);
+    }
+
+    delete[] order;
+}
+
+}
+
+void
+analyzeGrammar (OutputStream * const mt_nonnull outs,
+		PargenTask   * const mt_nonnull pargen_task)
+{
+    Analyzer analyzer (outs);
+
+    analyzer.collectTerminals (pargen_task);
+    analyzer.collectDecls (pargen_task);
+    analyzer.computeFirstSets ();
+    analyzer.computeLeftEdges ();
+    analyzer.computeReachability ();
+
+    analyzer.reportOverlaps ();
+    analyzer.reportNullable ();
+    analyzer.reportLeftRecursion ();
+    analyzer.reportDeadAlternatives ();
+    analyzer.reportUnreachable ();
+    analyzer.reportDepth ();
+
+    outs->flush ();
+}
+
+// See the limitation described in grammar_analyzer.h: the reordering saves
+// tranzition checks of non-predictive switches, not backtracking.
+mt_throws Result
+applyGrammarProfile (PargenTask  * const mt_nonnull pargen_task,
+		     TokenStream * const mt_nonnull profile_stream)
+{
+    Analyzer analyzer (errs);
+
+    analyzer.collectTerminals (pargen_task);
+    analyzer.collectDecls (pargen_task);
+    analyzer.computeFirstSets ();
+
+    if (!analyzer.readProfile (profile_stream))
+	return Result::Failure;
+
+    bool * const anchored = new (std::nothrow) bool [analyzer.num_decls];
+    assert (anchored);
+    for (Size i = 0; i < analyzer.num_decls; ++i)
+	anchored [i] = false;
+
+    analyzer.markAnchoredDecls (pargen_task, anchored);
+
+    for (Size i = 0; i < analyzer.num_decls; ++i) {
+	DeclInfo * const info = &analyzer.decls [i];
+	if (info->decl->is_precedence || anchored [i])
+	    continue;
+
+	analyzer.reorderAlternatives (info);
+    }
+
+    delete[] anchored;
+
+    return Result::Success;
+}
+
+}
+
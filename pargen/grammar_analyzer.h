@@ -0,0 +1,64 @@
+/*  Pargen - Flexible parser generator
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#ifndef PARGEN__GRAMMAR_ANALYZER__H__
+#define PARGEN__GRAMMAR_ANALYZER__H__
+
+
+#include <libmary/libmary.h>
+
+#include <pargen/token_stream.h>
+#include <pargen/pargen_task_parser.h>
+
+
+namespace Pargen {
+
+using namespace M;
+
+// Reports performance hazards of the grammar ("pargen --analyze"):
+// alternatives with overlapping sets of first tokens (backtracking points),
+// nullable alternatives (which can't be upwards-optimized), left recursion,
+// alternatives and declarations which are never used, and the estimated
+// worst-case number of nested backtracking points.
+//
+// The analysis mirrors what optimizeGrammar() computes for the generated
+// grammar at runtime.
+void analyzeGrammar (OutputStream * mt_nonnull outs,
+                     PargenTask   * mt_nonnull pargen_task);
+
+// Reorders alternatives of switch declarations by the numbers of matches
+// recorded in a GrammarProfile ("pargen --profile"), the most frequent ones
+// going first. Only the alternatives which can't match at the same position
+// are reordered, so parsing results stay the same. Declarations which are
+// targets of upwards anchors are left as is.
+//
+// Known limitation: alternatives which can be swapped start with different
+// tokens, and the parser doesn't backtrack between them anyway: predictive
+// switches dispatch on the next token, and tranzition checks skip the rest.
+// Reordering only saves those checks for the alternatives which are tried
+// first. Alternatives which overlap, where backtracking does happen, keep
+// their order, as moving them could change parsing results.
+mt_throws Result applyGrammarProfile (PargenTask  * mt_nonnull pargen_task,
+                                      TokenStream * mt_nonnull profile_stream);
+
+}
+
+
+#endif /* PARGEN__GRAMMAR_ANALYZER__H__ */
+
@@ -0,0 +1,83 @@
+/*  Pargen - Flexible parser generator
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#include <libmary/libmary.h>
+
+#include <pargen/grammar.h>
+
+#include <pargen/grammar_profile.h>
+
+
+using namespace M;
+
+namespace Pargen {
+
+void
+GrammarProfile::addHit (Grammar * const mt_nonnull switch_grammar,
+                        Grammar * const mt_nonnull alt_grammar)
+{
+    HitEntry *hit_entry = hit_tree.lookup ((UintPtr) alt_grammar);
+    if (!hit_entry) {
+        hit_entry = new (std::nothrow) HitEntry;
+        assert (hit_entry);
+        hit_entry->alt_grammar = alt_grammar;
+        hit_entry->switch_grammar = switch_grammar;
+        hit_entry->num_hits = 0;
+
+        hit_tree.add (hit_entry);
+        hit_list.append (hit_entry);
+    }
+
+    ++hit_entry->num_hits;
+}
+
+mt_throws Result
+GrammarProfile::save (OutputStream * const mt_nonnull outs)
+{
+    for (HitEntry *hit_entry = hit_list.getFirst();
+         hit_entry;
+         hit_entry = hit_list.getNext (hit_entry))
+    {
+        StRef<String> const switch_name = hit_entry->switch_grammar->toString ();
+        StRef<String> const alt_name = hit_entry->alt_grammar->toString ();
+        if (!switch_name || !alt_name)
+            continue;
+
+        if (!outs->print (switch_name, " ", alt_name, " ", hit_entry->num_hits, "\n"))
+            return Result::Failure;
+    }
+
+    if (!outs->flush ())
+        return Result::Failure;
+
+    return Result::Success;
+}
+
+GrammarProfile::~GrammarProfile ()
+{
+    HitEntry *hit_entry = hit_list.getFirst();
+    while (hit_entry) {
+        HitEntry * const next_hit_entry = hit_list.getNext (hit_entry);
+        delete hit_entry;
+        hit_entry = next_hit_entry;
+    }
+}
+
+}
+
@@ -0,0 +1,87 @@
+/*  Pargen - Flexible parser generator
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#ifndef PARGEN__GRAMMAR_PROFILE__H__
+#define PARGEN__GRAMMAR_PROFILE__H__
+
+
+#include <libmary/libmary.h>
+
+
+namespace Pargen {
+
+using namespace M;
+
+// Not including grammar.h: it includes parser.h, which includes this header.
+class Grammar;
+
+// Numbers of non-empty matches of switch alternatives. A profile is filled
+// by parses which have it set in their ParserConfig. The saved profile is
+// fed back to "pargen --profile" to put frequent alternatives first.
+//
+// Recording is not synchronized: concurrent parses should use separate
+// profiles.
+class GrammarProfile : public StReferenced
+{
+private:
+    class HitEntry : public IntrusiveAvlTree_Node<>,
+                     public IntrusiveListElement<>
+    {
+    public:
+        Grammar *alt_grammar;
+        Grammar *switch_grammar;
+        Uint64 num_hits;
+    };
+
+    typedef IntrusiveAvlTree< HitEntry,
+                              MemberExtractor< HitEntry,
+                                               Grammar*,
+                                               &HitEntry::alt_grammar,
+                                               UintPtr,
+                                               CastExtractor< Grammar*,
+                                                              UintPtr > >,
+                              DirectComparator<UintPtr> >
+            HitTree;
+
+    typedef IntrusiveList<HitEntry> HitList;
+
+    HitTree hit_tree;
+    // Same entries as in 'hit_tree', in the order of the first hit.
+    HitList hit_list;
+
+public:
+    // Alternatives are told apart by their grammars: an alternative
+    // belongs to a single switch.
+    void addHit (Grammar * mt_nonnull switch_grammar,
+                 Grammar * mt_nonnull alt_grammar);
+
+    // Text format, one line per alternative:
+    //     <switch name> <alternative name> <number of matches>
+    // Alternatives of generated grammars are named "<switch name>_<phrase name>".
+    // Unnamed grammars are skipped.
+    mt_throws Result save (OutputStream * mt_nonnull outs);
+
+    ~GrammarProfile ();
+};
+
+}
+
+
+#endif /* PARGEN__GRAMMAR_PROFILE__H__ */
+
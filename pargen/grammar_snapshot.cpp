@@ -0,0 +1,1328 @@
+/*  Pargen - Flexible parser generator
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+
+#include <libmary/libmary.h>
+
+#include <pargen/parsing_exception.h>
+#include <pargen/parser.h>
+
+#include <pargen/grammar_snapshot.h>
+
+
+// Snapshot layout, in 32-bit words:
+//
+//     magic, version
+//     number of strings, strings (length, then bytes padded to a word)
+//     number of grammars, (type, token string) for every grammar
+//     grammar records, the root grammar goes first
+//
+// Strings, grammars and symbols are referred to by indices, NoIndex
+// stands for NULL. Symbols are referred to by the indices of their names.
+
+
+using namespace M;
+
+namespace Pargen {
+
+void
+GrammarSymbols::addSymbol (ConstMemory   const name,
+			   Func          const func,
+			   void const  * const data)
+{
+    Symbol *symbol = symbol_hash.lookup (name);
+    if (!symbol) {
+	symbol = new (std::nothrow) Symbol;
+	assert (symbol);
+	symbol->name = st_grab (new (std::nothrow) String (name));
+	symbol_hash.add (symbol);
+    }
+
+    symbol->func = func;
+    symbol->data = data;
+}
+
+GrammarSymbols::Func
+GrammarSymbols::lookupFunc (ConstMemory const name)
+{
+    Symbol * const symbol = symbol_hash.lookup (name);
+    if (!symbol)
+	return NULL;
+
+    return symbol->func;
+}
+
+void const*
+GrammarSymbols::lookupData (ConstMemory const name)
+{
+    Symbol * const symbol = symbol_hash.lookup (name);
+    if (!symbol)
+	return NULL;
+
+    return symbol->data;
+}
+
+StRef<String>
+GrammarSymbols::getFuncName (Func const func)
+{
+    SymbolHash::iter iter (symbol_hash);
+    while (!symbol_hash.iter_done (iter)) {
+	Symbol * const symbol = symbol_hash.iter_next (iter);
+	if (symbol->func == func)
+	    return symbol->name;
+    }
+
+    return NULL;
+}
+
+StRef<String>
+GrammarSymbols::getDataName (void const * const data)
+{
+    SymbolHash::iter iter (symbol_hash);
+    while (!symbol_hash.iter_done (iter)) {
+	Symbol * const symbol = symbol_hash.iter_next (iter);
+	if (symbol->data == data)
+	    return symbol->name;
+    }
+
+    return NULL;
+}
+
+GrammarSymbols::~GrammarSymbols ()
+{
+    SymbolHash::iter iter (symbol_hash);
+    while (!symbol_hash.iter_done (iter)) {
+	Symbol * const symbol = symbol_hash.iter_next (iter);
+	delete symbol;
+    }
+}
+
+namespace {
+
+enum {
+    SnapshotMagic   = 0x31534750, // "PGS1"
+    SnapshotVersion = 1
+};
+
+Uint32 const NoIndex = 0xffffffff;
+
+class WordBuffer
+{
+public:
+    Uint32 *words;
+    Size len;
+    Size capacity;
+
+    void put (Uint32 const word)
+    {
+	if (len == capacity) {
+	    Size const new_capacity = (capacity ? capacity * 2 : 1024);
+	    Uint32 * const new_words = new (std::nothrow) Uint32 [new_capacity];
+	    assert (new_words);
+	    if (len > 0)
+		memcpy (new_words, words, len * sizeof (Uint32));
+
+	    delete[] words;
+	    words = new_words;
+	    capacity = new_capacity;
+	}
+
+	words [len] = word;
+	++len;
+    }
+
+    void putBytes (ConstMemory const mem)
+    {
+	put ((Uint32) mem.len());
+	for (Size i = 0; i < mem.len(); i += sizeof (Uint32)) {
+	    Uint32 word = 0;
+	    Size const chunk = (mem.len() - i < sizeof (Uint32) ? mem.len() - i : sizeof (Uint32));
+	    memcpy (&word, mem.mem() + i, chunk);
+	    put (word);
+	}
+    }
+
+    WordBuffer ()
+	: words (NULL),
+	  len (0),
+	  capacity (0)
+    {
+    }
+
+    ~WordBuffer ()
+    {
+	delete[] words;
+    }
+};
+
+class SnapshotWriter
+{
+public:
+    GrammarSymbols *symbols;
+
+    class StringEntry : public M::HashEntry<>
+    {
+    public:
+	StRef<String> str;
+	Uint32 index;
+    };
+
+    typedef M::Hash< StringEntry,
+		     Memory,
+		     MemberExtractor< StringEntry,
+				      StRef<String>,
+				      &StringEntry::str,
+				      Memory,
+				      AccessorExtractor< String,
+							 Memory,
+							 &String::mem > >,
+		     MemoryComparator<> >
+	    StringHash;
+
+    StringHash string_hash;
+    WordBuffer strings;
+    Uint32 num_strings;
+
+    // Grammar::loop_id holds the index of the grammar plus 1 while writing.
+    Grammar **grammars;
+    Size num_grammars;
+    Size grammars_capacity;
+
+    WordBuffer records;
+
+    // Set if a callback is not registered in 'symbols'.
+    bool unknown_symbol;
+
+    Uint32 putString (ConstMemory const mem)
+    {
+	StringEntry *entry = string_hash.lookup (mem);
+	if (!entry) {
+	    entry = new (std::nothrow) StringEntry;
+	    assert (entry);
+	    entry->str = st_grab (new (std::nothrow) String (mem));
+	    entry->index = num_strings;
+	    string_hash.add (entry);
+
+	    strings.putBytes (mem);
+	    ++num_strings;
+	}
+
+	return entry->index;
+    }
+
+    void putStringRef (String * const str)
+    {
+	records.put (str ? putString (str->mem()) : NoIndex);
+    }
+
+    void putFunc (GrammarSymbols::Func const func)
+    {
+	if (!func) {
+	    records.put (NoIndex);
+	    return;
+	}
+
+	StRef<String> const name = symbols->getFuncName (func);
+	if (!name) {
+	    unknown_symbol = true;
+	    records.put (NoIndex);
+	    return;
+	}
+
+	records.put (putString (name->mem()));
+    }
+
+    void putData (void const * const data)
+    {
+	if (!data) {
+	    records.put (NoIndex);
+	    return;
+	}
+
+	StRef<String> const name = symbols->getDataName (data);
+	if (!name) {
+	    unknown_symbol = true;
+	    records.put (NoIndex);
+	    return;
+	}
+
+	records.put (putString (name->mem()));
+    }
+
+    Uint32 grammarIndex (Grammar * const grammar)
+    {
+	if (!grammar)
+	    return NoIndex;
+
+	if (grammar->loop_id != 0)
+	    return grammar->loop_id - 1;
+
+	if (num_grammars == grammars_capacity) {
+	    Size const new_capacity = (grammars_capacity ? grammars_capacity * 2 : 64);
+	    Grammar ** const new_grammars = new (std::nothrow) Grammar* [new_capacity];
+	    assert (new_grammars);
+	    for (Size i = 0; i < num_grammars; ++i)
+		new_grammars [i] = grammars [i];
+
+	    delete[] grammars;
+	    grammars = new_grammars;
+	    grammars_capacity = new_capacity;
+	}
+
+	grammars [num_grammars] = grammar;
+	++num_grammars;
+	grammar->loop_id = num_grammars;
+
+	return num_grammars - 1;
+    }
+
+    void putGrammar (Grammar * const grammar)
+    {
+	records.put (grammarIndex (grammar));
+    }
+
+    void putTranzitions (SwitchGrammarEntry * mt_nonnull entry);
+
+    void putGrammarRecord (Grammar * mt_nonnull grammar);
+
+    SnapshotWriter (GrammarSymbols * const mt_nonnull symbols)
+	: symbols (symbols),
+	  num_strings (0),
+	  grammars (NULL),
+	  num_grammars (0),
+	  grammars_capacity (0),
+	  unknown_symbol (false)
+    {
+    }
+
+    ~SnapshotWriter ()
+    {
+	for (Size i = 0; i < num_grammars; ++i)
+	    grammars [i]->loop_id = 0;
+
+	delete[] grammars;
+
+	StringHash::iter iter (string_hash);
+	while (!string_hash.iter_done (iter)) {
+	    StringEntry * const entry = string_hash.iter_next (iter);
+	    delete entry;
+	}
+    }
+};
+
+void
+SnapshotWriter::putTranzitions (SwitchGrammarEntry * const mt_nonnull entry)
+{
+    records.put (entry->any_tranzition ? 1 : 0);
+    records.put (entry->tranzition_ids_incomplete ? 1 : 0);
+
+    records.put ((Uint32) entry->num_tranzition_token_id_words);
+    for (Size i = 0; i < entry->num_tranzition_token_id_words; ++i)
+	records.put (entry->tranzition_token_ids [i]);
+
+    {
+	Uint32 num_tranzitions = 0;
+	SwitchGrammarEntry::TranzitionEntryHash::iter iter (entry->tranzition_entries);
+	while (!entry->tranzition_entries.iter_done (iter)) {
+	    entry->tranzition_entries.iter_next (iter);
+	    ++num_tranzitions;
+	}
+	records.put (num_tranzitions);
+    }
+
+    {
+	SwitchGrammarEntry::TranzitionEntryHash::iter iter (entry->tranzition_entries);
+	while (!entry->tranzition_entries.iter_done (iter)) {
+	    SwitchGrammarEntry::TranzitionEntry * const tranzition_entry =
+		    entry->tranzition_entries.iter_next (iter);
+	    putStringRef (tranzition_entry->grammar_name);
+	}
+    }
+
+    records.put ((Uint32) entry->tranzition_match_entries.getNumElements ());
+    {
+	List< StRef<TranzitionMatchEntry> >::DataIterator iter (entry->tranzition_match_entries);
+	while (!iter.done ()) {
+	    StRef<TranzitionMatchEntry> &match_entry = iter.next ();
+	    putData (match_entry->token_dfa);
+	    putFunc ((GrammarSymbols::Func) match_entry->token_match_cb);
+	    records.put (match_entry->token_match_cb_pure ? 1 : 0);
+	}
+    }
+}
+
+void
+SnapshotWriter::putGrammarRecord (Grammar * const mt_nonnull grammar)
+{
+    records.put (grammar->optimized ? 1 : 0);
+    putFunc ((GrammarSymbols::Func) grammar->begin_func);
+    putFunc ((GrammarSymbols::Func) grammar->match_func);
+    putFunc ((GrammarSymbols::Func) grammar->accept_func);
+    putFunc ((GrammarSymbols::Func) grammar->token_classify_func);
+
+    switch (grammar->grammar_type) {
+	case Grammar::t_Immediate: {
+	    Grammar_Immediate_SingleToken * const grammar__immediate =
+		    static_cast <Grammar_Immediate_SingleToken*> (grammar);
+
+	    // The token itself goes to the table of grammar types.
+	    records.put (grammar__immediate->token_id);
+	    putFunc ((GrammarSymbols::Func) grammar__immediate->token_match_cb);
+	    records.put (grammar__immediate->token_match_cb_pure ? 1 : 0);
+	    putData (grammar__immediate->token_dfa);
+	    putStringRef (grammar__immediate->token_match_cb_name);
+	} break;
+	case Grammar::t_Compound: {
+	    Grammar_Compound * const grammar__compound =
+		    static_cast <Grammar_Compound*> (grammar);
+
+	    putStringRef (grammar__compound->name);
+	    putFunc ((GrammarSymbols::Func) grammar__compound->elem_creation_func);
+	    records.put (grammar__compound->tail_iteration ? 1 : 0);
+
+	    records.put ((Uint32) grammar__compound->grammar_entries.getNumElements ());
+	    List< StRef<CompoundGrammarEntry> >::DataIterator iter (grammar__compound->grammar_entries);
+	    while (!iter.done ()) {
+		StRef<CompoundGrammarEntry> &entry = iter.next ();
+
+		records.put (entry->is_jump ? 1 : 0);
+		putGrammar (entry->jump_grammar);
+		putFunc ((GrammarSymbols::Func) entry->jump_cb);
+		records.put ((Uint32) entry->jump_switch_grammar_index);
+		records.put ((Uint32) entry->jump_compound_grammar_index);
+		records.put (entry->is_cut ? 1 : 0);
+		putFunc ((GrammarSymbols::Func) entry->inline_match_func);
+		putGrammar (entry->grammar);
+		records.put (entry->flags);
+		putFunc ((GrammarSymbols::Func) entry->assignment_func);
+	    }
+	} break;
+	case Grammar::t_Switch: {
+	    Grammar_Switch * const grammar__switch =
+		    static_cast <Grammar_Switch*> (grammar);
+
+	    putStringRef (grammar__switch->name);
+	    records.put (grammar__switch->lr_entries_ready ? 1 : 0);
+	    records.put (grammar__switch->predictive ? 1 : 0);
+
+	    records.put ((Uint32) grammar__switch->grammar_entries.getNumElements ());
+	    List< StRef<SwitchGrammarEntry> >::DataIterator iter (grammar__switch->grammar_entries);
+	    while (!iter.done ()) {
+		StRef<SwitchGrammarEntry> &entry = iter.next ();
+
+		putGrammar (entry->grammar);
+		records.put (entry->flags);
+
+		records.put ((Uint32) entry->variants.getNumElements ());
+		List< StRef<String> >::DataIterator variant_iter (entry->variants);
+		while (!variant_iter.done ()) {
+		    StRef<String> &variant = variant_iter.next ();
+		    putStringRef (variant);
+		}
+
+		putTranzitions (entry);
+
+		records.put (entry->left_recursive ? 1 : 0);
+		if (entry->lr_tail) {
+		    records.put (1);
+		    putTranzitions (entry->lr_tail);
+		} else {
+		    records.put (0);
+		}
+
+		records.put ((Uint32) entry->shared_prefix_len);
+	    }
+
+	    {
+		Uint32 num_predict_entries = 0;
+		Grammar_Switch::PredictEntryHash::iter predict_iter (grammar__switch->predict_entries);
+		while (!grammar__switch->predict_entries.iter_done (predict_iter)) {
+		    grammar__switch->predict_entries.iter_next (predict_iter);
+		    ++num_predict_entries;
+		}
+		records.put (num_predict_entries);
+	    }
+
+	    {
+		Grammar_Switch::PredictEntryHash::iter predict_iter (grammar__switch->predict_entries);
+		while (!grammar__switch->predict_entries.iter_done (predict_iter)) {
+		    Grammar_Switch::PredictEntry * const predict_entry =
+			    grammar__switch->predict_entries.iter_next (predict_iter);
+
+		    Uint32 entry_index = 0;
+		    for (List< StRef<SwitchGrammarEntry> >::Element *el = grammar__switch->grammar_entries.first;
+			 el && el != predict_entry->entry_el;
+			 el = el->next)
+		    {
+			++entry_index;
+		    }
+
+		    putStringRef (predict_entry->token);
+		    records.put (entry_index);
+		}
+	    }
+
+	    if (grammar__switch->predict_by_id) {
+		records.put ((Uint32) grammar__switch->num_predict_ids);
+		for (Size i = 0; i < grammar__switch->num_predict_ids; ++i) {
+		    Uint32 entry_index = 0;
+		    if (grammar__switch->predict_by_id [i]) {
+			entry_index = 1;
+			for (List< StRef<SwitchGrammarEntry> >::Element *el = grammar__switch->grammar_entries.first;
+			     el && el != grammar__switch->predict_by_id [i];
+			     el = el->next)
+			{
+			    ++entry_index;
+			}
+		    }
+
+		    records.put (entry_index);
+		}
+	    } else {
+		records.put (0);
+	    }
+	} break;
+	case Grammar::t_Alias: {
+	    Grammar_Alias * const grammar__alias =
+		    static_cast <Grammar_Alias*> (grammar);
+
+	    putStringRef (grammar__alias->name);
+	    putGrammar (grammar__alias->aliased_grammar);
+	} break;
+	case Grammar::t_Precedence: {
+	    Grammar_Precedence * const grammar__precedence =
+		    static_cast <Grammar_Precedence*> (grammar);
+
+	    putStringRef (grammar__precedence->name);
+	    putGrammar (grammar__precedence->operand_grammar);
+	    putGrammar (grammar__precedence->binary_grammar);
+
+	    {
+		Uint32 num_operators = 0;
+		Grammar_Precedence::OperatorHash::iter op_iter (grammar__precedence->operators);
+		while (!grammar__precedence->operators.iter_done (op_iter)) {
+		    grammar__precedence->operators.iter_next (op_iter);
+		    ++num_operators;
+		}
+		records.put (num_operators);
+	    }
+
+	    Grammar_Precedence::OperatorHash::iter op_iter (grammar__precedence->operators);
+	    while (!grammar__precedence->operators.iter_done (op_iter)) {
+		Grammar_Precedence::Operator * const op =
+			grammar__precedence->operators.iter_next (op_iter);
+		putStringRef (op->token);
+		records.put (op->precedence);
+		records.put (op->right_assoc ? 1 : 0);
+	    }
+	} break;
+	default:
+	    unreachable ();
+    }
+}
+
+class SnapshotReader
+{
+public:
+    Byte const *mem;
+    Size len;
+    Size pos;
+
+    bool error;
+    // Set if a callback is not registered in 'symbols'.
+    StRef<String> unknown_symbol;
+
+    GrammarSymbols *symbols;
+
+    StRef<String> *strings;
+    Uint32 num_strings;
+
+    StRef<Grammar> *grammars;
+    Uint32 num_grammars;
+
+    Uint32 get ()
+    {
+	if (len - pos < sizeof (Uint32)) {
+	    error = true;
+	    return 0;
+	}
+
+	Uint32 word;
+	memcpy (&word, mem + pos, sizeof (Uint32));
+	pos += sizeof (Uint32);
+	return word;
+    }
+
+    bool getBool ()
+    {
+	return get () != 0;
+    }
+
+    StRef<String> getString ()
+    {
+	Uint32 const index = get ();
+	if (index == NoIndex)
+	    return NULL;
+
+	if (index >= num_strings) {
+	    error = true;
+	    return NULL;
+	}
+
+	return strings [index];
+    }
+
+    Grammar* getGrammar ()
+    {
+	Uint32 const index = get ();
+	if (index == NoIndex)
+	    return NULL;
+
+	if (index >= num_grammars) {
+	    error = true;
+	    return NULL;
+	}
+
+	return grammars [index];
+    }
+
+    GrammarSymbols::Func getFunc ()
+    {
+	StRef<String> const name = getString ();
+	if (!name)
+	    return NULL;
+
+	GrammarSymbols::Func const func = symbols->lookupFunc (name->mem());
+	if (!func) {
+	    unknown_symbol = name;
+	    error = true;
+	}
+
+	return func;
+    }
+
+    void const* getData ()
+    {
+	StRef<String> const name = getString ();
+	if (!name)
+	    return NULL;
+
+	void const * const data = symbols->lookupData (name->mem());
+	if (!data) {
+	    unknown_symbol = name;
+	    error = true;
+	}
+
+	return data;
+    }
+
+    void getTranzitions (SwitchGrammarEntry * mt_nonnull entry);
+
+    void getGrammarRecord (Grammar * mt_nonnull grammar);
+
+    // Checks references which depend on the records of other grammars.
+    void checkReferences ();
+
+    // Makes references to grammars which own the referring one non-owning,
+    // see GrammarRef. Also checks that all grammars are reachable from
+    // the root grammar.
+    void breakCycles ();
+
+    SnapshotReader (ConstMemory      const snapshot,
+		    GrammarSymbols * const mt_nonnull symbols)
+	: mem (snapshot.mem()),
+	  len (snapshot.len()),
+	  pos (0),
+	  error (false),
+	  symbols (symbols),
+	  strings (NULL),
+	  num_strings (0),
+	  grammars (NULL),
+	  num_grammars (0)
+    {
+    }
+
+    ~SnapshotReader ()
+    {
+	delete[] strings;
+	delete[] grammars;
+    }
+};
+
+void
+SnapshotReader::getTranzitions (SwitchGrammarEntry * const mt_nonnull entry)
+{
+    entry->any_tranzition = getBool ();
+    entry->tranzition_ids_incomplete = getBool ();
+
+    Uint32 const num_id_words = get ();
+    if (num_id_words > (len - pos) / sizeof (Uint32)) {
+	error = true;
+	return;
+    }
+
+    if (num_id_words > 0) {
+	entry->tranzition_token_ids = new (std::nothrow) Uint32 [num_id_words];
+	assert (entry->tranzition_token_ids);
+	for (Uint32 i = 0; i < num_id_words; ++i)
+	    entry->tranzition_token_ids [i] = get ();
+    }
+    entry->num_tranzition_token_id_words = num_id_words;
+
+    Uint32 const num_tranzitions = get ();
+    for (Uint32 i = 0; i < num_tranzitions && !error; ++i) {
+	StRef<String> const token = getString ();
+	if (!token) {
+	    error = true;
+	    break;
+	}
+
+	SwitchGrammarEntry::TranzitionEntry * const tranzition_entry = new SwitchGrammarEntry::TranzitionEntry;
+	tranzition_entry->grammar_name = token;
+	entry->tranzition_entries.add (tranzition_entry);
+    }
+
+    Uint32 const num_match_entries = get ();
+    for (Uint32 i = 0; i < num_match_entries && !error; ++i) {
+	StRef<TranzitionMatchEntry> const match_entry = st_grab (new (std::nothrow) TranzitionMatchEntry);
+	match_entry->token_dfa = static_cast <TokenDfa const *> (getData ());
+	match_entry->token_match_cb = (Grammar_Immediate_SingleToken::TokenMatchCallback) getFunc ();
+	match_entry->token_match_cb_pure = getBool ();
+	entry->tranzition_match_entries.append (match_entry);
+    }
+}
+
+void
+SnapshotReader::getGrammarRecord (Grammar * const mt_nonnull grammar)
+{
+    grammar->optimized = getBool ();
+    grammar->begin_func = (Grammar::BeginFunc) getFunc ();
+    grammar->match_func = (Grammar::MatchFunc) getFunc ();
+    grammar->accept_func = (Grammar::AcceptFunc) getFunc ();
+    grammar->token_classify_func = (Grammar::TokenClassifyFunc) getFunc ();
+
+    switch (grammar->grammar_type) {
+	case Grammar::t_Immediate: {
+	    Grammar_Immediate_SingleToken * const grammar__immediate =
+		    static_cast <Grammar_Immediate_SingleToken*> (grammar);
+
+	    grammar__immediate->token_id = get ();
+	    grammar__immediate->token_match_cb =
+		    (Grammar_Immediate_SingleToken::TokenMatchCallback) getFunc ();
+	    grammar__immediate->token_match_cb_pure = getBool ();
+	    grammar__immediate->token_dfa = static_cast <TokenDfa const *> (getData ());
+	    grammar__immediate->token_match_cb_name = getString ();
+	} break;
+	case Grammar::t_Compound: {
+	    Grammar_Compound * const grammar__compound =
+		    static_cast <Grammar_Compound*> (grammar);
+
+	    grammar__compound->name = getString ();
+	    grammar__compound->elem_creation_func = (Grammar_Compound::ElementCreationFunc) getFunc ();
+	    grammar__compound->tail_iteration = getBool ();
+
+	    Uint32 const num_entries = get ();
+	    for (Uint32 i = 0; i < num_entries && !error; ++i) {
+		StRef<CompoundGrammarEntry> const entry = st_grab (new (std::nothrow) CompoundGrammarEntry);
+
+		entry->is_jump = getBool ();
+		entry->jump_grammar = getGrammar ();
+		entry->jump_cb = (Grammar::JumpFunc) getFunc ();
+		entry->jump_switch_grammar_index = get ();
+		entry->jump_compound_grammar_index = get ();
+		entry->is_cut = getBool ();
+		entry->inline_match_func = (Grammar::InlineMatchFunc) getFunc ();
+		entry->grammar = getGrammar ();
+		entry->flags = get ();
+		entry->assignment_func = (CompoundGrammarEntry::AssignmentFunc) getFunc ();
+
+		if (entry->is_jump) {
+		    if (!entry->jump_grammar)
+			error = true;
+		} else
+		if (!entry->is_cut && !entry->inline_match_func && !entry->grammar) {
+		    error = true;
+		}
+
+		grammar__compound->grammar_entries.append (entry);
+	    }
+	} break;
+	case Grammar::t_Switch: {
+	    Grammar_Switch * const grammar__switch =
+		    static_cast <Grammar_Switch*> (grammar);
+
+	    grammar__switch->name = getString ();
+	    grammar__switch->lr_entries_ready = getBool ();
+	    grammar__switch->predictive = getBool ();
+
+	    Uint32 const num_entries = get ();
+	    for (Uint32 i = 0; i < num_entries && !error; ++i) {
+		StRef<SwitchGrammarEntry> const entry = st_grab (new (std::nothrow) SwitchGrammarEntry);
+
+		entry->grammar = getGrammar ();
+		if (!entry->grammar)
+		    error = true;
+
+		entry->flags = get ();
+
+		Uint32 const num_variants = get ();
+		for (Uint32 j = 0; j < num_variants && !error; ++j) {
+		    StRef<String> const variant = getString ();
+		    if (!variant) {
+			error = true;
+			break;
+		    }
+
+		    entry->variants.append (variant);
+		}
+
+		getTranzitions (entry);
+
+		entry->left_recursive = getBool ();
+		if (getBool ()) {
+		    entry->lr_tail = st_grab (new (std::nothrow) SwitchGrammarEntry);
+		    getTranzitions (entry->lr_tail);
+		}
+
+		entry->shared_prefix_len = get ();
+		if (entry->shared_prefix_len > SwitchGrammarEntry::MaxSharedPrefixLen)
+		    error = true;
+
+		grammar__switch->grammar_entries.append (entry);
+		if (entry->left_recursive)
+		    grammar__switch->lr_grammar_entries.append (entry);
+	    }
+
+	    if (error)
+		break;
+
+	    List< StRef<SwitchGrammarEntry> >::Element ** const entry_els =
+		    new (std::nothrow) List< StRef<SwitchGrammarEntry> >::Element* [num_entries + 1];
+	    assert (entry_els);
+	    {
+		Uint32 i = 0;
+		for (List< StRef<SwitchGrammarEntry> >::Element *el = grammar__switch->grammar_entries.first;
+		     el;
+		     el = el->next)
+		{
+		    entry_els [i] = el;
+		    ++i;
+		}
+	    }
+
+	    Uint32 const num_predict_entries = get ();
+	    for (Uint32 i = 0; i < num_predict_entries && !error; ++i) {
+		StRef<String> const token = getString ();
+		Uint32 const entry_index = get ();
+		if (!token || entry_index >= num_entries) {
+		    error = true;
+		    break;
+		}
+
+		Grammar_Switch::PredictEntry * const predict_entry = new (std::nothrow) Grammar_Switch::PredictEntry;
+		assert (predict_entry);
+		predict_entry->token = token;
+		predict_entry->entry_el = entry_els [entry_index];
+		grammar__switch->predict_entries.add (predict_entry);
+	    }
+
+	    Uint32 const num_predict_ids = get ();
+	    if (num_predict_ids > (len - pos) / sizeof (Uint32))
+		error = true;
+
+	    if (num_predict_ids > 0 && !error) {
+		grammar__switch->predict_by_id =
+			new (std::nothrow) List< StRef<SwitchGrammarEntry> >::Element* [num_predict_ids];
+		assert (grammar__switch->predict_by_id);
+		grammar__switch->num_predict_ids = num_predict_ids;
+
+		for (Uint32 i = 0; i < num_predict_ids; ++i) {
+		    Uint32 const entry_index = get ();
+		    if (entry_index > num_entries) {
+			error = true;
+			grammar__switch->predict_by_id [i] = NULL;
+			continue;
+		    }
+
+		    grammar__switch->predict_by_id [i] = (entry_index ? entry_els [entry_index - 1] : NULL);
+		}
+	    }
+
+	    delete[] entry_els;
+	} break;
+	case Grammar::t_Alias: {
+	    Grammar_Alias * const grammar__alias =
+		    static_cast <Grammar_Alias*> (grammar);
+
+	    grammar__alias->name = getString ();
+	    grammar__alias->aliased_grammar = getGrammar ();
+	    if (!grammar__alias->aliased_grammar)
+		error = true;
+	} break;
+	case Grammar::t_Precedence: {
+	    Grammar_Precedence * const grammar__precedence =
+		    static_cast <Grammar_Precedence*> (grammar);
+
+	    grammar__precedence->name = getString ();
+	    grammar__precedence->operand_grammar = getGrammar ();
+	    grammar__precedence->binary_grammar = getGrammar ();
+	    if (!grammar__precedence->operand_grammar || !grammar__precedence->binary_grammar)
+		error = true;
+
+	    Uint32 const num_operators = get ();
+	    for (Uint32 i = 0; i < num_operators && !error; ++i) {
+		StRef<String> const token = getString ();
+		Uint32 const precedence = get ();
+		bool const right_assoc = getBool ();
+		if (!token) {
+		    error = true;
+		    break;
+		}
+
+		if (!grammar__precedence->addOperator (token->mem(), precedence, right_assoc)) {
+		    error = true;
+		    break;
+		}
+	    }
+	} break;
+	default:
+	    unreachable ();
+    }
+}
+
+
+static Size
+get_grammar_refs (Grammar     * const mt_nonnull grammar,
+		  GrammarRef ** const ret_refs)
+{
+    Size num_refs = 0;
+
+    switch (grammar->grammar_type) {
+	case Grammar::t_Immediate:
+	    break;
+	case Grammar::t_Compound: {
+	    Grammar_Compound * const grammar__compound =
+		    static_cast <Grammar_Compound*> (grammar);
+
+	    List< StRef<CompoundGrammarEntry> >::DataIterator iter (grammar__compound->grammar_entries);
+	    while (!iter.done ()) {
+		StRef<CompoundGrammarEntry> &entry = iter.next ();
+		if (entry->grammar) {
+		    if (ret_refs)
+			ret_refs [num_refs] = &entry->grammar;
+		    ++num_refs;
+		}
+	    }
+	} break;
+	case Grammar::t_Switch: {
+	    Grammar_Switch * const grammar__switch =
+		    static_cast <Grammar_Switch*> (grammar);
+
+	    List< StRef<SwitchGrammarEntry> >::DataIterator iter (grammar__switch->grammar_entries);
+	    while (!iter.done ()) {
+		StRef<SwitchGrammarEntry> &entry = iter.next ();
+		if (ret_refs)
+		    ret_refs [num_refs] = &entry->grammar;
+		++num_refs;
+	    }
+	} break;
+	case Grammar::t_Alias: {
+	    if (ret_refs)
+		ret_refs [0] = &static_cast <Grammar_Alias*> (grammar)->aliased_grammar;
+	    num_refs = 1;
+	} break;
+	case Grammar::t_Precedence: {
+	    Grammar_Precedence * const grammar__precedence =
+		    static_cast <Grammar_Precedence*> (grammar);
+
+	    if (ret_refs) {
+		ret_refs [0] = &grammar__precedence->operand_grammar;
+		ret_refs [1] = &grammar__precedence->binary_grammar;
+	    }
+	    num_refs = 2;
+	} break;
+	default:
+	    unreachable ();
+    }
+
+    return num_refs;
+}
+
+void
+SnapshotReader::checkReferences ()
+{
+    for (Uint32 i = 0; i < num_grammars; ++i) {
+	Grammar * const grammar = grammars [i];
+
+	if (grammar->grammar_type == Grammar::t_Compound) {
+	    Grammar_Compound * const grammar__compound =
+		    static_cast <Grammar_Compound*> (grammar);
+
+	    List< StRef<CompoundGrammarEntry> >::DataIterator iter (grammar__compound->grammar_entries);
+	    while (!iter.done ()) {
+		StRef<CompoundGrammarEntry> &entry = iter.next ();
+		if (!entry->is_jump)
+		    continue;
+
+		// See Grammar_Compound::freeze().
+		if (entry->jump_grammar->grammar_type != Grammar::t_Switch) {
+		    error = true;
+		    return;
+		}
+
+		Grammar_Switch * const jump_switch = static_cast <Grammar_Switch*> (entry->jump_grammar);
+		if (entry->jump_switch_grammar_index >= jump_switch->grammar_entries.getNumElements ()) {
+		    error = true;
+		    return;
+		}
+
+		Grammar * const jump_target =
+			jump_switch->grammar_entries.getIthElement (entry->jump_switch_grammar_index)->data->grammar;
+		if (jump_target->grammar_type != Grammar::t_Compound
+		    || entry->jump_compound_grammar_index >
+			       static_cast <Grammar_Compound*> (jump_target)->grammar_entries.getNumElements ())
+		{
+		    error = true;
+		    return;
+		}
+	    }
+	} else
+	if (grammar->grammar_type == Grammar::t_Precedence) {
+	    // The parser matches operators with the second entry
+	    // of "<left> * <right>".
+	    Grammar * const binary_grammar =
+		    static_cast <Grammar_Precedence*> (grammar)->binary_grammar;
+	    if (binary_grammar->grammar_type != Grammar::t_Compound) {
+		error = true;
+		return;
+	    }
+
+	    Grammar_Compound * const binary_compound = static_cast <Grammar_Compound*> (binary_grammar);
+	    if (binary_compound->grammar_entries.getNumElements () < 3
+		|| !binary_compound->grammar_entries.first->next->data->grammar)
+	    {
+		error = true;
+		return;
+	    }
+	}
+    }
+}
+
+void
+SnapshotReader::breakCycles ()
+{
+    Size * const ref_offsets = new (std::nothrow) Size [num_grammars + 1];
+    assert (ref_offsets);
+
+    ref_offsets [0] = 0;
+    for (Uint32 i = 0; i < num_grammars; ++i)
+	ref_offsets [i + 1] = ref_offsets [i] + get_grammar_refs (grammars [i], NULL);
+
+    GrammarRef ** const refs = new (std::nothrow) GrammarRef* [ref_offsets [num_grammars] + 1];
+    assert (refs);
+
+    // Grammar::loop_id holds the index of the grammar plus 1 here.
+    for (Uint32 i = 0; i < num_grammars; ++i) {
+	get_grammar_refs (grammars [i], refs + ref_offsets [i]);
+	grammars [i]->loop_id = i + 1;
+    }
+
+    enum {
+	Unvisited = 0,
+	OnPath,
+	Visited
+    };
+
+    Byte   * const state     = new (std::nothrow) Byte [num_grammars];
+    Size   * const next_ref  = new (std::nothrow) Size [num_grammars];
+    Uint32 * const path      = new (std::nothrow) Uint32 [num_grammars];
+    assert (state && next_ref && path);
+
+    for (Uint32 i = 0; i < num_grammars; ++i) {
+	state [i] = Unvisited;
+	next_ref [i] = ref_offsets [i];
+    }
+
+    // Depth-first walk from the root grammar. A cycle of references always
+    // contains a reference to a grammar on the current path, and every such
+    // grammar owns the referring one through the path.
+    Size path_len = 1;
+    path [0] = 0;
+    state [0] = OnPath;
+    while (path_len > 0) {
+	Uint32 const cur = path [path_len - 1];
+	if (next_ref [cur] == ref_offsets [cur + 1]) {
+	    state [cur] = Visited;
+	    --path_len;
+	    continue;
+	}
+
+	GrammarRef * const ref = refs [next_ref [cur]];
+	++next_ref [cur];
+
+	Uint32 const target = (Uint32) ref->ptr()->loop_id - 1;
+	if (state [target] == OnPath) {
+	    ref->setNonOwning (ref->ptr());
+	} else
+	if (state [target] == Unvisited) {
+	    state [target] = OnPath;
+	    path [path_len] = target;
+	    ++path_len;
+	}
+    }
+
+    for (Uint32 i = 0; i < num_grammars; ++i) {
+	// saveGrammarSnapshot() writes reachable grammars only.
+	if (state [i] != Visited)
+	    error = true;
+
+	grammars [i]->loop_id = 0;
+    }
+
+    delete[] path;
+    delete[] next_ref;
+    delete[] state;
+    delete[] refs;
+    delete[] ref_offsets;
+}
+
+}
+
+mt_throws Result
+saveGrammarSnapshot (OutputStream   * const mt_nonnull outs,
+		     Grammar        * const mt_nonnull grammar,
+		     GrammarSymbols * const mt_nonnull symbols)
+{
+    if (!grammar->optimized)
+	optimizeGrammar (grammar);
+
+    SnapshotWriter writer (symbols);
+
+    writer.grammarIndex (grammar);
+    // Records refer to grammars which have not been numbered yet,
+    // and those are appended to 'writer.grammars'.
+    for (Size i = 0; i < writer.num_grammars; ++i)
+	writer.putGrammarRecord (writer.grammars [i]);
+
+    if (writer.unknown_symbol) {
+	exc_throw (InternalException, InternalException::BadInput);
+	return Result::Failure;
+    }
+
+    WordBuffer header;
+    header.put (SnapshotMagic);
+    header.put (SnapshotVersion);
+
+    // Tokens of immediate grammars are needed to create the grammar objects
+    // before the records are read.
+    WordBuffer types;
+    for (Size i = 0; i < writer.num_grammars; ++i) {
+	Grammar * const cur_grammar = writer.grammars [i];
+	types.put ((Uint32) cur_grammar->grammar_type);
+
+	if (cur_grammar->grammar_type == Grammar::t_Immediate) {
+	    StRef<String> const token =
+		    static_cast <Grammar_Immediate_SingleToken*> (cur_grammar)->getToken ();
+	    types.put (token ? writer.putString (token->mem()) : NoIndex);
+	} else {
+	    types.put (NoIndex);
+	}
+    }
+
+    header.put (writer.num_strings);
+
+    Uint32 const num_grammars_word = (Uint32) writer.num_grammars;
+
+    if (!outs->print (ConstMemory ((Byte const *) header.words, header.len * sizeof (Uint32)))
+	|| !outs->print (ConstMemory ((Byte const *) writer.strings.words, writer.strings.len * sizeof (Uint32)))
+	|| !outs->print (ConstMemory ((Byte const *) &num_grammars_word, sizeof (Uint32)))
+	|| !outs->print (ConstMemory ((Byte const *) types.words, types.len * sizeof (Uint32)))
+	|| !outs->print (ConstMemory ((Byte const *) writer.records.words, writer.records.len * sizeof (Uint32))))
+    {
+	return Result::Failure;
+    }
+
+    return Result::Success;
+}
+
+mt_throws Result
+loadGrammarSnapshot (ConstMemory      const snapshot,
+		     GrammarSymbols * const mt_nonnull symbols,
+		     StRef<Grammar> * const mt_nonnull ret_grammar)
+{
+    *ret_grammar = NULL;
+
+    SnapshotReader reader (snapshot, symbols);
+
+    if (reader.get () != SnapshotMagic || reader.get () != SnapshotVersion) {
+	exc_throw (InternalException, InternalException::BadInput);
+	return Result::Failure;
+    }
+
+    reader.num_strings = reader.get ();
+    if (reader.num_strings > (reader.len - reader.pos) / sizeof (Uint32)) {
+	exc_throw (InternalException, InternalException::BadInput);
+	return Result::Failure;
+    }
+
+    reader.strings = new (std::nothrow) StRef<String> [reader.num_strings + 1];
+    assert (reader.strings);
+    for (Uint32 i = 0; i < reader.num_strings; ++i) {
+	Uint32 const str_len = reader.get ();
+	if (reader.error || str_len > reader.len - reader.pos) {
+	    exc_throw (InternalException, InternalException::BadInput);
+	    return Result::Failure;
+	}
+
+	reader.strings [i] = st_grab (new (std::nothrow) String (ConstMemory (reader.mem + reader.pos, str_len)));
+	reader.pos += (str_len + sizeof (Uint32) - 1) / sizeof (Uint32) * sizeof (Uint32);
+	if (reader.pos > reader.len) {
+	    exc_throw (InternalException, InternalException::BadInput);
+	    return Result::Failure;
+	}
+    }
+
+    reader.num_grammars = reader.get ();
+    if (reader.num_grammars == 0
+	|| reader.num_grammars > (reader.len - reader.pos) / (2 * sizeof (Uint32)))
+    {
+	exc_throw (InternalException, InternalException::BadInput);
+	return Result::Failure;
+    }
+
+    reader.grammars = new (std::nothrow) StRef<Grammar> [reader.num_grammars];
+    assert (reader.grammars);
+    for (Uint32 i = 0; i < reader.num_grammars; ++i) {
+	Uint32 const type = reader.get ();
+	StRef<String> const token = reader.getString ();
+
+	switch (type) {
+	    case Grammar::t_Immediate:
+		reader.grammars [i] = st_grab (new (std::nothrow) Grammar_Immediate_SingleToken (token));
+		break;
+	    case Grammar::t_Compound:
+		reader.grammars [i] = st_grab (new (std::nothrow) Grammar_Compound (NULL /* elem_creation_func */));
+		break;
+	    case Grammar::t_Switch:
+		reader.grammars [i] = st_grab (new (std::nothrow) Grammar_Switch);
+		break;
+	    case Grammar::t_Alias:
+		reader.grammars [i] = st_grab (new (std::nothrow) Grammar_Alias);
+		break;
+	    case Grammar::t_Precedence:
+		reader.grammars [i] = st_grab (new (std::nothrow) Grammar_Precedence);
+		break;
+	    default:
+		reader.error = true;
+	}
+
+	if (reader.error) {
+	    exc_throw (InternalException, InternalException::BadInput);
+	    return Result::Failure;
+	}
+    }
+
+    for (Uint32 i = 0; i < reader.num_grammars; ++i) {
+	reader.getGrammarRecord (reader.grammars [i]);
+	if (reader.error)
+	    break;
+    }
+
+    if (!reader.error)
+	reader.checkReferences ();
+
+    if (!reader.error)
+	reader.breakCycles ();
+
+    if (reader.error) {
+	if (reader.unknown_symbol) {
+	    exc_throw (ParsingException,
+		       FilePosition (),
+		       st_makeString ("Grammar snapshot: unknown symbol: ", reader.unknown_symbol));
+	} else {
+	    exc_throw (InternalException, InternalException::BadInput);
+	}
+
+	return Result::Failure;
+    }
+
+    for (Uint32 i = 0; i < reader.num_grammars; ++i) {
+	if (reader.grammars [i]->grammar_type == Grammar::t_Compound)
+	    static_cast <Grammar_Compound*> (reader.grammars [i].ptr ())->freeze ();
+    }
+
+    *ret_grammar = reader.grammars [0];
+    return Result::Success;
+}
+
+mt_throws Result
+loadGrammarSnapshotFile (ConstMemory      const filename,
+			 GrammarSymbols * const mt_nonnull symbols,
+			 StRef<Grammar> * const mt_nonnull ret_grammar)
+{
+    *ret_grammar = NULL;
+
+    StRef<String> const filename_str = st_makeString (filename);
+
+    int const fd = open (filename_str->cstr(), O_RDONLY);
+    if (fd == -1) {
+	exc_throw (PosixException, errno);
+	return Result::Failure;
+    }
+
+    struct stat st;
+    if (fstat (fd, &st) == -1) {
+	exc_throw (PosixException, errno);
+	close (fd);
+	return Result::Failure;
+    }
+
+    if (st.st_size == 0) {
+	close (fd);
+	exc_throw (InternalException, InternalException::BadInput);
+	return Result::Failure;
+    }
+
+    void * const mem = mmap (NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+	exc_throw (PosixException, errno);
+	close (fd);
+	return Result::Failure;
+    }
+
+    close (fd);
+
+    Result const res = loadGrammarSnapshot (ConstMemory ((Byte const *) mem, (Size) st.st_size),
+					    symbols,
+					    ret_grammar);
+
+    munmap (mem, (size_t) st.st_size);
+
+    return res;
+}
+
+}
+
@@ -0,0 +1,123 @@
+/*  Pargen - Flexible parser generator
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#ifndef PARGEN__GRAMMAR_SNAPSHOT__H__
+#define PARGEN__GRAMMAR_SNAPSHOT__H__
+
+
+#include <libmary/libmary.h>
+
+#include <pargen/grammar.h>
+
+
+namespace Pargen {
+
+using namespace M;
+
+// Callbacks and token classes referred to by grammars, by name.
+// Generated code fills the registry with register_<header_name>_symbols().
+class GrammarSymbols
+{
+public:
+    typedef void (*Func) ();
+
+private:
+    class Symbol : public M::HashEntry<>
+    {
+    public:
+	StRef<String> name;
+	Func func;
+	void const *data;
+    };
+
+    typedef M::Hash< Symbol,
+		     Memory,
+		     MemberExtractor< Symbol,
+				      StRef<String>,
+				      &Symbol::name,
+				      Memory,
+				      AccessorExtractor< String,
+							 Memory,
+							 &String::mem > >,
+		     MemoryComparator<> >
+	    SymbolHash;
+
+    SymbolHash symbol_hash;
+
+    void addSymbol (ConstMemory  name,
+		    Func         func,
+		    void const  *data);
+
+public:
+    void addFunc (ConstMemory const name,
+		  Func        const func)
+    {
+	addSymbol (name, func, NULL);
+    }
+
+    void addData (ConstMemory   const name,
+		  void const  * const data)
+    {
+	addSymbol (name, NULL, data);
+    }
+
+    // Returns NULL if there's no such symbol.
+    Func lookupFunc (ConstMemory name);
+
+    // Returns NULL if there's no such symbol.
+    void const* lookupData (ConstMemory name);
+
+    // Reverse lookups are linear and are meant for writing snapshots only.
+    // Return NULL if the symbol is not registered.
+    StRef<String> getFuncName (Func func);
+
+    StRef<String> getDataName (void const *data);
+
+    ~GrammarSymbols ();
+};
+
+// Grammar snapshots hold an optimized grammar with all of its tranzition
+// tables. Loading a snapshot takes no optimizeGrammar() call and no generated
+// grammar construction code. Callbacks are stored by name and are resolved
+// with 'symbols' when loading.
+//
+// Snapshots use native byte order and are not portable between
+// architectures.
+
+// Optimizes the grammar first if it has not been optimized yet.
+mt_throws Result saveGrammarSnapshot (OutputStream   * mt_nonnull outs,
+				      Grammar        * mt_nonnull grammar,
+				      GrammarSymbols * mt_nonnull symbols);
+
+// References which close cycles in the loaded grammar are non-owning
+// (see GrammarRef), hence subgrammars are valid while 'ret_grammar' is held.
+mt_throws Result loadGrammarSnapshot (ConstMemory      snapshot,
+				      GrammarSymbols * mt_nonnull symbols,
+				      StRef<Grammar> * mt_nonnull ret_grammar);
+
+// Maps the file read-only for the time of loading.
+mt_throws Result loadGrammarSnapshotFile (ConstMemory      filename,
+					  GrammarSymbols * mt_nonnull symbols,
+					  StRef<Grammar> * mt_nonnull ret_grammar);
+
+}
+
+
+#endif /* PARGEN__GRAMMAR_SNAPSHOT__H__ */
+
@@ -87,6 +87,9 @@ compileHeader_Phrase_External (File                                    * const m
 	    case PhrasePart::t_Label: {
 	      // No-op
 	    } break;
+	    case PhrasePart::t_Cut: {
+	      // No-op
+	    } break;
 	    default:
                 unreachable ();
 	}
@@ -164,6 +167,9 @@ compileHeader_Phrase (File                                    * const mt_nonnull
 	    case PhrasePart::t_Label: {
 	      // No-op
 	    } break;
+	    case PhrasePart::t_Cut: {
+	      // No-op
+	    } break;
 	    default:
                 unreachable ();
 	}
@@ -187,6 +193,7 @@ compileHeader (File                     * const mt_nonnull file,
                       "\n"
                       "#include <pargen/parser_element.h>\n"
                       "#include <pargen/grammar.h>\n"
+                      "#include <pargen/grammar_snapshot.h>\n"
                       "\n"
                       "\n"
                       "namespace ", opts->capital_namespace_name, " {\n"
@@ -465,6 +472,12 @@ compileHeader (File                     * const mt_nonnull file,
         }
     }
 
+    if (!file->print ("void register_", opts->header_name, "_symbols (Pargen::GrammarSymbols *symbols);\n"
+                      "\n"))
+    {
+        return Result::Failure;
+    }
+
     if (!file->print ("}\n"
                       "\n"
                       "\n"
@@ -0,0 +1,104 @@
+/*  Pargen - Flexible parser generator
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+
+#include <cstring>
+
+#include <libmary/libmary.h>
+
+#include <pargen/line_index.h>
+
+
+using namespace M;
+
+namespace Pargen {
+
+static Size
+count_newlines (ConstMemory const mem)
+{
+    Byte const *pos = mem.mem();
+    Byte const * const end = mem.mem() + mem.len();
+
+    Size num_newlines = 0;
+    while (pos < end) {
+        Byte const * const nl = (Byte const *) memchr (pos, '\n', end - pos);
+        if (!nl)
+            break;
+
+        ++num_newlines;
+        pos = nl + 1;
+    }
+
+    return num_newlines;
+}
+
+void
+LineIndex::build (ConstMemory const mem)
+{
+    delete[] line_starts;
+
+    num_lines = count_newlines (mem) + 1;
+    line_starts = new (std::nothrow) FileSize [num_lines];
+    assert (line_starts);
+
+    line_starts [0] = 0;
+
+    Byte const *pos = mem.mem();
+    Byte const * const end = mem.mem() + mem.len();
+    for (Size i = 1; i < num_lines; ++i) {
+        Byte const * const nl = (Byte const *) memchr (pos, '\n', end - pos);
+        assert (nl);
+
+        pos = nl + 1;
+        line_starts [i] = pos - mem.mem();
+    }
+}
+
+FilePosition
+LineIndex::getFilePosition (FileSize const offset) const
+{
+    assert (line_starts);
+
+    // The last line which begins at or before 'offset'.
+    Size left = 0;
+    Size right = num_lines;
+    while (right - left > 1) {
+        Size const middle = left + (right - left) / 2;
+        if (line_starts [middle] <= offset)
+            left = middle;
+        else
+            right = middle;
+    }
+
+    return FilePosition (left, line_starts [left], offset);
+}
+
+LineIndex::LineIndex ()
+    : line_starts (NULL),
+      num_lines   (0)
+{
+}
+
+LineIndex::~LineIndex ()
+{
+    delete[] line_starts;
+}
+
+}
+
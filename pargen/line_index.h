@@ -0,0 +1,63 @@
+/*  Pargen - Flexible parser generator
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+
+#ifndef PARGEN__LINE_INDEX__H__
+#define PARGEN__LINE_INDEX__H__
+
+
+#include <libmary/libmary.h>
+
+#include <pargen/file_position.h>
+
+
+namespace Pargen {
+
+using namespace M;
+
+// Offsets of line beginnings in a memory buffer. Lets token streams and
+// users of ParserElement spans translate byte offsets into line/column
+// positions without tracking lines while lexing. The buffer is scanned
+// once, with memchr().
+class LineIndex
+{
+private:
+    FileSize *line_starts;
+    Size num_lines;
+
+public:
+    bool isBuilt () const
+    {
+        return line_starts != NULL;
+    }
+
+    void build (ConstMemory mem);
+
+    // Lines are counted from zero, like in FileTokenStream.
+    FilePosition getFilePosition (FileSize offset) const;
+
+     LineIndex ();
+    ~LineIndex ();
+};
+
+}
+
+
+#endif /* PARGEN__LINE_INDEX__H__ */
+
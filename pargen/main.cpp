@@ -27,6 +27,7 @@
 #include <pargen/pargen_task_parser.h>
 #include <pargen/header_compiler.h>
 #include <pargen/source_compiler.h>
+#include <pargen/grammar_analyzer.h>
 
 
 #define DEBUG(a) a
@@ -44,8 +45,10 @@ struct Options
     StRef<String> module_name;
     StRef<String> namespace_name;
     StRef<String> header_name;
+    StRef<String> profile_filename;
 
     Bool extmode;
+    Bool analyze;
 
     Bool help;
 };
@@ -62,6 +65,8 @@ print_usage ()
                    "  --namespace\n"
                    "  --header-name\n"
                    "  --extmode\n"
+                   "  --analyze\n"
+                   "  --profile=<file>\n"
                    "  -h, --help");
 }
 
@@ -120,12 +125,34 @@ cmdline_extmode (const char * /* short_name */,
     return true;
 }
 
+static bool
+cmdline_analyze (const char * /* short_name */,
+		 const char * /* long_name */,
+		 const char * /* value */,
+		 void       * /* opt_data */,
+		 void       * /* callback_data */)
+{
+    options.analyze = true;
+    return true;
+}
+
+static bool
+cmdline_profile (const char * /* short_name */,
+		 const char * /* long_name */,
+		 const char *value,
+		 void       * /* opt_data */,
+		 void       * /* callback_data */)
+{
+    options.profile_filename = st_grab (new (std::nothrow) String (value));
+    return true;
+}
+
 int main (int argc, char **argv)
 {
     libMaryInit ();
 
     {
-	const Size num_opts = 5;
+	const Size num_opts = 7;
 	CmdlineOption opts [num_opts];
 
 	opts [0].short_name = NULL;
@@ -158,6 +185,18 @@ int main (int argc, char **argv)
 	opts [4].opt_data   = NULL;
 	opts [4].opt_callback = cmdline_extmode;
 
+	opts [5].short_name = NULL;
+	opts [5].long_name  = "analyze";
+	opts [5].with_value = false;
+	opts [5].opt_data   = NULL;
+	opts [5].opt_callback = cmdline_analyze;
+
+	opts [6].short_name = NULL;
+	opts [6].long_name  = "profile";
+	opts [6].with_value = true;
+	opts [6].opt_data   = NULL;
+	opts [6].opt_callback = cmdline_profile;
+
 	ArrayIterator<CmdlineOption> opts_iter (opts, num_opts);
 	parseCmdline (&argc, &argv, opts_iter,
 		      NULL /* callback */,
@@ -182,6 +221,52 @@ int main (int argc, char **argv)
         return EXIT_FAILURE;
     }
 
+    NativeFile file;
+    if (!file.open (input_filename, 0 /* open_flags */, FileAccessMode::ReadOnly)) {
+        errs->println ("Could not open ", input_filename, ": ", exc->toString());
+        return EXIT_FAILURE;
+    }
+
+    FileTokenStream file_token_stream (&file,
+                                       true /* report_newlines */,
+                                       true /* minus_is_alpha */);
+
+    StRef<PargenTask> pargen_task;
+    if (!parsePargenTask (&file_token_stream, &pargen_task)) {
+        errs->println ("Parsing error: ", exc->toString());
+        return EXIT_FAILURE;
+    }
+
+    DEBUG_OLD (
+      dumpDeclarations (pargen_task);
+    )
+
+    file.close (true /* flush_data */);
+
+    if (options.profile_filename) {
+        NativeFile profile_file;
+        if (!profile_file.open (options.profile_filename->mem(), 0 /* open_flags */, FileAccessMode::ReadOnly)) {
+            errs->println ("Could not open ", options.profile_filename, ": ", exc->toString());
+            return EXIT_FAILURE;
+        }
+
+        FileTokenStream profile_token_stream (&profile_file,
+                                              false /* report_newlines */,
+                                              true  /* minus_is_alpha */);
+
+        if (!applyGrammarProfile (pargen_task, &profile_token_stream)) {
+            errs->println ("Profile error: ", exc->toString());
+            return EXIT_FAILURE;
+        }
+
+        profile_file.close (true /* flush_data */);
+    }
+
+    if (options.analyze) {
+        analyzeGrammar (outs, pargen_task);
+        return 0;
+    }
+
     if (!options.module_name) {
         errs->println ("Module name not specified");
         return EXIT_FAILURE;
@@ -219,28 +304,6 @@ int main (int argc, char **argv)
                                     false /* keep_underscore */);
     comp_opts->all_caps_header_name = capitalizeNameAllCaps (comp_opts->header_name->mem());
 
-    NativeFile file;
-    if (!file.open (input_filename, 0 /* open_flags */, FileAccessMode::ReadOnly)) {
-        errs->println ("Could not open ", input_filename, ": ", exc->toString());
-        return EXIT_FAILURE;
-    }
-
-    FileTokenStream file_token_stream (&file,
-                                       true /* report_newlines */,
-                                       true /* minus_is_alpha */);
-
-    StRef<PargenTask> pargen_task;
-    if (!parsePargenTask (&file_token_stream, &pargen_task)) {
-        errs->println ("Parsing error: ", exc->toString());
-        return EXIT_FAILURE;
-    }
-
-    DEBUG_OLD (
-      dumpDeclarations (pargen_task);
-    )
-
-    file.close (true /* flush_data */);
-
     NativeFile header_file;
     if (!header_file.open (header_filename->mem(),
                            FileOpenFlags::Create | FileOpenFlags::Truncate,
@@ -24,6 +24,7 @@
 #include <libmary/libmary.h>
 
 #include <pargen/token_stream.h>
+#include <pargen/line_index.h>
 
 
 namespace Pargen {
@@ -39,32 +40,254 @@ private:
     mt_const bool report_newlines;
     mt_const ConstMemory newline_replacement;
     mt_const bool minus_is_alpha;
+    mt_const bool stable;
 
     mt_const Byte *token_buf;
 
     Size cur_pos;
+    // Beginning of the last token returned by getNextToken().
+    Size token_begin;
 
-    unsigned long cur_line;
-    Uint64 cur_line_start;
+    // Built on the first request for a line number. The lexer doesn't
+    // track lines itself.
+    LineIndex line_index;
+
+    static bool isWhitespace (unsigned char const c)
+    {
+        return c == ' ' || c == '\t' || c == '\v' || c == '\r' || c == '\n';
+    }
+
+    static bool isNewline (unsigned char const c)
+    {
+        return c == '\n';
+    }
 
 public:
   mt_iface (TokenStream)
-    mt_throws Result getNextToken    (ConstMemory *ret_mem);
-    mt_throws Result getPosition     (PositionMarker * mt_nonnull ret_pmark);
-    mt_throws Result setPosition     (PositionMarker const *pmark);
+    // getNextToken() and position methods are inline: the parser has an
+    // instantiation which calls them non-virtually for memory token streams.
+    inline mt_throws Result getNextToken (ConstMemory *ret_mem);
+
+    mt_throws Result getPosition (PositionMarker * const mt_nonnull ret_pmark)
+    {
+        getPositionBody (&ret_pmark->body);
+        // Lines are not tracked, see getFilePosition().
+        ret_pmark->body.cur_line = 0;
+        ret_pmark->body.cur_line_start = 0;
+        return Result::Success;
+    }
+
+    mt_throws Result setPosition (PositionMarker const * const pmark)
+    {
+        if (!pmark) {
+            cur_pos = 0;
+            return Result::Success;
+        }
+
+        return setPositionBody (&pmark->body);
+    }
+
     mt_throws Result getFilePosition (FilePosition *ret_fpos);
+    ConstMemory      getStableMemory ();
+    void             getTokenSpan    (FileSize * mt_nonnull ret_begin,
+                                      FileSize * mt_nonnull ret_end);
   mt_iface_end
 
+    // Positions without a PositionMarker around them. Only the offset
+    // is stored.
+    mt_throws Result getPositionBody (PositionMarker::Body * const mt_nonnull ret_body)
+    {
+        ret_body->offset = cur_pos;
+        return Result::Success;
+    }
+
+    mt_throws Result setPositionBody (PositionMarker::Body const * const mt_nonnull body)
+    {
+        cur_pos = (Size) body->offset;
+        return Result::Success;
+    }
+
+    // Translates offsets of parser element spans into line numbers.
+    LineIndex* getLineIndex ();
+
+    // If @stable is true, then @mem must stay valid for as long as parser
+    // elements produced from this stream are in use. Tokens are not copied
+    // by the parser in this case, except for string literals with escapes.
     void init (ConstMemory mem,
                bool        report_newlines = false,
                ConstMemory newline_replacement = ConstMemory ("\n"),
                bool        minus_is_alpha  = false,
-               Uint64      max_token_len   = 4096);
+               Uint64      max_token_len   = 4096,
+               bool        stable          = false);
 
      MemoryTokenStream ();
     ~MemoryTokenStream ();
 };
 
+inline mt_throws Result
+MemoryTokenStream::getNextToken (ConstMemory * const ret_mem)
+{
+
+    if (!ret_mem)
+        return Result::Success;
+
+    Byte const * const buf = mem.mem();
+    Size const len = mem.len();
+    Size pos = cur_pos;
+    for (Size const pos_end = len; pos < pos_end;) {
+        char c = buf [pos];
+
+        if (isWhitespace (c)) {
+            bool newline = false;
+            do {
+                if (isNewline (buf [pos]))
+                    newline = true;
+
+                ++pos;
+            } while (pos < len && isWhitespace (buf [pos]));
+
+            if (newline && report_newlines) {
+                *ret_mem = newline_replacement;
+                token_begin = cur_pos;
+                cur_pos = pos;
+                return Result::Success;
+            }
+
+            cur_pos = pos;
+            continue;
+        }
+
+        if (c == '/' && pos + 1 < pos_end) {
+            if (buf [pos + 1] == '/') {
+              // Single-line comment
+                pos += 2;
+                for (; pos < pos_end; ++pos) {
+                    if (isNewline (buf [pos])) {
+                        ++pos;
+                        break;
+                    }
+                }
+                cur_pos = pos;
+                continue;
+            } else
+            if (buf [pos + 1] == '*') {
+              // Multiline comment
+                pos += 2;
+                for (; pos < pos_end; ++pos) {
+                    if (buf [pos] == '*' && pos + 1 < pos_end) {
+                        if (buf [pos + 1] == '/') {
+                            pos += 2;
+                            break;
+                        }
+                    }
+                }
+                cur_pos = pos;
+                continue;
+            }
+        }
+
+        if (c == '"') {
+
+            ++pos;
+            bool escaped = false;
+            bool escape_offs = 0;
+            for (; pos < pos_end; ++pos) {
+                if (pos - cur_pos - 1 >= max_token_len) {
+                    // TODO Throw ParsingException
+                    exc_throw (InternalException, InternalException::BadInput);
+                    return Result::Failure;
+                }
+
+                if (escape_offs > 0)
+                    token_buf [pos - cur_pos - 1 - escape_offs] = buf [pos];
+
+                if (escaped) {
+                    if (isNewline (buf [pos])) {
+                      // Multiline string literal
+                        ++escape_offs;
+                    }
+
+                    escaped = false;
+                    continue;
+                }
+
+                if (isNewline (buf [pos])) {
+                    // TODO Throw ParsingException
+                    exc_throw (InternalException, InternalException::BadInput);
+                    return Result::Failure;
+                } else
+                if (buf [pos] == '"') {
+                    if (escape_offs > 0)
+                        *ret_mem = ConstMemory (token_buf, pos - cur_pos - 1 - escape_offs);
+                    else
+                        *ret_mem = ConstMemory (buf + cur_pos + 1, pos - cur_pos - 1);
+
+
+                    token_begin = cur_pos;
+                    cur_pos = pos + 1;
+                    return Result::Success;
+                } else
+                if (buf [pos] == '\\') {
+                    escaped = true;
+                    ++escape_offs;
+                    memcpy (token_buf, buf + cur_pos + 1, pos - cur_pos - 1);
+                }
+            }
+        } else
+        if (c >= '0' && c <= '9') {
+            ++pos;
+            for (; pos < pos_end; ++pos) {
+                unsigned char const c = buf [pos];
+                if (!((c >= '0' && c <= '9') ||
+                      (c >= 'a' && c <= 'z') ||
+                      (c >= 'A' && c <= 'Z') ||
+                      c == '.'))
+                {
+                    *ret_mem = ConstMemory (buf + cur_pos, pos - cur_pos);
+                    token_begin = cur_pos;
+                    cur_pos = pos;
+                    return Result::Success;
+                }
+            }
+        } else
+        if ((c >= 'a' && c <= 'z') ||
+            (c >= 'A' && c <= 'Z') ||
+            c == '_' ||
+            (minus_is_alpha && c == '-'))
+        {
+            ++pos;
+            for (; pos < pos_end; ++pos) {
+                c = buf [pos];
+                if (!((c >= '0' && c <= '9') ||
+                      (c >= 'a' && c <= 'z') ||
+                      (c >= 'A' && c <= 'Z') ||
+                      c == '_' ||
+                      (minus_is_alpha && c == '-')))
+                {
+                    *ret_mem = ConstMemory (buf + cur_pos, pos - cur_pos);
+                    token_begin = cur_pos;
+                    cur_pos = pos;
+                    return Result::Success;
+                }
+            }
+        } else {
+          // Single-char token
+            *ret_mem = ConstMemory (buf + pos, 1);
+            token_begin = pos;
+            ++pos;
+            cur_pos = pos;
+            return Result::Success;
+        }
+
+        ++pos;
+    }
+
+    *ret_mem = ConstMemory (buf + cur_pos, pos - cur_pos);
+    token_begin = cur_pos;
+    cur_pos = len;
+    return Result::Success;
+}
+
 }
 
 
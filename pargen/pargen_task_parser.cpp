@@ -19,6 +19,8 @@
 
 #include <pargen/util.h>
 
+#include <pargen/token_dfa_compiler.h>
+
 #include <pargen/pargen_task_parser.h>
 
 
@@ -260,25 +262,37 @@ parsePhrasePart (TokenStream       * const mt_nonnull token_stream,
 	    phrase_part = phrase_part__token;
 	} else
 	if (equal (token, "{")) {
-	  // Any token with a match callback
+	  // Any token with a match callback: "{cb}" or "{pure cb}"
 
 	    if (!getNonwhspToken (token_stream, &token))
                 return Result::Failure;
 	    if (token.len() == 0)
 		goto _no_match;
 
-	    StRef<String> const token_match_cb = st_grab (new (std::nothrow) String (token));
+	    StRef<String> token_match_cb = st_grab (new (std::nothrow) String (token));
+	    bool token_match_cb_pure = false;
 
 	    if (!getNonwhspToken (token_stream, &token))
                 return Result::Failure;
 	    if (token.len() == 0)
 		goto _no_match;
 
+	    if (equal (token_match_cb->mem(), "pure") && !equal (token, "}")) {
+		token_match_cb = st_grab (new (std::nothrow) String (token));
+		token_match_cb_pure = true;
+
+		if (!getNonwhspToken (token_stream, &token))
+                    return Result::Failure;
+		if (token.len() == 0)
+		    goto _no_match;
+	    }
+
 	    if (!equal (token, "}"))
 		goto _no_match;
 
 	    StRef<PhrasePart_Token> const phrase_part__token = st_grab (new (std::nothrow) PhrasePart_Token);
 	    phrase_part__token->token_match_cb = token_match_cb;
+	    phrase_part__token->token_match_cb_pure = token_match_cb_pure;
 
 	    phrase_part = phrase_part__token;
 	} else
@@ -356,6 +370,12 @@ parsePhrasePart (TokenStream       * const mt_nonnull token_stream,
 	    if (!token_stream->getPosition (&marker))
                 return Result::Failure;
 	} else
+	if (equal (token, "!")) {
+	  // Cut
+
+	    StRef<PhrasePart_Cut> const phrase_part__cut = st_grab (new (std::nothrow) PhrasePart_Cut);
+	    phrase_part = phrase_part__cut;
+	} else
 	if (equal (token, "@")) {
 	  // Label
 
@@ -897,6 +917,9 @@ parsePhrase (TokenStream * const mt_nonnull token_stream,
 		case PhrasePart::t_UpwardsAnchor: {
 		    phrase_record->phrase->phrase_name = st_grab (new (std::nothrow) String ("UpwardsAnchor"));
 		} break;
+		case PhrasePart::t_Cut: {
+		    phrase_record->phrase->phrase_name = st_grab (new (std::nothrow) String ("Cut"));
+		} break;
 		default:
                     unreachable ();
 	    }
@@ -1068,6 +1091,269 @@ parseDeclaration_Alias (TokenStream                * const mt_nonnull token_stre
     return Result::Success;
 }
 
+// Parses a token class declaration:
+//
+//     number ~ [0-9]+(\.[0-9]+)?
+//
+// The pattern takes the rest of the line. Whitespace is insignificant.
+//
+static mt_throws Result
+parseDeclaration_TokenClass (TokenStream                   * const mt_nonnull token_stream,
+                             StRef<Declaration_TokenClass> * const mt_nonnull ret_decl_token_class)
+{
+    assert (token_stream);
+
+    DEBUG (
+      errs->println (_func_);
+    )
+
+    FilePosition fpos;
+    if (!token_stream->getFilePosition (&fpos))
+        return Result::Failure;
+
+    StRef<Declaration_TokenClass> const decl = st_grab (new (std::nothrow) Declaration_TokenClass);
+    decl->pattern = st_grab (new (std::nothrow) String);
+
+    for (;;) {
+      // Not using getNextToken(): '#' is a valid pattern character.
+
+	ConstMemory token;
+	if (!token_stream->getNextToken (&token))
+            return Result::Failure;
+
+	if (token.len() == 0 || equal (token, "\n"))
+	    break;
+
+	decl->pattern = st_makeString (decl->pattern, token);
+    }
+
+    if (decl->pattern->len() == 0) {
+        exc_throw (ParsingException, fpos, st_grab (new (std::nothrow) String ("token pattern expected")));
+        return Result::Failure;
+    }
+
+    if (!compileTokenDfa (decl, fpos))
+        return Result::Failure;
+
+    *ret_decl_token_class = decl;
+    return Result::Success;
+}
+
+// Parses the operator table of a precedence declaration:
+//
+//     expression % unary_expression
+//         left  [+] [-]
+//         left  [*] [/]
+//         right [^]
+//
+// Each line is a precedence level, from the lowest to the highest one.
+//
+static mt_throws Result
+parseDeclaration_Precedence (TokenStream                * const mt_nonnull token_stream,
+			     LookupData                 * const mt_nonnull lookup_data,
+			     ConstMemory                  const declaration_name,
+                             StRef<Declaration_Phrases> * const mt_nonnull ret_decl_phrases)
+{
+    assert (token_stream && lookup_data);
+
+    DEBUG (
+      errs->println (_func_);
+    )
+
+    StRef<Declaration_Phrases> const decl = st_grab (new (std::nothrow) Declaration_Phrases);
+    decl->is_precedence = true;
+
+    ConstMemory token;
+    if (!getNonwhspToken (token_stream, &token))
+        return Result::Failure;
+    if (token.len() == 0) {
+        FilePosition fpos;
+        if (!token_stream->getFilePosition (&fpos))
+            return Result::Failure;
+        exc_throw (ParsingException, fpos, st_grab (new (std::nothrow) String ("operand expected")));
+        return Result::Failure;
+    }
+
+    {
+      // Operand) operand
+
+	StRef<Declaration_Phrases::PhraseRecord> const phrase_record =
+                st_grab (new (std::nothrow) Declaration_Phrases::PhraseRecord);
+	phrase_record->phrase = st_grab (new (std::nothrow) Phrase);
+	phrase_record->phrase->phrase_name = st_grab (new (std::nothrow) String ("Operand"));
+
+	StRef<PhrasePart_Phrase> const phrase_part__phrase = st_grab (new (std::nothrow) PhrasePart_Phrase);
+	phrase_part__phrase->phrase_name = capitalizeName (token);
+	phrase_part__phrase->name = capitalizeName (token);
+
+	// Decapitalizing the first letter.
+	if (phrase_part__phrase->name->len() > 0) {
+	    char c = phrase_part__phrase->name->mem().mem() [0];
+	    if (c >= 0x41 /* 'A' */ &&
+		c <= 0x5a /* 'Z' */)
+	    {
+		phrase_part__phrase->name->mem().mem() [0] = c + 0x20;
+	    }
+	}
+
+	phrase_record->phrase->phrase_parts.append (phrase_part__phrase);
+	decl->phrases.append (phrase_record);
+    }
+
+    {
+      // Binary) <left> self * <right> self
+
+	StRef<Declaration_Phrases::PhraseRecord> const phrase_record =
+                st_grab (new (std::nothrow) Declaration_Phrases::PhraseRecord);
+	phrase_record->phrase = st_grab (new (std::nothrow) Phrase);
+	phrase_record->phrase->phrase_name = st_grab (new (std::nothrow) String ("Binary"));
+
+	StRef<PhrasePart_Phrase> const left_part = st_grab (new (std::nothrow) PhrasePart_Phrase);
+	left_part->phrase_name = st_grab (new (std::nothrow) String (declaration_name));
+	left_part->name = st_grab (new (std::nothrow) String ("left"));
+	left_part->name_is_explicit = true;
+	phrase_record->phrase->phrase_parts.append (left_part);
+
+	StRef<PhrasePart_Token> const operator_part = st_grab (new (std::nothrow) PhrasePart_Token);
+	phrase_record->phrase->phrase_parts.append (operator_part);
+
+	StRef<PhrasePart_Phrase> const right_part = st_grab (new (std::nothrow) PhrasePart_Phrase);
+	right_part->phrase_name = st_grab (new (std::nothrow) String (declaration_name));
+	right_part->name = st_grab (new (std::nothrow) String ("right"));
+	right_part->name_is_explicit = true;
+	phrase_record->phrase->phrase_parts.append (right_part);
+
+	decl->phrases.append (phrase_record);
+    }
+
+    for (;;) {
+	TokenStream::PositionMarker level_marker;
+	if (!token_stream->getPosition (&level_marker))
+            return Result::Failure;
+
+	if (!getNonwhspToken (token_stream, &token))
+            return Result::Failure;
+
+	bool right_assoc;
+	if (equal (token, "left")) {
+	    right_assoc = false;
+	} else
+	if (equal (token, "right")) {
+	    right_assoc = true;
+	} else {
+	    if (!token_stream->setPosition (&level_marker))
+                return Result::Failure;
+	    break;
+	}
+
+	{
+	  // "left" and "right" may be names of the following declarations.
+
+	    TokenStream::PositionMarker marker;
+	    if (!token_stream->getPosition (&marker))
+                return Result::Failure;
+
+	    if (!getNonwhspToken (token_stream, &token))
+                return Result::Failure;
+
+	    bool const is_level = equal (token, "[");
+
+	    if (!token_stream->setPosition (is_level ? &marker : &level_marker))
+                return Result::Failure;
+
+	    if (!is_level)
+		break;
+	}
+
+	StRef<Declaration_Phrases::PrecedenceLevel> const level =
+                st_grab (new (std::nothrow) Declaration_Phrases::PrecedenceLevel);
+	level->right_assoc = right_assoc;
+
+	for (;;) {
+	  // Operators end with the end of the line.
+
+	    TokenStream::PositionMarker marker;
+	    if (!token_stream->getPosition (&marker))
+                return Result::Failure;
+
+	    do {
+		if (!getNextToken (token_stream, &token))
+                    return Result::Failure;
+	    } while (equal (token, " ") || equal (token, "\t"));
+
+	    if (token.len() == 0 || equal (token, "\n"))
+		break;
+
+	    if (!token_stream->setPosition (&marker))
+                return Result::Failure;
+
+	    StRef<PhrasePart> phrase_part;
+	    if (!parsePhrasePart (token_stream, lookup_data, &phrase_part))
+                return Result::Failure;
+
+	    if (!phrase_part
+		|| phrase_part->phrase_part_type != PhrasePart::t_Token
+		|| !static_cast <PhrasePart_Token*> (phrase_part.ptr())->token
+		|| phrase_part->opt)
+	    {
+                FilePosition fpos;
+                if (!token_stream->getFilePosition (&fpos))
+                    return Result::Failure;
+                exc_throw (ParsingException, fpos, st_grab (new (std::nothrow) String ("operator token expected")));
+                return Result::Failure;
+	    }
+
+	    StRef<String> const &op_token = static_cast <PhrasePart_Token*> (phrase_part.ptr())->token;
+
+	    // The parser finds operators by their tokens.
+	    bool duplicate = false;
+	    List< StRef<Declaration_Phrases::PrecedenceLevel> >::DataIterator prv_level_iter (decl->precedence_levels);
+	    while (!prv_level_iter.done () && !duplicate) {
+		StRef<Declaration_Phrases::PrecedenceLevel> &prv_level = prv_level_iter.next ();
+		List< StRef<String> >::DataIterator op_iter (prv_level->operators);
+		while (!op_iter.done ()) {
+		    if (equal (op_iter.next ()->mem(), op_token->mem())) {
+			duplicate = true;
+			break;
+		    }
+		}
+	    }
+
+	    {
+		List< StRef<String> >::DataIterator op_iter (level->operators);
+		while (!op_iter.done () && !duplicate) {
+		    if (equal (op_iter.next ()->mem(), op_token->mem()))
+			duplicate = true;
+		}
+	    }
+
+	    if (duplicate) {
+                FilePosition fpos;
+                if (!token_stream->getFilePosition (&fpos))
+                    return Result::Failure;
+                exc_throw (ParsingException, fpos,
+                           st_makeString ("Operator '", op_token, "' is declared more than once"));
+                return Result::Failure;
+	    }
+
+	    level->operators.append (op_token);
+	}
+
+	decl->precedence_levels.append (level);
+    }
+
+    if (decl->precedence_levels.isEmpty ()) {
+        FilePosition fpos;
+        if (!token_stream->getFilePosition (&fpos))
+            return Result::Failure;
+        exc_throw (ParsingException, fpos, st_grab (new (std::nothrow) String ("precedence levels expected")));
+        return Result::Failure;
+    }
+
+    *ret_decl_phrases = decl;
+    return Result::Success;
+}
+
 static mt_throws Result
 parseDeclaration (TokenStream        * const mt_nonnull token_stream,
 		  LookupData         * const mt_nonnull lookup_data,
@@ -1101,7 +1387,7 @@ parseDeclaration (TokenStream        * const mt_nonnull token_stream,
         return Result::Failure;
     if (token.len() == 0) {
         exc_throw (ParsingException,
-                   fpos, st_grab (new (std::nothrow) String ("':' or '{' expected")));
+                   fpos, st_grab (new (std::nothrow) String ("':', '{', '=', '%' or '~' expected")));
         return Result::Failure;
     }
 
@@ -1118,6 +1404,22 @@ parseDeclaration (TokenStream        * const mt_nonnull token_stream,
 	if (!lookup_data->addDeclaration (decl_phrases, declaration_name->mem()))
 	    errs->println (_func, "duplicate Declaration_Phrases name: ", declaration_name);
     } else
+    if (equal (token, "%")) {
+	StRef<Declaration_Phrases> decl_phrases;
+        if (!parseDeclaration_Precedence (token_stream, lookup_data, declaration_name->mem(), &decl_phrases))
+            return Result::Failure;
+	decl = decl_phrases;
+
+	if (!lookup_data->addDeclaration (decl_phrases, declaration_name->mem()))
+	    errs->println (_func, "duplicate Declaration_Phrases name: ", declaration_name);
+    } else
+    if (equal (token, "~")) {
+	StRef<Declaration_TokenClass> decl_token_class;
+        if (!parseDeclaration_TokenClass (token_stream, &decl_token_class))
+            return Result::Failure;
+
+	decl = decl_token_class;
+    } else
     if (equal (token, "{")) {
         StRef<Declaration_Callbacks> decl_callbacks;
 	if (!parseDeclaration_Callbacks (token_stream, &decl_callbacks))
@@ -1135,7 +1437,7 @@ parseDeclaration (TokenStream        * const mt_nonnull token_stream,
             errs->println (_func, "duplicate _Alias name: ", declaration_name);
     } else {
         exc_throw (ParsingException,
-                   fpos, st_grab (new (std::nothrow) String ("':' or '{' expected")));
+                   fpos, st_grab (new (std::nothrow) String ("':', '{', '=', '%' or '~' expected")));
         return Result::Failure;
     }
 
@@ -1424,6 +1726,102 @@ linkUpwardsAnchors (PargenTask * const mt_nonnull pargen_task,
     return Result::Success;
 }
 
+// "{name}" token parts refer either to token classes or to C callbacks.
+static void
+linkTokenClasses (PargenTask * const mt_nonnull pargen_task)
+{
+    List< StRef<Declaration> >::DataIterator decl_iter (pargen_task->decls);
+    while (!decl_iter.done()) {
+	StRef<Declaration> &decl = decl_iter.next ();
+	if (decl->declaration_type != Declaration::t_Phrases)
+	    continue;
+
+	Declaration_Phrases * const decl_phrases =
+                static_cast <Declaration_Phrases*> (decl.ptr());
+
+	List< StRef<Declaration_Phrases::PhraseRecord> >::DataIterator phrase_iter (decl_phrases->phrases);
+	while (!phrase_iter.done()) {
+	    StRef<Declaration_Phrases::PhraseRecord> &phrase_record = phrase_iter.next ();
+
+	    List< StRef<PhrasePart> >::DataIterator part_iter (phrase_record->phrase->phrase_parts);
+	    while (!part_iter.done()) {
+		StRef<PhrasePart> &phrase_part = part_iter.next ();
+		if (phrase_part->phrase_part_type != PhrasePart::t_Token)
+		    continue;
+
+		PhrasePart_Token * const phrase_part__token =
+			static_cast <PhrasePart_Token*> (phrase_part.ptr());
+		if (!phrase_part__token->token_match_cb)
+		    continue;
+
+		StRef<String> const cb_name = lowercaseName (phrase_part__token->token_match_cb->mem());
+
+		List< StRef<Declaration> >::DataIterator class_iter (pargen_task->decls);
+		while (!class_iter.done()) {
+		    StRef<Declaration> &class_decl = class_iter.next ();
+		    if (class_decl->declaration_type == Declaration::t_TokenClass &&
+			equal (class_decl->lowercase_declaration_name->mem(), cb_name->mem()))
+		    {
+			phrase_part__token->token_class =
+				static_cast <Declaration_TokenClass*> (class_decl.ptr());
+			break;
+		    }
+		}
+	    }
+	}
+    }
+}
+
+// Assigns ids to literal tokens for the generated token classifier.
+static void
+linkLiteralTokens (PargenTask * const mt_nonnull pargen_task)
+{
+    List< StRef<Declaration> >::DataIterator decl_iter (pargen_task->decls);
+    while (!decl_iter.done()) {
+	StRef<Declaration> &decl = decl_iter.next ();
+	if (decl->declaration_type != Declaration::t_Phrases)
+	    continue;
+
+	Declaration_Phrases * const decl_phrases =
+                static_cast <Declaration_Phrases*> (decl.ptr());
+
+	List< StRef<Declaration_Phrases::PhraseRecord> >::DataIterator phrase_iter (decl_phrases->phrases);
+	while (!phrase_iter.done()) {
+	    StRef<Declaration_Phrases::PhraseRecord> &phrase_record = phrase_iter.next ();
+
+	    List< StRef<PhrasePart> >::DataIterator part_iter (phrase_record->phrase->phrase_parts);
+	    while (!part_iter.done()) {
+		StRef<PhrasePart> &phrase_part = part_iter.next ();
+		if (phrase_part->phrase_part_type != PhrasePart::t_Token)
+		    continue;
+
+		PhrasePart_Token * const phrase_part__token =
+			static_cast <PhrasePart_Token*> (phrase_part.ptr());
+		if (!phrase_part__token->token ||
+		    phrase_part__token->token->len() == 0)
+		{
+		    continue;
+		}
+
+		Uint32 token_id = 1;
+		List< StRef<String> >::DataIterator literal_iter (pargen_task->literal_tokens);
+		while (!literal_iter.done()) {
+		    StRef<String> &literal = literal_iter.next ();
+		    if (equal (literal->mem(), phrase_part__token->token->mem()))
+			break;
+
+		    ++token_id;
+		}
+
+		if (token_id > pargen_task->literal_tokens.getNumElements())
+		    pargen_task->literal_tokens.append (phrase_part__token->token);
+
+		phrase_part__token->token_id = token_id;
+	    }
+	}
+    }
+}
+
 Result
 parsePargenTask (TokenStream       * const mt_nonnull token_stream,
                  StRef<PargenTask> * const mt_nonnull ret_pargen_task)
@@ -1453,6 +1851,9 @@ parsePargenTask (TokenStream       * const mt_nonnull token_stream,
                         static_cast <Declaration_Callbacks*> (decl.ptr());
 		decls_callbacks.add (decl_callbacks);
 	    } break;
+	    case Declaration::t_TokenClass: {
+		pargen_task->decls.append (decl);
+	    } break;
 #if 0
 	    case Declaration::t_Alias: {
 		Declaration_Alias * const decl_alias = static_cast <Declaration_Alias*> (decl.ptr ());
@@ -1488,6 +1889,9 @@ parsePargenTask (TokenStream       * const mt_nonnull token_stream,
     if (!linkUpwardsAnchors (pargen_task, lookup_data))
         return Result::Failure;
 
+    linkTokenClasses (pargen_task);
+    linkLiteralTokens (pargen_task);
+
     *ret_pargen_task = pargen_task;
     return Result::Success;
 }
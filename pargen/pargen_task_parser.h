@@ -37,6 +37,10 @@ class PargenTask : public StReferenced
 {
 public:
     List< StRef<Declaration> > decls;
+
+    // All distinct literal tokens of the grammar. Token ids are indices
+    // in this list plus 1.
+    List< StRef<String> > literal_tokens;
 };
 
 mt_throws Result parsePargenTask (TokenStream       * mt_nonnull token_stream,
@@ -17,6 +17,12 @@
 */
 
 
+#include <typeinfo>
+
+#include <pargen/parsing_exception.h>
+#include <pargen/memory_token_stream.h>
+#include <pargen/file_token_stream.h>
+
 #include <pargen/parser.h>
 
 
@@ -48,25 +54,27 @@
 #define FUNC_NAME(a) ;
 
 
-// Enables forward optimization (single-token lookahead)
-#define PARGEN_FORWARD_OPTIMIZATION
-
-// Enables negative cache lookups
-#define PARGEN_NEGATIVE_CACHE
-
-// Enables upwards jumps
-#define PARGEN_UPWARDS_JUMPS
-
-
 using namespace M;
 
 namespace Pargen {
 
 StRef<ParserConfig>
-createParserConfig (bool const upwards_jumps)
+createParserConfig (bool             const upwards_jumps,
+                    GrammarProfile * const profile,
+                    bool             const forward_optimization,
+                    bool             const negative_cache,
+                    bool             const adaptive_negative_cache,
+                    bool             const source_spans,
+                    bool             const deferred_actions)
 {
     StRef<ParserConfig> const parser_config = st_grab (new (std::nothrow) ParserConfig);
     parser_config->upwards_jumps = upwards_jumps;
+    parser_config->forward_optimization = forward_optimization;
+    parser_config->negative_cache = negative_cache;
+    parser_config->adaptive_negative_cache = adaptive_negative_cache;
+    parser_config->profile = profile;
+    parser_config->source_spans = source_spans;
+    parser_config->deferred_actions = deferred_actions;
     return parser_config;
 }
 
@@ -76,16 +84,38 @@ createDefaultParserConfig ()
     return createParserConfig (true /* upwards_jumps */);
 }
 
-namespace {
-class ParsingState;
-}
+template <class TokenStreamT> class ParsingState;
 
-static mt_throws Result pop_step (ParsingState * mt_nonnull parsing_state,
-                                  bool          match,
-                                  bool          empty_match,
-                                  bool          negative_cache_update = true);
+template <class TokenStreamT>
+static mt_throws Result pop_step (ParsingState<TokenStreamT> * mt_nonnull parsing_state,
+                                  bool                        match,
+                                  bool                        empty_match,
+                                  bool                        negative_cache_update = true);
 
 namespace {
+class ParsingStep_Compound;
+
+// Subgrammars of compound grammars assign their elements to the parent
+// compound step with a direct call of 'entry->assignment_func' (see
+// assign_subel()). This spares an acceptor object and a virtual call
+// for every subgrammar which is tried.
+class SubelTarget
+{
+public:
+    // NULL if the target is not set.
+    ParsingStep_Compound *compound_step;
+    CompoundGrammarEntry *entry;
+    // If non-null, then the subelement is stored here as well.
+    ParserElement **record_subel;
+
+    SubelTarget ()
+        : compound_step (NULL),
+          entry (NULL),
+          record_subel (NULL)
+    {
+    }
+};
+
 class ParsingStep : public StReferenced,
                     public IntrusiveListElement<>
 {
@@ -97,7 +127,8 @@ public:
         t_Sequence,
         t_Compound,
         t_Switch,
-        t_Alias
+        t_Alias,
+        t_Precedence
     };
 
     const Type parsing_step_type;
@@ -110,8 +141,15 @@ public:
     // TODO Why not use steps vstack to hold the acceptor?
     VSlabRef<Acceptor> acceptor;
 #endif
+    // Used instead of 'acceptor' if set.
+    SubelTarget subel_target;
+
     Bool optional;
 
+    // Set for compound steps which have passed a cut ("!"). A failure
+    // of such a step is a syntax error, see pop_step().
+    Bool cut_passed;
+
     // Initialized in push_step()
     TokenStream::PositionMarker token_stream_pos;
 
@@ -120,10 +158,25 @@ public:
     VStack::Level vstack_level;
     VStack::Level el_level;
 
+    // Level of the event log at the moment the step was pushed.
+    // Used for event-driven parsing only.
+    Size event_level;
+    // Level of the action log at the moment the step was pushed.
+    // Used with ParserConfig::deferred_actions only.
+    Size action_level;
+
+    // Beginning of the first token which has been read since the step was
+    // pushed, see record_span_begin(). Used with ParserConfig::source_spans.
+    FileSize span_begin;
+    Bool got_span_begin;
+
     ParsingStep (Type type)
         : parsing_step_type (type),
           grammar (NULL),
-          go_right_count (0)
+          go_right_count (0),
+          event_level (0),
+          action_level (0),
+          span_begin (0)
     {
     }
 
@@ -143,12 +196,29 @@ public:
     // FIXME Memory leak + inefficient: use intrusive list.
     List<ParserElement*> parser_elements;
 
+    // 'true' if there are only compound and alias steps below this one.
+    // In streaming modes, completed items of top-level sequences
+    // are committed and released.
+    Bool top_level;
+    // Number of items which have been released.
+    Size num_released;
+
     ParsingStep_Sequence ()
-        : ParsingStep (ParsingStep::t_Sequence)
+        : ParsingStep (ParsingStep::t_Sequence),
+          num_released (0)
     {
     }
 };
 
+// Elements of complete tail iterations, which end where the whole step
+// ends. Links are allocated on the element vstack with the elements.
+class TailSpanLink
+{
+public:
+    ParserElement *parser_element;
+    TailSpanLink *prv;
+};
+
 class ParsingStep_Compound : public ParsingStep
 {
 public:
@@ -166,10 +236,51 @@ public:
     // cases when b_opt doesn't match, hence this hint.
     Grammar *lr_parent;
 
+    // Created lazily, see get_compound_element().
     ParserElement *parser_element;
 
     Bool got_nonoptional_match;
 
+    // 'true' for left-recursive grammars pushed by the parent switch step
+    // in State_LR. Such phrases begin where the parent switch begins.
+    Bool lr_wrap;
+
+    // Number of subgrammars which have been taken from 'cur_subg_el'.
+    Size subg_index;
+
+    // Left factoring, see SwitchGrammarEntry::shared_prefix_len.
+    // 'switch_entry_el' is the entry of the parent switch step which
+    // this step has been pushed for. The state of the parser after
+    // the shared prefix has been matched is saved in prefix_*.
+    List< StRef<SwitchGrammarEntry> >::Element *switch_entry_el;
+    Size shared_prefix_len;
+    ParserElement *prefix_subels [SwitchGrammarEntry::MaxSharedPrefixLen];
+    Bool prefix_marked;
+    TokenStream::PositionMarker prefix_token_pos;
+    Size prefix_go_right_count;
+    VStack::Level prefix_el_level;
+    Size prefix_event_level;
+    Size prefix_action_level;
+    Bool prefix_got_nonoptional_match;
+
+    // Tail iteration, see Grammar_Compound::tail_iteration.
+    // 'tail_depth' is the number of iterations after the first one.
+    // The state of the parser at the beginning of the current iteration
+    // is saved in tail_*.
+    Size tail_depth;
+    ParserElement *tail_first_element;
+    ParserElement *tail_prv_element;
+    TokenStream::PositionMarker tail_token_pos;
+    Size tail_go_right_count;
+    VStack::Level tail_el_level;
+    Size tail_event_level;
+    Size tail_action_level;
+    Bool tail_got_nonoptional_match;
+    // A cut in a previous iteration doesn't commit the current one.
+    Bool tail_cut_passed;
+    // Used with ParserConfig::source_spans only.
+    TailSpanLink *tail_span_link;
+
     ParsingStep_Compound ()
         : ParsingStep (ParsingStep::t_Compound),
           jump_grammar (NULL),
@@ -177,8 +288,23 @@ public:
           jump_switch_grammar_entry (NULL),
           jump_compound_grammar_entry (NULL),
           lr_parent (NULL),
-          parser_element (NULL)
+          parser_element (NULL),
+          subg_index (0),
+          switch_entry_el (NULL),
+          shared_prefix_len (0),
+          prefix_go_right_count (0),
+          prefix_event_level (0),
+          prefix_action_level (0),
+          tail_depth (0),
+          tail_first_element (NULL),
+          tail_prv_element (NULL),
+          tail_go_right_count (0),
+          tail_event_level (0),
+          tail_action_level (0),
+          tail_span_link (NULL)
     {
+        for (unsigned i = 0; i < SwitchGrammarEntry::MaxSharedPrefixLen; ++i)
+            prefix_subels [i] = NULL;
     }
 };
 
@@ -201,6 +327,12 @@ public:
     List< StRef<SwitchGrammarEntry> >::Element *cur_nlr_el;
     List< StRef<SwitchGrammarEntry> >::Element *cur_lr_el;
 
+    // 'predict' is set if the NLR entry to try should be chosen
+    // by the next token (see Grammar_Switch::predictive). 'predicted' is set
+    // once it has been chosen: there's no point in trying the others.
+    Bool predict;
+    Bool predicted;
+
 #ifdef VSLAB_ACCEPTOR
     ParserElement *nlr_parser_element;
     ParserElement *parser_element;
@@ -229,6 +361,47 @@ public:
     }
 };
 
+class ParsingStep_Precedence : public ParsingStep
+{
+public:
+    // Pending "left <operator>" pairs waiting for their right operands.
+    // Records are allocated on the steps vstack right above the step itself,
+    // hence they are released together with the step.
+    class Record
+    {
+    public:
+        Record *prv;
+
+        ParserElement *left;
+        ParserElement *op_element;
+        Grammar_Precedence::Operator *op;
+
+        // Level of the steps vstack before the record was pushed.
+        VStack::Level vstack_level;
+
+        // Parser state before the operator was consumed. Used to give back
+        // the operator if no operand follows it.
+        TokenStream::PositionMarker op_pos;
+        VStack::Level op_el_level;
+        Size op_event_level;
+        Size op_action_level;
+    };
+
+    Record *top_record;
+
+    // The last operand (or the result of a reduction).
+    ParserElement *operand_element;
+    ParserElement *op_element;
+
+    ParsingStep_Precedence ()
+        : ParsingStep (ParsingStep::t_Precedence),
+          top_record (NULL),
+          operand_element (NULL),
+          op_element (NULL)
+    {
+    }
+};
+
 // Positive cache is an n-ary tree with chains of matching phrases.
 // Nodes of the tree refer to grammars.
 //
@@ -255,7 +428,7 @@ public:
 //             b        d        e        f
 //
 // Positive cache is cleaned at cache cleanup points. Such points are
-// specified explicitly in the grammar. They are usually points of
+// specified explicitly in the grammar with cuts ("!"). They are points of
 // no return, after wich match failures mean syntax errors in input.
 //
 class PositiveCacheEntry : public StReferenced
@@ -292,16 +465,150 @@ public:
     }
 };
 
+// Adaptive negative cache policy (ParserConfig::adaptive_negative_cache).
+//
+// Many grammars fail at some position and are never tried at that position
+// again. Recording their failures is pure overhead. Each grammar starts on
+// probation: if none of its first ProbationLen negative entries is looked up
+// with success, its next DisabledLen failures are not recorded, and then
+// probation starts anew. Grammars with at least one successful lookup are
+// always recorded.
+//
+// Statistics are kept per parse in an open-addressing table keyed by
+// grammar pointers: grammars are shared between parses and are read-only.
+class NegativeCachePolicy
+{
+private:
+    enum {
+        ProbationLen = 64,
+        DisabledLen  = 4096
+    };
+
+    class GrammarStats
+    {
+    public:
+        Grammar *grammar;
+        Uint32 num_added;
+        Uint32 num_skipped;
+        bool hit;
+    };
+
+    GrammarStats *slots;
+    // Power of 2.
+    Size num_slots;
+    Size num_used;
+
+    static Size hashGrammar (Grammar * const grammar)
+    {
+        return (Size) (((UintPtr) grammar >> 4) * 0x9e3779b1);
+    }
+
+    void grow ()
+    {
+        GrammarStats * const old_slots = slots;
+        Size const old_num_slots = num_slots;
+
+        num_slots = (old_num_slots ? old_num_slots * 2 : 64);
+        slots = new (std::nothrow) GrammarStats [num_slots];
+        assert (slots);
+        memset (slots, 0, sizeof (GrammarStats) * num_slots);
+
+        for (Size i = 0; i < old_num_slots; ++i) {
+            if (!old_slots [i].grammar)
+                continue;
+
+            Size j = hashGrammar (old_slots [i].grammar) & (num_slots - 1);
+            while (slots [j].grammar)
+                j = (j + 1) & (num_slots - 1);
+
+            slots [j] = old_slots [i];
+        }
+
+        delete[] old_slots;
+    }
+
+    GrammarStats* getStats (Grammar * const mt_nonnull grammar)
+    {
+        if ((num_used + 1) * 2 > num_slots)
+            grow ();
+
+        Size i = hashGrammar (grammar) & (num_slots - 1);
+        while (slots [i].grammar) {
+            if (slots [i].grammar == grammar)
+                return &slots [i];
+
+            i = (i + 1) & (num_slots - 1);
+        }
+
+        ++num_used;
+        slots [i].grammar = grammar;
+        return &slots [i];
+    }
+
+public:
+    // Returns 'false' if a failure of the grammar should not be recorded.
+    bool shouldRecord (Grammar * const mt_nonnull grammar)
+    {
+        GrammarStats * const stats = getStats (grammar);
+        if (stats->hit)
+            return true;
+
+        if (stats->num_skipped > 0) {
+            --stats->num_skipped;
+            return false;
+        }
+
+        if (++stats->num_added >= ProbationLen) {
+            stats->num_added = 0;
+            stats->num_skipped = DisabledLen;
+        }
+
+        return true;
+    }
+
+    void hit (Grammar * const mt_nonnull grammar)
+    {
+        getStats (grammar)->hit = true;
+    }
+
+    NegativeCachePolicy ()
+        : slots (NULL),
+          num_slots (0),
+          num_used (0)
+    {
+    }
+
+    ~NegativeCachePolicy ()
+    {
+        delete[] slots;
+    }
+};
+
 // TODO Having a similar superclass for positive cache would be nice.
+// Besides negative matches, the cache holds other per-position data
+// which doesn't change when we backtrack, like the id of the token.
 class NegativeCache
 {
 private:
-    class GrammarEntry : public IntrusiveAvlTree_Node<>
+    class GrammarEntry : public IntrusiveAvlTree_Node<>,
+                         public IntrusiveListElement<>
     {
     public:
         Grammar *grammar;
     };
 
+    typedef IntrusiveList<GrammarEntry> GrammarEntryList;
+
+    // Memoized result of a pure token match callback.
+    class CbResultEntry : public IntrusiveListElement<>
+    {
+    public:
+        Grammar_Immediate_SingleToken::TokenMatchCallback token_match_cb;
+        bool result;
+    };
+
+    typedef IntrusiveList<CbResultEntry> CbResultEntryList;
+
     class NegEntry : //public SimplyReferenced
                      public IntrusiveListElement<>
     {
@@ -317,20 +624,94 @@ private:
                 GrammarEntryTree;
 
         GrammarEntryTree grammar_entries;
+        // Same entries as in 'grammar_entries', for releasing them in cut().
+        GrammarEntryList grammar_entry_list;
+
+        // Result of Grammar::TokenClassifyFunc for the token at this position.
+        bool   token_id_valid;
+        Uint32 token_id;
+
+        // There's only a handful of callbacks for a position,
+        // hence a plain list.
+        CbResultEntryList cb_result_list;
+
+        NegEntry ()
+            : token_id_valid (false),
+              token_id (0)
+        {
+        }
     };
 
     // Note: There's no crucial reason to do this.
     typedef IntrusiveList<NegEntry> NegEntryList;
 
     VStack neg_vstack;
-    VSlab<GrammarEntry> grammar_slab;
+
+    // Entries released by cut() are reused, which keeps memory usage bounded
+    // when the cache is cut regularly.
+    NegEntryList      free_neg_entries;
+    GrammarEntryList  free_grammar_entries;
+    CbResultEntryList free_cb_result_entries;
 
     NegEntryList neg_cache;
     NegEntry *cur_neg_entry;
 
+    // Per-position token ids and callback results are kept regardless
+    // of these flags.
+    bool negatives_enabled;
+    bool adaptive;
+    NegativeCachePolicy policy;
+
     // For debugging
     size_t pos_index;
 
+    NegEntry* allocNegEntry ()
+    {
+        void *mem;
+        if (!free_neg_entries.isEmpty()) {
+            NegEntry * const neg_entry = free_neg_entries.getFirst();
+            free_neg_entries.remove (neg_entry);
+            mem = neg_entry;
+        } else {
+            mem = neg_vstack.push_malign (sizeof (NegEntry), alignof (NegEntry));
+        }
+
+        return new (mem) NegEntry;
+    }
+
+    GrammarEntry* allocGrammarEntry ()
+    {
+        void *mem;
+        if (!free_grammar_entries.isEmpty()) {
+            GrammarEntry * const grammar_entry = free_grammar_entries.getFirst();
+            free_grammar_entries.remove (grammar_entry);
+            mem = grammar_entry;
+        } else {
+            mem = neg_vstack.push_malign (sizeof (GrammarEntry), alignof (GrammarEntry));
+        }
+
+        return new (mem) GrammarEntry;
+    }
+
+    void releaseNegEntry (NegEntry * const mt_nonnull neg_entry)
+    {
+        GrammarEntry *grammar_entry = neg_entry->grammar_entry_list.getFirst();
+        while (grammar_entry) {
+            GrammarEntry * const next_grammar_entry = neg_entry->grammar_entry_list.getNext (grammar_entry);
+            free_grammar_entries.append (grammar_entry);
+            grammar_entry = next_grammar_entry;
+        }
+
+        CbResultEntry *cb_result_entry = neg_entry->cb_result_list.getFirst();
+        while (cb_result_entry) {
+            CbResultEntry * const next_cb_result_entry = neg_entry->cb_result_list.getNext (cb_result_entry);
+            free_cb_result_entries.append (cb_result_entry);
+            cb_result_entry = next_cb_result_entry;
+        }
+
+        free_neg_entries.append (neg_entry);
+    }
+
 public:
     void goRight ()
     {
@@ -341,8 +722,7 @@ public:
         if (cur_neg_entry == NULL ||
             cur_neg_entry == neg_cache.getLast())
         {
-            NegEntry * const neg_entry =
-                    new (neg_vstack.push_malign (sizeof (NegEntry), alignof (NegEntry))) NegEntry;
+            NegEntry * const neg_entry = allocNegEntry ();
             neg_cache.append (neg_entry);
             cur_neg_entry = neg_cache.getLast();
         } else {
@@ -360,8 +740,7 @@ public:
         if (cur_neg_entry == NULL ||
             cur_neg_entry == neg_cache.getFirst())
         {
-            NegEntry * const neg_entry =
-                    new (neg_vstack.push_malign (sizeof (NegEntry), alignof (NegEntry))) NegEntry;
+            NegEntry * const neg_entry = allocNegEntry ();
             neg_cache.append (neg_entry, cur_neg_entry /* to_el */);
             cur_neg_entry = neg_entry;
         } else {
@@ -374,21 +753,33 @@ public:
         )
     }
 
+    void setPolicy (bool const negatives_enabled,
+                    bool const adaptive)
+    {
+        this->negatives_enabled = negatives_enabled;
+        this->adaptive = adaptive;
+    }
+
     void addNegative (Grammar * const mt_nonnull grammar)
     {
         assert (cur_neg_entry);
 
+        if (!negatives_enabled ||
+            (adaptive && !policy.shouldRecord (grammar)))
+        {
+            return;
+        }
+
         DEBUG_NEGC2 (
             errs->println (_func, "pos_index ", pos_index);
         )
 
-        VSlab<GrammarEntry>::AllocKey slab_key;
-        GrammarEntry * const grammar_entry = grammar_slab.alloc (&slab_key);
+        GrammarEntry * const grammar_entry = allocGrammarEntry ();
         grammar_entry->grammar = grammar;
         if (!cur_neg_entry->grammar_entries.addUnique (grammar_entry)) {
           // New element inserted.
 
-//		grammar_entry->slab_key = slab_key;
+            cur_neg_entry->grammar_entry_list.append (grammar_entry);
         } else {
           // Element with the same value already exists.
 
@@ -396,7 +787,7 @@ public:
                 errs->println (_func, "duplicate entry");
             )
 
-            grammar_slab.free (slab_key);
+            free_grammar_entries.append (grammar_entry);
         }
     }
 
@@ -408,7 +799,73 @@ public:
             errs->println (_func, "pos_index ", pos_index);
         )
 
-        return cur_neg_entry->grammar_entries.lookup ((UintPtr) grammar);
+        if (!negatives_enabled)
+            return false;
+
+        if (!cur_neg_entry->grammar_entries.lookup ((UintPtr) grammar))
+            return false;
+
+        if (adaptive)
+            policy.hit (grammar);
+
+        return true;
+    }
+
+    bool getTokenId (Uint32 * const mt_nonnull ret_token_id)
+    {
+        assert (cur_neg_entry);
+
+        if (!cur_neg_entry->token_id_valid)
+            return false;
+
+        *ret_token_id = cur_neg_entry->token_id;
+        return true;
+    }
+
+    void setTokenId (Uint32 const token_id)
+    {
+        assert (cur_neg_entry);
+
+        cur_neg_entry->token_id = token_id;
+        cur_neg_entry->token_id_valid = true;
+    }
+
+    bool getCbResult (Grammar_Immediate_SingleToken::TokenMatchCallback   const token_match_cb,
+                      bool                                              * const mt_nonnull ret_result)
+    {
+        assert (cur_neg_entry);
+
+        CbResultEntry *cb_result_entry = cur_neg_entry->cb_result_list.getFirst();
+        while (cb_result_entry) {
+            if (cb_result_entry->token_match_cb == token_match_cb) {
+                *ret_result = cb_result_entry->result;
+                return true;
+            }
+
+            cb_result_entry = cur_neg_entry->cb_result_list.getNext (cb_result_entry);
+        }
+
+        return false;
+    }
+
+    void setCbResult (Grammar_Immediate_SingleToken::TokenMatchCallback const token_match_cb,
+                      bool                                              const result)
+    {
+        assert (cur_neg_entry);
+
+        void *mem;
+        if (!free_cb_result_entries.isEmpty()) {
+            CbResultEntry * const cb_result_entry = free_cb_result_entries.getFirst();
+            free_cb_result_entries.remove (cb_result_entry);
+            mem = cb_result_entry;
+        } else {
+            mem = neg_vstack.push_malign (sizeof (CbResultEntry), alignof (CbResultEntry));
+        }
+
+        CbResultEntry * const cb_result_entry = new (mem) CbResultEntry;
+        cb_result_entry->token_match_cb = token_match_cb;
+        cb_result_entry->result = result;
+        cur_neg_entry->cb_result_list.append (cb_result_entry);
     }
 
     void cut ()
@@ -421,10 +878,7 @@ public:
                 break;
 
             neg_cache.remove (neg_entry);
-
-            // TODO FIXME Forgot to cut neg_vstack?
-
-            // TODO vstack->vqueue, cut queue tail
+            releaseNegEntry (neg_entry);
 
             neg_entry = next_neg_entry;
         }
@@ -433,2275 +887,4824 @@ public:
     NegativeCache ()
         : neg_vstack (1 << 16),
           cur_neg_entry (NULL),
+          negatives_enabled (true),
+          adaptive (false),
           pos_index (0)
     {
     }
 };
 
-class VStackContainer : public StReferenced
-{
-public:
-    VStack vstack;
-
-    VStackContainer (Size const block_size)
-        : vstack (block_size)
-    {
-    }
-};
-
-// State of the parser.
-class ParsingState : public ParserControl
+// Log of parse events which may still be undone by backtracking.
+//
+// Events are appended as we go and truncated when steps fail. Each step
+// remembers the level of the log at the moment it was pushed. Levels are
+// absolute indices which keep growing as the log gets flushed, so that levels
+// remembered by the steps remain valid after a flush.
+//
+// Left recursion makes things trickier: we learn that a phrase begins
+// only after we've parsed its first subgrammar. Such phrases are logged
+// with LrPhraseBegin events which refer to the point where the phrase
+// actually begins (the anchor). The order of events is fixed up in flush().
+//
+class EventLog
 {
-public:
-    enum Direction {
-        Up,
-        Down
+private:
+    enum EventType {
+        PhraseBegin,
+        LrPhraseBegin,
+        Token,
+        PhraseEnd
     };
 
-    class PositionMarker : public ParserPositionMarker
+    class Event
     {
     public:
-        TokenStream::PositionMarker token_stream_pos;
-        ParsingStep_Compound *compound_step;
-        List< StRef<CompoundGrammarEntry> >::Element *cur_subg_el;
-        Bool got_nonoptional_match;
-        Size go_right_count;
-
-        PositionMarker ()
-            : compound_step (NULL)
-        {
-        }
-    };
+        EventType type;
+        Grammar *grammar;
 
-    StRef<ParserConfig> parser_config;
+        ConstMemory token;
+        void *token_user_ptr;
+        // Level of token_vstack before the event was logged.
+        VStack::Level token_level;
 
-    ConstMemory default_variant;
+        // For LrPhraseBegin events: absolute index of the anchor.
+        Size lr_anchor;
 
-    VSlab< ListAcceptor<ParserElement> > list_acceptor_slab;
-    VSlab< PtrAcceptor<ParserElement> > ptr_acceptor_slab;
+        // The following fields are used in flush() only.
+        // Indices are local and biased by 1, 0 means "none".
 
-    Bool create_elements;
+        // First LrPhraseBegin event to be delivered before this event.
+        Size lr_chain;
+        // Next LrPhraseBegin event in the chain.
+        Size lr_next;
+        // 'true' if the LrPhraseBegin event has been linked to its anchor.
+        bool lr_linked;
+    };
 
-    StRef<String> variant;
+    Event *events;
+    Size num_events;
+    Size max_events;
 
-    // Nest level is used for debugging output.
-    Size nest_level;
+    // Absolute index of events [0].
+    Size base_index;
 
-    TokenStream *token_stream;
-    LookupData  *lookup_data;
-    // User data for accept_func() and match_func().
-    void *user_data;
+    VStack token_vstack;
 
-    StRef<VStackContainer> el_vstack_container;
-    VStack *el_vstack;
+    Event* appendEvent (EventType const type)
+    {
+        if (num_events == max_events) {
+            Size const new_max_events = (max_events ? max_events * 2 : 1024);
+            Event * const new_events = new (std::nothrow) Event [new_max_events];
+            assert (new_events);
+            for (Size i = 0; i < num_events; ++i)
+                new_events [i] = events [i];
+
+            delete[] events;
+            events = new_events;
+            max_events = new_max_events;
+        }
 
-    // Stack of grammar invocations.
-    ParsingStepList step_list;
-    VStack step_vstack;
+        Event * const event = &events [num_events];
+        ++num_events;
 
-    // Direction of the previous movement along the stack:
-    // "Up" means we've become one level deeper ('steps' grew),
-    // "Down" means we've returned from a nested level ('steps' shrunk).
-    // Note: it looks like I've swapped the meanings for "up" and "down" here.
-    Direction cur_direction;
+        event->type = type;
+        event->grammar = NULL;
+        event->token = ConstMemory ();
+        event->token_user_ptr = NULL;
+        event->token_level = token_vstack.getLevel ();
+        event->lr_anchor = 0;
 
-    // 'true' if we've come from a nested grammar with a match for that grammar,
-    // 'false' otherwise.
-    Bool match;
-    // 'true' if we've come from a nested grammar with an empty match
-    // for that grammar.
-    Bool empty_match;
+        return event;
+    }
 
-    // 'true' if we're up from a grammar which turns out
-    // to be left recursive after attempting to parse it.
-    // ("a: b_opt a c", and "b" is no match).
-    Bool compound_lr;
+public:
+    Size getLevel () const
+    {
+        return base_index + num_events;
+    }
 
-    // 'true' if we're up from a compound grammar which is an empty match.
-    // This is possible if all subgrammars are optional or if we preset
-    // the first element of a left-recursive grammar and all of the following
-    // elements are optional.
-    Bool compound_empty;
+    // Drops all events starting from @level. Events which have already
+    // been delivered can't be dropped.
+    void setLevel (Size const level)
+    {
+        if (level >= base_index + num_events)
+            return;
 
-    Bool debug_dump;
+        Size const new_num_events = (level > base_index ? level - base_index : 0);
+        token_vstack.setLevel (events [new_num_events].token_level);
+        num_events = new_num_events;
+    }
 
-    PositiveCacheEntry  positive_cache_root;
-    PositiveCacheEntry *cur_positive_cache_entry;
+    // @lr_anchor is the absolute index of the event which the phrase
+    // should precede. If it equals to getLevel(), then the phrase is
+    // not a left-recursive one.
+    void addPhraseBegin (Grammar * const mt_nonnull grammar,
+                         Size      const lr_anchor)
+    {
+        Event * const event = appendEvent (lr_anchor < getLevel () ? LrPhraseBegin : PhraseBegin);
+        event->grammar = grammar;
+        event->lr_anchor = lr_anchor;
+    }
 
-    NegativeCache negative_cache;
+    // @token is not copied if @token_stable is true.
+    void addToken (ConstMemory const token,
+                   void      * const token_user_ptr,
+                   bool        const token_stable)
+    {
+        Event * const event = appendEvent (Token);
 
-    Bool position_changed;
+        if (token_stable) {
+            event->token = token;
+        } else {
+            Byte * const buf = token_vstack.push_unaligned (token.len());
+            memcpy (buf, token.mem(), token.len());
+            event->token = ConstMemory (buf, token.len());
+        }
 
-    ParsingStep& getLastStep ()
-    {
-        assert (!step_list.isEmpty());
-        return *step_list.getLast();
+        event->token_user_ptr = token_user_ptr;
     }
 
-  mt_iface (ParserControl)
-
-    void setCreateElements (bool const create_elements)
+    void addPhraseEnd (Grammar * const mt_nonnull grammar)
     {
-        this->create_elements = create_elements;
+        Event * const event = appendEvent (PhraseEnd);
+        event->grammar = grammar;
     }
 
-    StRef<ParserPositionMarker> getPosition ();
+    // Changes the grammar of the PhraseBegin event at @level. Returns false
+    // if the event has already been delivered.
+    bool replacePhraseBegin (Size      const level,
+                             Grammar * const mt_nonnull grammar)
+    {
+        if (level < base_index || level >= base_index + num_events)
+            return false;
 
-    mt_throws Result setPosition (ParserPositionMarker *pmark);
+        Event * const event = &events [level - base_index];
+        assert (event->type == PhraseBegin);
+        event->grammar = grammar;
+        return true;
+    }
 
-    void setVariant (ConstMemory const variant)
+    // Delivers logged events which precede @level to @handler.
+    // The caller must ensure that no LrPhraseBegin events will be anchored
+    // below @level later on.
+    void flush (ParserEventHandler * const mt_nonnull handler,
+                void               * const user_data,
+                Size                 const level)
     {
-        this->variant = st_grab (new (std::nothrow) String (variant));
-    }
+        if (level <= base_index || num_events == 0)
+            return;
 
-  mt_iface_end
+        Size const num_flushed = (level - base_index < num_events ? level - base_index : num_events);
 
-    ParsingState ()
-        : step_vstack (1 << 16 /* block_size */)
+        for (Size i = 0; i < num_flushed; ++i) {
+            events [i].lr_chain = 0;
+            events [i].lr_next = 0;
+            events [i].lr_linked = false;
+        }
+
+        // Outer left-recursive phrases are logged later than inner ones,
+        // hence prepending to the chain.
+        for (Size i = 0; i < num_flushed; ++i) {
+            Event * const event = &events [i];
+            if (event->type != LrPhraseBegin)
+                continue;
+
+            // If the anchor has already been delivered, then there's nothing
+            // we can do but deliver the event in place.
+            if (event->lr_anchor < base_index)
+                continue;
+
+            Event * const anchor_event = &events [event->lr_anchor - base_index];
+            event->lr_next = anchor_event->lr_chain;
+            event->lr_linked = true;
+            anchor_event->lr_chain = i + 1;
+        }
+
+        for (Size i = 0; i < num_flushed; ++i) {
+            Event * const event = &events [i];
+
+            for (Size lr_idx = event->lr_chain; lr_idx != 0; lr_idx = events [lr_idx - 1].lr_next)
+                handler->phraseBegin (events [lr_idx - 1].grammar, user_data);
+
+            switch (event->type) {
+                case PhraseBegin:
+                    handler->phraseBegin (event->grammar, user_data);
+                    break;
+                case LrPhraseBegin:
+                    if (!event->lr_linked)
+                        handler->phraseBegin (event->grammar, user_data);
+                    break;
+                case Token:
+                    handler->token (event->token, event->token_user_ptr, user_data);
+                    break;
+                case PhraseEnd:
+                    handler->phraseEnd (event->grammar, user_data);
+                    break;
+                default:
+                    unreachable ();
+            }
+        }
+
+        if (num_flushed == num_events) {
+            token_vstack.setLevel (events [0].token_level);
+        } else {
+          // Token copies of the remaining events stay where they are,
+          // they're released once the log becomes empty.
+            for (Size i = num_flushed; i < num_events; ++i)
+                events [i - num_flushed] = events [i];
+        }
+
+        base_index += num_flushed;
+        num_events -= num_flushed;
+    }
+
+    // Delivers all logged events to @handler.
+    void flush (ParserEventHandler * const mt_nonnull handler,
+                void               * const user_data)
     {
-        el_vstack_container = st_grab (new (std::nothrow) VStackContainer (1 << 16 /* block_size */));
-        assert (el_vstack_container);
-        el_vstack = &el_vstack_container->vstack;
+        flush (handler, user_data, getLevel ());
+    }
 
-        DEBUG_VSTACK (
-            errs->println (_func,
-                           "list_acceptor_slab vstack: 0x", fmt_hex, (UintPtr) &list_acceptor_slab.vstack, ", "
-                           "ptr_acceptor_slab vstack: 0x", fmt_hex, (UintPtr) &ptr_acceptor_slab.vstack);
-            errs->println (_func,
-                           "el_vstack: 0x", fmt_hex, (UintPtr) el_vstack, ", "
-                           "step_vstack: 0x", fmt_hex, (UintPtr) &step_vstack);
-            errs->println (_func, "CompoundGrammarEntry::acceptor_slab vstack: "
-                           "0x", fmt_hex, (UintPtr) &CompoundGrammarEntry::acceptor_slab.vstack);
-        )
+    EventLog ()
+        : events (NULL),
+          num_events (0),
+          max_events (0),
+          base_index (0),
+          token_vstack (1 << 16 /* block_size */)
+    {
+    }
+
+    ~EventLog ()
+    {
+        delete[] events;
     }
 };
 
-StRef<ParserPositionMarker>
-ParsingState::getPosition ()
+// Parser control for deferred accept_func() calls. The phrases of the calls
+// are not being parsed by the time the calls are made, hence there's no
+// position to get or to return to.
+class ReplayParserControl : public ParserControl
 {
-    ParsingStep &parsing_step = getLastStep ();
-    assert (parsing_step.parsing_step_type == ParsingStep::t_Compound);
-    ParsingStep_Compound * const compound_step = static_cast <ParsingStep_Compound*> (&parsing_step);
-
-    StRef<PositionMarker> const pmark = st_grab (new (std::nothrow) PositionMarker);
-    token_stream->getPosition (&pmark->token_stream_pos);
-    pmark->compound_step = compound_step;
-    pmark->got_nonoptional_match = compound_step->got_nonoptional_match;
-    pmark->go_right_count = parsing_step.go_right_count;
-
+public:
+    void setCreateElements (bool const /* create_elements */)
     {
-#if 0
-// TODO Зачем это было написано (нееверный блок)?
-        List< StRef<CompoundGrammarEntry> >::Element *next_subg_el = compound_step->cur_subg_el;
-        while (next_subg_el != NULL &&
-               // FIXME Спорно. Скорее всего, нужно пропускать
-               //       только первую match-функцию - ту, которая вызвана
-               //       в данный момент.
-               next_subg_el->data->inline_match_func != NULL)
-        {
-            next_subg_el = next_subg_el->next;
-        }
+    }
 
-        pmark->cur_subg_el = next_subg_el;
-#endif
+    // Leaves @ret_pmark as is: setPosition() fails for any marker.
+    void getPosition (ParserPositionMarker * const mt_nonnull /* ret_pmark */)
+    {
+    }
 
-        pmark->cur_subg_el = compound_step->cur_subg_el;
+    mt_throws Result setPosition (ParserPositionMarker const * const mt_nonnull /* pmark */)
+    {
+        exc_throw (InternalException, InternalException::BadInput);
+        return Result::Failure;
     }
 
-    return pmark;
-}
+    void setVariant (ConstMemory const /* variant_name */)
+    {
+    }
+};
 
-mt_throws Result
-ParsingState::setPosition (ParserPositionMarker * const _pmark)
+// Deferred accept_func() and begin_func() calls, see
+// ParserConfig::deferred_actions.
+//
+// Like the event log, the action log is truncated when steps fail, and its
+// levels are absolute indices which stay valid after the log is replayed.
+//
+class ActionLog
 {
-    PositionMarker * const pmark = static_cast <PositionMarker*> (_pmark);
+private:
+    class Action
+    {
+    public:
+        Grammar *grammar;
+        // NULL for begin_func() calls and for accept_func (NULL) calls.
+        ParserElement *parser_element;
+        bool begin;
+    };
 
-    position_changed = true;
+    Action *actions;
+    Size num_actions;
+    Size max_actions;
 
-    Size total_go_right = 0;
-    {
-        ParsingStep * const mark_step = static_cast <ParsingStep*> (pmark->compound_step);
-        for (;;) {
-            ParsingStep * const cur_step = step_list.getLast();
-            if (cur_step == mark_step)
-                break;
+    // Absolute index of actions [0].
+    Size base_index;
 
-            total_go_right += cur_step->go_right_count;
+    ReplayParserControl replay_parser_control;
 
-            if (!pop_step (this, false /* match */, false /* empty_match */, false /* negative_cache_update */))
-                return Result::Failure;
+    void appendAction (Grammar       * const grammar,
+                       ParserElement * const parser_element,
+                       bool            const begin)
+    {
+        if (num_actions == max_actions) {
+            Size const new_max_actions = (max_actions ? max_actions * 2 : 1024);
+            Action * const new_actions = new (std::nothrow) Action [new_max_actions];
+            assert (new_actions);
+            for (Size i = 0; i < num_actions; ++i)
+                new_actions [i] = actions [i];
+
+            delete[] actions;
+            actions = new_actions;
+            max_actions = new_max_actions;
         }
+
+        Action * const action = &actions [num_actions];
+        ++num_actions;
+
+        action->grammar = grammar;
+        action->parser_element = parser_element;
+        action->begin = begin;
     }
 
-    ParsingStep_Compound * const compound_step =
-            static_cast <ParsingStep_Compound*> (&getLastStep ());
+public:
+    Size getLevel () const
+    {
+        return base_index + num_actions;
+    }
 
-    compound_step->cur_subg_el = pmark->cur_subg_el;
-    compound_step->got_nonoptional_match = pmark->got_nonoptional_match;
+    // Drops all actions starting from @level. Actions which have already
+    // been replayed can't be dropped.
+    void setLevel (Size const level)
+    {
+        if (level >= base_index + num_actions)
+            return;
 
-    cur_direction = ParsingState::Up;
+        num_actions = (level > base_index ? level - base_index : 0);
+    }
 
-    total_go_right += compound_step->go_right_count;
-    assert (total_go_right >= pmark->go_right_count);
-    for (Size i = 0; i < total_go_right - pmark->go_right_count; i++) {
-        DEBUG_NEGC (
-            errs->println (_func, "go left");
-        )
-        negative_cache.goLeft ();
+    void addBegin (Grammar * const mt_nonnull grammar)
+    {
+        appendAction (grammar, NULL, true /* begin */);
     }
 
-    return token_stream->setPosition (&pmark->token_stream_pos);
-}
-} // namespace {}
+    void addAccept (Grammar       * const mt_nonnull grammar,
+                    ParserElement * const parser_element)
+    {
+        appendAction (grammar, parser_element, false /* begin */);
+    }
 
-static void
-print_whsp (OutputStream * const mt_nonnull outs,
-	    Size           const num_spaces)
-{
-    for (Size i = 0; i < num_spaces; i++)
-	outs->print (" ");
-}
+    // Returns false if actions at @level have already been replayed.
+    bool isPending (Size const level) const
+    {
+        return level >= base_index;
+    }
 
-static void
-print_tab (OutputStream * const mt_nonnull outs,
-	   Size           const nest_level)
-{
-    print_whsp (outs, nest_level * 1);
-}
+    // Replaces the begin_func() call for @old_grammar logged at @level with
+    // a call for @new_grammar. If only one of the grammars has begin_func(),
+    // then the call is dropped or inserted, and the following actions move
+    // accordingly.
+    void replaceBegin (Size      const level,
+                       Grammar * const mt_nonnull old_grammar,
+                       Grammar * const mt_nonnull new_grammar)
+    {
+        assert (isPending (level) && level <= base_index + num_actions);
+        Size const index = level - base_index;
 
-static void
-push_step (ParsingState * const mt_nonnull parsing_state,
-	   ParsingStep  * const mt_nonnull step,
-	   Bool           const new_checkpoint = true)
-{
-    DEBUG_INT (
-      errs->println ("Pargen.push_step");
-    )
+        if (old_grammar->begin_func) {
+            assert (index < num_actions                 &&
+                    actions [index].begin               &&
+                    actions [index].grammar == old_grammar);
 
-    assert (parsing_state && step);
+            if (new_grammar->begin_func) {
+                actions [index].grammar = new_grammar;
+                return;
+            }
 
-    parsing_state->token_stream->getPosition (&step->token_stream_pos);
+            for (Size i = index + 1; i < num_actions; ++i)
+                actions [i - 1] = actions [i];
 
-    parsing_state->nest_level ++;
+            --num_actions;
+            return;
+        }
 
-    {
-        #warning What's' this?
-	// TEST FIXME TEMPORAL
-	step->ref ();
+        if (!new_grammar->begin_func)
+            return;
 
-	parsing_state->step_list.append (step);
-	step->ref ();
+        appendAction (new_grammar, NULL, true /* begin */);
+        for (Size i = num_actions - 1; i > index; --i)
+            actions [i] = actions [i - 1];
 
-#if 0
-        errs->println ("--- step_list appended: "
-                       "f 0x", fmt_hex, (UintPtr) parsing_state->step_list.getFirst(),
-                       ", l 0x", (UintPtr) parsing_state->step_list.getLast(),
-                       ", fe 0x", fmt_hex, (UintPtr) parsing_state->step_list.first,
-                       ", le 0x", (UintPtr) parsing_state->step_list.last);
-#endif
+        actions [index].grammar = new_grammar;
+        actions [index].parser_element = NULL;
+        actions [index].begin = true;
     }
 
-    parsing_state->cur_direction = ParsingState::Up;
+    // Makes all logged calls in the order in which they were logged.
+    // accept_func() gets a ReplayParserControl: the calls may be made
+    // while the parser is working on other phrases.
+    void replay (void * const user_data)
+    {
+        for (Size i = 0; i < num_actions; ++i) {
+            Action * const action = &actions [i];
+            if (action->begin)
+                action->grammar->begin_func (user_data);
+            else
+                action->grammar->accept_func (action->parser_element, &replay_parser_control, user_data);
+        }
 
-    if (new_checkpoint) {
-	if (parsing_state->lookup_data)
-	    parsing_state->lookup_data->newCheckpoint ();
+        base_index += num_actions;
+        num_actions = 0;
     }
 
-    DEBUG_PAR (
-	if (parsing_state->debug_dump) {
-	    errs->print (">");
-	    print_tab (errs, parsing_state->nest_level);
-
-	    ParsingStep &_step = parsing_state->getLastStep ();
-	    switch (_step.parsing_step_type) {
-		case ParsingStep::t_Sequence: {
-		    ParsingStep_Sequence &step = static_cast <ParsingStep_Sequence&> (_step);
-		    errs->print ("(seq) ", step.grammar->toString ());
-		} break;
-		case ParsingStep::t_Compound: {
-		    ParsingStep_Compound &step = static_cast <ParsingStep_Compound&> (_step);
-		    errs->print ("(com) ", step.grammar->toString ());
-		} break;
-		case ParsingStep::t_Switch: {
-		    ParsingStep_Switch &step = static_cast <ParsingStep_Switch&> (_step);
-		    errs->print ("(swi) ", step.grammar->toString ());
-		} break;
-		case ParsingStep::t_Alias: {
-		    errs->print ("(alias)");
-		}
-	    }
+    ActionLog ()
+        : actions (NULL),
+          num_actions (0),
+          max_actions (0),
+          base_index (0)
+    {
+    }
 
-	    errs->println (" >");
-	}
-    )
-}
+    ~ActionLog ()
+    {
+        delete[] actions;
+    }
+};
 
-static mt_throws Result
-pop_step (ParsingState *parsing_state,
-	  bool match,
-	  bool empty_match,
-	  bool negative_cache_update)
+class VStackContainer : public StReferenced
 {
-    assert (!(empty_match && !match));
+public:
+    VStack vstack;
 
-    DEBUG_INT (
-	errs->println (_func, "match: ", match, ", "
-                       "empty_match: ", empty_match);
-    );
+    VStackContainer (Size const block_size)
+        : vstack (block_size)
+    {
+    }
+};
 
-    DEBUG_PAR (
-	if (parsing_state->debug_dump) {
-	    if (match)
-		errs->print (ConstMemory ("+"));
-	    else
-		errs->print (ConstMemory (" "));
+// Token stream calls made by the parser. Parsing code is instantiated for
+// MemoryTokenStream and FileTokenStream, which are called directly, and for
+// TokenStream, which covers all other streams with virtual calls
+// (see do_parse_stream()).
+//
+// 'Position' is the type of short-lived position markers. Streams which are
+// called directly don't use complex markers, hence plain marker bodies are
+// used for them, with no copy_func/release_func checks.
+template <class TokenStreamT>
+class TokenStreamCalls
+{
+public:
+    typedef TokenStream::PositionMarker::Body Position;
 
-	    print_tab (errs, parsing_state->nest_level);
+    static mt_throws Result getNextToken (TokenStreamT        * const mt_nonnull token_stream,
+                                          ConstMemory         * const mt_nonnull ret_mem,
+                                          StRef<StReferenced> * const mt_nonnull ret_user_obj,
+                                          void               ** const mt_nonnull ret_user_ptr)
+    {
+        // These streams don't associate user objects with tokens.
+        *ret_user_obj = NULL;
+        *ret_user_ptr = NULL;
+        return token_stream->TokenStreamT::getNextToken (ret_mem);
+    }
 
-	    if (match)
-		errs->print ("MATCH ");
+    static mt_throws Result getPosition (TokenStreamT                * const mt_nonnull token_stream,
+                                         TokenStream::PositionMarker * const mt_nonnull ret_pmark)
+    {
+        return token_stream->TokenStreamT::getPosition (ret_pmark);
+    }
 
-	    ParsingStep &_step = parsing_state->getLastStep ();
-	    switch (_step.parsing_step_type) {
-		case ParsingStep::t_Sequence: {
-		    ParsingStep_Sequence &step = static_cast <ParsingStep_Sequence&> (_step);
-		    errs->print ("(seq) ", step.grammar->toString ());
-		} break;
-		case ParsingStep::t_Compound: {
-		    ParsingStep_Compound &step = static_cast <ParsingStep_Compound&> (_step);
-		    errs->print ("(com) ", step.grammar->toString ());
-		} break;
-		case ParsingStep::t_Switch: {
-		    ParsingStep_Switch &step = static_cast <ParsingStep_Switch&> (_step);
-		    errs->print ("(swi) ", step.grammar->toString ());
-		} break;
-		case ParsingStep::t_Alias: {
-		    errs->print ("(alias)");
-		} break;
-	    }
+    static mt_throws Result setPosition (TokenStreamT                      * const mt_nonnull token_stream,
+                                         TokenStream::PositionMarker const * const mt_nonnull pmark)
+    {
+        return token_stream->TokenStreamT::setPosition (pmark);
+    }
 
-	    if (match)
-		errs->print (" +");
-	    else
-		errs->print (" <");
+    static mt_throws Result getPosition (TokenStreamT * const mt_nonnull token_stream,
+                                         Position     * const mt_nonnull ret_pos)
+    {
+        return token_stream->getPositionBody (ret_pos);
+    }
 
-            errs->println (ConstMemory (""));
-	}
-    );
+    static mt_throws Result setPosition (TokenStreamT   * const mt_nonnull token_stream,
+                                         Position const * const mt_nonnull pos)
+    {
+        return token_stream->setPositionBody (pos);
+    }
+};
 
-    assert (parsing_state);
+template <>
+class TokenStreamCalls<TokenStream>
+{
+public:
+    typedef TokenStream::PositionMarker Position;
 
-    assert (!parsing_state->step_list.isEmpty());
-    ParsingStep &step = *parsing_state->step_list.getLast();
+    static mt_throws Result getNextToken (TokenStream         * const mt_nonnull token_stream,
+                                          ConstMemory         * const mt_nonnull ret_mem,
+                                          StRef<StReferenced> * const mt_nonnull ret_user_obj,
+                                          void               ** const mt_nonnull ret_user_ptr)
+    {
+        return token_stream->getNextToken (ret_mem, ret_user_obj, ret_user_ptr);
+    }
 
-    if (!match || empty_match) {
-	if (!parsing_state->token_stream->setPosition (&step.token_stream_pos))
-            return Result::Failure;
+    static mt_throws Result getPosition (TokenStream * const mt_nonnull token_stream,
+                                         Position    * const mt_nonnull ret_pmark)
+    {
+        return token_stream->getPosition (ret_pmark);
     }
 
-    if (negative_cache_update) {
-	if (!match || empty_match) {
-	    for (Size i = 0; i < step.go_right_count; i++) {
-		DEBUG_NEGC (
-                  errs->println (_func, "go left");
-		)
-		parsing_state->negative_cache.goLeft ();
-	    }
-	} else {
-	    if (parsing_state->step_list.getFirst() != parsing_state->step_list.getLast()) {
-		ParsingStep &prv_step = *(parsing_state->step_list.getPrevious (parsing_state->step_list.getLast()));
-		prv_step.go_right_count += step.go_right_count;
-	    }
-	}
-
-	if (!match /* TEST && !empty_match */) {
-	    DEBUG_NEGC (
-              errs->println (_func, "adding negative ", step.grammar->toString ());
-	    )
-	    parsing_state->negative_cache.addNegative (step.grammar);
-	}
+    static mt_throws Result setPosition (TokenStream    * const mt_nonnull token_stream,
+                                         Position const * const mt_nonnull pmark)
+    {
+        return token_stream->setPosition (pmark);
     }
+};
 
-    parsing_state->match = match;
-    parsing_state->empty_match = empty_match;
+} // namespace {}
 
-    parsing_state->nest_level --;
-    {
-	ParsingStep * const tmp_step = parsing_state->step_list.getLast();
-	VStack::Level const tmp_level = tmp_step->vstack_level;
-	VStack::Level const tmp_el_level = tmp_step->el_level;
+// State of the parser. Not in the anonymous namespace, because
+// ParserPositionMarker grants it access to its fields.
+template <class TokenStreamT>
+class ParsingState : public ParserControl
+{
+public:
+    enum Direction {
+        Up,
+        Down
+    };
 
-	parsing_state->step_list.remove (tmp_step);
-	tmp_step->~ParsingStep ();
+    StRef<ParserConfig> parser_config;
 
-#if 0
-        errs->println ("--- step_list removed: "
-                       "f 0x", fmt_hex, (UintPtr) parsing_state->step_list.getFirst(),
-                       ", l 0x", (UintPtr) parsing_state->step_list.getLast(),
-                       ", fe 0x", fmt_hex, (UintPtr) parsing_state->step_list.first,
-                       ", le 0x", (UintPtr) parsing_state->step_list.last);
-#endif
+    ConstMemory default_variant;
 
-	parsing_state->step_vstack.setLevel (tmp_level);
+    VSlab< ListAcceptor<ParserElement> > list_acceptor_slab;
+    VSlab< PtrAcceptor<ParserElement> > ptr_acceptor_slab;
 
-	if (!match)
-	    parsing_state->el_vstack->setLevel (tmp_el_level);
-    }
+    Bool create_elements;
 
-    parsing_state->cur_direction = ParsingState::Down;
+    StRef<String> variant;
 
-    if (match) {
-	if (parsing_state->lookup_data)
-	    parsing_state->lookup_data->commitCheckpoint ();
-    } else {
-	if (parsing_state->lookup_data)
-	    parsing_state->lookup_data->cancelCheckpoint ();
-    }
+    // Nest level is used for debugging output.
+    Size nest_level;
 
-    return Result::Success;
-}
+    TokenStreamT *token_stream;
+    // See TokenStream::getStableMemory().
+    ConstMemory stable_mem;
+    LookupData  *lookup_data;
+    // User data for accept_func() and match_func().
+    void *user_data;
 
-// Returns 'true' (@ret_res) if we have a match, 'false otherwise.
-static mt_throws Result
-parse_Immediate (ParsingState      * const mt_nonnull parsing_state,
-		 Grammar_Immediate * const mt_nonnull grammar,
-		 Acceptor          * const acceptor,
-                 bool              * const mt_nonnull ret_res)
-{
-    DEBUG_FLO (
-      errs->println (_func_);
-    );
+    StRef<VStackContainer> el_vstack_container;
+    VStack *el_vstack;
 
-    assert (parsing_state);
+    // Stack of grammar invocations.
+    ParsingStepList step_list;
+    VStack step_vstack;
 
-    TokenStream::PositionMarker pmark;
-    parsing_state->token_stream->getPosition (&pmark);
+    // Direction of the previous movement along the stack:
+    // "Up" means we've become one level deeper ('steps' grew),
+    // "Down" means we've returned from a nested level ('steps' shrunk).
+    // Note: it looks like I've swapped the meanings for "up" and "down" here.
+    Direction cur_direction;
 
-    StRef<StReferenced> user_obj;
-    void *user_ptr;
-    ConstMemory token;
-    if (!parsing_state->token_stream->getNextToken (&token, &user_obj, &user_ptr))
-        return Result::Failure;
-    if (token.len() == 0) {
-	if (!parsing_state->token_stream->setPosition (&pmark))
-            return Result::Failure;
+    // 'true' if we've come from a nested grammar with a match for that grammar,
+    // 'false' otherwise.
+    Bool match;
+    // 'true' if we've come from a nested grammar with an empty match
+    // for that grammar.
+    Bool empty_match;
 
-	DEBUG (
-          errs->println (_func, "no token");
-	)
-        *ret_res = false;
-        return Result::Success;
-    }
+    // 'true' if we're up from a grammar which turns out
+    // to be left recursive after attempting to parse it.
+    // ("a: b_opt a c", and "b" is no match).
+    Bool compound_lr;
 
-    DEBUG_PAR (
-      if (parsing_state->debug_dump)
-          errs->println (_func, "token: ", token);
-    )
+    // 'true' if we're up from a compound grammar which is an empty match.
+    // This is possible if all subgrammars are optional or if we preset
+    // the first element of a left-recursive grammar and all of the following
+    // elements are optional.
+    Bool compound_empty;
 
-    DEBUG_INT (
-      errs->println (_func, "token: ", token);
-    )
+    Bool debug_dump;
 
-    if (!grammar->match (token, user_ptr, parsing_state->user_data)) {
-	if (!parsing_state->token_stream->setPosition (&pmark))
-            return Result::Failure;
+    PositiveCacheEntry  positive_cache_root;
+    PositiveCacheEntry *cur_positive_cache_entry;
 
-	DEBUG_INT (
-          errs->println (_func, "!grammar->match()");
-	)
+    NegativeCache negative_cache;
 
-        *ret_res = false;
-        return Result::Success;
-    }
+    // Keyword recognizer of the top-level grammar, may be null.
+    Grammar::TokenClassifyFunc classify_token;
 
-    // Note: This is a strange condition...
-    if (acceptor) {
-	Byte * const el_token_buf = parsing_state->el_vstack->push_unaligned (token.len());
-	memcpy (el_token_buf, token.mem(), token.len());
-	ParserElement * const parser_element =
-		new (parsing_state->el_vstack->push_malign (
-                                    sizeof (ParserElement_Token), alignof (ParserElement_Token)))
-                            ParserElement_Token (
-                                    ConstMemory (el_token_buf, token.len()),
-                                    user_ptr);
+    Bool position_changed;
 
-	// TODO I think that match_func() and accept_func() should be called
-	// regardless of whether 'acceptor' is NULL or not.
-	if (grammar->match_func != NULL) {
-	    DEBUG_CB (
-              errs->println (_func, "calling match_func()");
-	    )
-	    if (!grammar->match_func (parser_element, parsing_state, parsing_state->user_data)) {
-		if (!parsing_state->token_stream->setPosition (&pmark))
-                    return Result::Failure;
+    // Non-null for event-driven parsing.
+    ParserEventHandler *event_handler;
+    EventLog *event_log;
 
-		DEBUG_INT (
-                  errs->println (_func, "match_func() returned false");
-		)
-                *ret_res = false;
-                return Result::Success;
-	    }
+    // Non-null if ParserConfig::deferred_actions is set.
+    ActionLog *action_log;
 
-	    DEBUG_INT (
-              errs->println (_func, "match_func() returned true");
-	    )
-	} else {
-	    DEBUG_INT (
-              errs->println (_func, "no match_func()");
-	    )
-	}
+    // Non-null for parseItems().
+    ParserItemFunc item_func;
 
-	if (grammar->accept_func != NULL) {
-	    DEBUG_CB (
-              errs->println (_func, "calling accept_func()");
-	    )
-	    grammar->accept_func (parser_element,
-				  parsing_state,
-				  parsing_state->user_data);
-	}
+    // Incremented each time the parser commits to the input parsed so far
+    // for good (see is_committed_stack()). Position markers can't be used
+    // to go back across such points.
+    Size commit_count;
 
-	acceptor->setParserElement (parser_element);
+    ParsingStep& getLastStep ()
+    {
+        assert (!step_list.isEmpty());
+        return *step_list.getLast();
     }
 
-    *ret_res = true;
-    return Result::Success;
-}
+    // Returns the id of 'token', which is the token at the current position.
+    // Tokens are classified once per position.
+    Uint32 getTokenId (ConstMemory const &token)
+    {
+        assert (classify_token);
 
-enum ParsingResult {
-    ParseUp,
-    ParseNonemptyMatch,
-    ParseEmptyMatch,
-    ParseNoMatch
-};
+        Uint32 token_id;
+        if (negative_cache.getTokenId (&token_id))
+            return token_id;
 
-static void
-push_compound_step (ParsingState     * const parsing_state,
-		    Grammar_Compound * const grammar,
-#ifndef VSLAB_ACCEPTOR
-		    Acceptor         * const acceptor,
-#else
-		    VSlabRef<Acceptor> const acceptor,
-#endif
-		    bool               const optional,
-		    bool               const got_nonoptional_match = false,
-		    Size               const go_right_count = 0,
-		    bool               const got_cur_subg_el = false,
-		    List< StRef<CompoundGrammarEntry> >::Element * const cur_subg_el = NULL)
-{
-    VStack::Level const tmp_vstack_level = parsing_state->step_vstack.getLevel ();
-    VStack::Level const tmp_el_level = parsing_state->el_vstack->getLevel ();
-    ParsingStep_Compound * const step =
-	    new (parsing_state->step_vstack.push_malign (
-                                sizeof (ParsingStep_Compound), alignof (ParsingStep_Compound)))
-                        ParsingStep_Compound;
-    step->vstack_level = tmp_vstack_level;
-    step->el_level = tmp_el_level;
-    step->acceptor = acceptor;
-    step->optional = optional;
-    step->grammar = grammar;
-    step->got_nonoptional_match = got_nonoptional_match;
-    step->go_right_count = go_right_count;
+        token_id = classify_token (token);
+        negative_cache.setTokenId (token_id);
+        return token_id;
+    }
 
-    if (got_cur_subg_el)
-	step->cur_subg_el = cur_subg_el;
-    else
-	step->cur_subg_el = grammar->grammar_entries.first;
+    // Calls a pure token match callback for the token at the current
+    // position, at most once per position.
+    bool matchPureCb (Grammar_Immediate_SingleToken::TokenMatchCallback   const token_match_cb,
+                      ConstMemory                                         const &token,
+                      void                                              * const token_user_ptr)
+    {
+        bool result;
+        if (negative_cache.getCbResult (token_match_cb, &result))
+            return result;
 
-    step->parser_element = grammar->createParserElement (parsing_state->el_vstack);
-    push_step (parsing_state, step);
-}
+        result = token_match_cb (token, token_user_ptr, user_data);
+        negative_cache.setCbResult (token_match_cb, result);
+        return result;
+    }
 
-static void
-push_switch_step (ParsingState       * const parsing_state,
-		  Grammar_Switch     * const grammar,
-#ifndef VSLAB_ACCEPTOR
-		  Acceptor           * const acceptor,
-#else
-		  VSlabRef<Acceptor>   const acceptor,
-#endif
-		  bool                 const optional,
-		  List< StRef<SwitchGrammarEntry> >::Element * const cur_subg_el = NULL)
-{
-    VStack::Level const tmp_vstack_level = parsing_state->step_vstack.getLevel ();
-    VStack::Level const tmp_el_level = parsing_state->el_vstack->getLevel ();
-    ParsingStep_Switch * const step =
-	    new (parsing_state->step_vstack.push_malign (
-                                sizeof (ParsingStep_Switch), alignof (ParsingStep_Switch)))
-                        ParsingStep_Switch;
-    step->vstack_level = tmp_vstack_level;
-    step->el_level = tmp_el_level;
-    step->acceptor = acceptor;
-    step->optional = optional;
-    step->grammar = grammar;
-    step->state = ParsingStep_Switch::State_NLR;
-    step->got_empty_nlr_match = false;
-    step->got_nonempty_nlr_match = false;
-    step->got_lr_match = false;
+  mt_iface (ParserControl)
 
-    if (cur_subg_el != NULL)
-	step->cur_nlr_el = cur_subg_el;
-    else
-	step->cur_nlr_el = grammar->grammar_entries.first;
+    void setCreateElements (bool const create_elements)
+    {
+        this->create_elements = create_elements;
+    }
 
-    step->cur_lr_el = NULL;
+    void getPosition (ParserPositionMarker * mt_nonnull ret_pmark);
 
-    push_step (parsing_state, step);
-}
+    mt_throws Result setPosition (ParserPositionMarker const * mt_nonnull pmark);
 
-static mt_throws Result
-parse_grammar (ParsingState       * const mt_nonnull parsing_state,
-	       Grammar            * const mt_nonnull _grammar,
-// VSLAB ACCEPTOR	       Acceptor     *acceptor,
-	       VSlabRef<Acceptor>   const acceptor,
-	       bool                 const optional,
-               ParsingResult      * const mt_nonnull ret_res)
-{
-    DEBUG_FLO (
-      errs->println (_func_);
-    );
+    void setVariant (ConstMemory const variant)
+    {
+        this->variant = st_grab (new (std::nothrow) String (variant));
+    }
 
-    assert (parsing_state && _grammar);
+  mt_iface_end
 
-#ifdef PARGEN_NEGATIVE_CACHE
-    if (parsing_state->negative_cache.isNegative (_grammar)) {
-      // TODO At this point, we have already checked that the grammar is
-      // in negative cache for the current token. But we'll test for this
-      // again in pop_step(), which could be avoided if we remembered the result
-      // of the lookup that we've just made.
-
-	DEBUG_NEGC (
-          errs->println (_func, "negative ", _grammar->toString ());
-	)
-
-	if (optional) {
-#if 0
-	  // FIXME: This looks strange. Why don't we expect this to be called
-	  // in parse_Immediate()? This calls seems to be excessive.
-	    if (_grammar->accept_func != NULL) {
-		_grammar->accept_func (NULL,
-				       parsing_state,
-				       parsing_state->user_data);
-	    }
-#endif
+    // See TokenStreamCalls.
+    typedef typename TokenStreamCalls<TokenStreamT>::Position StreamPosition;
 
-	    *ret_res = ParseEmptyMatch;
-            return Result::Success;
-	}
-
-	*ret_res = ParseNoMatch;
-        return Result::Success;
+    mt_throws Result streamGetNextToken (ConstMemory         * const mt_nonnull ret_mem,
+                                         StRef<StReferenced> * const mt_nonnull ret_user_obj,
+                                         void               ** const mt_nonnull ret_user_ptr)
+    {
+        return TokenStreamCalls<TokenStreamT>::getNextToken (token_stream, ret_mem, ret_user_obj, ret_user_ptr);
     }
-#endif
 
-    switch (_grammar->grammar_type) {
-	case Grammar::t_Immediate: {
-	    DEBUG_INT (
-	      errs->println (_func, "Grammar::_Immediate");
-	    )
+    // @ret_pos is either a TokenStream::PositionMarker or a StreamPosition.
+    template <class PositionT>
+    mt_throws Result streamGetPosition (PositionT * const mt_nonnull ret_pos)
+    {
+        return TokenStreamCalls<TokenStreamT>::getPosition (token_stream, ret_pos);
+    }
 
-            bool match;
-	    if (!parse_Immediate (parsing_state,
-                                  static_cast <Grammar_Immediate*> (_grammar),
-                                  acceptor,
-                                  &match))
-            {
-                return Result::Failure;
-            }
+    template <class PositionT>
+    mt_throws Result streamSetPosition (PositionT const * const mt_nonnull pos)
+    {
+        return TokenStreamCalls<TokenStreamT>::setPosition (token_stream, pos);
+    }
 
-	    if (match) {
-		{
-		  // Updating negative cache state (moving right)
+    ParsingState ()
+        : step_vstack (1 << 16 /* block_size */)
+    {
+        el_vstack_container = st_grab (new (std::nothrow) VStackContainer (1 << 16 /* block_size */));
+        assert (el_vstack_container);
+        el_vstack = &el_vstack_container->vstack;
 
-		    DEBUG_NEGC (
-                      errs->println (_func, "go right");
-		    )
-		    parsing_state->negative_cache.goRight ();
+        DEBUG_VSTACK (
+            errs->println (_func,
+                           "list_acceptor_slab vstack: 0x", fmt_hex, (UintPtr) &list_acceptor_slab.vstack, ", "
+                           "ptr_acceptor_slab vstack: 0x", fmt_hex, (UintPtr) &ptr_acceptor_slab.vstack);
+            errs->println (_func,
+                           "el_vstack: 0x", fmt_hex, (UintPtr) el_vstack, ", "
+                           "step_vstack: 0x", fmt_hex, (UintPtr) &step_vstack);
+            errs->println (_func, "CompoundGrammarEntry::acceptor_slab vstack: "
+                           "0x", fmt_hex, (UintPtr) &CompoundGrammarEntry::acceptor_slab.vstack);
+        )
+    }
+};
 
-		    if (!parsing_state->step_list.isEmpty()) {
-			ParsingStep * const step = parsing_state->step_list.getLast();
-			step->go_right_count ++;
-		    }
-		}
+template <class TokenStreamT>
+void
+ParsingState<TokenStreamT>::getPosition (ParserPositionMarker * const mt_nonnull pmark)
+{
+    ParsingStep &parsing_step = getLastStep ();
+    assert (parsing_step.parsing_step_type == ParsingStep::t_Compound);
+    ParsingStep_Compound * const compound_step = static_cast <ParsingStep_Compound*> (&parsing_step);
 
-		*ret_res = ParseNonemptyMatch;
-                return Result::Success;
-	    }
+    streamGetPosition (&pmark->token_stream_pos);
+    pmark->compound_step = compound_step;
+    pmark->got_nonoptional_match = compound_step->got_nonoptional_match;
+    pmark->go_right_count = parsing_step.go_right_count;
+    pmark->cut_passed = compound_step->cut_passed;
+    pmark->commit_count = commit_count;
 
-	    if (optional) {
-	      // FIXME: This looks strange. Why don't we expect this to be called
-	      // in parse_Immediate()? This call seems to be excessive.
+    {
+#if 0
+// TODO Зачем это было написано (нееверный блок)?
+        List< StRef<CompoundGrammarEntry> >::Element *next_subg_el = compound_step->cur_subg_el;
+        while (next_subg_el != NULL &&
+               // FIXME Спорно. Скорее всего, нужно пропускать
+               //       только первую match-функцию - ту, которая вызвана
+               //       в данный момент.
+               next_subg_el->data->inline_match_func != NULL)
+        {
+            next_subg_el = next_subg_el->next;
+        }
 
-		assert (!match);
-		if (_grammar->accept_func != NULL) {
-		    _grammar->accept_func (NULL,
-					   parsing_state,
-					   parsing_state->user_data);
-		}
+        pmark->cur_subg_el = next_subg_el;
+#endif
 
-		*ret_res = ParseEmptyMatch;
-                return Result::Success;
-	    }
+        pmark->cur_subg_el = compound_step->cur_subg_el;
+    }
+}
 
-	    *ret_res = ParseNoMatch;
-            return Result::Success;
-	} break;
+template <class TokenStreamT>
+mt_throws Result
+ParsingState<TokenStreamT>::setPosition (ParserPositionMarker const * const mt_nonnull pmark)
+{
+    ParsingStep * const mark_step = static_cast <ParsingStep_Compound*> (pmark->compound_step);
 
-	case Grammar::t_Compound: {
-	    DEBUG_INT (
-	      errs->println (_func, "Grammar::_Compound");
-	    )
+    // Going back across a cut or a commit point is not allowed.
+    if (pmark->commit_count != commit_count ||
+        (mark_step->cut_passed && !pmark->cut_passed))
+    {
+        exc_throw (InternalException, InternalException::BadInput);
+        return Result::Failure;
+    }
 
-	    Grammar_Compound * const grammar = static_cast <Grammar_Compound*> (_grammar);
+    for (ParsingStep *cur_step = step_list.getLast();
+         cur_step != mark_step;
+         cur_step = step_list.getPrevious (cur_step))
+    {
+        if (cur_step->cut_passed) {
+            exc_throw (InternalException, InternalException::BadInput);
+            return Result::Failure;
+        }
+    }
 
-	    push_compound_step (parsing_state,
-				grammar,
-				acceptor,
-				optional,
-				false /* got_nonoptional_match */,
-				0     /* go_right_count */,
-				false /* got_cur_subg_el */,
-				NULL  /* cur_subg_el */);
-	} break;
+    position_changed = true;
 
-	case Grammar::t_Switch: {
-	    DEBUG_INT (
-	      errs->println (_func, "Grammar::_Switch");
-	    )
+    Size total_go_right = 0;
+    {
+        for (;;) {
+            ParsingStep * const cur_step = step_list.getLast();
+            if (cur_step == mark_step)
+                break;
 
-	    Grammar_Switch * const grammar = static_cast <Grammar_Switch*> (_grammar);
+            total_go_right += cur_step->go_right_count;
 
-	    push_switch_step (parsing_state, grammar, acceptor, optional, NULL /* cur_subg_el */);
-	} break;
+            if (!pop_step (this, false /* match */, false /* empty_match */, false /* negative_cache_update */))
+                return Result::Failure;
+        }
+    }
 
-	case Grammar::t_Alias: {
-	    DEBUG_INT (
-		errs->print (_func, "Grammar::_Alias");
-	    )
+    ParsingStep_Compound * const compound_step =
+            static_cast <ParsingStep_Compound*> (&getLastStep ());
 
-	    Grammar_Alias * const grammar = static_cast <Grammar_Alias*> (_grammar);
+    compound_step->cur_subg_el = pmark->cur_subg_el;
+    compound_step->got_nonoptional_match = pmark->got_nonoptional_match;
 
-	    VStack::Level const tmp_vstack_level = parsing_state->step_vstack.getLevel ();
-	    VStack::Level const tmp_el_level = parsing_state->el_vstack->getLevel ();
+    cur_direction = Up;
 
-	    ParsingStep_Alias * const step =
-		    new (parsing_state->step_vstack.push_malign (
-                                        sizeof (ParsingStep_Alias), alignof (ParsingStep_Alias)))
-                                ParsingStep_Alias;
-	    step->vstack_level = tmp_vstack_level;
-	    step->el_level = tmp_el_level;
-	    step->acceptor = acceptor;
-	    step->optional = optional;
-	    step->grammar = grammar;
+    total_go_right += compound_step->go_right_count;
+    assert (total_go_right >= pmark->go_right_count);
+    for (Size i = 0; i < total_go_right - pmark->go_right_count; i++) {
+        DEBUG_NEGC (
+            errs->println (_func, "go left");
+        )
+        negative_cache.goLeft ();
+    }
 
-	    push_step (parsing_state, step);
-	} break;
+    return streamSetPosition (&pmark->token_stream_pos);
+}
 
-	default:
-            unreachable ();
-    }
+static void
+print_whsp (OutputStream * const mt_nonnull outs,
+	    Size           const num_spaces)
+{
+    for (Size i = 0; i < num_spaces; i++)
+	outs->print (" ");
+}
 
-    *ret_res = ParseUp;
-    return Result::Success;
+static void
+print_tab (OutputStream * const mt_nonnull outs,
+	   Size           const nest_level)
+{
+    print_whsp (outs, nest_level * 1);
 }
 
-static mt_throws Result
-parse_sequence_no_match (ParsingState         * const mt_nonnull parsing_state,
-			 ParsingStep_Sequence * const mt_nonnull step)
+template <class TokenStreamT>
+static void
+push_step (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+	   ParsingStep                * const mt_nonnull step,
+	   Bool                         const new_checkpoint = true)
 {
-    DEBUG_FLO (
-      errs->println (_func_);
+    DEBUG_INT (
+      errs->println ("Pargen.push_step");
     )
 
     assert (parsing_state && step);
 
-    if (!step->parser_elements.isEmpty ()) {
-	List<ParserElement*>::DataIterator parser_el_iter (step->parser_elements);
-	while (!parser_el_iter.done ()) {
-	    DEBUG_INT (
-	      errs->println (_func, "accepting element");
-	    )
+    parsing_state->streamGetPosition (&step->token_stream_pos);
 
-	    if (step->acceptor)
-		step->acceptor->setParserElement (parser_el_iter.next ());
-	}
+    if (parsing_state->action_log)
+        step->action_level = parsing_state->action_log->getLevel ();
 
-	DEBUG (
-          errs->println (_func, "non-empty list");
-	)
-	if (!pop_step (parsing_state, true /* match */, false /* empty_match */))
-            return Result::Failure;
-    } else {
-	if (step->optional) {
-	    if (!pop_step (parsing_state, true /* match */, true /* empty_match */))
-                return Result::Failure;
-        } else {
-            if (!pop_step (parsing_state, false /* match */, false /* empty_match */))
-                return Result::Failure;
+    if (parsing_state->event_log) {
+        step->event_level = parsing_state->event_log->getLevel ();
+
+        if (step->parsing_step_type == ParsingStep::t_Compound) {
+            Size lr_anchor = step->event_level;
+            if (static_cast <ParsingStep_Compound*> (step)->lr_wrap) {
+                assert (!parsing_state->step_list.isEmpty());
+                lr_anchor = parsing_state->step_list.getLast()->event_level;
+            }
+
+            parsing_state->event_log->addPhraseBegin (step->grammar, lr_anchor);
+        } else
+        if (step->parsing_step_type == ParsingStep::t_Precedence) {
+            parsing_state->event_log->addPhraseBegin (step->grammar, step->event_level);
         }
     }
 
-    return Result::Success;
-}
+    parsing_state->nest_level ++;
 
-static mt_throws Result
-parse_sequence_match (ParsingState         * const mt_nonnull parsing_state,
-		      ParsingStep_Sequence * const mt_nonnull step)
-{
-    assert (parsing_state && step);
+    {
+        #warning What's' this?
+	// TEST FIXME TEMPORAL
+	step->ref ();
 
-    VSlabRef< ListAcceptor<ParserElement> > const acceptor =
-	    VSlabRef< ListAcceptor<ParserElement> >::forRef < ListAcceptor<ParserElement> > (
-		    parsing_state->list_acceptor_slab.alloc ());
-    acceptor->init (&step->parser_elements);
-    for (;;) {
-	ParsingResult pres;
-        if (!parse_grammar (parsing_state, step->grammar, acceptor, false /* optional */, &pres))
-            return Result::Failure;
+	parsing_state->step_list.append (step);
+	step->ref ();
 
-	if (pres == ParseNonemptyMatch)
-	    continue;
+#if 0
+        errs->println ("--- step_list appended: "
+                       "f 0x", fmt_hex, (UintPtr) parsing_state->step_list.getFirst(),
+                       ", l 0x", (UintPtr) parsing_state->step_list.getLast(),
+                       ", fe 0x", fmt_hex, (UintPtr) parsing_state->step_list.first,
+                       ", le 0x", (UintPtr) parsing_state->step_list.last);
+#endif
+    }
 
-	if (pres == ParseEmptyMatch ||
-	    pres == ParseNoMatch)
-	{
-	    if (!parse_sequence_no_match (parsing_state, step))
-                return Result::Failure;
-	} else {
-	    assert (pres == ParseUp);
-        }
+    parsing_state->cur_direction = ParsingState<TokenStreamT>::Up;
 
-	break;
+    if (new_checkpoint) {
+	if (parsing_state->lookup_data)
+	    parsing_state->lookup_data->newCheckpoint ();
     }
 
-    return Result::Success;
+    DEBUG_PAR (
+	if (parsing_state->debug_dump) {
+	    errs->print (">");
+	    print_tab (errs, parsing_state->nest_level);
+
+	    ParsingStep &_step = parsing_state->getLastStep ();
+	    switch (_step.parsing_step_type) {
+		case ParsingStep::t_Sequence: {
+		    ParsingStep_Sequence &step = static_cast <ParsingStep_Sequence&> (_step);
+		    errs->print ("(seq) ", step.grammar->toString ());
+		} break;
+		case ParsingStep::t_Compound: {
+		    ParsingStep_Compound &step = static_cast <ParsingStep_Compound&> (_step);
+		    errs->print ("(com) ", step.grammar->toString ());
+		} break;
+		case ParsingStep::t_Switch: {
+		    ParsingStep_Switch &step = static_cast <ParsingStep_Switch&> (_step);
+		    errs->print ("(swi) ", step.grammar->toString ());
+		} break;
+		case ParsingStep::t_Alias: {
+		    errs->print ("(alias)");
+		} break;
+		case ParsingStep::t_Precedence: {
+		    ParsingStep_Precedence &step = static_cast <ParsingStep_Precedence&> (_step);
+		    errs->print ("(pre) ", step.grammar->toString ());
+		} break;
+	    }
+
+	    errs->println (" >");
+	}
+    )
 }
 
+template <class TokenStreamT>
 static mt_throws Result
-parse_compound_no_match (ParsingState         * const mt_nonnull parsing_state,
-			 ParsingStep_Compound * const mt_nonnull step)
+pop_step (ParsingState<TokenStreamT> *parsing_state,
+	  bool match,
+	  bool empty_match,
+	  bool negative_cache_update)
 {
-    DEBUG_FLO (
-      errs->println (_func_);
-    )
+    assert (!(empty_match && !match));
 
-    assert (parsing_state && step);
+    DEBUG_INT (
+	errs->println (_func, "match: ", match, ", "
+                       "empty_match: ", empty_match);
+    );
 
-#ifdef PARGEN_UPWARDS_JUMPS
-    if (parsing_state->parser_config->upwards_jumps &&
-	!step->jump_performed                       &&
-	step->got_jump)
-    {
-	do {
-	    if (step->jump_cb != NULL) {
-		if (!step->jump_cb (step->parser_element, parsing_state->user_data))
-		    break;
+    DEBUG_PAR (
+	if (parsing_state->debug_dump) {
+	    if (match)
+		errs->print (ConstMemory ("+"));
+	    else
+		errs->print (ConstMemory (" "));
+
+	    print_tab (errs, parsing_state->nest_level);
+
+	    if (match)
+		errs->print ("MATCH ");
+
+	    ParsingStep &_step = parsing_state->getLastStep ();
+	    switch (_step.parsing_step_type) {
+		case ParsingStep::t_Sequence: {
+		    ParsingStep_Sequence &step = static_cast <ParsingStep_Sequence&> (_step);
+		    errs->print ("(seq) ", step.grammar->toString ());
+		} break;
+		case ParsingStep::t_Compound: {
+		    ParsingStep_Compound &step = static_cast <ParsingStep_Compound&> (_step);
+		    errs->print ("(com) ", step.grammar->toString ());
+		} break;
+		case ParsingStep::t_Switch: {
+		    ParsingStep_Switch &step = static_cast <ParsingStep_Switch&> (_step);
+		    errs->print ("(swi) ", step.grammar->toString ());
+		} break;
+		case ParsingStep::t_Alias: {
+		    errs->print ("(alias)");
+		} break;
+		case ParsingStep::t_Precedence: {
+		    ParsingStep_Precedence &step = static_cast <ParsingStep_Precedence&> (_step);
+		    errs->print ("(pre) ", step.grammar->toString ());
+		} break;
 	    }
 
-	    SwitchGrammarEntry * const switch_ge = step->jump_switch_grammar_entry->data;
-	    assert (switch_ge->grammar->grammar_type == Grammar::t_Compound);
-	    Grammar_Compound * const grammar__compound = static_cast <Grammar_Compound*> (switch_ge->grammar.ptr ());
+	    if (match)
+		errs->print (" +");
+	    else
+		errs->print (" <");
 
-	    push_compound_step (parsing_state,
-				grammar__compound,
-#ifndef VSLAB_ACCEPTOR
-				NULL /* acceptor */,
-#else
-				VSlabRef<Acceptor> () /* acceptor */,
-#endif
-				false /* optional */,
-				step->got_nonoptional_match,
-				step->go_right_count,
-				true  /* got_cur_subg_el */,
-				step->jump_compound_grammar_entry);
+            errs->println (ConstMemory (""));
+	}
+    );
 
-	    step->jump_performed = true;
-	    step->go_right_count = 0;
+    assert (parsing_state);
 
-	    DEBUG (
-              errs->println ("--- JUMP --- 0x", fmt_hex, (Uint64) step->jump_compound_grammar_entry);
+    assert (!parsing_state->step_list.isEmpty());
+    ParsingStep &step = *parsing_state->step_list.getLast();
+
+    if (step.cut_passed && !match) {
+      // Failure after a cut is a syntax error. The token stream is
+      // at the first token which we could not match.
+	FilePosition fpos;
+	if (!parsing_state->token_stream->getFilePosition (&fpos))
+	    return Result::Failure;
+
+	exc_throw (ParsingException, fpos, st_makeString ("syntax error in ", step.grammar->toString ()));
+	return Result::Failure;
+    }
+
+    if (!match || empty_match) {
+	if (!parsing_state->streamSetPosition (&step.token_stream_pos))
+            return Result::Failure;
+    }
+
+    if (!match && parsing_state->action_log)
+	parsing_state->action_log->setLevel (step.action_level);
+
+    if (parsing_state->event_log) {
+	if (!match || empty_match)
+	    parsing_state->event_log->setLevel (step.event_level);
+	else
+	if (step.parsing_step_type == ParsingStep::t_Compound ||
+	    step.parsing_step_type == ParsingStep::t_Precedence)
+	{
+	    parsing_state->event_log->addPhraseEnd (step.grammar);
+	}
+    }
+
+    if (negative_cache_update) {
+	if (!match || empty_match) {
+	    for (Size i = 0; i < step.go_right_count; i++) {
+		DEBUG_NEGC (
+                  errs->println (_func, "go left");
+		)
+		parsing_state->negative_cache.goLeft ();
+	    }
+	} else {
+	    if (parsing_state->step_list.getFirst() != parsing_state->step_list.getLast()) {
+		ParsingStep &prv_step = *(parsing_state->step_list.getPrevious (parsing_state->step_list.getLast()));
+		prv_step.go_right_count += step.go_right_count;
+	    }
+	}
+
+	if (!match /* TEST && !empty_match */) {
+	    DEBUG_NEGC (
+              errs->println (_func, "adding negative ", step.grammar->toString ());
 	    )
+	    parsing_state->negative_cache.addNegative (step.grammar);
+	}
+    }
 
-	    return Result::Success;
-	} while (0);
+    if (match && !empty_match) {
+	GrammarProfile * const profile = parsing_state->parser_config->profile.ptr ();
+	if (profile && step.parsing_step_type == ParsingStep::t_Compound) {
+	  // Compound steps with 'lr_parent' set are alternatives
+	  // pushed by their parent switch steps.
+	    ParsingStep_Compound &compound_step = static_cast <ParsingStep_Compound&> (step);
+	    if (compound_step.lr_parent)
+		profile->addHit (compound_step.lr_parent, compound_step.grammar);
+	}
     }
-#endif
 
-    if (step->optional) {
-	if (step->grammar->accept_func != NULL) {
-	    step->grammar->accept_func (NULL,
-					parsing_state,
-					parsing_state->user_data);
+    parsing_state->match = match;
+    parsing_state->empty_match = empty_match;
+
+    parsing_state->nest_level --;
+    {
+	ParsingStep * const tmp_step = parsing_state->step_list.getLast();
+	VStack::Level const tmp_level = tmp_step->vstack_level;
+	VStack::Level const tmp_el_level = tmp_step->el_level;
+
+	parsing_state->step_list.remove (tmp_step);
+
+	if (tmp_step->parsing_step_type == ParsingStep::t_Precedence) {
+	  // Pending records are left when the step is unwound by
+	  // ParsingState::setPosition().
+	    ParsingStep_Precedence * const precedence_step = static_cast <ParsingStep_Precedence*> (tmp_step);
+	    while (precedence_step->top_record) {
+		ParsingStep_Precedence::Record * const record = precedence_step->top_record;
+		precedence_step->top_record = record->prv;
+		record->~Record ();
+	    }
 	}
 
-	if (!pop_step (parsing_state, true /* mach */, true /* empty_match */))
-            return Result::Failure;
+	tmp_step->~ParsingStep ();
+
+#if 0
+        errs->println ("--- step_list removed: "
+                       "f 0x", fmt_hex, (UintPtr) parsing_state->step_list.getFirst(),
+                       ", l 0x", (UintPtr) parsing_state->step_list.getLast(),
+                       ", fe 0x", fmt_hex, (UintPtr) parsing_state->step_list.first,
+                       ", le 0x", (UintPtr) parsing_state->step_list.last);
+#endif
+
+	parsing_state->step_vstack.setLevel (tmp_level);
+
+	if (!match)
+	    parsing_state->el_vstack->setLevel (tmp_el_level);
+    }
+
+    parsing_state->cur_direction = ParsingState<TokenStreamT>::Down;
+
+    if (match) {
+	if (parsing_state->lookup_data)
+	    parsing_state->lookup_data->commitCheckpoint ();
     } else {
-	if (!pop_step (parsing_state, false /* mach */, false /* empty_match */))
-            return Result::Failure;
+	if (parsing_state->lookup_data)
+	    parsing_state->lookup_data->cancelCheckpoint ();
     }
 
     return Result::Success;
 }
 
-static mt_throws Result
-parse_compound_match (ParsingState         * const mt_nonnull parsing_state,
-		      ParsingStep_Compound * const mt_nonnull step,
-		      bool                   const empty_match)
+// Most compound steps fail on their first token. Their parser elements are
+// created only when the first subelement is assigned (see assign_subel()),
+// or when the element is needed by a callback or by the end of the step.
+template <class TokenStreamT>
+static ParserElement*
+get_compound_element (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		      ParsingStep_Compound       * const mt_nonnull step)
 {
-    assert (parsing_state && step);
+    if (!step->parser_element) {
+	step->parser_element =
+		static_cast <Grammar_Compound*> (step->grammar)->createParserElement (parsing_state->el_vstack);
+    }
 
-    if (!empty_match)
-	step->got_nonoptional_match = true;
+    return step->parser_element;
+}
 
-    while (!step->jump_performed &&
-	   step->cur_subg_el != NULL)
-    {
-	CompoundGrammarEntry &entry = *step->cur_subg_el->data;
-	step->cur_subg_el = step->cur_subg_el->next;
+template <class TokenStreamT>
+static void
+assign_subel (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+	      SubelTarget const          &target,
+	      ParserElement              * const parser_element)
+{
+    if (target.record_subel)
+	*target.record_subel = parser_element;
 
-	if (entry.is_jump) {
-	    step->got_jump = true;
-	    step->jump_grammar = entry.jump_grammar;
-	    step->jump_cb = entry.jump_cb;
+    // Assignment functions ignore null subelements, hence there's
+    // no reason to create the compound element for them.
+    if (target.entry->assignment_func == NULL || !parser_element)
+	return;
 
-	    assert (entry.jump_grammar->grammar_type == Grammar::t_Switch);
-	    Grammar_Switch * const grammar__switch = static_cast <Grammar_Switch*> (entry.jump_grammar);
+    target.entry->assignment_func (get_compound_element (parsing_state, target.compound_step), parser_element);
+}
 
-	    if (entry.jump_switch_grammar_entry == NULL) {
-		entry.jump_switch_grammar_entry =
-			grammar__switch->grammar_entries.getIthElement (entry.jump_switch_grammar_index);
-	    }
-	    step->jump_switch_grammar_entry = entry.jump_switch_grammar_entry;
+// Hands the element parsed by 'step' over to the parent.
+template <class TokenStreamT>
+static void
+accept_element (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		ParsingStep                * const mt_nonnull step,
+		ParserElement              * const parser_element)
+{
+    if (step->subel_target.compound_step) {
+	assign_subel (parsing_state, step->subel_target, parser_element);
+	return;
+    }
 
-	    SwitchGrammarEntry * const switch_ge = entry.jump_switch_grammar_entry->data;
-	    assert (switch_ge->grammar->grammar_type == Grammar::t_Compound);
-	    Grammar_Compound * const grammar__compound = static_cast <Grammar_Compound*> (switch_ge->grammar.ptr ());
+    if (step->acceptor)
+	step->acceptor->setParserElement (parser_element);
+}
 
-	    if (entry.jump_compound_grammar_entry == NULL &&
-		grammar__compound->grammar_entries.getNumElements () != entry.jump_compound_grammar_index)
-	    {
-		entry.jump_compound_grammar_entry =
-			grammar__compound->grammar_entries.getIthElement (entry.jump_compound_grammar_index);
-	    }
-	    step->jump_compound_grammar_entry = entry.jump_compound_grammar_entry;
+// Steps which have been pushed since the previous token was read begin
+// with the current token. Steps below them have got their beginnings
+// already. Used with ParserConfig::source_spans only.
+template <class TokenStreamT>
+static void
+record_span_begin (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		   FileSize                     const token_begin)
+{
+    ParsingStep *step = parsing_state->step_list.getLast ();
+    while (step && !step->got_span_begin) {
+	step->span_begin = token_begin;
+	step->got_span_begin = true;
+	step = parsing_state->step_list.getPrevious (step);
+    }
+}
 
-	    continue;
-	}
+// The current position is right after the last token which has been
+// accepted.
+template <class TokenStreamT>
+static FileSize
+get_span_end (ParsingState<TokenStreamT> * const mt_nonnull parsing_state)
+{
+    TokenStream::PositionMarker pmark;
+    pmark.body.offset = 0;
+    parsing_state->streamGetPosition (&pmark);
+    return pmark.body.offset;
+}
 
-	if (entry.inline_match_func != NULL) {
-	    DEBUG_CB (
-              errs->println (_func, "calling intermediate accept_func()");
-	    )
-	    // Note: This is the only place where inline match functions are called.
-// Deprecated	    entry.accept_func (step->parser_element, parsing_state, parsing_state->user_data);
-	    if (!entry.inline_match_func (step->parser_element, parsing_state, parsing_state->user_data)) {
-	      // Inline match has failed, so we have no match for the current
-	      // compound grammar.
-		return parse_compound_no_match (parsing_state, step);
-	    }
+template <class TokenStreamT>
+static void
+set_element_span (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		  ParsingStep                * const mt_nonnull step,
+		  ParserElement              * const mt_nonnull parser_element)
+{
+    FileSize const span_end = get_span_end (parsing_state);
 
-	    continue;
-	}
+    // If the first token has been given back, then the step is empty.
+    parser_element->span_begin =
+	    (step->got_span_begin && step->span_begin <= span_end ? step->span_begin : span_end);
+    parser_element->span_end = span_end;
+}
 
-	if (entry.flags & CompoundGrammarEntry::Sequence) {
-	    DEBUG_INT (
-	      errs->println (_func, "sequence");
-	    )
+// With ParserConfig::deferred_actions, calls are logged and made once
+// the parse is complete (see ActionLog).
+template <class TokenStreamT>
+static void
+call_accept_func (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		  Grammar                    * const mt_nonnull grammar,
+		  ParserElement              * const parser_element)
+{
+    if (parsing_state->action_log) {
+	parsing_state->action_log->addAccept (grammar, parser_element);
+	return;
+    }
 
-	    VStack::Level const tmp_vstack_level = parsing_state->step_vstack.getLevel ();
-	    VStack::Level const tmp_el_level = parsing_state->el_vstack->getLevel ();
-	    ParsingStep_Sequence * const new_step =
-		    new (parsing_state->step_vstack.push_malign (
-                                        sizeof (ParsingStep_Sequence), alignof (ParsingStep_Sequence)))
-                                ParsingStep_Sequence;
-	    new_step->vstack_level = tmp_vstack_level;
-	    new_step->el_level = tmp_el_level;
-	    new_step->acceptor = entry.createAcceptorFor (step->parser_element);
-	    new_step->optional = entry.flags & CompoundGrammarEntry::Optional;
-	    new_step->grammar = entry.grammar;
+    grammar->accept_func (parser_element, parsing_state, parsing_state->user_data);
+}
 
-// TODO Do not create a new checkpoint for sequence steps, _and_ do not
-// commit/cancel the checkpoint in pop_step() accordingly.
-//	    push_step (parsing_state, new_step, false /* new_checkpoint */);
-	    push_step (parsing_state, new_step);
-	    return Result::Success;
-	} else {
-	    DEBUG_INT (
-                errs->println (_func, "not a sequence");
-	    )
+template <class TokenStreamT>
+static void
+call_begin_func (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		 Grammar                    * const mt_nonnull grammar)
+{
+    if (parsing_state->action_log) {
+	parsing_state->action_log->addBegin (grammar);
+	return;
+    }
 
-	    {
-                DEBUG_INT (
-                  errs->println (_func, "creating acceptor");
-                )
-                VSlabRef<Acceptor> acceptor = entry.createAcceptorFor (step->parser_element);
-                DEBUG_INT (
-                  errs->println (_func, "0x", fmt_hex, (Uint64) (Acceptor*) acceptor);
-                )
-                ParsingResult pres;
-                if (!parse_grammar (parsing_state,
-                                    entry.grammar,
-                                    acceptor,
-                                    entry.flags & CompoundGrammarEntry::Optional,
-                                    &pres))
-                {
-                    return Result::Failure;
-                }
+    grammar->begin_func (parsing_state->user_data);
+}
 
-                if (pres == ParseNonemptyMatch) {
-                    step->got_nonoptional_match = true;
-                    continue;
-                }
+// Returns 'true' (@ret_res) if we have a match, 'false otherwise.
+template <class TokenStreamT>
+static mt_throws Result
+parse_Immediate (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		 Grammar_Immediate          * const mt_nonnull grammar,
+		 Acceptor                   * const acceptor,
+		 SubelTarget const          * const subel_target,
+                 bool                       * const mt_nonnull ret_res)
+{
+    DEBUG_FLO (
+      errs->println (_func_);
+    );
 
-                if (pres == ParseEmptyMatch && (entry.flags & CompoundGrammarEntry::Optional))
-                    continue;
+    assert (parsing_state);
 
-                if (pres == ParseNoMatch)
-                    return parse_compound_no_match (parsing_state, step);
-                else
-                    assert (pres == ParseUp);
+    typename ParsingState<TokenStreamT>::StreamPosition pmark;
+    parsing_state->streamGetPosition (&pmark);
 
-                DEBUG_INT (
-                  errs->println (_func, "leaving test scope");
-                )
-	    }
-	    DEBUG_INT (
-              errs->println (_func, "left test scope");
-	    )
+    StRef<StReferenced> user_obj;
+    void *user_ptr;
+    ConstMemory token;
+    if (!parsing_state->streamGetNextToken (&token, &user_obj, &user_ptr))
+        return Result::Failure;
+    if (token.len() == 0) {
+	if (!parsing_state->streamSetPosition (&pmark))
+            return Result::Failure;
 
-	    return Result::Success;
-	}
+	DEBUG (
+          errs->println (_func, "no token");
+	)
+        *ret_res = false;
+        return Result::Success;
     }
 
-  // We have parsed all subgrammars.
+    FileSize token_begin = 0;
+    FileSize token_end   = 0;
+    if (parsing_state->parser_config->source_spans) {
+	parsing_state->token_stream->getTokenSpan (&token_begin, &token_end);
+	record_span_begin (parsing_state, token_begin);
+    }
 
-    bool user_match = true;
-// TODO FIXME (explain)
-//    if (!empty_match) {
-	if (!step->jump_performed &&
-	    step->grammar->match_func != NULL)
+    DEBUG_PAR (
+      if (parsing_state->debug_dump)
+          errs->println (_func, "token: ", token);
+    )
+
+    DEBUG_INT (
+      errs->println (_func, "token: ", token);
+    )
+
+    bool match;
+    {
+	Grammar_Immediate_SingleToken * const grammar__single_token =
+		static_cast <Grammar_Immediate_SingleToken*> (grammar);
+	if (parsing_state->classify_token
+	    && grammar__single_token->token_id != 0
+	    && !grammar__single_token->token_dfa
+	    && !grammar__single_token->token_match_cb)
 	{
-	    DEBUG_CB (
-              errs->println (_func, "calling match_func()");
-	    )
-	    if (!step->grammar->match_func (step->parser_element, parsing_state, parsing_state->user_data))
-		user_match = false;
+	    match = (parsing_state->getTokenId (token) == grammar__single_token->token_id);
+	} else
+	if (grammar__single_token->token_match_cb_pure
+	    && grammar__single_token->token_match_cb
+	    && !grammar__single_token->token_dfa)
+	{
+	    match = parsing_state->matchPureCb (grammar__single_token->token_match_cb, token, user_ptr);
+	} else {
+	    match = grammar->match (token, user_ptr, parsing_state->user_data);
 	}
-//    }
+    }
+
+    if (!match) {
+	if (!parsing_state->streamSetPosition (&pmark))
+            return Result::Failure;
 
-    if (user_match) {
 	DEBUG_INT (
-          errs->println (_func, "match_func() returned true");
+          errs->println (_func, "!grammar->match()");
 	)
 
-	if (!step->jump_performed) {
-	    if (step->grammar->accept_func != NULL) {
-		DEBUG_CB (
-                  errs->println (_func, "calling accept_func()");
-		)
-		step->grammar->accept_func (step->parser_element,
-					    parsing_state,
-					    parsing_state->user_data);
-	    }
+        *ret_res = false;
+        return Result::Success;
+    }
 
-// TODO FIXME (explain)
-//	    if (!empty_match)
-	    if (step->acceptor) {
-		DEBUG (
-                  errs->println (_func, "calling setParserElement(): "
-                                 "0x", fmt_hex, (Uint64) step->parser_element);
+    // Tokens from the stream's stable memory are referenced directly.
+    bool const token_stable =
+            parsing_state->stable_mem.len() > 0
+            && token.mem() >= parsing_state->stable_mem.mem()
+            && token.mem() + token.len() <= parsing_state->stable_mem.mem() + parsing_state->stable_mem.len();
+
+    // Note: This is a strange condition...
+    if (acceptor || subel_target) {
+	ConstMemory el_token = token;
+	if (!token_stable) {
+	    Byte * const el_token_buf = parsing_state->el_vstack->push_unaligned (token.len());
+	    memcpy (el_token_buf, token.mem(), token.len());
+	    el_token = ConstMemory (el_token_buf, token.len());
+	}
+
+	ParserElement * const parser_element =
+		new (parsing_state->el_vstack->push_malign (
+                                    sizeof (ParserElement_Token), alignof (ParserElement_Token)))
+                            ParserElement_Token (el_token, user_ptr);
+	parser_element->span_begin = token_begin;
+	parser_element->span_end   = token_end;
+
+	// TODO I think that match_func() and accept_func() should be called
+	// regardless of whether 'acceptor' is NULL or not.
+	if (grammar->match_func != NULL) {
+	    DEBUG_CB (
+              errs->println (_func, "calling match_func()");
+	    )
+	    if (!grammar->match_func (parser_element, parsing_state, parsing_state->user_data)) {
+		if (!parsing_state->streamSetPosition (&pmark))
+                    return Result::Failure;
+
+		DEBUG_INT (
+                  errs->println (_func, "match_func() returned false");
 		)
-		step->acceptor->setParserElement (step->parser_element);
+                *ret_res = false;
+                return Result::Success;
 	    }
+
+	    DEBUG_INT (
+              errs->println (_func, "match_func() returned true");
+	    )
+	} else {
+	    DEBUG_INT (
+              errs->println (_func, "no match_func()");
+	    )
+	}
+
+	if (grammar->accept_func != NULL) {
+	    DEBUG_CB (
+              errs->println (_func, "calling accept_func()");
+	    )
+	    call_accept_func (parsing_state, grammar, parser_element);
 	}
 
-	DEBUG (
-          errs->println (_func, "user_match");
-	)
-	if (!pop_step (parsing_state, true /* mach */, !step->got_nonoptional_match /* empty_match */))
-            return Result::Failure;
-    } else {
-	DEBUG_INT (
-          errs->println (_func, "match_func() returned false");
-	)
+	if (subel_target)
+	    assign_subel (parsing_state, *subel_target, parser_element);
+	else
+	    acceptor->setParserElement (parser_element);
+    }
+
+    if (parsing_state->event_log)
+        parsing_state->event_log->addToken (token, user_ptr, token_stable);
+
+    *ret_res = true;
+    return Result::Success;
+}
+
+enum ParsingResult {
+    ParseUp,
+    ParseNonemptyMatch,
+    ParseEmptyMatch,
+    ParseNoMatch
+};
+
+template <class TokenStreamT>
+static void
+push_compound_step (ParsingState<TokenStreamT> * const parsing_state,
+		    Grammar_Compound           * const grammar,
+#ifndef VSLAB_ACCEPTOR
+		    Acceptor                   * const acceptor,
+#else
+		    VSlabRef<Acceptor> const acceptor,
+#endif
+		    bool                         const optional,
+		    bool                         const got_nonoptional_match = false,
+		    Size                         const go_right_count = 0,
+		    bool                         const got_cur_subg_el = false,
+		    List< StRef<CompoundGrammarEntry> >::Element * const cur_subg_el = NULL,
+		    SubelTarget const * const subel_target = NULL)
+{
+    VStack::Level const tmp_vstack_level = parsing_state->step_vstack.getLevel ();
+    VStack::Level const tmp_el_level = parsing_state->el_vstack->getLevel ();
+    ParsingStep_Compound * const step =
+	    new (parsing_state->step_vstack.push_malign (
+                                sizeof (ParsingStep_Compound), alignof (ParsingStep_Compound)))
+                        ParsingStep_Compound;
+    step->vstack_level = tmp_vstack_level;
+    step->el_level = tmp_el_level;
+    step->acceptor = acceptor;
+    if (subel_target)
+	step->subel_target = *subel_target;
+    step->optional = optional;
+    step->grammar = grammar;
+    step->got_nonoptional_match = got_nonoptional_match;
+    step->go_right_count = go_right_count;
+
+    if (got_cur_subg_el)
+	step->cur_subg_el = cur_subg_el;
+    else
+	step->cur_subg_el = grammar->grammar_entries.first;
+
+    push_step (parsing_state, step);
+}
+
+template <class TokenStreamT>
+static void
+push_switch_step (ParsingState<TokenStreamT> * const parsing_state,
+		  Grammar_Switch             * const grammar,
+#ifndef VSLAB_ACCEPTOR
+		  Acceptor                   * const acceptor,
+#else
+		  VSlabRef<Acceptor>           const acceptor,
+#endif
+		  bool                         const optional,
+		  List< StRef<SwitchGrammarEntry> >::Element * const cur_subg_el = NULL,
+		  SubelTarget const          * const subel_target = NULL)
+{
+    VStack::Level const tmp_vstack_level = parsing_state->step_vstack.getLevel ();
+    VStack::Level const tmp_el_level = parsing_state->el_vstack->getLevel ();
+    ParsingStep_Switch * const step =
+	    new (parsing_state->step_vstack.push_malign (
+                                sizeof (ParsingStep_Switch), alignof (ParsingStep_Switch)))
+                        ParsingStep_Switch;
+    step->vstack_level = tmp_vstack_level;
+    step->el_level = tmp_el_level;
+    step->acceptor = acceptor;
+    if (subel_target)
+	step->subel_target = *subel_target;
+    step->optional = optional;
+    step->grammar = grammar;
+    step->state = ParsingStep_Switch::State_NLR;
+    step->got_empty_nlr_match = false;
+    step->got_nonempty_nlr_match = false;
+    step->got_lr_match = false;
+
+    if (cur_subg_el != NULL)
+	step->cur_nlr_el = cur_subg_el;
+    else
+	step->cur_nlr_el = grammar->grammar_entries.first;
+
+    // Prediction is single-token lookahead as well.
+    step->predict = (cur_subg_el == NULL                              &&
+		     grammar->predictive                              &&
+		     parsing_state->parser_config->forward_optimization);
+
+    step->cur_lr_el = NULL;
+
+    push_step (parsing_state, step);
+}
+
+template <class TokenStreamT>
+static mt_throws Result
+parse_grammar (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+	       Grammar                    * const mt_nonnull _grammar,
+// VSLAB ACCEPTOR	       Acceptor     *acceptor,
+	       VSlabRef<Acceptor>           const acceptor,
+	       bool                         const optional,
+               ParsingResult              * const mt_nonnull ret_res,
+	       SubelTarget const          * const subel_target = NULL)
+{
+    DEBUG_FLO (
+      errs->println (_func_);
+    );
+
+    assert (parsing_state && _grammar);
+
+    if (parsing_state->negative_cache.isNegative (_grammar)) {
+      // TODO At this point, we have already checked that the grammar is
+      // in negative cache for the current token. But we'll test for this
+      // again in pop_step(), which could be avoided if we remembered the result
+      // of the lookup that we've just made.
+
+	DEBUG_NEGC (
+          errs->println (_func, "negative ", _grammar->toString ());
+	)
+
+	if (optional) {
+#if 0
+	  // FIXME: This looks strange. Why don't we expect this to be called
+	  // in parse_Immediate()? This calls seems to be excessive.
+	    if (_grammar->accept_func != NULL) {
+		call_accept_func (parsing_state, _grammar, NULL);
+	    }
+#endif
+
+	    *ret_res = ParseEmptyMatch;
+            return Result::Success;
+	}
+
+	*ret_res = ParseNoMatch;
+        return Result::Success;
+    }
+
+    switch (_grammar->grammar_type) {
+	case Grammar::t_Immediate: {
+	    DEBUG_INT (
+	      errs->println (_func, "Grammar::_Immediate");
+	    )
+
+            bool match;
+	    if (!parse_Immediate (parsing_state,
+                                  static_cast <Grammar_Immediate*> (_grammar),
+                                  acceptor,
+                                  subel_target,
+                                  &match))
+            {
+                return Result::Failure;
+            }
+
+	    if (match) {
+		{
+		  // Updating negative cache state (moving right)
+
+		    DEBUG_NEGC (
+                      errs->println (_func, "go right");
+		    )
+		    parsing_state->negative_cache.goRight ();
+
+		    if (!parsing_state->step_list.isEmpty()) {
+			ParsingStep * const step = parsing_state->step_list.getLast();
+			step->go_right_count ++;
+		    }
+		}
+
+		*ret_res = ParseNonemptyMatch;
+                return Result::Success;
+	    }
+
+	    if (optional) {
+	      // FIXME: This looks strange. Why don't we expect this to be called
+	      // in parse_Immediate()? This call seems to be excessive.
+
+		assert (!match);
+		if (_grammar->accept_func != NULL) {
+		    call_accept_func (parsing_state, _grammar, NULL);
+		}
+
+		*ret_res = ParseEmptyMatch;
+                return Result::Success;
+	    }
+
+	    *ret_res = ParseNoMatch;
+            return Result::Success;
+	} break;
+
+	case Grammar::t_Compound: {
+	    DEBUG_INT (
+	      errs->println (_func, "Grammar::_Compound");
+	    )
+
+	    Grammar_Compound * const grammar = static_cast <Grammar_Compound*> (_grammar);
+
+	    push_compound_step (parsing_state,
+				grammar,
+				acceptor,
+				optional,
+				false /* got_nonoptional_match */,
+				0     /* go_right_count */,
+				false /* got_cur_subg_el */,
+				NULL  /* cur_subg_el */,
+				subel_target);
+	} break;
+
+	case Grammar::t_Switch: {
+	    DEBUG_INT (
+	      errs->println (_func, "Grammar::_Switch");
+	    )
+
+	    Grammar_Switch * const grammar = static_cast <Grammar_Switch*> (_grammar);
+
+	    push_switch_step (parsing_state, grammar, acceptor, optional, NULL /* cur_subg_el */, subel_target);
+	} break;
+
+	case Grammar::t_Alias: {
+	    DEBUG_INT (
+		errs->print (_func, "Grammar::_Alias");
+	    )
+
+	    Grammar_Alias * const grammar = static_cast <Grammar_Alias*> (_grammar);
+
+	    VStack::Level const tmp_vstack_level = parsing_state->step_vstack.getLevel ();
+	    VStack::Level const tmp_el_level = parsing_state->el_vstack->getLevel ();
+
+	    ParsingStep_Alias * const step =
+		    new (parsing_state->step_vstack.push_malign (
+                                        sizeof (ParsingStep_Alias), alignof (ParsingStep_Alias)))
+                                ParsingStep_Alias;
+	    step->vstack_level = tmp_vstack_level;
+	    step->el_level = tmp_el_level;
+	    step->acceptor = acceptor;
+	    if (subel_target)
+		step->subel_target = *subel_target;
+	    step->optional = optional;
+	    step->grammar = grammar;
+
+	    push_step (parsing_state, step);
+	} break;
+
+	case Grammar::t_Precedence: {
+	    DEBUG_INT (
+		errs->print (_func, "Grammar::_Precedence");
+	    )
+
+	    VStack::Level const tmp_vstack_level = parsing_state->step_vstack.getLevel ();
+	    VStack::Level const tmp_el_level = parsing_state->el_vstack->getLevel ();
+
+	    ParsingStep_Precedence * const step =
+		    new (parsing_state->step_vstack.push_malign (
+                                        sizeof (ParsingStep_Precedence), alignof (ParsingStep_Precedence)))
+                                ParsingStep_Precedence;
+	    step->vstack_level = tmp_vstack_level;
+	    step->el_level = tmp_el_level;
+	    step->acceptor = acceptor;
+	    if (subel_target)
+		step->subel_target = *subel_target;
+	    step->optional = optional;
+	    step->grammar = _grammar;
+
+	    push_step (parsing_state, step);
+	} break;
+
+	default:
+            unreachable ();
+    }
+
+    *ret_res = ParseUp;
+    return Result::Success;
+}
+
+// Returns 'true' if none of the steps below @top (all steps if @top is NULL)
+// can make the parser go back to a position which precedes the current one.
+// A failure of such steps fails the whole parse.
+template <class TokenStreamT>
+static bool
+is_committed_stack (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		    ParsingStep                * const top)
+{
+    ParsingStep *cur_step = parsing_state->step_list.getFirst();
+    while (cur_step && cur_step != top) {
+	if (cur_step->optional)
+	    return false;
+
+	switch (cur_step->parsing_step_type) {
+	    case ParsingStep::t_Compound: {
+		ParsingStep_Compound * const compound_step = static_cast <ParsingStep_Compound*> (cur_step);
+		// An undone tail iteration goes back to its beginning.
+		if (compound_step->tail_depth > 0)
+		    return false;
+
+		if (parsing_state->parser_config->upwards_jumps &&
+		    compound_step->got_jump                     &&
+		    !compound_step->jump_performed)
+		{
+		    return false;
+		}
+	    } break;
+	    case ParsingStep::t_Alias:
+		break;
+	    default:
+	      // Switches may try other alternatives, sequences and precedence
+	      // steps may give back their last item or operand.
+		return false;
+	}
+
+	cur_step = parsing_state->step_list.getNext (cur_step);
+    }
+
+    return true;
+}
+
+// Returns 'true' if completed items of a sequence which is about to be pushed
+// can be committed, i.e. when none of the steps on the stack can make
+// the parser go back (see is_committed_stack()). Such sequences are called
+// "top-level".
+template <class TokenStreamT>
+static bool
+is_top_level_sequence (ParsingState<TokenStreamT> * const mt_nonnull parsing_state)
+{
+    if (!parsing_state->event_log && !parsing_state->item_func)
+	return false;
+
+    return is_committed_stack (parsing_state, NULL /* top */);
+}
+
+// Called when an item of a top-level sequence is complete. This is a commit
+// point: the parser will never backtrack into the item, so we deliver
+// the item to the user and release its parser elements.
+template <class TokenStreamT>
+static void
+commit_sequence_item (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		      ParsingStep_Sequence       * const mt_nonnull step)
+{
+    ++parsing_state->commit_count;
+
+    if (parsing_state->event_log)
+	parsing_state->event_log->flush (parsing_state->event_handler, parsing_state->user_data);
+
+    // Elements of the item are about to be released.
+    if (parsing_state->action_log)
+	parsing_state->action_log->replay (parsing_state->user_data);
+
+    if (parsing_state->item_func) {
+	List<ParserElement*>::DataIterator parser_el_iter (step->parser_elements);
+	while (!parser_el_iter.done ()) {
+	    DEBUG_CB (
+              errs->println (_func, "calling item_func()");
+	    )
+	    parsing_state->item_func (parser_el_iter.next (), parsing_state, parsing_state->user_data);
+	}
+    }
+
+    step->num_released += step->parser_elements.getNumElements ();
+    step->parser_elements.clear ();
+    parsing_state->el_vstack->setLevel (step->el_level);
+
+    parsing_state->negative_cache.cut ();
+}
+
+template <class TokenStreamT>
+static mt_throws Result
+parse_sequence_no_match (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+			 ParsingStep_Sequence       * const mt_nonnull step)
+{
+    DEBUG_FLO (
+      errs->println (_func_);
+    )
+
+    assert (parsing_state && step);
+
+    if (!step->parser_elements.isEmpty () || step->num_released > 0) {
+	List<ParserElement*>::DataIterator parser_el_iter (step->parser_elements);
+	while (!parser_el_iter.done ()) {
+	    DEBUG_INT (
+	      errs->println (_func, "accepting element");
+	    )
+
+	    accept_element (parsing_state, step, parser_el_iter.next ());
+	}
+
+	DEBUG (
+          errs->println (_func, "non-empty list");
+	)
+	if (!pop_step (parsing_state, true /* match */, false /* empty_match */))
+            return Result::Failure;
+    } else {
+	if (step->optional) {
+	    if (!pop_step (parsing_state, true /* match */, true /* empty_match */))
+                return Result::Failure;
+        } else {
+            if (!pop_step (parsing_state, false /* match */, false /* empty_match */))
+                return Result::Failure;
+        }
+    }
+
+    return Result::Success;
+}
+
+// @item_done is 'true' if we've just got one more item for the sequence.
+template <class TokenStreamT>
+static mt_throws Result
+parse_sequence_match (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		      ParsingStep_Sequence       * const mt_nonnull step,
+		      bool                         item_done)
+{
+    assert (parsing_state && step);
+
+    VSlabRef< ListAcceptor<ParserElement> > const acceptor =
+	    VSlabRef< ListAcceptor<ParserElement> >::forRef < ListAcceptor<ParserElement> > (
+		    parsing_state->list_acceptor_slab.alloc ());
+    acceptor->init (&step->parser_elements);
+    for (;;) {
+	if (item_done && step->top_level)
+	    commit_sequence_item (parsing_state, step);
+
+	ParsingResult pres;
+        if (!parse_grammar (parsing_state, step->grammar, acceptor, false /* optional */, &pres))
+            return Result::Failure;
+
+	if (pres == ParseNonemptyMatch) {
+	    item_done = true;
+	    continue;
+	}
+
+	if (pres == ParseEmptyMatch ||
+	    pres == ParseNoMatch)
+	{
+	    if (!parse_sequence_no_match (parsing_state, step))
+                return Result::Failure;
+	} else {
+	    assert (pres == ParseUp);
+        }
+
+	break;
+    }
+
+    return Result::Success;
+}
+
+template <class TokenStreamT>
+static bool
+is_cur_variant (ParsingState<TokenStreamT> * mt_nonnull parsing_state,
+		SwitchGrammarEntry         * mt_nonnull entry);
+
+template <class TokenStreamT>
+static mt_throws Result
+parse_compound_match (ParsingState<TokenStreamT> * mt_nonnull parsing_state,
+		      ParsingStep_Compound       * mt_nonnull step,
+		      bool                         empty_match);
+
+// Saves the state of the parser once the prefix which 'step' shares
+// with the next entry of the parent switch has been matched.
+template <class TokenStreamT>
+static void
+mark_shared_prefix (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		    ParsingStep_Compound       * const mt_nonnull step)
+{
+    if (step->shared_prefix_len == 0 ||
+	step->prefix_marked          ||
+	step->subg_index != step->shared_prefix_len)
+    {
+	return;
+    }
+
+    parsing_state->streamGetPosition (&step->prefix_token_pos);
+    step->prefix_go_right_count = step->go_right_count;
+    step->prefix_el_level = parsing_state->el_vstack->getLevel ();
+    if (parsing_state->event_log)
+	step->prefix_event_level = parsing_state->event_log->getLevel ();
+    if (parsing_state->action_log)
+	step->prefix_action_level = parsing_state->action_log->getLevel ();
+    step->prefix_got_nonoptional_match = step->got_nonoptional_match;
+    step->prefix_marked = true;
+}
+
+// Without the action log, callbacks are made as the parser goes. Handing
+// over the prefix would then skip the calls which the next entry makes
+// before and while matching the prefix anew: begin_func() of the entries'
+// grammars and the calls for the prefix subgrammars.
+static bool
+is_shared_prefix_callback_free (ParsingStep_Compound * const mt_nonnull step,
+				SwitchGrammarEntry   * const mt_nonnull next_entry)
+{
+    if (step->grammar->begin_func || next_entry->grammar->begin_func)
+	return false;
+
+    List< StRef<CompoundGrammarEntry> >::Element *subg_el =
+	    static_cast <Grammar_Compound*> (next_entry->grammar.ptr ())->grammar_entries.first;
+    for (Size i = 0; i < step->shared_prefix_len; ++i) {
+	assert (subg_el);
+	Grammar * const subg = subg_el->data->grammar;
+	if (subg->begin_func || subg->accept_func)
+	    return false;
+
+	subg_el = subg_el->next;
+    }
+
+    return true;
+}
+
+// Left factoring: 'step' has failed after the prefix which it shares
+// with the next entry of the parent switch has been matched. Instead of
+// failing, the step is turned into a step for the next entry, with
+// the prefix already matched. Sets @ret_done to 'true' if that's the case.
+//
+// Without the action log, grammars with callbacks are not handed over
+// (see is_shared_prefix_callback_free()). Lookup data is not supported:
+// changes made by the failed part of the step can't be cancelled separately.
+template <class TokenStreamT>
+static mt_throws Result
+hand_over_shared_prefix (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+			 ParsingStep_Compound       * const mt_nonnull step,
+			 bool                       * const mt_nonnull ret_done)
+{
+    *ret_done = false;
+
+    if (!step->prefix_marked             ||
+	parsing_state->lookup_data       ||
+	step->cut_passed)
+    {
+	return Result::Success;
+    }
+
+    ParsingStep * const prv_step = parsing_state->step_list.getPrevious (step);
+    assert (prv_step && prv_step->parsing_step_type == ParsingStep::t_Switch);
+    ParsingStep_Switch * const switch_step = static_cast <ParsingStep_Switch*> (prv_step);
+    if (switch_step->state != ParsingStep_Switch::State_NLR ||
+	switch_step->predicted)
+    {
+	return Result::Success;
+    }
+
+    List< StRef<SwitchGrammarEntry> >::Element * const next_el = step->switch_entry_el->next;
+    assert (next_el);
+    SwitchGrammarEntry * const next_entry = next_el->data;
+    assert (next_entry->grammar->grammar_type == Grammar::t_Compound);
+    if (!is_cur_variant (parsing_state, next_entry))
+	return Result::Success;
+
+    if (parsing_state->action_log) {
+	if (!parsing_state->action_log->isPending (step->action_level))
+	    return Result::Success;
+    } else
+    if (!is_shared_prefix_callback_free (step, next_entry)) {
+	return Result::Success;
+    }
+
+    if (parsing_state->event_log) {
+	if (!parsing_state->event_log->replacePhraseBegin (step->event_level, next_entry->grammar))
+	    return Result::Success;
+    }
+
+    DEBUG_INT (
+      errs->println (_func, "handing over to ", next_entry->grammar->toString ());
+    )
+
+    if (!parsing_state->streamSetPosition (&step->prefix_token_pos))
+	return Result::Failure;
+
+    for (Size i = step->prefix_go_right_count; i < step->go_right_count; ++i)
+	parsing_state->negative_cache.goLeft ();
+    step->go_right_count = step->prefix_go_right_count;
+
+    if (parsing_state->event_log)
+	parsing_state->event_log->setLevel (step->prefix_event_level);
+
+    if (parsing_state->action_log)
+	parsing_state->action_log->setLevel (step->prefix_action_level);
+
+    parsing_state->el_vstack->setLevel (step->prefix_el_level);
+
+    Grammar_Compound * const grammar = static_cast <Grammar_Compound*> (next_entry->grammar.ptr ());
+
+    // The logged begin_func() call is replaced in place, so that it still
+    // precedes the calls for the prefix.
+    if (parsing_state->action_log) {
+	parsing_state->action_log->replaceBegin (step->action_level, step->grammar, grammar);
+	step->prefix_action_level = parsing_state->action_log->getLevel ();
+    }
+
+    step->grammar = grammar;
+    step->parser_element = NULL;
+    step->got_nonoptional_match = step->prefix_got_nonoptional_match;
+    step->got_jump = false;
+    step->jump_performed = false;
+
+    List< StRef<CompoundGrammarEntry> >::Element *subg_el = grammar->grammar_entries.first;
+    for (Size i = 0; i < step->shared_prefix_len; ++i) {
+	assert (subg_el);
+	CompoundGrammarEntry * const subg_entry = subg_el->data;
+	if (subg_entry->assignment_func && step->prefix_subels [i])
+	    subg_entry->assignment_func (get_compound_element (parsing_state, step), step->prefix_subels [i]);
+
+	subg_el = subg_el->next;
+    }
+    step->cur_subg_el = subg_el;
+
+    step->switch_entry_el = next_el;
+    switch_step->cur_nlr_el = next_el->next;
+
+    // The new prefix is matched already if it's the same length.
+    // If it's shorter, then the state for it is lost.
+    if (next_entry->shared_prefix_len < step->shared_prefix_len) {
+	step->shared_prefix_len = 0;
+	step->prefix_marked = false;
+    } else
+    if (next_entry->shared_prefix_len > step->shared_prefix_len) {
+	step->shared_prefix_len = next_entry->shared_prefix_len;
+	step->prefix_marked = false;
+    }
+
+    *ret_done = true;
+    return parse_compound_match (parsing_state, step, true /* empty_match */);
+}
+
+// Drops the current tail iteration of 'step', which didn't match.
+// The previous iteration becomes the last one, with an empty tail.
+template <class TokenStreamT>
+static mt_throws Result
+undo_tail_iteration (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		     ParsingStep_Compound       * const mt_nonnull step)
+{
+    assert (step->tail_depth > 0);
+
+    if (!parsing_state->streamSetPosition (&step->tail_token_pos))
+	return Result::Failure;
+
+    for (Size i = step->tail_go_right_count; i < step->go_right_count; ++i)
+	parsing_state->negative_cache.goLeft ();
+    step->go_right_count = step->tail_go_right_count;
+
+    if (parsing_state->event_log)
+	parsing_state->event_log->setLevel (step->tail_event_level);
+
+    if (parsing_state->action_log)
+	parsing_state->action_log->setLevel (step->tail_action_level);
+
+    if (step->tail_span_link) {
+      // The previous iteration becomes the current one again.
+	TailSpanLink * const link = step->tail_span_link;
+	step->span_begin = link->parser_element->span_begin;
+	step->got_span_begin = true;
+	step->tail_span_link = link->prv;
+    }
+
+    parsing_state->el_vstack->setLevel (step->tail_el_level);
+
+    if (parsing_state->lookup_data)
+	parsing_state->lookup_data->cancelCheckpoint ();
+
+    parsing_state->negative_cache.addNegative (step->grammar);
+
+    step->parser_element = step->tail_prv_element;
+    step->got_nonoptional_match = step->tail_got_nonoptional_match;
+    step->cut_passed = step->tail_cut_passed;
+    step->cur_subg_el = NULL;
+    --step->tail_depth;
+
+    return Result::Success;
+}
+
+// Called instead of parsing the tail self-reference of a grammar with
+// Grammar_Compound::tail_iteration set. Completes the current iteration
+// and begins the next one in the same step, like push_step() would do
+// for a nested step.
+template <class TokenStreamT>
+static mt_throws Result
+begin_tail_iteration (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		      ParsingStep_Compound       * const mt_nonnull step,
+		      CompoundGrammarEntry       * const mt_nonnull tail_entry)
+{
+    Grammar_Compound * const grammar = static_cast <Grammar_Compound*> (step->grammar);
+
+    if (step->tail_depth > 0) {
+	if (step->go_right_count == step->tail_go_right_count) {
+	  // Empty iterations would never end.
+	    return undo_tail_iteration (parsing_state, step);
+	}
+
+	if (tail_entry->assignment_func)
+	    tail_entry->assignment_func (step->tail_prv_element, get_compound_element (parsing_state, step));
+    }
+
+    if (parsing_state->negative_cache.isNegative (grammar))
+	return Result::Success;
+
+    parsing_state->streamGetPosition (&step->tail_token_pos);
+    step->tail_go_right_count = step->go_right_count;
+    step->tail_el_level = parsing_state->el_vstack->getLevel ();
+    step->tail_got_nonoptional_match = step->got_nonoptional_match;
+
+    // Each iteration is a nested phrase: a cut which has been passed
+    // in the current iteration doesn't apply to the next one.
+    step->tail_cut_passed = step->cut_passed;
+    step->cut_passed = false;
+
+    if (parsing_state->lookup_data)
+	parsing_state->lookup_data->newCheckpoint ();
+
+    if (parsing_state->action_log)
+	step->tail_action_level = parsing_state->action_log->getLevel ();
+
+    if (parsing_state->event_log) {
+	step->tail_event_level = parsing_state->event_log->getLevel ();
+	parsing_state->event_log->addPhraseBegin (grammar, step->tail_event_level);
+    }
+
+    if (grammar->begin_func != NULL)
+	call_begin_func (parsing_state, grammar);
+
+    if (step->tail_depth == 0)
+	step->tail_first_element = get_compound_element (parsing_state, step);
+
+    step->tail_prv_element = step->parser_element;
+    step->parser_element = grammar->createParserElement (parsing_state->el_vstack);
+
+    if (parsing_state->parser_config->source_spans) {
+	step->tail_prv_element->span_begin =
+		(step->got_span_begin ? step->span_begin : get_span_end (parsing_state));
+
+	TailSpanLink * const link =
+		new (parsing_state->el_vstack->push_malign (
+				     sizeof (TailSpanLink), alignof (TailSpanLink)))
+			     TailSpanLink;
+	link->parser_element = step->tail_prv_element;
+	link->prv = step->tail_span_link;
+	step->tail_span_link = link;
+
+	// The next iteration begins with the next token.
+	step->got_span_begin = false;
+    }
+
+    step->cur_subg_el = grammar->grammar_entries.first;
+    step->subg_index = 0;
+    step->got_nonoptional_match = false;
+    ++step->tail_depth;
+
+    return Result::Success;
+}
+
+// All iterations of 'step' are complete. Closes the nested phrases.
+template <class TokenStreamT>
+static void
+finish_tail_iterations (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+			ParsingStep_Compound       * const mt_nonnull step)
+{
+    if (step->tail_depth == 0)
+	return;
+
+    for (Size i = 0; i < step->tail_depth; ++i) {
+	if (parsing_state->event_log)
+	    parsing_state->event_log->addPhraseEnd (step->grammar);
+
+	if (parsing_state->lookup_data)
+	    parsing_state->lookup_data->commitCheckpoint ();
+    }
+
+    if (parsing_state->parser_config->source_spans) {
+      // Nested iterations end where the whole step ends.
+	set_element_span (parsing_state, step, step->parser_element);
+	for (TailSpanLink *link = step->tail_span_link; link; link = link->prv)
+	    link->parser_element->span_end = step->parser_element->span_end;
+	step->tail_span_link = NULL;
+
+	step->span_begin = step->tail_first_element->span_begin;
+	step->got_span_begin = true;
+    }
+
+    step->parser_element = step->tail_first_element;
+    step->tail_depth = 0;
+}
+
+template <class TokenStreamT>
+static mt_throws Result
+parse_compound_no_match (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+			 ParsingStep_Compound       * const mt_nonnull step)
+{
+    DEBUG_FLO (
+      errs->println (_func_);
+    )
+
+    assert (parsing_state && step);
+
+    // Failures after a cut in the current iteration are reported
+    // by pop_step().
+    if (step->tail_depth > 0 &&
+	!step->cut_passed)
+    {
+	if (!undo_tail_iteration (parsing_state, step))
+	    return Result::Failure;
+
+	return parse_compound_match (parsing_state, step, true /* empty_match */);
+    }
+
+    if (parsing_state->parser_config->upwards_jumps &&
+	!step->jump_performed                       &&
+	step->got_jump)
+    {
+	do {
+	    if (step->jump_cb != NULL) {
+		if (!step->jump_cb (get_compound_element (parsing_state, step), parsing_state->user_data))
+		    break;
+	    }
+
+	    SwitchGrammarEntry * const switch_ge = step->jump_switch_grammar_entry->data;
+	    assert (switch_ge->grammar->grammar_type == Grammar::t_Compound);
+	    Grammar_Compound * const grammar__compound = static_cast <Grammar_Compound*> (switch_ge->grammar.ptr ());
+
+	    push_compound_step (parsing_state,
+				grammar__compound,
+#ifndef VSLAB_ACCEPTOR
+				NULL /* acceptor */,
+#else
+				VSlabRef<Acceptor> () /* acceptor */,
+#endif
+				false /* optional */,
+				step->got_nonoptional_match,
+				step->go_right_count,
+				true  /* got_cur_subg_el */,
+				step->jump_compound_grammar_entry);
+
+	    step->jump_performed = true;
+	    step->go_right_count = 0;
+
+	    DEBUG (
+              errs->println ("--- JUMP --- 0x", fmt_hex, (Uint64) step->jump_compound_grammar_entry);
+	    )
+
+	    return Result::Success;
+	} while (0);
+    }
+
+    if (step->shared_prefix_len != 0) {
+	bool done = false;
+	if (!hand_over_shared_prefix (parsing_state, step, &done))
+	    return Result::Failure;
+	if (done)
+	    return Result::Success;
+    }
+
+    if (step->optional) {
+	if (step->grammar->accept_func != NULL) {
+	    call_accept_func (parsing_state, step->grammar, NULL);
+	}
+
+	if (!pop_step (parsing_state, true /* mach */, true /* empty_match */))
+            return Result::Failure;
+    } else {
+	if (!pop_step (parsing_state, false /* mach */, false /* empty_match */))
+            return Result::Failure;
+    }
+
+    return Result::Success;
+}
+
+// Called when a cut ("!") is passed. The current compound step becomes
+// committed: its failure means a syntax error. If the steps below it can't
+// go back either, then negative cache entries and events which precede
+// the cut are of no use anymore.
+template <class TokenStreamT>
+static void
+commit_cut (ParsingState<TokenStreamT> * const mt_nonnull parsing_state)
+{
+    DEBUG_FLO (
+      errs->println (_func_);
+    )
+
+    ParsingStep * const step = parsing_state->step_list.getLast ();
+    step->cut_passed = true;
+
+    if (!is_committed_stack (parsing_state, step))
+	return;
+
+    ++parsing_state->commit_count;
+    parsing_state->negative_cache.cut ();
+
+    if (parsing_state->event_log) {
+      // Switch steps may still wrap their matches into left-recursive phrases,
+      // and compound steps with no tokens matched yet may still turn out
+      // to be empty. Events after such steps can't be delivered yet.
+	Size flush_level = parsing_state->event_log->getLevel ();
+	ParsingStep *cur_step = parsing_state->step_list.getFirst();
+	while (cur_step) {
+	    if (cur_step->parsing_step_type == ParsingStep::t_Switch ||
+		(cur_step->parsing_step_type == ParsingStep::t_Compound &&
+		 !static_cast <ParsingStep_Compound*> (cur_step)->got_nonoptional_match))
+	    {
+		if (cur_step->event_level < flush_level)
+		    flush_level = cur_step->event_level;
+	    }
+
+	    cur_step = parsing_state->step_list.getNext (cur_step);
+	}
+
+	parsing_state->event_log->flush (parsing_state->event_handler, parsing_state->user_data, flush_level);
+    }
+}
+
+template <class TokenStreamT>
+static mt_throws Result
+parse_compound_match (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		      ParsingStep_Compound       * const mt_nonnull step,
+		      bool                         const empty_match)
+{
+    assert (parsing_state && step);
+
+    if (!empty_match)
+	step->got_nonoptional_match = true;
+
+    while (!step->jump_performed &&
+	   step->cur_subg_el != NULL)
+    {
+	mark_shared_prefix (parsing_state, step);
+
+	CompoundGrammarEntry &entry = *step->cur_subg_el->data;
+	step->cur_subg_el = step->cur_subg_el->next;
+	++step->subg_index;
+
+	if (step->cur_subg_el == NULL &&
+	    entry.grammar.ptr () == step->grammar &&
+	    static_cast <Grammar_Compound*> (step->grammar)->tail_iteration)
+	{
+	    if (!begin_tail_iteration (parsing_state, step, &entry))
+		return Result::Failure;
+
+	    continue;
+	}
+
+	if (entry.is_cut) {
+	    commit_cut (parsing_state);
+	    continue;
+	}
+
+	if (entry.is_jump) {
+	    step->got_jump = true;
+	    step->jump_grammar = entry.jump_grammar;
+	    step->jump_cb = entry.jump_cb;
+
+	    assert (entry.jump_grammar->grammar_type == Grammar::t_Switch);
+	    Grammar_Switch * const grammar__switch = static_cast <Grammar_Switch*> (entry.jump_grammar);
+
+	    if (entry.jump_switch_grammar_entry == NULL) {
+		entry.jump_switch_grammar_entry =
+			grammar__switch->grammar_entries.getIthElement (entry.jump_switch_grammar_index);
+	    }
+	    step->jump_switch_grammar_entry = entry.jump_switch_grammar_entry;
+
+	    SwitchGrammarEntry * const switch_ge = entry.jump_switch_grammar_entry->data;
+	    assert (switch_ge->grammar->grammar_type == Grammar::t_Compound);
+	    Grammar_Compound * const grammar__compound = static_cast <Grammar_Compound*> (switch_ge->grammar.ptr ());
+
+	    if (entry.jump_compound_grammar_entry == NULL &&
+		grammar__compound->grammar_entries.getNumElements () != entry.jump_compound_grammar_index)
+	    {
+		entry.jump_compound_grammar_entry =
+			grammar__compound->grammar_entries.getIthElement (entry.jump_compound_grammar_index);
+	    }
+	    step->jump_compound_grammar_entry = entry.jump_compound_grammar_entry;
+
+	    continue;
+	}
+
+	if (entry.inline_match_func != NULL) {
+	    DEBUG_CB (
+              errs->println (_func, "calling intermediate accept_func()");
+	    )
+	    // Note: This is the only place where inline match functions are called.
+// Deprecated	    entry.accept_func (step->parser_element, parsing_state, parsing_state->user_data);
+	    if (!entry.inline_match_func (get_compound_element (parsing_state, step), parsing_state, parsing_state->user_data)) {
+	      // Inline match has failed, so we have no match for the current
+	      // compound grammar.
+		return parse_compound_no_match (parsing_state, step);
+	    }
+
+	    continue;
+	}
+
+	if (entry.flags & CompoundGrammarEntry::Sequence) {
+	    DEBUG_INT (
+	      errs->println (_func, "sequence");
+	    )
+
+	    VStack::Level const tmp_vstack_level = parsing_state->step_vstack.getLevel ();
+	    VStack::Level const tmp_el_level = parsing_state->el_vstack->getLevel ();
+	    ParsingStep_Sequence * const new_step =
+		    new (parsing_state->step_vstack.push_malign (
+                                        sizeof (ParsingStep_Sequence), alignof (ParsingStep_Sequence)))
+                                ParsingStep_Sequence;
+	    new_step->vstack_level = tmp_vstack_level;
+	    new_step->el_level = tmp_el_level;
+	    new_step->subel_target.compound_step = step;
+	    new_step->subel_target.entry = &entry;
+	    new_step->optional = entry.flags & CompoundGrammarEntry::Optional;
+	    new_step->grammar = entry.grammar;
+	    new_step->top_level = is_top_level_sequence (parsing_state);
+
+// TODO Do not create a new checkpoint for sequence steps, _and_ do not
+// commit/cancel the checkpoint in pop_step() accordingly.
+//	    push_step (parsing_state, new_step, false /* new_checkpoint */);
+	    push_step (parsing_state, new_step);
+	    return Result::Success;
+	} else {
+	    DEBUG_INT (
+                errs->println (_func, "not a sequence");
+	    )
+
+	    {
+                SubelTarget subel_target;
+                subel_target.compound_step = step;
+                subel_target.entry = &entry;
+                subel_target.record_subel =
+                        (step->subg_index <= step->shared_prefix_len ?
+                                 &step->prefix_subels [step->subg_index - 1] : NULL);
+
+                ParsingResult pres;
+                if (!parse_grammar (parsing_state,
+                                    entry.grammar,
+                                    VSlabRef<Acceptor> () /* acceptor */,
+                                    entry.flags & CompoundGrammarEntry::Optional,
+                                    &pres,
+                                    &subel_target))
+                {
+                    return Result::Failure;
+                }
+
+                if (pres == ParseNonemptyMatch) {
+                    step->got_nonoptional_match = true;
+                    continue;
+                }
+
+                if (pres == ParseEmptyMatch && (entry.flags & CompoundGrammarEntry::Optional))
+                    continue;
+
+                if (pres == ParseNoMatch)
+                    return parse_compound_no_match (parsing_state, step);
+                else
+                    assert (pres == ParseUp);
+
+                DEBUG_INT (
+                  errs->println (_func, "leaving test scope");
+                )
+	    }
+	    DEBUG_INT (
+              errs->println (_func, "left test scope");
+	    )
+
+	    return Result::Success;
+	}
+    }
+
+  // We have parsed all subgrammars.
+
+    mark_shared_prefix (parsing_state, step);
+    finish_tail_iterations (parsing_state, step);
+    get_compound_element (parsing_state, step);
+
+    if (parsing_state->parser_config->source_spans)
+	set_element_span (parsing_state, step, step->parser_element);
+
+    bool user_match = true;
+// TODO FIXME (explain)
+//    if (!empty_match) {
+	if (!step->jump_performed &&
+	    step->grammar->match_func != NULL)
+	{
+	    DEBUG_CB (
+              errs->println (_func, "calling match_func()");
+	    )
+	    if (!step->grammar->match_func (step->parser_element, parsing_state, parsing_state->user_data))
+		user_match = false;
+	}
+//    }
+
+    if (user_match) {
+	DEBUG_INT (
+          errs->println (_func, "match_func() returned true");
+	)
+
+	if (!step->jump_performed) {
+	    if (step->grammar->accept_func != NULL) {
+		DEBUG_CB (
+                  errs->println (_func, "calling accept_func()");
+		)
+		call_accept_func (parsing_state, step->grammar, step->parser_element);
+	    }
+
+// TODO FIXME (explain)
+//	    if (!empty_match)
+	    DEBUG (
+              errs->println (_func, "accepting element: "
+                             "0x", fmt_hex, (Uint64) step->parser_element);
+	    )
+	    accept_element (parsing_state, step, step->parser_element);
+	}
+
+	DEBUG (
+          errs->println (_func, "user_match");
+	)
+	if (!pop_step (parsing_state, true /* mach */, !step->got_nonoptional_match /* empty_match */))
+            return Result::Failure;
+    } else {
+	DEBUG_INT (
+          errs->println (_func, "match_func() returned false");
+	)
+
+	if (!parse_compound_no_match (parsing_state, step))
+            return Result::Failure;
+    }
+
+    return Result::Success;
+}
+
+template <class TokenStreamT>
+static mt_throws Result
+parse_switch_final_match (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+			  ParsingStep_Switch         * const mt_nonnull step,
+			  bool                         const empty_match)
+{
+// Wrong condition. We should set parser elements for empty matches as well.
+// Otherwise, "key = ;" yields NULL 'value' field in mconfig.
+//    if (!empty_match) {
+	DEBUG_INT (
+          errs->println (_func, "accepting element: "
+                         "0x", fmt_hex, (Uint64) step->parser_element);
+	)
+	accept_element (parsing_state, step, step->parser_element);
+//    }
+
+    if (!pop_step (parsing_state, true /* match */, empty_match))
+        return Result::Failure;
+
+    return Result::Success;
+}
+
+template <class TokenStreamT>
+static mt_throws Result
+parse_switch_no_match_yet (ParsingState<TokenStreamT> * mt_nonnull parsing_state,
+			   ParsingStep_Switch         * mt_nonnull step);
+
+// Returns the first entry to try when growing the left-recursive match.
+// For optimized grammars, only left-recursive entries are iterated.
+static List< StRef<SwitchGrammarEntry> >::Element*
+get_first_lr_el (ParsingStep_Switch * const mt_nonnull step)
+{
+    Grammar_Switch * const grammar = static_cast <Grammar_Switch*> (step->grammar);
+    if (grammar->lr_entries_ready)
+	return grammar->lr_grammar_entries.first;
+
+    return grammar->grammar_entries.first;
+}
+
+template <class TokenStreamT>
+static mt_throws Result
+parse_switch_match (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		    ParsingStep_Switch         * const mt_nonnull step,
+		    bool                         const match,
+		    bool                         const empty_match)
+{
+    assert (parsing_state &&
+	    step &&
+	    !(empty_match && !match));
+
+    DEBUG_INT (
+      errs->println (_func, "step->parser_element: "
+                     "0x", fmt_hex, (Uint64) step->parser_element, ", "
+                     "step->nlr_parser_element: 0x", fmt_hex, (Uint64) step->nlr_parser_element);
+    )
+
+    switch (step->state) {
+	case ParsingStep_Switch::State_NLR: {
+	  // We've just parsed a non-left-recursive grammar.
+
+	  // Note: ParserElement parsed is stored in 'step->nlr_parser_element',
+	  // as prescribed in the acceptor that we set for NLR grammars.
+
+	    if (empty_match) {
+	      // We've got an empty match. For recursion handling, we want to see
+	      // if there'll be any non-empty matches for the switch. Empty matches
+	      // can't be used for parsing left-recursive grammars, so we move on
+	      // to the next non-left-recursive subgrammar.
+
+		step->got_empty_nlr_match = true;
+
+		DEBUG_INT (
+                    errs->println (_func, "(NLR, empty): "
+                                   "calling parse_switch_no_match_yet()");
+		)
+		if (!parse_switch_no_match_yet (parsing_state, step))
+                    return Result::Failure;
+	    } else {
+	      // We've got a non-empty match. Let's try parsing left-recursive grammars,
+	      // if any, with this match at the left.
+
+		if (match) {
+		    if (step->grammar->accept_func != NULL) {
+			DEBUG_CB (
+                          errs->println (_func, "calling accept_func (NLR, non-empty)");
+			)
+			call_accept_func (parsing_state, step->grammar, step->nlr_parser_element);
+		    }
+
+		    step->got_nonempty_nlr_match = true;
+		}
+
+		step->state = ParsingStep_Switch::State_LR;
+		step->cur_lr_el = get_first_lr_el (step);
+
+		DEBUG_INT (
+                  errs->println (_func, "(NLR, non-empty): "
+                                 "calling parse_switch_no_match_yet()");
+		)
+		if (!parse_switch_no_match_yet (parsing_state, step))
+                    return Result::Failure;
+	    }
+	} break;
+	case ParsingStep_Switch::State_LR: {
+	  // We've been parsing left-recursive grammars.
+
+	    if (empty_match) {
+	      // The match is empty. This means that the recursive grammar
+	      // has an empty tail, hence the match is not recursive at all.
+	      // Moving on to the next left-recursive grammar.
+
+		DEBUG_INT (
+                  errs->println (_func, "(LR, empty): "
+                                 "calling parse_switch_no_match_yet()");
+		)
+		if (!parse_switch_no_match_yet (parsing_state, step))
+                    return Result::Failure;
+
+		return Result::Success;;
+	    }
+
+	    // Note: when we're building a long recursive chain of elements,
+	    // each intermediate state of the chain should be a match.
+	    // It's not clear at this point if we'll have to call match_func()
+	    // on each iteration.
+
+	    // Here we're making a trick: pretending like we've just parsed
+	    // a non-left-recursive grammar, so that we can move on with
+	    // the recursion.
+
+	    // Calling accept_func early.
+	    if (step->grammar->accept_func != NULL) {
+		DEBUG_CB (
+                  errs->println (_func, "calling accept_func");
+		)
+		call_accept_func (parsing_state, step->grammar, step->parser_element);
+	    }
+
+	    step->got_lr_match = true;
+
+	    step->nlr_parser_element = step->parser_element;
+	    step->parser_element = NULL;
+	    step->cur_lr_el = get_first_lr_el (step);
+
+	    if (!parse_switch_no_match_yet (parsing_state, step))
+                return Result::Failure;
+
+// TODO Figure out how to call match_func() properly for left-recursive grammars.
+// The net result should be equivalent to what happens when dealing with othre
+// type of recursion.
+#if 0
+	    if (step->grammar->match_func != NULL) {
+		DEBUG_CB (
+                  errs->println (_func, "calling match_func()");
+		)
+		if (!step->grammar->match_func (step->parser_element, parsing_state->user_data)) {
+		    if (!parse_switch_no_match_yet (parsing_state, step))
+                        return Result::Failure;
+
+                    return Result::Success;
+		}
+	    }
+#endif
+	} break;
+	default:
+            unreachable ();
+    }
+
+    return Result::Success;
+}
+
+template <class TokenStreamT>
+static bool
+is_cur_variant (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		SwitchGrammarEntry         * const mt_nonnull entry)
+{
+    if (entry->variants.isEmpty ())
+	return true;
+
+    List< StRef<String> >::DataIterator variant_iter (entry->variants);
+    while (!variant_iter.done ()) {
+        StRef<String> &variant = variant_iter.next ();
+	if (!parsing_state->variant ||
+	    parsing_state->variant->len() == 0)
+	{
+	    if (equal (variant->mem(), parsing_state->default_variant))
+		return true;
+	} else {
+	    if (equal (variant->mem(), parsing_state->variant->mem()))
+		return true;
+	}
+    }
+
+    return false;
+}
+
+// Upwards optimization.
+template <class TokenStreamT>
+static mt_throws Result
+parse_switch_upwards_green_forward (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+				    SwitchGrammarEntry         * const mt_nonnull switch_grammar_entry,
+                                    bool                       * const mt_nonnull ret_res)
+{
+    if (!parsing_state->parser_config->forward_optimization) {
+        *ret_res = true;
+        return Result::Success;
+    }
+
+  // Note: this is a raw non-optimized version.
+  //     * Uses linked list traversal instead of map/hash lookups;
+  //     * The list of tranzition entries is not cleaned up.
+  //       It contains overlapping entries (like "any token" at the end
+  //       of the list).
+
+    if (switch_grammar_entry->any_tranzition) {
+        *ret_res = true;
+        return Result::Success;
+    }
+
+    ConstMemory token;
+    StRef<StReferenced> user_obj;
+    void *user_ptr;
+    {
+	typename ParsingState<TokenStreamT>::StreamPosition pmark;
+	parsing_state->streamGetPosition (&pmark);
+        {
+            if (!parsing_state->streamGetNextToken (&token, &user_obj, &user_ptr))
+                return Result::Failure;
+        }
+	if (!parsing_state->streamSetPosition (&pmark))
+            return Result::Failure;
+    }
+
+    if (token.len() == 0) {
+        *ret_res = false;
+        return Result::Success;
+    }
+
+    // Literal tokens are the cheapest to check, hence going first.
+    DEBUG_OPT2 (
+      errs->println ("--- FIND: ", token.mem());
+    )
+    if (parsing_state->classify_token && !switch_grammar_entry->tranzition_ids_incomplete) {
+        Uint32 const token_id = parsing_state->getTokenId (token);
+        if (token_id != 0 && switch_grammar_entry->hasTranzitionTokenId (token_id)) {
+            *ret_res = true;
+            return Result::Success;
+        }
+    } else
+    if (switch_grammar_entry->tranzition_entries.lookup (token)) {
+        *ret_res = true;
+        return Result::Success;
+    }
+
+    {
+	List< StRef<TranzitionMatchEntry> >::DataIterator iter (
+		switch_grammar_entry->tranzition_match_entries);
+	while (!iter.done ()) {
+	    StRef<TranzitionMatchEntry> &tranzition_match_entry = iter.next ();
+
+	    if (tranzition_match_entry->token_dfa) {
+		if (tranzition_match_entry->token_dfa->match (token)) {
+		    *ret_res = true;
+		    return Result::Success;
+		}
+
+		continue;
+	    }
+
+	    DEBUG_OPT2 (
+              errs->println ("--- TOKEN MATCH CB");
+	    )
+
+	    if (tranzition_match_entry->token_match_cb_pure) {
+		if (parsing_state->matchPureCb (tranzition_match_entry->token_match_cb, token, user_ptr)) {
+		    *ret_res = true;
+		    return Result::Success;
+		}
+
+		continue;
+	    }
+
+	    if (tranzition_match_entry->token_match_cb (token,
+							user_ptr,
+							parsing_state->user_data))
+	    {
+                *ret_res = true;
+                return Result::Success;
+	    }
+	}
+    }
+
+    *ret_res = false;
+    return Result::Success;
+}
+
+// Chooses the only NLR entry of a predictive switch grammar which may match
+// the next token. Sets 'ret_el' to NULL if there's no such entry.
+template <class TokenStreamT>
+static mt_throws Result
+predict_switch_entry (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		      Grammar_Switch             * const mt_nonnull grammar,
+		      List< StRef<SwitchGrammarEntry> >::Element ** const mt_nonnull ret_el)
+{
+    *ret_el = NULL;
+
+    ConstMemory token;
+    StRef<StReferenced> user_obj;
+    void *user_ptr;
+    {
+	typename ParsingState<TokenStreamT>::StreamPosition pmark;
+	parsing_state->streamGetPosition (&pmark);
+        {
+            if (!parsing_state->streamGetNextToken (&token, &user_obj, &user_ptr))
+                return Result::Failure;
+        }
+	if (!parsing_state->streamSetPosition (&pmark))
+            return Result::Failure;
+    }
+
+    if (token.len() == 0)
+        return Result::Success;
+
+    if (grammar->predict_by_id && parsing_state->classify_token) {
+        Uint32 const token_id = parsing_state->getTokenId (token);
+        if (token_id < grammar->num_predict_ids)
+            *ret_el = grammar->predict_by_id [token_id];
+
+        return Result::Success;
+    }
+
+    Grammar_Switch::PredictEntry * const predict_entry = grammar->predict_entries.lookup (token);
+    if (predict_entry)
+        *ret_el = predict_entry->entry_el;
+
+    return Result::Success;
+}
+
+template <class TokenStreamT>
+static mt_throws Result
+parse_switch_upwards_green (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+			    SwitchGrammarEntry         * const mt_nonnull switch_grammar_entry,
+                            bool                       * const mt_nonnull ret_res)
+{
+  FUNC_NAME (
+    char const * const _func_name = "Pargen.Parser.parse_switch_upwards_green";
+  )
+
+    if (parsing_state->negative_cache.isNegative (switch_grammar_entry->grammar)) {
+	DEBUG_NEGC (
+          errs->println (_func, "negative ", switch_grammar_entry->grammar->toString ());
+	)
+
+        *ret_res = false;
+        return Result::Success;
+    }
+
+    if (switch_grammar_entry->grammar->optimized)
+	return parse_switch_upwards_green_forward (parsing_state, switch_grammar_entry, ret_res);
+
+    *ret_res = true;
+    return Result::Success;
+}
+
+template <class TokenStreamT>
+static mt_throws Result
+parse_switch_no_match_yet (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+			   ParsingStep_Switch         * const mt_nonnull step)
+{
+    DEBUG_FLO (
+      errs->print (_func_);
+    )
+
+    assert (parsing_state && step);
+
+    // Here we're going to deal with left recursion.
+    //
+    // The general case for left recursion is the following:
+    //
+    //     a:
+    //         b_opt a c
+    //
+    // This grammar turns out to be left-recursive if b_opt evalutes
+    // to an empty sequence. In this case, we get "a: a c", which can't
+    // be processed by out left-to-right parser without special treatment.
+    //
+    // We're going to deal with this by delaying parsing of left-recursive
+    // grammars until any non-left-recursive grammar evaluates
+    // to a non-empty sequence.
+    //
+    // In general, any left-recursive grammar can potentially be parsed
+    // only if it is a part of a switch-type parent with at least one
+    // non-left-recursive child. Once we've got a match for such a child,
+    // we can move forward with parsing the recursive ones, throwing away
+    // recursive references at their left. We can do this by simulating
+    // a match for the first element of the corresponding compound grammars.
+    //
+    // Left-recursive grammars are always a better match than non-left-recursive
+    // ones.
+    //
+    // We'll parse the following grammar in two steps:
+    //
+    //     a:
+    //         b
+    //         d
+    //         a c
+    //         a e
+    //
+    //     1. Parse switch { "b", "d" }, choose the one that matches
+    //        (say, "b"), remember it.
+    //     2. Parse switch { "a c", "a e" }, with "a" pre-matched as "b".
+    //        If we've got a match, then that's the result. If not, then
+    //        the result is the remembered "b".
+    //
+    // If a left-recursive grammar's match sequence is not longer than
+    // the remembered one the remember non-left-recursive grammar
+    //
+    // Note that multiple occurences of references to the parent grammar
+    // is not a special case. As long as we've got a match for the leftmost
+    // reference, the rest of the grammar is not left-recursive anymore,
+    // and we can safely parse it as usual.
+
+    switch (step->state) {
+	case ParsingStep_Switch::State_NLR: {
+	  // At this step we're parsing non-left-recursive grammars only.
+
+	    DEBUG (
+              errs->println (_func, "NLR");
+	    )
+
+	    // Workaround for the unfortunate side effect of acceptor initialization:
+	    // it nullifies the target pointer.
+	    ParserElement *tmp_nlr_parser_element = step->nlr_parser_element;
+
+#ifndef VSLAB_ACCEPTOR
+	    StRef<Acceptor> const nlr_acceptor =
+		    st_grab (static_cast <Acceptor*> (new (std::nothrow) RefAcceptor<ParserElement> (&step->nlr_parser_element)));
+#else
+	    VSlabRef< PtrAcceptor<ParserElement> > const nlr_acceptor =
+		    VSlabRef< PtrAcceptor<ParserElement> >::forRef < PtrAcceptor<ParserElement> > (
+			    parsing_state->ptr_acceptor_slab.alloc ());
+	    nlr_acceptor->init (&step->nlr_parser_element);
+	    DEBUG_INT (
+              errs->println (_func, "NLR: acceptor: "
+                             "0x", fmt_hex, (Uint64) (Acceptor*) nlr_acceptor);
+	    )
+#endif
+
+	    step->nlr_parser_element = tmp_nlr_parser_element;
+
+	    if (step->predict) {
+		step->predict = false;
+		step->predicted = true;
+		if (!predict_switch_entry (parsing_state,
+					   static_cast <Grammar_Switch*> (step->grammar),
+					   &step->cur_nlr_el))
+		{
+                    return Result::Failure;
+		}
+	    }
+
+	    bool got_new_step = false;
+	    while (step->cur_nlr_el != NULL) {
+		DEBUG (
+                  errs->println (_func, "NLR: iteration");
+		)
+
+		List< StRef<SwitchGrammarEntry> >::Element * const entry_el = step->cur_nlr_el;
+		SwitchGrammarEntry &entry = *entry_el->data;
+		step->cur_nlr_el = (step->predicted ? NULL : step->cur_nlr_el->next);
+
+		if (!is_cur_variant (parsing_state, &entry))
+		    continue;
+
+                {
+                    bool res = false;
+                    if (!parse_switch_upwards_green (parsing_state, &entry, &res))
+                        return Result::Failure;
+                    if (!res)
+                        continue;
+                }
+
+		// I suppose that the better option is to give up on detecting left-recursive
+		// grammars for the cases where subgrammar is not a compound one. For pargen-generated
+		// grammars this means we're never giving up :)
+		if (entry.grammar->grammar_type == Grammar::t_Compound) {
+		    DEBUG (
+                      errs->println (_func, "NLR: _Compound");
+		    )
+
+		    Grammar_Compound *grammar = static_cast <Grammar_Compound*> (entry.grammar.ptr ());
+
+		    {
+			bool left_recursive;
+			if (static_cast <Grammar_Switch*> (step->grammar)->lr_entries_ready)
+			    left_recursive = entry.left_recursive;
+			else
+			    left_recursive = (grammar->getFirstSubgrammar () == step->grammar);
+
+			if (left_recursive) {
+			  // The subgrammar happens to be a left-recursive one.
+			  // We're simply proceeding to the next subgrammar.
+
+			    continue;
+			}
+		    }
+
+		    VStack::Level const tmp_vstack_level = parsing_state->step_vstack.getLevel ();
+		    VStack::Level const tmp_el_level = parsing_state->el_vstack->getLevel ();
+		    ParsingStep_Compound * const compound_step =
+			    new (parsing_state->step_vstack.push_malign (
+                                                sizeof (ParsingStep_Compound), alignof (ParsingStep_Compound)))
+                                        ParsingStep_Compound;
+		    compound_step->vstack_level = tmp_vstack_level;
+		    compound_step->el_level = tmp_el_level;
+		    compound_step->lr_parent = step->grammar;
+		    compound_step->acceptor = nlr_acceptor;
+		    compound_step->optional = false;
+		    compound_step->grammar = grammar;
+		    compound_step->cur_subg_el = grammar->grammar_entries.first;
+		    compound_step->switch_entry_el = entry_el;
+		    compound_step->shared_prefix_len = entry.shared_prefix_len;
+		    push_step (parsing_state, compound_step);
+		} else {
+		    DEBUG (
+                      errs->println (_func, "NLR: non-compound");
+		    )
+
+		    // TEST
+                    unreachable ();
+
+		    // Note: this path is currently inadequate.
+#if 0
+		    ParsingResult pres = parse_grammar (parsing_state, entry.grammar, nlr_acceptor, false /* optional */);
+		    if (pres == ParseEmptyMatch ||
+			pres == ParseNoMatch)
+		    {
+			continue;
+		    }
+
+		    if (pres == ParseNonemptyMatch) {
+			step->parser_element = step->nlr_parser_element;
+			// TODO Call match_func here (helps to avoid recursion)
+			if (!parse_switch_match (parsing_state, step, true /* match */, false /* empty_match */))
+                            return Result::Failure;
+		    } else {
+			assert (pres == ParseUp);
+                    }
+#endif
+		}
+
+		got_new_step = true;
+		break;
+	    }
+
+	    if (!got_new_step) {
+		if (step->got_empty_nlr_match) {
+		  // We've got an empty match. It cannot be used for handling left-recursive grammars,
+		  // so we just accept it.
+
+		    DEBUG_INT (
+                      errs->println (_func, "empty NLR match, step->nlr_parser_element: "
+                                     "0x", fmt_hex, (UintPtr) step->nlr_parser_element);
+		    )
+		    step->parser_element = step->nlr_parser_element;
+
+		    if (step->grammar->accept_func != NULL) {
+			DEBUG_CB (
+                          errs->println (_func, "calling accept_func()");
+			)
+			call_accept_func (parsing_state, step->grammar, step->parser_element);
+		    }
+
+		    if (!parse_switch_final_match (parsing_state, step, true /* empty_match */))
+                        return Result::Failure;
+		} else {
+		  // We've tried all of the Switch grammar's non-left-recursive subgrammars,
+		  // and none of them match.
+
+		  // Still, if there are lef-recursive subgrammars with optional left-recursive part,
+		  // then there might be a match for the current switch grammar.
+		  // Proceeding to left-recursive subgrammars handling.
+
+		  // Note: This code path and functions' naming is counterintuitive.
+		  // It would make sense to sort this out.
+
+		    if (!parse_switch_match (parsing_state, step, false /* match */, false /* empty_match */))
+                        return Result::Failure;
+		}
+	    }
+	} break;
+	case ParsingStep_Switch::State_LR: {
+	  // We're parsing only left-recursive grammars now.
+
+	    DEBUG (
+              errs->println (_func, "LR");
+	    )
+
+#ifndef VSLAB_ACCEPTOR
+	    StRef<Acceptor> const lr_acceptor =
+		    st_grab (static_cast <Acceptor*> (new (std::nothrow) RefAcceptor<ParserElement> (&step->parser_element)));
+#else
+	    VSlabRef< PtrAcceptor<ParserElement> > const lr_acceptor =
+		    VSlabRef< PtrAcceptor<ParserElement> >::forRef < PtrAcceptor<ParserElement> > (
+			    parsing_state->ptr_acceptor_slab.alloc ());
+	    lr_acceptor->init (&step->parser_element);
+	    DEBUG_INT (
+              errs->println (_func, "LR: acceptor: 0x", fmt_hex, (Uint64) (Acceptor*) lr_acceptor);
+	    )
+#endif
+
+	    bool got_new_step = false;
+	    while (step->cur_lr_el != NULL) {
+		DEBUG (
+                  errs->println (_func, "LR: iteration");
+		)
+
+		SwitchGrammarEntry &entry = *step->cur_lr_el->data;
+		step->cur_lr_el = step->cur_lr_el->next;
+
+		if (entry.grammar->grammar_type != Grammar::t_Compound)
+		    continue;
+
+		if (!is_cur_variant (parsing_state, &entry))
+		    continue;
+
+	      // Note: checking negative cache here is pointless, since it will
+	      // be checked in parse_up() anyway.
+
+		Grammar_Compound *grammar = static_cast <Grammar_Compound*> (entry.grammar.ptr ());
+
+		{
+		  // Checking if the grammar is left-recursive and suitable.
+
+		    CompoundGrammarEntry * const first_subg = grammar->getFirstSubgrammarEntry ();
+		    if (first_subg == NULL ||
+			(first_subg->grammar != step->grammar))
+		    {
+		      // The subgrammar is not a left-recursive one.
+		      // Proceeding to the next subgrammar.
+
+			DEBUG (
+                          errs->println (_func, "LR: non-lr");
+			)
+
+			continue;
+		    }
+
+		    if (!step->got_empty_nlr_match    &&
+			!step->got_nonempty_nlr_match &&
+			!(first_subg->flags & CompoundGrammarEntry::Optional))
+		    {
+		      // If we've got an empty nlr match, then only left-recursive grammars
+		      // with optional left-recursive part can match.
+
+			continue;
+		    }
+		}
+
+		if (entry.lr_tail) {
+		  // Growing the current match only with alternatives which
+		  // can continue with the next token.
+
+		    bool res = false;
+		    if (!parse_switch_upwards_green_forward (parsing_state, entry.lr_tail, &res))
+			return Result::Failure;
+		    if (!res)
+			continue;
+		}
+
+		got_new_step = true;
+
+		VStack::Level const tmp_vstack_level = parsing_state->step_vstack.getLevel ();
+		VStack::Level const tmp_el_level = parsing_state->el_vstack->getLevel ();
+		ParsingStep_Compound * const compound_step =
+			new (parsing_state->step_vstack.push_malign (
+                                            sizeof (ParsingStep_Compound), alignof (ParsingStep_Compound)))
+                                    ParsingStep_Compound;
+		compound_step->vstack_level = tmp_vstack_level;
+		compound_step->el_level = tmp_el_level;
+		compound_step->lr_parent = step->grammar;
+		compound_step->lr_wrap = true;
+		compound_step->acceptor = lr_acceptor;
+		compound_step->optional = false;
+		compound_step->grammar = grammar;
+		// We'll start parsing from the second subgrammar (the first one is
+		// a left-recursive reference to the parent grammar).
+		compound_step->cur_subg_el = grammar->getSecondSubgrammarElement ();
+		compound_step->parser_element = grammar->createParserElement (parsing_state->el_vstack);
+		// The phrase begins where the parent switch begins.
+		compound_step->span_begin = step->span_begin;
+		compound_step->got_span_begin = step->got_span_begin;
+
+//#if 0
+// TODO This breaks normal operation. Look at this carefully.
+// Deprecated as long as we don't call leading inline accept callbacks.
+
+		// Note: This is a hack: we create the checkpoint early to be able
+		// to call inline accept functions for match simulation.
+		if (parsing_state->lookup_data)
+		    parsing_state->lookup_data->newCheckpoint ();
+//#endif
+
+		{
+		  // We're simulating a match. Inline accept callbacks which stand before
+		  // the left-recursive subgrammar must be called.
+
+		  // Note: It looks like calling these accept callbacks is confusing and does no good.
+
+		    List< StRef<CompoundGrammarEntry> >::DataIterator iter (grammar->grammar_entries);
+		    while (!iter.done ()) {
+			StRef<CompoundGrammarEntry> &entry = iter.next ();
+			if (entry->inline_match_func == NULL)
+			    break;
+
+			// TODO Aborting is a temporal measure.
+			//
+			// [10.09.15] Not so temporal anymore. I think this should become
+			// a permanent ban.
+                        errs->println (_func, "Leading inline accept callbacks in left-recursive grammars "
+                                       "are never called");
+                        unreachable ();
+		    }
+		}
+
+		if (step->nlr_parser_element != NULL) {
+		  // Pre-setting the compound grammar's first subgrammar with
+		  // the remembered non-left-recursive match.
+
+		    CompoundGrammarEntry * const cg_entry = grammar->getFirstSubgrammarEntry ();
+		    assert (cg_entry);
+
+		    if (cg_entry->assignment_func != NULL)
+			cg_entry->assignment_func (compound_step->parser_element, step->nlr_parser_element);
+		}
+
+		push_step (parsing_state, compound_step, false /* new_checkpoint */);
+		break;
+	    }
+
+	    if (!got_new_step) {
+	      // None of left-recursive subgrammars match. In this case,
+	      // the remembered non-left-recursive match is the result.
+
+		DEBUG (
+                  errs->print (_func, "LR: none match");
+		)
+
+		step->parser_element = step->nlr_parser_element;
+
+		if (step->got_nonempty_nlr_match &&
+		    step->grammar->match_func != NULL)
+		{
+		    DEBUG_CB (
+                      errs->println (_func, "calling match_func()");
+		    )
+		    if (!step->grammar->match_func (step->parser_element, parsing_state, parsing_state->user_data))
+			return pop_step (parsing_state, false /* match */, false /* empty_match */);
+		}
+
+		if (step->got_lr_match) {
+		  // We've got a left-recursive match.
+
+		    if (!parse_switch_final_match (parsing_state, step, false /* empty_match */))
+                        return Result::Failure;
+		} else {
+		    if (!step->got_nonempty_nlr_match && !step->got_empty_nlr_match) {
+			if (step->optional) {
+			    if (step->grammar->accept_func != NULL) {
+				DEBUG_CB (
+                                  errs->println (_func, "calling accept_func(NULL)");
+				)
+				call_accept_func (parsing_state, step->grammar, NULL);
+			    }
+
+			    if (!pop_step (parsing_state, true /* match */, true /* empty_match */))
+                                return Result::Failure;
+			} else
+			    if (!pop_step (parsing_state, false /* match */, false /* empty_match */))
+                                return Result::Failure;
+		    } else {
+			if (step->got_empty_nlr_match) {
+			    if (step->grammar->accept_func != NULL) {
+				DEBUG_CB (
+                                  errs->println (_func, "calling accept_func(NULL)");
+				)
+				call_accept_func (parsing_state, step->grammar, NULL);
+			    }
 
-	if (!parse_compound_no_match (parsing_state, step))
-            return Result::Failure;
+			    if (!parse_switch_final_match (parsing_state, step, true /* empty_match */))
+                                return Result::Failure;
+			} else
+			    if (!parse_switch_final_match (parsing_state, step, false /* empty_match */))
+                                return Result::Failure;
+		    }
+		}
+	    }
+	} break;
+	default:
+            unreachable ();
     }
 
+    DEBUG (
+      errs->println (_func, "done");
+    )
     return Result::Success;
 }
 
+template <class TokenStreamT>
 static mt_throws Result
-parse_switch_final_match (ParsingState       * const mt_nonnull parsing_state,
-			  ParsingStep_Switch * const mt_nonnull step,
-			  bool                 const empty_match)
+parse_alias (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+	     ParsingStep_Alias          * const mt_nonnull step)
 {
-// Wrong condition. We should set parser elements for empty matches as well.
-// Otherwise, "key = ;" yields NULL 'value' field in mconfig.
-//    if (!empty_match) {
-	if (step->acceptor) {
-	    DEBUG_INT (
-              errs->println (_func, "calling setParserElement(): "
-                             "0x", fmt_hex, (Uint64) step->parser_element);
-	    )
-	    step->acceptor->setParserElement (step->parser_element);
-	}
-//    }
+    DEBUG_FLO (
+      errs->println (_func_);
+    )
 
-    if (!pop_step (parsing_state, true /* match */, empty_match))
+    assert (parsing_state && step);
+
+    VSlabRef< PtrAcceptor<ParserElement> > acceptor =
+	    VSlabRef< PtrAcceptor<ParserElement> >::forRef < PtrAcceptor<ParserElement> > (
+		    parsing_state->ptr_acceptor_slab.alloc ());
+    acceptor->init (&step->parser_element);
+
+    ParsingResult pres;
+    if (!parse_grammar (parsing_state,
+                        static_cast <Grammar_Alias*> (step->grammar)->aliased_grammar,
+                        acceptor,
+                        step->optional,
+                        &pres))
+    {
         return Result::Failure;
+    }
+
+    if (pres == ParseUp)
+	return Result::Success;
+
+    switch (pres) {
+	case ParseNonemptyMatch:
+	    if (!pop_step (parsing_state, true /* match */, false /* empty_match */))
+                return Result::Failure;
+	    break;
+	case ParseEmptyMatch:
+	    if (!pop_step (parsing_state, true /* match */, true /* empty_match */))
+                return Result::Failure;
+	    break;
+	case ParseNoMatch:
+	    DEBUG_INT (
+              errs->println (_func, "pop_step: false, false");
+	    )
+	    if (!pop_step (parsing_state, false /* match */, false /* empty_match */))
+                return Result::Failure;
+	    break;
+	default:
+            unreachable ();
+    }
 
     return Result::Success;
 }
 
+template <class TokenStreamT>
 static mt_throws Result
-parse_switch_no_match_yet (ParsingState       * mt_nonnull parsing_state,
-			   ParsingStep_Switch * mt_nonnull step);
-
-static mt_throws Result
-parse_switch_match (ParsingState       * const mt_nonnull parsing_state,
-		    ParsingStep_Switch * const mt_nonnull step,
-		    bool                 const match,
-		    bool                 const empty_match)
+parse_precedence_no_match (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+			   ParsingStep_Precedence     * const mt_nonnull step)
 {
-    assert (parsing_state &&
-	    step &&
-	    !(empty_match && !match));
+    if (step->optional) {
+	if (step->grammar->accept_func != NULL)
+	    call_accept_func (parsing_state, step->grammar, NULL);
 
-    DEBUG_INT (
-      errs->println (_func, "step->parser_element: "
-                     "0x", fmt_hex, (Uint64) step->parser_element, ", "
-                     "step->nlr_parser_element: 0x", fmt_hex, (Uint64) step->nlr_parser_element);
-    )
+	return pop_step (parsing_state, true /* match */, true /* empty_match */);
+    }
 
-    switch (step->state) {
-	case ParsingStep_Switch::State_NLR: {
-	  // We've just parsed a non-left-recursive grammar.
+    return pop_step (parsing_state, false /* match */, false /* empty_match */);
+}
 
-	  // Note: ParserElement parsed is stored in 'step->nlr_parser_element',
-	  // as prescribed in the acceptor that we set for NLR grammars.
+// Replaces the top record and the current operand with a binary element.
+// Sets @ret_done to 'true' if the step should not be continued, which is
+// the case when the binary grammar's match_func() rejects the element
+// (the whole phrase doesn't match then) or changes the position.
+template <class TokenStreamT>
+static mt_throws Result
+precedence_reduce_one (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+		       ParsingStep_Precedence     * const mt_nonnull step,
+		       bool                       * const mt_nonnull ret_done)
+{
+    *ret_done = false;
 
-	    if (empty_match) {
-	      // We've got an empty match. For recursion handling, we want to see
-	      // if there'll be any non-empty matches for the switch. Empty matches
-	      // can't be used for parsing left-recursive grammars, so we move on
-	      // to the next non-left-recursive subgrammar.
+    ParsingStep_Precedence::Record * const record = step->top_record;
+    assert (record);
 
-		step->got_empty_nlr_match = true;
+    ParserElement * const right = step->operand_element;
 
-		DEBUG_INT (
-                    errs->println (_func, "(NLR, empty): "
-                                   "calling parse_switch_no_match_yet()");
-		)
-		if (!parse_switch_no_match_yet (parsing_state, step))
-                    return Result::Failure;
-	    } else {
-	      // We've got a non-empty match. Let's try parsing left-recursive grammars,
-	      // if any, with this match at the left.
+    Grammar_Compound * const binary_grammar =
+	    static_cast <Grammar_Compound*> (
+		    static_cast <Grammar_Precedence*> (step->grammar)->binary_grammar.ptr());
 
-		if (match) {
-		    if (step->grammar->accept_func != NULL) {
-			DEBUG_CB (
-                          errs->println (_func, "calling accept_func (NLR, non-empty)");
-			)
-			step->grammar->accept_func (step->nlr_parser_element,
-						    parsing_state,
-						    parsing_state->user_data);
-		    }
+    ParserElement * const parser_element = binary_grammar->createParserElement (parsing_state->el_vstack);
 
-		    step->got_nonempty_nlr_match = true;
-		}
+    // "<left> * <right>"
+    ParserElement * const subels [3] = { record->left, record->op_element, right };
+    Size i = 0;
+    List< StRef<CompoundGrammarEntry> >::DataIterator iter (binary_grammar->grammar_entries);
+    while (!iter.done () && i < 3) {
+	StRef<CompoundGrammarEntry> &entry = iter.next ();
+	if (entry->assignment_func != NULL)
+	    entry->assignment_func (parser_element, subels [i]);
 
-		step->state = ParsingStep_Switch::State_LR;
-		step->cur_lr_el = static_cast <Grammar_Switch*> (step->grammar)->grammar_entries.first;
+	++i;
+    }
 
-		DEBUG_INT (
-                  errs->println (_func, "(NLR, non-empty): "
-                                 "calling parse_switch_no_match_yet()");
-		)
-		if (!parse_switch_no_match_yet (parsing_state, step))
-                    return Result::Failure;
-	    }
-	} break;
-	case ParsingStep_Switch::State_LR: {
-	  // We've been parsing left-recursive grammars.
+    if (parsing_state->parser_config->source_spans && record->left && right) {
+	parser_element->span_begin = record->left->span_begin;
+	parser_element->span_end   = right->span_end;
+    }
 
-	    if (empty_match) {
-	      // The match is empty. This means that the recursive grammar
-	      // has an empty tail, hence the match is not recursive at all.
-	      // Moving on to the next left-recursive grammar.
+    VStack::Level const tmp_vstack_level = record->vstack_level;
+    step->top_record = record->prv;
+    record->~Record ();
+    parsing_state->step_vstack.setLevel (tmp_vstack_level);
 
-		DEBUG_INT (
-                  errs->println (_func, "(LR, empty): "
-                                 "calling parse_switch_no_match_yet()");
-		)
-		if (!parse_switch_no_match_yet (parsing_state, step))
-                    return Result::Failure;
+    step->operand_element = parser_element;
 
-		return Result::Success;;
-	    }
+    if (binary_grammar->match_func != NULL) {
+	DEBUG_CB (
+          errs->println (_func, "calling match_func()");
+	)
+	parsing_state->position_changed = false;
+	bool const user_match = binary_grammar->match_func (parser_element, parsing_state, parsing_state->user_data);
+	if (parsing_state->position_changed) {
+	    *ret_done = true;
+	    return Result::Success;
+	}
 
-	    // Note: when we're building a long recursive chain of elements,
-	    // each intermediate state of the chain should be a match.
-	    // It's not clear at this point if we'll have to call match_func()
-	    // on each iteration.
+	if (!user_match) {
+	    *ret_done = true;
+	    return parse_precedence_no_match (parsing_state, step);
+	}
+    }
 
-	    // Here we're making a trick: pretending like we've just parsed
-	    // a non-left-recursive grammar, so that we can move on with
-	    // the recursion.
+    if (binary_grammar->accept_func != NULL)
+	call_accept_func (parsing_state, binary_grammar, parser_element);
 
-	    // Calling accept_func early.
-	    if (step->grammar->accept_func != NULL) {
-		DEBUG_CB (
-                  errs->println (_func, "calling accept_func");
-		)
-		step->grammar->accept_func (step->parser_element,
-					    parsing_state,
-					    parsing_state->user_data);
-	    }
+    return Result::Success;
+}
 
-	    step->got_lr_match = true;
+template <class TokenStreamT>
+static mt_throws Result
+parse_precedence_finish (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+			 ParsingStep_Precedence     * const mt_nonnull step)
+{
+    DEBUG_FLO (
+      errs->println (_func_);
+    )
 
-	    step->nlr_parser_element = step->parser_element;
-	    step->parser_element = NULL;
-	    step->cur_lr_el = static_cast <Grammar_Switch*> (step->grammar)->grammar_entries.first;
+    while (step->top_record) {
+	bool done;
+	if (!precedence_reduce_one (parsing_state, step, &done))
+	    return Result::Failure;
 
-	    if (!parse_switch_no_match_yet (parsing_state, step))
-                return Result::Failure;
+	if (done)
+	    return Result::Success;
+    }
 
-// TODO Figure out how to call match_func() properly for left-recursive grammars.
-// The net result should be equivalent to what happens when dealing with othre
-// type of recursion.
-#if 0
-	    if (step->grammar->match_func != NULL) {
-		DEBUG_CB (
-                  errs->println (_func, "calling match_func()");
-		)
-		if (!step->grammar->match_func (step->parser_element, parsing_state->user_data)) {
-		    if (!parse_switch_no_match_yet (parsing_state, step))
-                        return Result::Failure;
+    if (step->grammar->match_func != NULL) {
+	DEBUG_CB (
+          errs->println (_func, "calling match_func()");
+	)
+	parsing_state->position_changed = false;
+	bool const user_match = step->grammar->match_func (step->operand_element, parsing_state, parsing_state->user_data);
+	if (parsing_state->position_changed)
+	    return Result::Success;
 
-                    return Result::Success;
-		}
-	    }
-#endif
-	} break;
-	default:
-            unreachable ();
+	if (!user_match)
+	    return parse_precedence_no_match (parsing_state, step);
     }
 
-    return Result::Success;
+    if (step->grammar->accept_func != NULL)
+	call_accept_func (parsing_state, step->grammar, step->operand_element);
+
+    accept_element (parsing_state, step, step->operand_element);
+
+    return pop_step (parsing_state, true /* match */, false /* empty_match */);
 }
 
-static bool
-is_cur_variant (ParsingState       * const mt_nonnull parsing_state,
-		SwitchGrammarEntry * const mt_nonnull entry)
+template <class TokenStreamT>
+static mt_throws Result
+parse_precedence_operand (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+			  ParsingStep_Precedence     * const mt_nonnull step);
+
+// Called when an attempt to match an operand has been made.
+template <class TokenStreamT>
+static mt_throws Result
+parse_precedence_operand_done (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+			       ParsingStep_Precedence     * const mt_nonnull step,
+			       bool                         const match)
 {
-    if (entry->variants.isEmpty ())
-	return true;
+    DEBUG_FLO (
+      errs->println (_func_);
+    )
 
-    List< StRef<String> >::DataIterator variant_iter (entry->variants);
-    while (!variant_iter.done ()) {
-        StRef<String> &variant = variant_iter.next ();
-	if (!parsing_state->variant ||
-	    parsing_state->variant->len() == 0)
-	{
-	    if (equal (variant->mem(), parsing_state->default_variant))
-		return true;
-	} else {
-	    if (equal (variant->mem(), parsing_state->variant->mem()))
-		return true;
+    Grammar_Precedence * const grammar = static_cast <Grammar_Precedence*> (step->grammar);
+
+    if (!match) {
+	if (!step->top_record) {
+	  // No operands at all.
+	    return parse_precedence_no_match (parsing_state, step);
 	}
-    }
 
-    return false;
-}
+      // The last operator is not followed by an operand: giving it back.
 
-// Upwards optimization.
-static mt_throws Result
-parse_switch_upwards_green_forward (ParsingState       * const mt_nonnull parsing_state,
-				    SwitchGrammarEntry * const mt_nonnull switch_grammar_entry,
-                                    bool               * const mt_nonnull ret_res)
-{
-#ifdef PARGEN_FORWARD_OPTIMIZATION
-  // Note: this is a raw non-optimized version.
-  //     * Uses linked list traversal instead of map/hash lookups;
-  //     * The list of tranzition entries is not cleaned up.
-  //       It contains overlapping entries (like "any token" at the end
-  //       of the list).
+	ParsingStep_Precedence::Record * const record = step->top_record;
 
-    if (switch_grammar_entry->any_tranzition) {
-        *ret_res = true;
-        return Result::Success;
+	if (!parsing_state->streamSetPosition (&record->op_pos))
+	    return Result::Failure;
+
+	// The operator is a single token.
+	DEBUG_NEGC (
+          errs->println (_func, "go left");
+	)
+	parsing_state->negative_cache.goLeft ();
+	assert (step->go_right_count > 0);
+	step->go_right_count --;
+
+	if (parsing_state->event_log)
+	    parsing_state->event_log->setLevel (record->op_event_level);
+
+	if (parsing_state->action_log)
+	    parsing_state->action_log->setLevel (record->op_action_level);
+
+	step->operand_element = record->left;
+	step->top_record = record->prv;
+
+	VStack::Level const tmp_el_level = record->op_el_level;
+	VStack::Level const tmp_vstack_level = record->vstack_level;
+	record->~Record ();
+
+	parsing_state->el_vstack->setLevel (tmp_el_level);
+	parsing_state->step_vstack.setLevel (tmp_vstack_level);
+
+	return parse_precedence_finish (parsing_state, step);
     }
 
     ConstMemory token;
-    StRef<StReferenced> user_obj;
-    void *user_ptr;
     {
-	TokenStream::PositionMarker pmark;
-	parsing_state->token_stream->getPosition (&pmark);
-        {
-            if (!parsing_state->token_stream->getNextToken (&token, &user_obj, &user_ptr))
-                return Result::Failure;
-        }
-	if (!parsing_state->token_stream->setPosition (&pmark))
-            return Result::Failure;
+	typename ParsingState<TokenStreamT>::StreamPosition pmark;
+	if (!parsing_state->streamGetPosition (&pmark))
+	    return Result::Failure;
+
+	StRef<StReferenced> user_obj;
+	void *user_ptr;
+	if (!parsing_state->streamGetNextToken (&token, &user_obj, &user_ptr))
+	    return Result::Failure;
+
+	if (!parsing_state->streamSetPosition (&pmark))
+	    return Result::Failure;
     }
 
-    if (token.len() == 0) {
-        *ret_res = false;
-        return Result::Success;
+    Grammar_Precedence::Operator * const op =
+	    (token.len() > 0 ? grammar->lookupOperator (token) : NULL);
+    if (!op)
+	return parse_precedence_finish (parsing_state, step);
+
+    DEBUG_INT (
+      errs->println (_func, "operator: ", token);
+    )
+
+    // Left-associative operators of the same precedence are reduced first.
+    while (step->top_record &&
+	   (step->top_record->op->precedence > op->precedence ||
+	    (step->top_record->op->precedence == op->precedence && !op->right_assoc)))
+    {
+	bool done;
+	if (!precedence_reduce_one (parsing_state, step, &done))
+	    return Result::Failure;
+
+	if (done)
+	    return Result::Success;
     }
 
+    VStack::Level const tmp_vstack_level = parsing_state->step_vstack.getLevel ();
+    ParsingStep_Precedence::Record * const record =
+	    new (parsing_state->step_vstack.push_malign (
+                                sizeof (ParsingStep_Precedence::Record), alignof (ParsingStep_Precedence::Record)))
+                        ParsingStep_Precedence::Record;
+    record->vstack_level = tmp_vstack_level;
+    record->prv = step->top_record;
+    record->left = step->operand_element;
+    record->op = op;
+    record->op_element = NULL;
+
+    if (!parsing_state->streamGetPosition (&record->op_pos))
+	return Result::Failure;
+    record->op_el_level = parsing_state->el_vstack->getLevel ();
+    record->op_event_level = (parsing_state->event_log ? parsing_state->event_log->getLevel () : 0);
+    record->op_action_level = (parsing_state->action_log ? parsing_state->action_log->getLevel () : 0);
+
+    step->top_record = record;
+
     {
-	List< StRef<TranzitionMatchEntry> >::DataIterator iter (
-		switch_grammar_entry->tranzition_match_entries);
-	while (!iter.done ()) {
-	    StRef<TranzitionMatchEntry> &tranzition_match_entry = iter.next ();
+      // Consuming the operator. The second entry of the binary grammar
+      // matches any token, which gives us the usual token element.
 
-	    DEBUG_OPT2 (
-              errs->println ("--- TOKEN MATCH CB");
-	    )
+	Grammar_Compound * const binary_grammar = static_cast <Grammar_Compound*> (grammar->binary_grammar.ptr());
+	List< StRef<CompoundGrammarEntry> >::Element * const op_el = binary_grammar->grammar_entries.first->next;
+	assert (op_el);
 
-	    if (tranzition_match_entry->token_match_cb (token,
-							user_ptr,
-							parsing_state->user_data))
-	    {
-                *ret_res = true;
-                return Result::Success;
-	    }
-	}
-    }
+	VSlabRef< PtrAcceptor<ParserElement> > acceptor =
+		VSlabRef< PtrAcceptor<ParserElement> >::forRef < PtrAcceptor<ParserElement> > (
+			parsing_state->ptr_acceptor_slab.alloc ());
+	acceptor->init (&record->op_element);
 
-    DEBUG_OPT2 (
-      errs->println ("--- FIND: ", token.mem());
-    )
-    if (switch_grammar_entry->tranzition_entries.lookup (token)) {
-        *ret_res = true;
-        return Result::Success;
+	ParsingResult pres;
+	if (!parse_grammar (parsing_state, op_el->data->grammar, acceptor, false /* optional */, &pres))
+	    return Result::Failure;
+
+	assert (pres == ParseNonemptyMatch);
     }
 
-    *ret_res = false;
-    return Result::Success;
-#else
-    *ret_res = true;
-    return Result::Success;
-#endif // PARGEN_FORWARD_OPTIMIZATION
+    step->operand_element = NULL;
+    return parse_precedence_operand (parsing_state, step);
 }
 
+template <class TokenStreamT>
 static mt_throws Result
-parse_switch_upwards_green (ParsingState       * const mt_nonnull parsing_state,
-			    SwitchGrammarEntry * const mt_nonnull switch_grammar_entry,
-                            bool               * const mt_nonnull ret_res)
+parse_precedence_operand (ParsingState<TokenStreamT> * const mt_nonnull parsing_state,
+			  ParsingStep_Precedence     * const mt_nonnull step)
 {
-  FUNC_NAME (
-    char const * const _func_name = "Pargen.Parser.parse_switch_upwards_green";
-  )
+    DEBUG_FLO (
+      errs->println (_func_);
+    )
 
-#ifdef PARGEN_NEGATIVE_CACHE
-    if (parsing_state->negative_cache.isNegative (switch_grammar_entry->grammar)) {
-	DEBUG_NEGC (
-          errs->println (_func, "negative ", switch_grammar_entry->grammar->toString ());
-	)
+    VSlabRef< PtrAcceptor<ParserElement> > acceptor =
+	    VSlabRef< PtrAcceptor<ParserElement> >::forRef < PtrAcceptor<ParserElement> > (
+		    parsing_state->ptr_acceptor_slab.alloc ());
+    acceptor->init (&step->operand_element);
 
-        *ret_res = false;
-        return Result::Success;
+    ParsingResult pres;
+    if (!parse_grammar (parsing_state,
+                        static_cast <Grammar_Precedence*> (step->grammar)->operand_grammar,
+                        acceptor,
+                        false /* optional */,
+                        &pres))
+    {
+        return Result::Failure;
     }
-#endif
 
-    if (switch_grammar_entry->grammar->optimized)
-	return parse_switch_upwards_green_forward (parsing_state, switch_grammar_entry, ret_res);
+    if (pres == ParseUp)
+	return Result::Success;
 
-    *ret_res = true;
-    return Result::Success;
+    return parse_precedence_operand_done (parsing_state, step, pres == ParseNonemptyMatch);
 }
 
+template <class TokenStreamT>
 static mt_throws Result
-parse_switch_no_match_yet (ParsingState       * const mt_nonnull parsing_state,
-			   ParsingStep_Switch * const mt_nonnull step)
+parse_up (ParsingState<TokenStreamT> * const mt_nonnull parsing_state)
 {
-    DEBUG_FLO (
-      errs->print (_func_);
-    )
+    assert (parsing_state);
 
-    assert (parsing_state && step);
+    ParsingStep &_step = parsing_state->getLastStep ();
 
-    // Here we're going to deal with left recursion.
-    //
-    // The general case for left recursion is the following:
-    //
-    //     a:
-    //         b_opt a c
-    //
-    // This grammar turns out to be left-recursive if b_opt evalutes
-    // to an empty sequence. In this case, we get "a: a c", which can't
-    // be processed by out left-to-right parser without special treatment.
-    //
-    // We're going to deal with this by delaying parsing of left-recursive
-    // grammars until any non-left-recursive grammar evaluates
-    // to a non-empty sequence.
-    //
-    // In general, any left-recursive grammar can potentially be parsed
-    // only if it is a part of a switch-type parent with at least one
-    // non-left-recursive child. Once we've got a match for such a child,
-    // we can move forward with parsing the recursive ones, throwing away
-    // recursive references at their left. We can do this by simulating
-    // a match for the first element of the corresponding compound grammars.
-    //
-    // Left-recursive grammars are always a better match than non-left-recursive
-    // ones.
-    //
-    // We'll parse the following grammar in two steps:
-    //
-    //     a:
-    //         b
-    //         d
-    //         a c
-    //         a e
-    //
-    //     1. Parse switch { "b", "d" }, choose the one that matches
-    //        (say, "b"), remember it.
-    //     2. Parse switch { "a c", "a e" }, with "a" pre-matched as "b".
-    //        If we've got a match, then that's the result. If not, then
-    //        the result is the remembered "b".
-    //
-    // If a left-recursive grammar's match sequence is not longer than
-    // the remembered one the remember non-left-recursive grammar
-    //
-    // Note that multiple occurences of references to the parent grammar
-    // is not a special case. As long as we've got a match for the leftmost
-    // reference, the rest of the grammar is not left-recursive anymore,
-    // and we can safely parse it as usual.
+    switch (_step.parsing_step_type) {
+	case ParsingStep::t_Sequence: {
+	    DEBUG_INT (
+	      errs->println (_func, "ParsingStep::_Sequence");
+	    )
+	    ParsingStep_Sequence &step = static_cast <ParsingStep_Sequence&> (_step);
 
-    switch (step->state) {
-	case ParsingStep_Switch::State_NLR: {
-	  // At this step we're parsing non-left-recursive grammars only.
+            return parse_sequence_match (parsing_state, &step, false /* item_done */);
+	} break;
+	case ParsingStep::t_Compound: {
+	    DEBUG_INT (
+	      errs->println (_func, "ParsingStep::_Compound");
+	    )
 
-	    DEBUG (
-              errs->println (_func, "NLR");
+	    ParsingStep_Compound &step = static_cast <ParsingStep_Compound&> (_step);
+
+	    if (static_cast <Grammar_Compound*> (step.grammar)->getFirstSubgrammar () == step.grammar) {
+	      // FIXME 1) This is now allowed;
+	      //       2) This assertion should be hit for lr grammars.
+	      //
+	      // The compound grammar happens to be left-recursive. We do not support that.
+                unreachable ();
+	    }
+
+	    if (step.grammar->begin_func != NULL)
+		call_begin_func (parsing_state, step.grammar);
+
+	    return parse_compound_match (parsing_state, &step, true /* empty_match */);
+	} break;
+	case ParsingStep::t_Switch: {
+	    DEBUG_INT (
+	      errs->println (_func, "ParsingStep::_Switch");
 	    )
 
-	    // Workaround for the unfortunate side effect of acceptor initialization:
-	    // it nullifies the target pointer.
-	    ParserElement *tmp_nlr_parser_element = step->nlr_parser_element;
+	    ParsingStep_Switch &step = static_cast <ParsingStep_Switch&> (_step);
 
-#ifndef VSLAB_ACCEPTOR
-	    StRef<Acceptor> const nlr_acceptor =
-		    st_grab (static_cast <Acceptor*> (new (std::nothrow) RefAcceptor<ParserElement> (&step->nlr_parser_element)));
-#else
-	    VSlabRef< PtrAcceptor<ParserElement> > const nlr_acceptor =
-		    VSlabRef< PtrAcceptor<ParserElement> >::forRef < PtrAcceptor<ParserElement> > (
-			    parsing_state->ptr_acceptor_slab.alloc ());
-	    nlr_acceptor->init (&step->nlr_parser_element);
+	    if (step.grammar->begin_func != NULL)
+		call_begin_func (parsing_state, step.grammar);
+
+	    return parse_switch_no_match_yet (parsing_state, &step);
+	} break;
+	case ParsingStep::t_Alias: {
 	    DEBUG_INT (
-              errs->println (_func, "NLR: acceptor: "
-                             "0x", fmt_hex, (Uint64) (Acceptor*) nlr_acceptor);
+              errs->println (_func, "ParsingStep::_Alias");
 	    )
-#endif
 
-	    step->nlr_parser_element = tmp_nlr_parser_element;
+	    ParsingStep_Alias &step = static_cast <ParsingStep_Alias&> (_step);
 
-	    bool got_new_step = false;
-	    while (step->cur_nlr_el != NULL) {
-		DEBUG (
-                  errs->println (_func, "NLR: iteration");
-		)
+	    if (step.grammar->begin_func != NULL)
+		call_begin_func (parsing_state, step.grammar);
+
+	    return parse_alias (parsing_state, &step);
+	} break;
+	case ParsingStep::t_Precedence: {
+	    DEBUG_INT (
+              errs->println (_func, "ParsingStep::_Precedence");
+	    )
 
-		SwitchGrammarEntry &entry = *step->cur_nlr_el->data;
-		step->cur_nlr_el = step->cur_nlr_el->next;
+	    ParsingStep_Precedence &step = static_cast <ParsingStep_Precedence&> (_step);
 
-		if (!is_cur_variant (parsing_state, &entry))
-		    continue;
+	    if (step.grammar->begin_func != NULL)
+		call_begin_func (parsing_state, step.grammar);
+
+	    return parse_precedence_operand (parsing_state, &step);
+	} break;
+	default:
+            unreachable ();
+    };
+
+    unreachable ();
+    return Result::Success;
+}
+
+template <class TokenStreamT>
+static mt_throws Result
+parse_down (ParsingState<TokenStreamT> * const mt_nonnull parsing_state)
+{
+    assert (parsing_state);
+
+    ParsingStep &_step = parsing_state->getLastStep ();
+
+    switch (_step.parsing_step_type) {
+	case ParsingStep::t_Sequence: {
+	    DEBUG_INT (
+	      errs->println (_func, "ParsingStep::_Sequence");
+	    )
+
+	    ParsingStep_Sequence &step = static_cast <ParsingStep_Sequence&> (_step);
+
+	    if (parsing_state->match) {
+		if (!parse_sequence_match (parsing_state, &step, true /* item_done */))
+                    return Result::Failure;
+            } else {
+		if (!parse_sequence_no_match (parsing_state, &step))
+                    return Result::Failure;
+            }
+	} break;
+	case ParsingStep::t_Compound: {
+	    DEBUG_INT (
+	      errs->println (_func, "ParsingStep::_Compound");
+	    )
+
+	    ParsingStep_Compound &step = static_cast <ParsingStep_Compound&> (_step);
+
+	    if (parsing_state->match) {
+		if (!parse_compound_match (parsing_state, &step, parsing_state->empty_match))
+                    return Result::Failure;
+            } else {
+		if (!parse_compound_no_match (parsing_state, &step))
+                    return Result::Failure;
+            }
+	} break;
+	case ParsingStep::t_Switch: {
+	    DEBUG_INT (
+	      errs->println (_func, "ParsingStep::_Switch");
+	    )
+
+	    ParsingStep_Switch &step = static_cast <ParsingStep_Switch&> (_step);
+
+	    if (parsing_state->match) {
+		if (!parse_switch_match (parsing_state, &step, true /* match */, parsing_state->empty_match))
+                    return Result::Failure;
+            } else {
+		if (!parse_switch_no_match_yet (parsing_state, &step))
+                    return Result::Failure;
+            }
+	} break;
+	case ParsingStep::t_Alias: {
+	    DEBUG_INT (
+              errs->println (_func, "ParsingStep::_Alias");
+	    )
 
-                {
-                    bool res = false;
-                    if (!parse_switch_upwards_green (parsing_state, &entry, &res))
-                        return Result::Failure;
-                    if (!res)
-                        continue;
-                }
+	    ParsingStep_Alias &step = static_cast <ParsingStep_Alias&> (_step);
 
-		// I suppose that the better option is to give up on detecting left-recursive
-		// grammars for the cases where subgrammar is not a compound one. For pargen-generated
-		// grammars this means we're never giving up :)
-		if (entry.grammar->grammar_type == Grammar::t_Compound) {
-		    DEBUG (
-                      errs->println (_func, "NLR: _Compound");
+	    if (parsing_state->match && !parsing_state->empty_match) {
+		bool user_match = true;
+		if (step.grammar->match_func != NULL) {
+		    DEBUG_CB (
+                      errs->println (_func, "calling match_func()");
 		    )
+		    parsing_state->position_changed = false;
+		    if (!step.grammar->match_func (step.parser_element, parsing_state, parsing_state->user_data))
+			user_match = false;
 
-		    Grammar_Compound *grammar = static_cast <Grammar_Compound*> (entry.grammar.ptr ());
+		    if (parsing_state->position_changed)
+			return Result::Success;;
+		}
 
-		    {
-			Grammar * const first_subg = grammar->getFirstSubgrammar ();
-			if (first_subg == step->grammar)
-			{
-			  // The subgrammar happens to be a left-recursive one.
-			  // We're simply proceeding to the next subgrammar.
+		if (user_match) {
+		    if (step.grammar->accept_func != NULL)
+			call_accept_func (parsing_state, step.grammar, step.parser_element);
 
-			    continue;
-			}
-		    }
+		    // This is a non-empty match case.
+		    accept_element (parsing_state, &step, step.parser_element);
 
-		    VStack::Level const tmp_vstack_level = parsing_state->step_vstack.getLevel ();
-		    VStack::Level const tmp_el_level = parsing_state->el_vstack->getLevel ();
-		    ParsingStep_Compound * const compound_step =
-			    new (parsing_state->step_vstack.push_malign (
-                                                sizeof (ParsingStep_Compound), alignof (ParsingStep_Compound)))
-                                        ParsingStep_Compound;
-		    compound_step->vstack_level = tmp_vstack_level;
-		    compound_step->el_level = tmp_el_level;
-		    compound_step->lr_parent = step->grammar;
-		    compound_step->acceptor = nlr_acceptor;
-		    compound_step->optional = false;
-		    compound_step->grammar = grammar;
-		    compound_step->cur_subg_el = grammar->grammar_entries.first;
-		    compound_step->parser_element = grammar->createParserElement (parsing_state->el_vstack);
-		    push_step (parsing_state, compound_step);
+		    if (!pop_step (parsing_state, true /* match */, false /* empty_match */))
+                        return Result::Failure;
 		} else {
-		    DEBUG (
-                      errs->println (_func, "NLR: non-compound");
-		    )
+		  // FIXME Code duplication (see right below)
 
-		    // TEST
-                    unreachable ();
+		    if (_step.optional) {
+		      // This is an empty match case.
 
-		    // Note: this path is currently inadequate.
-#if 0
-		    ParsingResult pres = parse_grammar (parsing_state, entry.grammar, nlr_acceptor, false /* optional */);
-		    if (pres == ParseEmptyMatch ||
-			pres == ParseNoMatch)
-		    {
-			continue;
-		    }
+			if (step.grammar->accept_func != NULL)
+			    call_accept_func (parsing_state, step.grammar, NULL);
 
-		    if (pres == ParseNonemptyMatch) {
-			step->parser_element = step->nlr_parser_element;
-			// TODO Call match_func here (helps to avoid recursion)
-			if (!parse_switch_match (parsing_state, step, true /* match */, false /* empty_match */))
+			if (!pop_step (parsing_state, true /* match */, true /* empty_match */))
                             return Result::Failure;
 		    } else {
-			assert (pres == ParseUp);
-                    }
-#endif
-		}
-
-		got_new_step = true;
-		break;
-	    }
-
-	    if (!got_new_step) {
-		if (step->got_empty_nlr_match) {
-		  // We've got an empty match. It cannot be used for handling left-recursive grammars,
-		  // so we just accept it.
-
-		    DEBUG_INT (
-                      errs->println (_func, "empty NLR match, step->nlr_parser_element: "
-                                     "0x", fmt_hex, (UintPtr) step->nlr_parser_element);
-		    )
-		    step->parser_element = step->nlr_parser_element;
-
-		    if (step->grammar->accept_func != NULL) {
-			DEBUG_CB (
-                          errs->println (_func, "calling accept_func()");
-			)
-			step->grammar->accept_func (step->parser_element,
-						    parsing_state,
-						    parsing_state->user_data);
+			if (!pop_step (parsing_state, false /* match */, false /* empty_match */))
+                            return Result::Failure;
 		    }
+		}
+	    } else {
+		if (_step.optional) {
+		    // This is an empty match case.
+		    assert (!step.parser_element);
+		    if (step.grammar->accept_func != NULL)
+			call_accept_func (parsing_state, step.grammar, NULL);
 
-		    if (!parse_switch_final_match (parsing_state, step, true /* empty_match */))
+		    if (!pop_step (parsing_state, true /* match */, true /* empty_match */))
                         return Result::Failure;
 		} else {
-		  // We've tried all of the Switch grammar's non-left-recursive subgrammars,
-		  // and none of them match.
-
-		  // Still, if there are lef-recursive subgrammars with optional left-recursive part,
-		  // then there might be a match for the current switch grammar.
-		  // Proceeding to left-recursive subgrammars handling.
-
-		  // Note: This code path and functions' naming is counterintuitive.
-		  // It would make sense to sort this out.
-
-		    if (!parse_switch_match (parsing_state, step, false /* match */, false /* empty_match */))
+		    if (!pop_step (parsing_state, false /* match */, false /* empty_match */))
                         return Result::Failure;
 		}
 	    }
 	} break;
-	case ParsingStep_Switch::State_LR: {
-	  // We're parsing only left-recursive grammars now.
-
-	    DEBUG (
-              errs->println (_func, "LR");
-	    )
-
-#ifndef VSLAB_ACCEPTOR
-	    StRef<Acceptor> const lr_acceptor =
-		    st_grab (static_cast <Acceptor*> (new (std::nothrow) RefAcceptor<ParserElement> (&step->parser_element)));
-#else
-	    VSlabRef< PtrAcceptor<ParserElement> > const lr_acceptor =
-		    VSlabRef< PtrAcceptor<ParserElement> >::forRef < PtrAcceptor<ParserElement> > (
-			    parsing_state->ptr_acceptor_slab.alloc ());
-	    lr_acceptor->init (&step->parser_element);
+	case ParsingStep::t_Precedence: {
 	    DEBUG_INT (
-              errs->println (_func, "LR: acceptor: 0x", fmt_hex, (Uint64) (Acceptor*) lr_acceptor);
+              errs->println (_func, "ParsingStep::_Precedence");
 	    )
-#endif
 
-	    bool got_new_step = false;
-	    while (step->cur_lr_el != NULL) {
-		DEBUG (
-                  errs->println (_func, "LR: iteration");
-		)
+	    ParsingStep_Precedence &step = static_cast <ParsingStep_Precedence&> (_step);
 
-		SwitchGrammarEntry &entry = *step->cur_lr_el->data;
-		step->cur_lr_el = step->cur_lr_el->next;
+	    if (!parse_precedence_operand_done (parsing_state,
+						&step,
+						parsing_state->match && !parsing_state->empty_match))
+	    {
+                return Result::Failure;
+	    }
+	} break;
+	default:
+            unreachable ();
+    }
 
-		if (entry.grammar->grammar_type != Grammar::t_Compound)
-		    continue;
+    return Result::Success;
+}
 
-		if (!is_cur_variant (parsing_state, &entry))
-		    continue;
+// Adds the first tokens of non-left-recursive entries of @grammar
+// to @predict_entries. Returns false if an entry doesn't have a fixed set
+// of first tokens, or if a token is shared by two entries.
+static bool
+add_predict_entries (Grammar_Switch                   * const mt_nonnull grammar,
+		     Grammar_Switch::PredictEntryHash * const mt_nonnull predict_entries)
+{
+    for (List< StRef<SwitchGrammarEntry> >::Element *el = grammar->grammar_entries.first;
+         el;
+         el = el->next)
+    {
+	SwitchGrammarEntry * const entry = el->data;
+	if (entry->left_recursive)
+	    continue;
 
-	      // Note: checking negative cache here is pointless, since it will
-	      // be checked in parse_up() anyway.
+	if (entry->any_tranzition
+	    || !entry->tranzition_match_entries.isEmpty())
+	{
+	    return false;
+	}
 
-		Grammar_Compound *grammar = static_cast <Grammar_Compound*> (entry.grammar.ptr ());
+	SwitchGrammarEntry::TranzitionEntryHash::iter iter (entry->tranzition_entries);
+	while (!entry->tranzition_entries.iter_done (iter)) {
+	    SwitchGrammarEntry::TranzitionEntry * const tranzition_entry =
+		    entry->tranzition_entries.iter_next (iter);
 
-		{
-		  // Checking if the grammar is left-recursive and suitable.
+	    if (predict_entries->lookup (tranzition_entry->grammar_name->mem()))
+		return false;
 
-		    CompoundGrammarEntry * const first_subg = grammar->getFirstSubgrammarEntry ();
-		    if (first_subg == NULL ||
-			(first_subg->grammar != step->grammar))
-		    {
-		      // The subgrammar is not a left-recursive one.
-		      // Proceeding to the next subgrammar.
+	    Grammar_Switch::PredictEntry * const predict_entry = new (std::nothrow) Grammar_Switch::PredictEntry;
+	    assert (predict_entry);
+	    predict_entry->token = tranzition_entry->grammar_name;
+	    predict_entry->entry_el = el;
+	    predict_entries->add (predict_entry);
+	}
+    }
 
-			DEBUG (
-                          errs->println (_func, "LR: non-lr");
-			)
+    return true;
+}
 
-			continue;
-		    }
+// Fills Grammar_Switch::predict_entries if the switch is deterministic
+// with one token of lookahead. Called after tranzitions of all entries
+// have been collected. 'predict_entries' stays empty otherwise.
+static void
+optimize_switch_predictive (Grammar_Switch * const mt_nonnull grammar)
+{
+    grammar->predictive = false;
 
-		    if (!step->got_empty_nlr_match    &&
-			!step->got_nonempty_nlr_match &&
-			!(first_subg->flags & CompoundGrammarEntry::Optional))
-		    {
-		      // If we've got an empty nlr match, then only left-recursive grammars
-		      // with optional left-recursive part can match.
+    {
+      // Checking the entries first, so that a non-predictive switch
+      // is left without a partial table.
+	Grammar_Switch::PredictEntryHash predict_entries;
+	bool const predictive = add_predict_entries (grammar, &predict_entries);
 
-			continue;
-		    }
-		}
+	Grammar_Switch::PredictEntryHash::iter iter (predict_entries);
+	while (!predict_entries.iter_done (iter))
+	    delete predict_entries.iter_next (iter);
 
-		got_new_step = true;
+	if (!predictive)
+	    return;
+    }
 
-		VStack::Level const tmp_vstack_level = parsing_state->step_vstack.getLevel ();
-		VStack::Level const tmp_el_level = parsing_state->el_vstack->getLevel ();
-		ParsingStep_Compound * const compound_step =
-			new (parsing_state->step_vstack.push_malign (
-                                            sizeof (ParsingStep_Compound), alignof (ParsingStep_Compound)))
-                                    ParsingStep_Compound;
-		compound_step->vstack_level = tmp_vstack_level;
-		compound_step->el_level = tmp_el_level;
-		compound_step->lr_parent = step->grammar;
-		compound_step->acceptor = lr_acceptor;
-		compound_step->optional = false;
-		compound_step->grammar = grammar;
-		// We'll start parsing from the second subgrammar (the first one is
-		// a left-recursive reference to the parent grammar).
-		compound_step->cur_subg_el = grammar->getSecondSubgrammarElement ();
-		compound_step->parser_element = grammar->createParserElement (parsing_state->el_vstack);
+    bool ids_complete = true;
+    Size num_id_words = 0;
+    Size num_entries = 0;
 
-//#if 0
-// TODO This breaks normal operation. Look at this carefully.
-// Deprecated as long as we don't call leading inline accept callbacks.
+    for (List< StRef<SwitchGrammarEntry> >::Element *el = grammar->grammar_entries.first;
+         el;
+         el = el->next)
+    {
+	SwitchGrammarEntry * const entry = el->data;
+	if (entry->left_recursive)
+	    continue;
 
-		// Note: This is a hack: we create the checkpoint early to be able
-		// to call inline accept functions for match simulation.
-		if (parsing_state->lookup_data)
-		    parsing_state->lookup_data->newCheckpoint ();
-//#endif
+	if (entry->tranzition_ids_incomplete)
+	    ids_complete = false;
 
-		{
-		  // We're simulating a match. Inline accept callbacks which stand before
-		  // the left-recursive subgrammar must be called.
+	if (entry->num_tranzition_token_id_words > num_id_words)
+	    num_id_words = entry->num_tranzition_token_id_words;
 
-		  // Note: It looks like calling these accept callbacks is confusing and does no good.
+	++num_entries;
+    }
 
-		    List< StRef<CompoundGrammarEntry> >::DataIterator iter (grammar->grammar_entries);
-		    while (!iter.done ()) {
-			StRef<CompoundGrammarEntry> &entry = iter.next ();
-			if (entry->inline_match_func == NULL)
-			    break;
+    // Nothing to choose from.
+    if (num_entries < 2)
+	return;
 
-			// TODO Aborting is a temporal measure.
-			//
-			// [10.09.15] Not so temporal anymore. I think this should become
-			// a permanent ban.
-                        errs->println (_func, "Leading inline accept callbacks in left-recursive grammars "
-                                       "are never called");
-                        unreachable ();
-		    }
-		}
+    add_predict_entries (grammar, &grammar->predict_entries);
+
+    if (ids_complete && num_id_words > 0) {
+	Size const num_ids = num_id_words * 32;
+	List< StRef<SwitchGrammarEntry> >::Element ** const predict_by_id =
+		new (std::nothrow) List< StRef<SwitchGrammarEntry> >::Element* [num_ids];
+	assert (predict_by_id);
+	for (Size i = 0; i < num_ids; ++i)
+	    predict_by_id [i] = NULL;
+
+	for (List< StRef<SwitchGrammarEntry> >::Element *el = grammar->grammar_entries.first;
+	     el;
+	     el = el->next)
+	{
+	    SwitchGrammarEntry * const entry = el->data;
+	    if (entry->left_recursive)
+		continue;
+
+	    for (Size i = 0; i < num_ids; ++i) {
+		if (entry->hasTranzitionTokenId (i))
+		    predict_by_id [i] = el;
+	    }
+	}
 
-		if (step->nlr_parser_element != NULL) {
-		  // Pre-setting the compound grammar's first subgrammar with
-		  // the remembered non-left-recursive match.
+	grammar->predict_by_id = predict_by_id;
+	grammar->num_predict_ids = num_ids;
+    }
 
-		    CompoundGrammarEntry * const cg_entry = grammar->getFirstSubgrammarEntry ();
-		    assert (cg_entry);
+    grammar->predictive = true;
+}
 
-		    if (cg_entry->assignment_func != NULL)
-			cg_entry->assignment_func (compound_step->parser_element, step->nlr_parser_element);
-		}
+static bool
+is_plain_compound_entry (CompoundGrammarEntry * const mt_nonnull entry)
+{
+    return !entry->is_jump
+	   && !entry->is_cut
+	   && !entry->inline_match_func
+	   && entry->flags == 0;
+}
 
-		push_step (parsing_state, compound_step, false /* new_checkpoint */);
-		break;
-	    }
+// Left factoring: sets SwitchGrammarEntry::shared_prefix_len for
+// non-left-recursive entries which start with the same subgrammars
+// as the entries which follow them.
+static void
+optimize_switch_prefixes (Grammar_Switch * const mt_nonnull grammar)
+{
+    // Alternatives of predictive switches never share first tokens.
+    if (grammar->predictive)
+	return;
 
-	    if (!got_new_step) {
-	      // None of left-recursive subgrammars match. In this case,
-	      // the remembered non-left-recursive match is the result.
+    for (List< StRef<SwitchGrammarEntry> >::Element *el = grammar->grammar_entries.first;
+	 el && el->next;
+	 el = el->next)
+    {
+	SwitchGrammarEntry * const entry = el->data;
+	SwitchGrammarEntry * const next_entry = el->next->data;
 
-		DEBUG (
-                  errs->print (_func, "LR: none match");
-		)
+	entry->shared_prefix_len = 0;
 
-		step->parser_element = step->nlr_parser_element;
+	if (entry->left_recursive || next_entry->left_recursive ||
+	    entry->grammar->grammar_type != Grammar::t_Compound ||
+	    next_entry->grammar->grammar_type != Grammar::t_Compound)
+	{
+	    continue;
+	}
 
-		if (step->got_nonempty_nlr_match &&
-		    step->grammar->match_func != NULL)
-		{
-		    DEBUG_CB (
-                      errs->println (_func, "calling match_func()");
-		    )
-		    if (!step->grammar->match_func (step->parser_element, parsing_state, parsing_state->user_data))
-			return pop_step (parsing_state, false /* match */, false /* empty_match */);
-		}
+	List< StRef<CompoundGrammarEntry> >::Element *subg_el =
+		static_cast <Grammar_Compound*> (entry->grammar.ptr ())->grammar_entries.first;
+	List< StRef<CompoundGrammarEntry> >::Element *next_subg_el =
+		static_cast <Grammar_Compound*> (next_entry->grammar.ptr ())->grammar_entries.first;
+
+	Size len = 0;
+	while (len < SwitchGrammarEntry::MaxSharedPrefixLen &&
+	       subg_el && next_subg_el &&
+	       is_plain_compound_entry (subg_el->data) &&
+	       is_plain_compound_entry (next_subg_el->data) &&
+	       subg_el->data->grammar.ptr () == next_subg_el->data->grammar.ptr ())
+	{
+	    ++len;
+	    subg_el = subg_el->next;
+	    next_subg_el = next_subg_el->next;
+	}
 
-		if (step->got_lr_match) {
-		  // We've got a left-recursive match.
+	DEBUG_OPT (
+	    if (len > 0)
+		errs->println ("shared prefix ", len, ": ", entry->grammar->toString (), ", ", next_entry->grammar->toString ());
+	)
 
-		    if (!parse_switch_final_match (parsing_state, step, false /* empty_match */))
-                        return Result::Failure;
-		} else {
-		    if (!step->got_nonempty_nlr_match && !step->got_empty_nlr_match) {
-			if (step->optional) {
-			    if (step->grammar->accept_func != NULL) {
-				DEBUG_CB (
-                                  errs->println (_func, "calling accept_func(NULL)");
-				)
-				step->grammar->accept_func (NULL,
-							    parsing_state,
-							    parsing_state->user_data);
-			    }
+	entry->shared_prefix_len = len;
+    }
+}
 
-			    if (!pop_step (parsing_state, true /* match */, true /* empty_match */))
-                                return Result::Failure;
-			} else
-			    if (!pop_step (parsing_state, false /* match */, false /* empty_match */))
-                                return Result::Failure;
-		    } else {
-			if (step->got_empty_nlr_match) {
-			    if (step->grammar->accept_func != NULL) {
-				DEBUG_CB (
-                                  errs->println (_func, "calling accept_func(NULL)");
-				)
-				step->grammar->accept_func (NULL,
-							    parsing_state,
-							    parsing_state->user_data);
-			    }
+// Sets Grammar_Compound::tail_iteration for "list: item list_opt" grammars.
+// Iterations are handled within a single step, hence user callbacks which
+// would be called for each nested phrase are not supported, as well as
+// upwards jumps. A cut applies to the iteration which contains it, like it
+// would to the nested phrase. There should be a non-optional part before
+// the tail.
+static void
+optimize_tail_iteration (Grammar_Compound * const mt_nonnull grammar)
+{
+    if (grammar->match_func || grammar->accept_func)
+	return;
 
-			    if (!parse_switch_final_match (parsing_state, step, true /* empty_match */))
-                                return Result::Failure;
-			} else
-			    if (!parse_switch_final_match (parsing_state, step, false /* empty_match */))
-                                return Result::Failure;
-		    }
-		}
+    bool got_head = false;
+    for (List< StRef<CompoundGrammarEntry> >::Element *el = grammar->grammar_entries.first;
+	 el;
+	 el = el->next)
+    {
+	CompoundGrammarEntry * const entry = el->data;
+	if (entry->is_jump)
+	    return;
+
+	if (entry->inline_match_func || !entry->grammar)
+	    continue;
+
+	if (el->next == NULL) {
+	    if (got_head &&
+		entry->grammar.ptr () == grammar &&
+		entry->flags == CompoundGrammarEntry::Optional)
+	    {
+		DEBUG_OPT (
+		    errs->println ("tail iteration: ", grammar->toString ());
+		)
+		grammar->tail_iteration = true;
 	    }
-	} break;
-	default:
-            unreachable ();
-    }
 
-    DEBUG (
-      errs->println (_func, "done");
-    )
-    return Result::Success;
+	    return;
+	}
+
+	if (!(entry->flags & CompoundGrammarEntry::Optional))
+	    got_head = true;
+    }
 }
 
-static mt_throws Result
-parse_alias (ParsingState      * const mt_nonnull parsing_state,
-	     ParsingStep_Alias * const mt_nonnull step)
+// optimizeGrammar() works on a graph of grammar nodes. Edges lead from
+// a grammar to its subgrammars. For compound grammars, "first" edges
+// lead to the subgrammars which may be entered at the position where
+// the grammar begins, i.e. the ones preceded by nullable subgrammars only.
+//
+// Nullable flags are propagated from nullable grammars to their parents
+// with a worklist over reverse edges. First tokens are computed for strongly
+// connected components of the graph of "first" edges: all grammars of such
+// component begin with the same set of tokens. The nullable pass visits every
+// node and every edge a constant number of times. The first token pass merges
+// the whole first set of the successor's component for every edge between
+// components, which makes it O(E * |first|). There is no recursion.
+
+namespace {
+class OptNode
 {
-    DEBUG_FLO (
-      errs->println (_func_);
-    )
+public:
+    Grammar *grammar;
 
-    assert (parsing_state && step);
+    // Node indices of subgrammars.
+    Size *succ;
+    // 'true' for subgrammars which are marked as optional.
+    bool *succ_optional;
+    Size num_succ;
+    // The first 'num_first_succ' entries of 'succ' are "first" edges.
+    Size num_first_succ;
+
+    bool nullable;
+    // Used by opt_compute_nullable(): for compound grammars, the number of
+    // non-optional subgrammars which are not known to be nullable yet.
+    Size num_pending;
+
+    // Tarjan's algorithm. 'dfs_index' is 0 for nodes not visited yet.
+    Size dfs_index;
+    Size lowlink;
+    bool on_stack;
+    Size scc;
+
+    // For removing duplicates when merging sets of first tokens.
+    Size stamp;
+};
 
-    VSlabRef< PtrAcceptor<ParserElement> > acceptor =
-	    VSlabRef< PtrAcceptor<ParserElement> >::forRef < PtrAcceptor<ParserElement> > (
-		    parsing_state->ptr_acceptor_slab.alloc ());
-    acceptor->init (&step->parser_element);
+class OptScc
+{
+public:
+    Size *members;
+    Size num_members;
 
-    ParsingResult pres;
-    if (!parse_grammar (parsing_state,
-                        static_cast <Grammar_Alias*> (step->grammar)->aliased_grammar,
-                        acceptor,
-                        step->optional,
-                        &pres))
+    // Node indices of immediate grammars which the grammars
+    // of the component may begin with.
+    Size *first;
+    Size num_first;
+};
+
+class OptState
+{
+public:
+    OptNode *nodes;
+    Size num_nodes;
+    Size nodes_capacity;
+
+    OptScc *sccs;
+    Size num_sccs;
+    Size *scc_members;
+
+    Size cur_stamp;
+
+    OptState ()
+	: nodes (NULL),
+	  num_nodes (0),
+	  nodes_capacity (0),
+	  sccs (NULL),
+	  num_sccs (0),
+	  scc_members (NULL),
+	  cur_stamp (0)
     {
-        return Result::Failure;
     }
+};
+}
 
-    if (pres == ParseUp)
-	return Result::Success;
-
-    switch (pres) {
-	case ParseNonemptyMatch:
-	    if (!pop_step (parsing_state, true /* match */, false /* empty_match */))
-                return Result::Failure;
-	    break;
-	case ParseEmptyMatch:
-	    if (!pop_step (parsing_state, true /* match */, true /* empty_match */))
-                return Result::Failure;
-	    break;
-	case ParseNoMatch:
-	    DEBUG_INT (
-              errs->println (_func, "pop_step: false, false");
-	    )
-	    if (!pop_step (parsing_state, false /* match */, false /* empty_match */))
-                return Result::Failure;
-	    break;
-	default:
-            unreachable ();
+// Grammar::loop_id holds the node index plus 1 while optimizing.
+static Size
+opt_get_node (OptState * const mt_nonnull state,
+	      Grammar  * const mt_nonnull grammar)
+{
+    if (grammar->loop_id != 0)
+	return grammar->loop_id - 1;
+
+    if (state->num_nodes == state->nodes_capacity) {
+	Size const new_capacity = (state->nodes_capacity ? state->nodes_capacity * 2 : 64);
+	OptNode * const new_nodes = new (std::nothrow) OptNode [new_capacity];
+	assert (new_nodes);
+	for (Size i = 0; i < state->num_nodes; ++i)
+	    new_nodes [i] = state->nodes [i];
+
+	delete[] state->nodes;
+	state->nodes = new_nodes;
+	state->nodes_capacity = new_capacity;
     }
 
-    return Result::Success;
+    Size const index = state->num_nodes;
+    ++state->num_nodes;
+
+    OptNode * const node = &state->nodes [index];
+    node->grammar = grammar;
+    node->succ = NULL;
+    node->succ_optional = NULL;
+    node->num_succ = 0;
+    node->num_first_succ = 0;
+    node->nullable = false;
+    node->num_pending = 0;
+    node->dfs_index = 0;
+    node->lowlink = 0;
+    node->on_stack = false;
+    node->scc = 0;
+    node->stamp = 0;
+
+    grammar->loop_id = index + 1;
+    return index;
 }
 
-static mt_throws Result
-parse_up (ParsingState * const mt_nonnull parsing_state)
+static Size
+opt_node_index (Grammar * const mt_nonnull grammar)
 {
-    assert (parsing_state);
+    assert (grammar->loop_id != 0);
+    return grammar->loop_id - 1;
+}
 
-    ParsingStep &_step = parsing_state->getLastStep ();
+// Collects all grammars reachable from 'root' with their edges.
+static void
+opt_collect_nodes (OptState * const mt_nonnull state,
+		   Grammar  * const mt_nonnull root)
+{
+    opt_get_node (state, root);
 
-    switch (_step.parsing_step_type) {
-	case ParsingStep::t_Sequence: {
-	    DEBUG_INT (
-	      errs->println (_func, "ParsingStep::_Sequence");
-	    )
-	    ParsingStep_Sequence &step = static_cast <ParsingStep_Sequence&> (_step);
+    // Newly found grammars are appended to 'state->nodes'.
+    for (Size index = 0; index < state->num_nodes; ++index) {
+	Grammar * const grammar = state->nodes [index].grammar;
 
-            return parse_sequence_match (parsing_state, &step);
-	} break;
-	case ParsingStep::t_Compound: {
-	    DEBUG_INT (
-	      errs->println (_func, "ParsingStep::_Compound");
-	    )
+	Size num_succ = 0;
+	switch (grammar->grammar_type) {
+	    case Grammar::t_Immediate:
+		break;
+	    case Grammar::t_Compound: {
+		List< StRef<CompoundGrammarEntry> >::DataIterator iter (
+			static_cast <Grammar_Compound*> (grammar)->grammar_entries);
+		while (!iter.done ()) {
+		    StRef<CompoundGrammarEntry> &compound_grammar_entry = iter.next ();
+		  // _AcceptCb or _UniversalAcceptCb or UpwardsAnchor have no grammar.
+		    if (compound_grammar_entry->grammar)
+			++num_succ;
+		}
+	    } break;
+	    case Grammar::t_Switch:
+		num_succ = static_cast <Grammar_Switch*> (grammar)->grammar_entries.getNumElements ();
+		break;
+	    case Grammar::t_Alias:
+		num_succ = 1;
+		break;
+	    case Grammar::t_Precedence:
+		num_succ = 2;
+		break;
+	    default:
+		unreachable ();
+	}
 
-	    ParsingStep_Compound &step = static_cast <ParsingStep_Compound&> (_step);
+	if (num_succ == 0)
+	    continue;
 
-	    if (static_cast <Grammar_Compound*> (step.grammar)->getFirstSubgrammar () == step.grammar) {
-	      // FIXME 1) This is now allowed;
-	      //       2) This assertion should be hit for lr grammars.
-	      //
-	      // The compound grammar happens to be left-recursive. We do not support that.
-                unreachable ();
-	    }
+	Size * const succ = new (std::nothrow) Size [num_succ];
+	assert (succ);
+	bool * const succ_optional = new (std::nothrow) bool [num_succ];
+	assert (succ_optional);
+
+	Size i = 0;
+	switch (grammar->grammar_type) {
+	    case Grammar::t_Compound: {
+		List< StRef<CompoundGrammarEntry> >::DataIterator iter (
+			static_cast <Grammar_Compound*> (grammar)->grammar_entries);
+		while (!iter.done ()) {
+		    StRef<CompoundGrammarEntry> &compound_grammar_entry = iter.next ();
+		    if (!compound_grammar_entry->grammar)
+			continue;
 
-	    if (step.grammar->begin_func != NULL)
-		step.grammar->begin_func (parsing_state->user_data);
+		    succ [i] = opt_get_node (state, compound_grammar_entry->grammar);
+		    succ_optional [i] = (compound_grammar_entry->flags & CompoundGrammarEntry::Optional);
 
-	    return parse_compound_match (parsing_state, &step, true /* empty_match */);
-	} break;
-	case ParsingStep::t_Switch: {
-	    DEBUG_INT (
-	      errs->println (_func, "ParsingStep::_Switch");
-	    )
+		    ++i;
+		}
+	    } break;
+	    case Grammar::t_Switch: {
+		List< StRef<SwitchGrammarEntry> >::DataIterator iter (
+			static_cast <Grammar_Switch*> (grammar)->grammar_entries);
+		while (!iter.done ()) {
+		    StRef<SwitchGrammarEntry> &switch_grammar_entry = iter.next ();
 
-	    ParsingStep_Switch &step = static_cast <ParsingStep_Switch&> (_step);
+		    succ [i] = opt_get_node (state, switch_grammar_entry->grammar);
+		    succ_optional [i] = (switch_grammar_entry->flags & CompoundGrammarEntry::Optional);
 
-	    if (step.grammar->begin_func != NULL)
-		step.grammar->begin_func (parsing_state->user_data);
+		    ++i;
+		}
+	    } break;
+	    case Grammar::t_Alias:
+		succ [0] = opt_get_node (state, static_cast <Grammar_Alias*> (grammar)->aliased_grammar);
+		succ_optional [0] = false;
+		break;
+	    case Grammar::t_Precedence: {
+		Grammar_Precedence * const grammar__precedence = static_cast <Grammar_Precedence*> (grammar);
+	      // Every match starts with an operand, which makes it the only
+	      // "first" edge. 'binary_grammar' is never entered by the parser
+	      // directly, but it is collected to be frozen with the rest.
+		succ [0] = opt_get_node (state, grammar__precedence->operand_grammar);
+		succ_optional [0] = false;
+		succ [1] = opt_get_node (state, grammar__precedence->binary_grammar);
+		succ_optional [1] = false;
+	    } break;
+	    default:
+		unreachable ();
+	}
 
-	    return parse_switch_no_match_yet (parsing_state, &step);
-	} break;
-	case ParsingStep::t_Alias: {
-	    DEBUG_INT (
-              errs->println (_func, "ParsingStep::_Alias");
-	    )
+	// 'state->nodes' may have been reallocated.
+	OptNode * const node = &state->nodes [index];
+	node->succ = succ;
+	node->succ_optional = succ_optional;
+	node->num_succ = num_succ;
+	node->num_first_succ = (grammar->grammar_type == Grammar::t_Precedence ? 1 : num_succ);
+    }
+}
 
-	    ParsingStep_Alias &step = static_cast <ParsingStep_Alias&> (_step);
+// Iterative Tarjan's algorithm over "first" edges. Components are numbered
+// in reverse topological order: successors of a component get lower numbers.
+// Fills 'state->sccs'.
+static void
+opt_find_sccs (OptState * const mt_nonnull state)
+{
+    Size const num_nodes = state->num_nodes;
 
-	    if (step.grammar->begin_func != NULL)
-		step.grammar->begin_func (parsing_state->user_data);
+    for (Size i = 0; i < num_nodes; ++i) {
+	state->nodes [i].dfs_index = 0;
+	state->nodes [i].on_stack = false;
+    }
 
-	    return parse_alias (parsing_state, &step);
-	} break;
-	default:
-            unreachable ();
-    };
+    Size * const scc_stack = new (std::nothrow) Size [num_nodes];
+    assert (scc_stack);
+    Size * const call_node = new (std::nothrow) Size [num_nodes];
+    assert (call_node);
+    Size * const call_edge = new (std::nothrow) Size [num_nodes];
+    assert (call_edge);
 
-    unreachable ();
-    return Result::Success;
-}
+    Size scc_top = 0;
+    Size next_dfs_index = 1;
+    Size num_sccs = 0;
 
-static mt_throws Result
-parse_down (ParsingState * const mt_nonnull parsing_state)
-{
-    assert (parsing_state);
+    for (Size root = 0; root < num_nodes; ++root) {
+	if (state->nodes [root].dfs_index != 0)
+	    continue;
 
-    ParsingStep &_step = parsing_state->getLastStep ();
+	Size call_top = 0;
+	call_node [call_top] = root;
+	call_edge [call_top] = 0;
+	++call_top;
+
+	state->nodes [root].dfs_index = next_dfs_index;
+	state->nodes [root].lowlink = next_dfs_index;
+	++next_dfs_index;
+	state->nodes [root].on_stack = true;
+	scc_stack [scc_top++] = root;
+
+	while (call_top > 0) {
+	    Size const v = call_node [call_top - 1];
+	    OptNode * const v_node = &state->nodes [v];
+
+	    Size const num_edges = v_node->num_first_succ;
+	    if (call_edge [call_top - 1] < num_edges) {
+		Size const w = v_node->succ [call_edge [call_top - 1]];
+		++call_edge [call_top - 1];
+
+		OptNode * const w_node = &state->nodes [w];
+		if (w_node->dfs_index == 0) {
+		    w_node->dfs_index = next_dfs_index;
+		    w_node->lowlink = next_dfs_index;
+		    ++next_dfs_index;
+		    w_node->on_stack = true;
+		    scc_stack [scc_top++] = w;
+
+		    call_node [call_top] = w;
+		    call_edge [call_top] = 0;
+		    ++call_top;
+		} else
+		if (w_node->on_stack) {
+		    if (w_node->dfs_index < v_node->lowlink)
+			v_node->lowlink = w_node->dfs_index;
+		}
 
-    switch (_step.parsing_step_type) {
-	case ParsingStep::t_Sequence: {
-	    DEBUG_INT (
-	      errs->println (_func, "ParsingStep::_Sequence");
-	    )
+		continue;
+	    }
 
-	    ParsingStep_Sequence &step = static_cast <ParsingStep_Sequence&> (_step);
+	    if (v_node->lowlink == v_node->dfs_index) {
+		for (;;) {
+		    Size const w = scc_stack [--scc_top];
+		    state->nodes [w].on_stack = false;
+		    state->nodes [w].scc = num_sccs;
+		    if (w == v)
+			break;
+		}
 
-	    if (parsing_state->match) {
-		if (!parse_sequence_match (parsing_state, &step))
-                    return Result::Failure;
-            } else {
-		if (!parse_sequence_no_match (parsing_state, &step))
-                    return Result::Failure;
-            }
-	} break;
-	case ParsingStep::t_Compound: {
-	    DEBUG_INT (
-	      errs->println (_func, "ParsingStep::_Compound");
-	    )
+		++num_sccs;
+	    }
+
+	    --call_top;
+	    if (call_top > 0) {
+		OptNode * const parent_node = &state->nodes [call_node [call_top - 1]];
+		if (v_node->lowlink < parent_node->lowlink)
+		    parent_node->lowlink = v_node->lowlink;
+	    }
+	}
+    }
+
+    delete[] scc_stack;
+    delete[] call_node;
+    delete[] call_edge;
+
+    delete[] state->sccs;
+    delete[] state->scc_members;
+
+    state->num_sccs = num_sccs;
+    state->sccs = new (std::nothrow) OptScc [num_sccs];
+    assert (state->sccs);
+    state->scc_members = new (std::nothrow) Size [num_nodes];
+    assert (state->scc_members);
+
+    for (Size i = 0; i < num_sccs; ++i) {
+	state->sccs [i].num_members = 0;
+	state->sccs [i].first = NULL;
+	state->sccs [i].num_first = 0;
+    }
+
+    for (Size i = 0; i < num_nodes; ++i)
+	++state->sccs [state->nodes [i].scc].num_members;
+
+    Size offset = 0;
+    for (Size i = 0; i < num_sccs; ++i) {
+	state->sccs [i].members = state->scc_members + offset;
+	offset += state->sccs [i].num_members;
+	state->sccs [i].num_members = 0;
+    }
 
-	    ParsingStep_Compound &step = static_cast <ParsingStep_Compound&> (_step);
+    for (Size i = 0; i < num_nodes; ++i) {
+	OptScc * const scc = &state->sccs [state->nodes [i].scc];
+	scc->members [scc->num_members] = i;
+	++scc->num_members;
+    }
+}
 
-	    if (parsing_state->match) {
-		if (!parse_compound_match (parsing_state, &step, parsing_state->empty_match))
-                    return Result::Failure;
-            } else {
-		if (!parse_compound_no_match (parsing_state, &step))
-                    return Result::Failure;
-            }
-	} break;
-	case ParsingStep::t_Switch: {
-	    DEBUG_INT (
-	      errs->println (_func, "ParsingStep::_Switch");
-	    )
+// Marks @index as nullable and queues it for propagation to its parents.
+static void
+opt_set_nullable (OptState * const mt_nonnull state,
+		  Size       const index,
+		  Size     * const mt_nonnull queue,
+		  Size     * const mt_nonnull queue_len)
+{
+    OptNode * const node = &state->nodes [index];
+    if (node->nullable)
+	return;
 
-	    ParsingStep_Switch &step = static_cast <ParsingStep_Switch&> (_step);
+    node->nullable = true;
+    queue [*queue_len] = index;
+    ++*queue_len;
+}
 
-	    if (parsing_state->match) {
-		if (!parse_switch_match (parsing_state, &step, true /* match */, parsing_state->empty_match))
-                    return Result::Failure;
-            } else {
-		if (!parse_switch_no_match_yet (parsing_state, &step))
-                    return Result::Failure;
-            }
-	} break;
-	case ParsingStep::t_Alias: {
-	    DEBUG_INT (
-              errs->println (_func, "ParsingStep::_Alias");
-	    )
+static void
+opt_compute_nullable (OptState * const mt_nonnull state)
+{
+    Size const num_nodes = state->num_nodes;
+
+    // Reverse edges: predecessors of node 'i' are
+    // 'preds [pred_start [i] .. pred_start [i + 1] - 1]', one entry per edge.
+    Size * const pred_start = new (std::nothrow) Size [num_nodes + 1];
+    assert (pred_start);
+    for (Size i = 0; i <= num_nodes; ++i)
+	pred_start [i] = 0;
+
+    Size num_edges = 0;
+    for (Size i = 0; i < num_nodes; ++i) {
+	OptNode * const node = &state->nodes [i];
+	for (Size j = 0; j < node->num_succ; ++j)
+	    ++pred_start [node->succ [j] + 1];
+
+	num_edges += node->num_succ;
+    }
 
-	    ParsingStep_Alias &step = static_cast <ParsingStep_Alias&> (_step);
+    for (Size i = 0; i < num_nodes; ++i)
+	pred_start [i + 1] += pred_start [i];
 
-	    if (parsing_state->match && !parsing_state->empty_match) {
-		bool user_match = true;
-		if (step.grammar->match_func != NULL) {
-		    DEBUG_CB (
-                      errs->println (_func, "calling match_func()");
-		    )
-		    parsing_state->position_changed = false;
-		    if (!step.grammar->match_func (step.parser_element, parsing_state, parsing_state->user_data))
-			user_match = false;
+    Size * const preds = new (std::nothrow) Size [num_edges ? num_edges : 1];
+    assert (preds);
+    bool * const preds_optional = new (std::nothrow) bool [num_edges ? num_edges : 1];
+    assert (preds_optional);
+    Size * const queue = new (std::nothrow) Size [num_nodes ? num_nodes : 1];
+    assert (queue);
+    {
+	// 'queue' is not in use yet.
+	Size * const pos = queue;
+	for (Size i = 0; i < num_nodes; ++i)
+	    pos [i] = pred_start [i];
+
+	for (Size i = 0; i < num_nodes; ++i) {
+	    OptNode * const node = &state->nodes [i];
+	    for (Size j = 0; j < node->num_succ; ++j) {
+		Size const k = pos [node->succ [j]];
+		++pos [node->succ [j]];
+		preds [k] = i;
+		preds_optional [k] = node->succ_optional [j];
+	    }
+	}
+    }
 
-		    if (parsing_state->position_changed)
-			return Result::Success;;
+    // Grammars which are nullable regardless of their subgrammars.
+    Size queue_len = 0;
+    for (Size i = 0; i < num_nodes; ++i) {
+	OptNode * const node = &state->nodes [i];
+	switch (node->grammar->grammar_type) {
+	    case Grammar::t_Compound: {
+		for (Size j = 0; j < node->num_succ; ++j) {
+		    if (!node->succ_optional [j])
+			++node->num_pending;
 		}
 
-		if (user_match) {
-		    if (step.grammar->accept_func != NULL)
-			step.grammar->accept_func (step.parser_element, parsing_state, parsing_state->user_data);
+		if (node->num_pending == 0)
+		    opt_set_nullable (state, i, queue, &queue_len);
+	    } break;
+	    case Grammar::t_Switch: {
+		for (Size j = 0; j < node->num_succ; ++j) {
+		    if (node->succ_optional [j]) {
+			opt_set_nullable (state, i, queue, &queue_len);
+			break;
+		    }
+		}
+	    } break;
+	    default:
+		break;
+	}
+    }
 
-		    // This is a non-empty match case.
-		    if (step.acceptor)
-			step.acceptor->setParserElement (step.parser_element);
+    // Every node is queued at most once, and every edge is followed once.
+    for (Size q = 0; q < queue_len; ++q) {
+	Size const index = queue [q];
+	for (Size k = pred_start [index]; k < pred_start [index + 1]; ++k) {
+	    Size const pred_index = preds [k];
+	    OptNode * const pred = &state->nodes [pred_index];
+	    if (pred->nullable)
+		continue;
+
+	    switch (pred->grammar->grammar_type) {
+		case Grammar::t_Compound:
+		    if (!preds_optional [k]) {
+			assert (pred->num_pending > 0);
+			--pred->num_pending;
+			if (pred->num_pending == 0)
+			    opt_set_nullable (state, pred_index, queue, &queue_len);
+		    }
+		    break;
+		case Grammar::t_Switch:
+		case Grammar::t_Alias:
+		    opt_set_nullable (state, pred_index, queue, &queue_len);
+		    break;
+		case Grammar::t_Precedence:
+		  // Nullable if the operand is.
+		    if (pred->succ [0] == index)
+			opt_set_nullable (state, pred_index, queue, &queue_len);
+		    break;
+		default:
+		    unreachable ();
+	    }
+	}
+    }
 
-		    if (!pop_step (parsing_state, true /* match */, false /* empty_match */))
-                        return Result::Failure;
-		} else {
-		  // FIXME Code duplication (see right below)
+    delete[] queue;
+    delete[] preds_optional;
+    delete[] preds;
+    delete[] pred_start;
 
-		    if (_step.optional) {
-		      // This is an empty match case.
+    for (Size i = 0; i < state->num_nodes; ++i) {
+	OptNode * const node = &state->nodes [i];
+	if (node->grammar->grammar_type != Grammar::t_Compound)
+	    continue;
 
-			if (step.grammar->accept_func != NULL)
-			    step.grammar->accept_func (NULL, parsing_state, parsing_state->user_data);
+	node->num_first_succ = node->num_succ;
+	for (Size j = 0; j < node->num_succ; ++j) {
+	    if (!node->succ_optional [j] && !state->nodes [node->succ [j]].nullable) {
+		node->num_first_succ = j + 1;
+		break;
+	    }
+	}
+    }
+}
 
-			if (!pop_step (parsing_state, true /* match */, true /* empty_match */))
-                            return Result::Failure;
-		    } else {
-			if (!pop_step (parsing_state, false /* match */, false /* empty_match */))
-                            return Result::Failure;
-		    }
+static void
+opt_compute_first (OptState * const mt_nonnull state)
+{
+    opt_find_sccs (state);
+
+    Size * const buf = new (std::nothrow) Size [state->num_nodes];
+    assert (buf);
+
+    for (Size i = 0; i < state->num_sccs; ++i) {
+	OptScc * const scc = &state->sccs [i];
+
+	++state->cur_stamp;
+	Size num_first = 0;
+
+	for (Size j = 0; j < scc->num_members; ++j) {
+	    Size const index = scc->members [j];
+	    OptNode * const node = &state->nodes [index];
+
+	    if (node->grammar->grammar_type == Grammar::t_Immediate) {
+		if (node->stamp != state->cur_stamp) {
+		    node->stamp = state->cur_stamp;
+		    buf [num_first++] = index;
 		}
-	    } else {
-		if (_step.optional) {
-		    // This is an empty match case.
-		    assert (!step.parser_element);
-		    if (step.grammar->accept_func != NULL)
-			step.grammar->accept_func (NULL, parsing_state, parsing_state->user_data);
 
-		    if (!pop_step (parsing_state, true /* match */, true /* empty_match */))
-                        return Result::Failure;
-		} else {
-		    if (!pop_step (parsing_state, false /* match */, false /* empty_match */))
-                        return Result::Failure;
+		continue;
+	    }
+
+	    for (Size k = 0; k < node->num_first_succ; ++k) {
+		Size const succ_scc = state->nodes [node->succ [k]].scc;
+		if (succ_scc == i)
+		    continue;
+
+		OptScc * const other = &state->sccs [succ_scc];
+		for (Size l = 0; l < other->num_first; ++l) {
+		    OptNode * const imm_node = &state->nodes [other->first [l]];
+		    if (imm_node->stamp != state->cur_stamp) {
+			imm_node->stamp = state->cur_stamp;
+			buf [num_first++] = other->first [l];
+		    }
 		}
 	    }
-	} break;
-	default:
-            unreachable ();
+	}
+
+	if (num_first > 0) {
+	    scc->first = new (std::nothrow) Size [num_first];
+	    assert (scc->first);
+	    for (Size j = 0; j < num_first; ++j)
+		scc->first [j] = buf [j];
+	}
+	scc->num_first = num_first;
     }
 
-    return Result::Success;
+    delete[] buf;
 }
 
-// If 'tranzition_entries' is NULL, then we're in the process of
-// iterating the nodes of the grammar.
-//
-// If 'tranzition_entries' is non-null, then do_optimizeGrammar() fills
-// 'tranzition_entries' with possible tranzitions for 'grammar'.
-//
-// If 'tranzition_entries' is non-null and the path is fully optional,
-// then 'ret_optional' is set to true on return. Otherwise, 'ret_optional'
-// is set to false. If 'tranzition_entries' is null, then the value
-// of 'ret_optional' after return is undefined. 'ret_optional' may be null.
-//
-// Returns 'true' if a tranzition has been recorded for the current path.
-// If 'tranzition_entries' is null, then return value is undefined.
-//
-// TODO Separate 'tranzition_entries' filling from initial walkthrough.
-//
-static bool
-do_optimizeGrammar (Grammar                                 * const mt_nonnull grammar,
-		    SwitchGrammarEntry::TranzitionEntryHash * const tranzition_entries,
-		    List< StRef<TranzitionMatchEntry> >     * const tranzition_match_entries,
-		    SwitchGrammarEntry                      * const param_switch_grammar_entry,
-		    bool                                    * const ret_optional,
-		    Size                                    * const mt_nonnull loop_id)
-{
-    if (ret_optional)
-	*ret_optional = false;
-
-    if (!tranzition_entries) {
-	if (grammar->optimized)
-	    return false;
+static void
+opt_add_immediate_tranzition (Grammar_Immediate_SingleToken * const mt_nonnull grammar__immediate,
+			      SwitchGrammarEntry            * const mt_nonnull switch_grammar_entry)
+{
+    if (!grammar__immediate->getToken() ||
+	grammar__immediate->getToken()->len() == 0)
+    {
+	if (grammar__immediate->token_match_cb_name) {
+	    DEBUG_OPT (
+		errs->print ("  {", grammar__immediate->token_match_cb_name, "}");
+	    )
+	} else {
+	    assert (!grammar__immediate->token_match_cb);
+	    DEBUG_OPT (
+		errs->print (" ANY");
+	    )
 
-	grammar->optimized = true;
+	    switch_grammar_entry->any_tranzition = true;
+	}
     } else {
-	if (grammar->loop_id == *loop_id) {
-	    if (ret_optional)
-		*ret_optional = true;
+	DEBUG_OPT (
+	    errs->print (" ", grammar__immediate->getToken ());
+	)
+    }
 
-	    return false;
+    if (grammar__immediate->token_match_cb_name) {
+	StRef<TranzitionMatchEntry> const tranzition_match_entry = st_grab (new TranzitionMatchEntry);
+	tranzition_match_entry->token_dfa = grammar__immediate->token_dfa;
+	tranzition_match_entry->token_match_cb = grammar__immediate->token_match_cb;
+	tranzition_match_entry->token_match_cb_pure = grammar__immediate->token_match_cb_pure;
+	DEBUG_OPT2 (
+	  errs->println ("--- TRANZITION MATCH ENTRY");
+	)
+	switch_grammar_entry->tranzition_match_entries.append (tranzition_match_entry);
+    } else
+    if (grammar__immediate->getToken () &&
+	grammar__immediate->getToken ()->len() > 0)
+    {
+	// Different immediate grammars may stand for the same token.
+	if (!switch_grammar_entry->tranzition_entries.lookup (grammar__immediate->getToken()->mem())) {
+	    SwitchGrammarEntry::TranzitionEntry * const tranzition_entry = new SwitchGrammarEntry::TranzitionEntry;
+	    tranzition_entry->grammar_name = grammar__immediate->getToken();
+	    switch_grammar_entry->tranzition_entries.add (tranzition_entry);
 	}
 
-	grammar->loop_id = *loop_id;
+	if (grammar__immediate->token_id != 0)
+	    switch_grammar_entry->addTranzitionTokenId (grammar__immediate->token_id);
+	else
+	    switch_grammar_entry->tranzition_ids_incomplete = true;
     }
+}
 
-    switch (grammar->grammar_type) {
-	case Grammar::t_Immediate: {
-	    Grammar_Immediate_SingleToken * const grammar__immediate =
-		    static_cast <Grammar_Immediate_SingleToken*> (grammar);
+// Adds first tokens of 'grammar' to the tranzitions of 'switch_grammar_entry'.
+// Returns 'true' if the grammar is nullable. Call with a new
+// 'state->cur_stamp' for every 'switch_grammar_entry'.
+static bool
+opt_add_tranzitions (OptState           * const mt_nonnull state,
+		     Grammar            * const mt_nonnull grammar,
+		     SwitchGrammarEntry * const mt_nonnull switch_grammar_entry)
+{
+    OptNode * const node = &state->nodes [opt_node_index (grammar)];
+    OptScc * const scc = &state->sccs [node->scc];
 
-	    if (tranzition_entries) {
-		if (!grammar__immediate->getToken() ||
-		    grammar__immediate->getToken()->len() == 0)
-		{
-		    if (grammar__immediate->token_match_cb_name) {
-			DEBUG_OPT (
-			    errs->print ("  {", grammar__immediate->token_match_cb_name, "}");
-			)
-		    } else {
-			assert (!grammar__immediate->token_match_cb);
-			DEBUG_OPT (
-			    errs->print (" ANY");
-			)
+    for (Size i = 0; i < scc->num_first; ++i) {
+	OptNode * const imm_node = &state->nodes [scc->first [i]];
+	if (imm_node->stamp == state->cur_stamp)
+	    continue;
 
-			param_switch_grammar_entry->any_tranzition = true;
-		    }
-		} else {
-		    DEBUG_OPT (
-			errs->print (" ", grammar__immediate->getToken ());
-		    )
-		}
+	imm_node->stamp = state->cur_stamp;
+	opt_add_immediate_tranzition (static_cast <Grammar_Immediate_SingleToken*> (imm_node->grammar),
+				      switch_grammar_entry);
+    }
 
-		if (grammar__immediate->token_match_cb_name) {
-		    StRef<TranzitionMatchEntry> const tranzition_match_entry = st_grab (new TranzitionMatchEntry);
-		    tranzition_match_entry->token_match_cb = grammar__immediate->token_match_cb;
-		    DEBUG_OPT2 (
-                      errs->println ("--- TRANZITION MATCH ENTRY");
-		    )
-		    tranzition_match_entries->append (tranzition_match_entry);
-		} else
-		if (grammar__immediate->getToken () &&
-		    grammar__immediate->getToken ()->len() > 0)
-		{
-		    SwitchGrammarEntry::TranzitionEntry * const tranzition_entry = new SwitchGrammarEntry::TranzitionEntry;
-		    tranzition_entry->grammar_name = st_grab (new String (grammar__immediate->getToken()->mem()));
-		    tranzition_entries->add (tranzition_entry);
-		}
-	    }
+    return node->nullable;
+}
 
-	    return true;
-	} break;
-	case Grammar::t_Compound: {
-	    Grammar_Compound * const grammar__compound =
-		    static_cast <Grammar_Compound*> (grammar);
+// Fills tranzitions for the tail of a left-recursive compound grammar.
+// These are used to grow left-recursive matches only with alternatives
+// which may continue with the next token.
+static void
+optimize_lr_tail (OptState           * const mt_nonnull state,
+		  Grammar_Compound   * const mt_nonnull grammar,
+		  SwitchGrammarEntry * const mt_nonnull switch_grammar_entry)
+{
+    StRef<SwitchGrammarEntry> const lr_tail = st_grab (new (std::nothrow) SwitchGrammarEntry);
 
-	    Bool got_tranzition = false;
-	    Bool optional = true;
-	    List< StRef<CompoundGrammarEntry> >::DataIterator iter (grammar__compound->grammar_entries);
-	    while (!iter.done ()) {
-		StRef<CompoundGrammarEntry> &compound_grammar_entry = iter.next ();
+    ++state->cur_stamp;
 
-		if (!compound_grammar_entry->grammar) {
-		  // _AcceptCb or _UniversalAcceptCb or UpwardsAnchor.
-		    continue;
-		}
+    bool optional = true;
+    List< StRef<CompoundGrammarEntry> >::Element *ge_el = grammar->getSecondSubgrammarElement ();
+    for (; ge_el != NULL; ge_el = ge_el->next) {
+	CompoundGrammarEntry * const compound_grammar_entry = ge_el->data;
+	if (!compound_grammar_entry->grammar) {
+	  // Callbacks, jumps and cuts.
+	    continue;
+	}
 
-		if (tranzition_entries) {
-		    bool tmp_optional = false;
-		    got_tranzition = do_optimizeGrammar (compound_grammar_entry->grammar,
-							 tranzition_entries,
-							 tranzition_match_entries,
-							 param_switch_grammar_entry,
-							 &tmp_optional,
-							 loop_id);
-		    if (!tmp_optional &&
-			!(compound_grammar_entry->flags & CompoundGrammarEntry::Optional))
-		    {
-			optional = false;
-		    }
+	bool const nullable = opt_add_tranzitions (state, compound_grammar_entry->grammar, lr_tail);
+	if (!nullable &&
+	    !(compound_grammar_entry->flags & CompoundGrammarEntry::Optional))
+	{
+	    optional = false;
+	    break;
+	}
+    }
 
-		    if (!optional)
-			break;
-		} else {
-		    do_optimizeGrammar (compound_grammar_entry->grammar,
-					NULL /* tranzition_entries */,
-					NULL /* tranzition_match_entries */,
-					NULL /* switch_grammar_entry */,
-					NULL /* ret_optional */,
-					loop_id);
-		}
-	    }
+    if (optional) {
+      // Empty tails should not be upwards-optimized.
+	lr_tail->any_tranzition = true;
+    }
 
-	    if (ret_optional)
-		*ret_optional = optional;
+    switch_grammar_entry->lr_tail = lr_tail;
+}
 
-	    return got_tranzition;
-	} break;
-	case Grammar::t_Switch: {
-	    Grammar_Switch * const grammar__switch =
-		    static_cast <Grammar_Switch*> (grammar);
-
-	    Bool got_tranzition = false;
-	    Bool optional = true;
-	    List< StRef<SwitchGrammarEntry> >::DataIterator iter (grammar__switch->grammar_entries);
-	    while (!iter.done ()) {
-		StRef<SwitchGrammarEntry> &switch_grammar_entry = iter.next ();
-
-		if (tranzition_entries) {
-		    bool tmp_optional = false;
-		    got_tranzition = do_optimizeGrammar (switch_grammar_entry->grammar,
-							 tranzition_entries,
-							 tranzition_match_entries,
-							 param_switch_grammar_entry,
-							 &tmp_optional,
-							 loop_id);
-		    if (!tmp_optional &&
-			!(switch_grammar_entry->flags & CompoundGrammarEntry::Optional))
-		    {
-			optional = false;
-		    }
-		} else {
-		    DEBUG_OPT (
-			errs->print (switch_grammar_entry->grammar->toString (), ": ");
-		    )
-		    {
-			bool tmp_optional = false;
-			do_optimizeGrammar (switch_grammar_entry->grammar,
-					    &switch_grammar_entry->tranzition_entries,
-					    &switch_grammar_entry->tranzition_match_entries,
-					    switch_grammar_entry,
-					    &tmp_optional,
-					    loop_id);
-			if (tmp_optional) {
-			  // Fully optional grammars should not be upwards-optimized.
-			  // We add 'any' token to force entering.
-			    switch_grammar_entry->any_tranzition = true;
-			}
-		    }
-		    DEBUG_OPT (
-			errs->print ("\n");
-		    )
+static void
+optimize_switch (OptState       * const mt_nonnull state,
+		 Grammar_Switch * const mt_nonnull grammar__switch)
+{
+    List< StRef<SwitchGrammarEntry> >::DataIterator iter (grammar__switch->grammar_entries);
+    while (!iter.done ()) {
+	StRef<SwitchGrammarEntry> &switch_grammar_entry = iter.next ();
 
-		    assert (*loop_id + 1 > *loop_id);
-		    (*loop_id) ++;
-		    do_optimizeGrammar (switch_grammar_entry->grammar,
-					NULL /* tranzition_entries */,
-					NULL /* tranzition_match_entries */,
-					NULL /* switch_grammar_entry */,
-					NULL /* ret_optional */,
-					loop_id);
-		}
-	    }
+	DEBUG_OPT (
+	    errs->print (switch_grammar_entry->grammar->toString (), ": ");
+	)
+	++state->cur_stamp;
+	if (opt_add_tranzitions (state, switch_grammar_entry->grammar, switch_grammar_entry)) {
+	  // Fully optional grammars should not be upwards-optimized.
+	  // We add 'any' token to force entering.
+	    switch_grammar_entry->any_tranzition = true;
+	}
+	DEBUG_OPT (
+	    errs->print ("\n");
+	)
 
-	    if (ret_optional)
-		*ret_optional = optional;
+	if (switch_grammar_entry->grammar->grammar_type == Grammar::t_Compound) {
+	    Grammar_Compound * const grammar__compound =
+		    static_cast <Grammar_Compound*> (switch_grammar_entry->grammar.ptr ());
 
-	    return got_tranzition;
-	} break;
-	case Grammar::t_Alias: {
-	    Grammar_Alias * const grammar_alias =
-		    static_cast <Grammar_Alias*> (grammar);
-
-	    return do_optimizeGrammar (grammar_alias->aliased_grammar,
-				       tranzition_entries,
-				       tranzition_match_entries,
-				       param_switch_grammar_entry,
-				       ret_optional,
-				       loop_id);
-	} break;
-	default:
-            unreachable ();
+	    if (grammar__compound->getFirstSubgrammar () == grammar__switch) {
+		switch_grammar_entry->left_recursive = true;
+		grammar__switch->lr_grammar_entries.append (switch_grammar_entry);
+		optimize_lr_tail (state, grammar__compound, switch_grammar_entry);
+	    }
+	}
     }
 
-    unreachable ();
-    return false;
+    grammar__switch->lr_entries_ready = true;
+    optimize_switch_predictive (grammar__switch);
+    optimize_switch_prefixes (grammar__switch);
 }
 
 void
 optimizeGrammar (Grammar * const mt_nonnull grammar)
 {
-    Size loop_id = 1;
-    do_optimizeGrammar (grammar,
-			NULL /* tranzition_entries */,
-			NULL /* tranzition_match_entries */,
-			NULL /* switch_grammar_entry */,
-			NULL /* ret_optional */,
-			&loop_id);
+    OptState state;
+
+    opt_collect_nodes (&state, grammar);
+    opt_compute_nullable (&state);
+    opt_compute_first (&state);
+
+    // Compound grammars are frozen first: optimize_switch() relies
+    // on their cached first subgrammars.
+    for (Size i = 0; i < state.num_nodes; ++i) {
+	Grammar * const node_grammar = state.nodes [i].grammar;
+	if (node_grammar->grammar_type == Grammar::t_Compound)
+	    static_cast <Grammar_Compound*> (node_grammar)->freeze ();
+    }
+
+    for (Size i = 0; i < state.num_nodes; ++i) {
+	Grammar * const node_grammar = state.nodes [i].grammar;
+	// Grammars may be shared with another grammar which has already
+	// been optimized.
+	if (node_grammar->optimized)
+	    continue;
+
+	if (node_grammar->grammar_type == Grammar::t_Switch)
+	    optimize_switch (&state, static_cast <Grammar_Switch*> (node_grammar));
+	else
+	if (node_grammar->grammar_type == Grammar::t_Compound)
+	    optimize_tail_iteration (static_cast <Grammar_Compound*> (node_grammar));
+    }
+
+    for (Size i = 0; i < state.num_nodes; ++i) {
+	OptNode * const node = &state.nodes [i];
+	node->grammar->optimized = true;
+	node->grammar->loop_id = 0;
+
+	delete[] node->succ;
+	delete[] node->succ_optional;
+    }
+
+    for (Size i = 0; i < state.num_sccs; ++i)
+	delete[] state.sccs [i].first;
+
+    delete[] state.sccs;
+    delete[] state.scc_members;
+    delete[] state.nodes;
 }
 
 // Как работает парсер:
@@ -2722,16 +5725,19 @@ optimizeGrammar (Grammar * const mt_nonnull grammar)
 //     Ступени Compound задают строгую последовательность подграмматик.
 //     Ступени Switch предполагают возможность вхождения одной из нескольких подграмматик.
 //
-mt_throws Result
-parse (TokenStream    * const mt_nonnull token_stream,
-       LookupData     * const lookup_data,
-       void           * const user_data,
-       Grammar        * const mt_nonnull grammar,
-       ParserElement ** const ret_element,
-       StRef<StReferenced> * const ret_element_container,
-       ConstMemory      const default_variant,
-       ParserConfig   *parser_config,
-       bool             const debug_dump)
+template <class TokenStreamT>
+static mt_throws Result
+do_parse (TokenStreamT       * const mt_nonnull token_stream,
+          LookupData         * const lookup_data,
+          void               * const user_data,
+          Grammar            * const mt_nonnull grammar,
+          ParserElement     ** const ret_element,
+          StRef<StReferenced> * const ret_element_container,
+          ParserEventHandler * const event_handler,
+          ParserItemFunc       const item_func,
+          ConstMemory          const default_variant,
+          ParserConfig       *parser_config,
+          bool                 const debug_dump)
 {
     assert (token_stream && grammar);
 
@@ -2747,19 +5753,32 @@ parse (TokenStream    * const mt_nonnull token_stream,
 	parser_config = tmp_parser_config;
     }
 
-    StRef<ParsingState> parsing_state = st_grab (new ParsingState);
+    StRef< ParsingState<TokenStreamT> > parsing_state = st_grab (new ParsingState<TokenStreamT>);
     parsing_state->parser_config = parser_config;
     parsing_state->nest_level = 0;
     parsing_state->token_stream = token_stream;
+    parsing_state->stable_mem = token_stream->getStableMemory ();
     parsing_state->lookup_data = lookup_data;
     parsing_state->user_data = user_data;
-    parsing_state->cur_direction = ParsingState::Up;
+    parsing_state->cur_direction = ParsingState<TokenStreamT>::Up;
     parsing_state->cur_positive_cache_entry = &parsing_state->positive_cache_root;
+    parsing_state->negative_cache.setPolicy (parser_config->negative_cache,
+                                             parser_config->adaptive_negative_cache);
     parsing_state->negative_cache.goRight ();
+    parsing_state->classify_token = grammar->token_classify_func;
     parsing_state->default_variant = default_variant;
 
     parsing_state->debug_dump = debug_dump;
 
+    EventLog event_log;
+    parsing_state->event_handler = event_handler;
+    parsing_state->event_log = (event_handler ? &event_log : NULL);
+    parsing_state->item_func = item_func;
+    parsing_state->commit_count = 0;
+
+    ActionLog action_log;
+    parsing_state->action_log = (parser_config->deferred_actions ? &action_log : NULL);
+
     VSlabRef< PtrAcceptor<ParserElement> > acceptor =
 	    VSlabRef< PtrAcceptor<ParserElement> >::forRef < PtrAcceptor<ParserElement> > (
 		    parsing_state->ptr_acceptor_slab.alloc ());
@@ -2769,7 +5788,7 @@ parse (TokenStream    * const mt_nonnull token_stream,
 	parsing_state->lookup_data->newCheckpoint ();
 
     ParsingResult pres;
-    if (!parse_grammar (parsing_state, grammar, acceptor, false /* optional */, &pres))
+    if (!parse_grammar<TokenStreamT> (parsing_state, grammar, acceptor, false /* optional */, &pres))
         return Result::Failure;
 
     if (ret_element_container)
@@ -2779,6 +5798,12 @@ parse (TokenStream    * const mt_nonnull token_stream,
 	pres == ParseEmptyMatch    ||
 	pres == ParseNoMatch)
     {
+	if (parsing_state->action_log)
+	    action_log.replay (user_data);
+
+	if (event_handler)
+	    event_log.flush (event_handler, user_data);
+
 	return Result::Success;
     }
 
@@ -2786,19 +5811,19 @@ parse (TokenStream    * const mt_nonnull token_stream,
 
     while (!parsing_state->step_list.isEmpty()) {
 	switch (parsing_state->cur_direction) {
-	    case ParsingState::Up:
+	    case ParsingState<TokenStreamT>::Up:
 		DEBUG_INT (
 		  errs->println (_func, "ParsingState::Up");
 		)
-		if (!parse_up (parsing_state))
+		if (!parse_up<TokenStreamT> (parsing_state))
                     return Result::Failure;
 
 		break;
-	    case ParsingState::Down:
+	    case ParsingState<TokenStreamT>::Down:
 		DEBUG_INT (
 		  errs->println (_func, "ParsingState::Down");
 		)
-		if (!parse_down (parsing_state))
+		if (!parse_down<TokenStreamT> (parsing_state))
                     return Result::Failure;
 
 		break;
@@ -2807,8 +5832,117 @@ parse (TokenStream    * const mt_nonnull token_stream,
 	}
     }
 
+    if (parsing_state->action_log)
+	action_log.replay (user_data);
+
+    if (event_handler)
+	event_log.flush (event_handler, user_data);
+
     return Result::Success;
 }
 
+// Chooses the instantiation of the parser for @token_stream. Only streams
+// of exactly these types are called directly: subclasses may override
+// their methods.
+static mt_throws Result
+do_parse_stream (TokenStream        * const mt_nonnull token_stream,
+                 LookupData         * const lookup_data,
+                 void               * const user_data,
+                 Grammar            * const mt_nonnull grammar,
+                 ParserElement     ** const ret_element,
+                 StRef<StReferenced> * const ret_element_container,
+                 ParserEventHandler * const event_handler,
+                 ParserItemFunc       const item_func,
+                 ConstMemory          const default_variant,
+                 ParserConfig       * const parser_config,
+                 bool                 const debug_dump)
+{
+    if (typeid (*token_stream) == typeid (MemoryTokenStream)) {
+        return do_parse (static_cast <MemoryTokenStream*> (token_stream),
+                         lookup_data, user_data, grammar, ret_element, ret_element_container,
+                         event_handler, item_func, default_variant, parser_config, debug_dump);
+    }
+
+    if (typeid (*token_stream) == typeid (FileTokenStream)) {
+        return do_parse (static_cast <FileTokenStream*> (token_stream),
+                         lookup_data, user_data, grammar, ret_element, ret_element_container,
+                         event_handler, item_func, default_variant, parser_config, debug_dump);
+    }
+
+    return do_parse (token_stream,
+                     lookup_data, user_data, grammar, ret_element, ret_element_container,
+                     event_handler, item_func, default_variant, parser_config, debug_dump);
+}
+
+mt_throws Result
+parse (TokenStream    * const mt_nonnull token_stream,
+       LookupData     * const lookup_data,
+       void           * const user_data,
+       Grammar        * const mt_nonnull grammar,
+       ParserElement ** const ret_element,
+       StRef<StReferenced> * const ret_element_container,
+       ConstMemory      const default_variant,
+       ParserConfig   * const parser_config,
+       bool             const debug_dump)
+{
+    return do_parse_stream (token_stream,
+                            lookup_data,
+                            user_data,
+                            grammar,
+                            ret_element,
+                            ret_element_container,
+                            NULL /* event_handler */,
+                            NULL /* item_func */,
+                            default_variant,
+                            parser_config,
+                            debug_dump);
+}
+
+mt_throws Result
+parseEvents (TokenStream        * const mt_nonnull token_stream,
+             LookupData         * const lookup_data,
+             void               * const user_data,
+             Grammar            * const mt_nonnull grammar,
+             ParserEventHandler * const mt_nonnull event_handler,
+             ConstMemory          const default_variant,
+             ParserConfig       * const parser_config,
+             bool                 const debug_dump)
+{
+    return do_parse_stream (token_stream,
+                            lookup_data,
+                            user_data,
+                            grammar,
+                            NULL /* ret_element */,
+                            NULL /* ret_element_container */,
+                            event_handler,
+                            NULL /* item_func */,
+                            default_variant,
+                            parser_config,
+                            debug_dump);
+}
+
+mt_throws Result
+parseItems (TokenStream    * const mt_nonnull token_stream,
+            LookupData     * const lookup_data,
+            void           * const user_data,
+            Grammar        * const mt_nonnull grammar,
+            ParserItemFunc   const mt_nonnull item_func,
+            ConstMemory      const default_variant,
+            ParserConfig   * const parser_config,
+            bool             const debug_dump)
+{
+    return do_parse_stream (token_stream,
+                            lookup_data,
+                            user_data,
+                            grammar,
+                            NULL /* ret_element */,
+                            NULL /* ret_element_container */,
+                            NULL /* event_handler */,
+                            item_func,
+                            default_variant,
+                            parser_config,
+                            debug_dump);
+}
+
 }
 
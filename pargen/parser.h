@@ -25,6 +25,7 @@
 #include <pargen/grammar.h>
 #include <pargen/parser_element.h>
 #include <pargen/lookup_data.h>
+#include <pargen/grammar_profile.h>
 //#include <pargen/parsing_exception.h>
 
 
@@ -37,11 +38,39 @@ namespace Pargen {
 
 using namespace M;
 
+template <class TokenStreamT> class ParsingState;
+
 /*c
  * Position marker
+ *
+ * Position markers are plain values which are meant to be allocated
+ * on the stack by match callbacks. A marker is valid while the compound
+ * grammar which has obtained it is being parsed, i.e. for the duration
+ * of the callback.
  */
-class ParserPositionMarker : public StReferenced
+class ParserPositionMarker
 {
+    template <class TokenStreamT> friend class ParsingState;
+
+private:
+    TokenStream::PositionMarker token_stream_pos;
+    void *compound_step;
+    List< StRef<CompoundGrammarEntry> >::Element *cur_subg_el;
+    bool got_nonoptional_match;
+    Size go_right_count;
+    bool cut_passed;
+    Size commit_count;
+
+public:
+    ParserPositionMarker ()
+        : compound_step (NULL),
+          cur_subg_el (NULL),
+          got_nonoptional_match (false),
+          go_right_count (0),
+          cut_passed (false),
+          commit_count (0)
+    {
+    }
 };
 
 /*c
@@ -52,24 +81,94 @@ class ParserControl : public StReferenced
 public:
     virtual void setCreateElements (bool create_elements) = 0;
 
-    virtual StRef<ParserPositionMarker> getPosition () = 0;
+    virtual void getPosition (ParserPositionMarker * mt_nonnull ret_pmark) = 0;
 
-    virtual mt_throws Result setPosition (ParserPositionMarker *pmark) = 0;
+    // Fails with InternalException::BadInput if the parser has passed a cut
+    // or has delivered a completed sequence item since @pmark was obtained.
+    virtual mt_throws Result setPosition (ParserPositionMarker const * mt_nonnull pmark) = 0;
 
     virtual void setVariant (ConstMemory variant_name) = 0;
 };
 
 // External users should not modify contents of ParserConfig objects.
+// All of the optimizations are enabled by default. Turning them off doesn't
+// change parsing results.
 class ParserConfig : public StReferenced
 {
 public:
     bool upwards_jumps;
+
+    // Single-token lookahead: switch alternatives which can't start with
+    // the next token are not tried.
+    bool forward_optimization;
+
+    // Failed grammars are remembered for each token position and are not
+    // retried at the same position.
+    bool negative_cache;
+
+    // Stops recording failures of grammars which are never retried
+    // at the same position. Has no effect without 'negative_cache'.
+    bool adaptive_negative_cache;
+
+    // Matches of switch alternatives are counted in 'profile' if it is set.
+    StRef<GrammarProfile> profile;
+
+    // Fill ParserElement::span_begin and span_end. Off by default.
+    bool source_spans;
+
+    // accept_func() and begin_func() calls are not made while parsing.
+    // They're logged instead, the calls made on branches which fail are
+    // dropped, and the rest are made in order once the parse is complete.
+    // In streaming modes, the calls are made before each top-level item
+    // is delivered. match_func() calls are not deferred. Off by default.
+    //
+    // match_func() and inline match callbacks don't see side effects
+    // of deferred accept_func() calls, including the contents of LookupData.
+    // Deferred accept_func() calls get a ParserControl of their own:
+    // setPosition() fails with InternalException::BadInput, getPosition()
+    // and setVariant() do nothing.
+    bool deferred_actions;
 };
 
-StRef<ParserConfig> createParserConfig (bool upwards_jumps);
+StRef<ParserConfig> createParserConfig (bool            upwards_jumps,
+                                        GrammarProfile *profile                 = NULL,
+                                        bool            forward_optimization    = true,
+                                        bool            negative_cache          = true,
+                                        bool            adaptive_negative_cache = true,
+                                        bool            source_spans            = false,
+                                        bool            deferred_actions        = false);
 
 StRef<ParserConfig> createDefaultParserConfig ();
 
+/*c
+ * Receiver of parse events for event-driven (streaming) parsing.
+ *
+ * Events are delivered only after the parser has committed to them,
+ * i.e. when they can't be undone by backtracking anymore.
+ * Empty phrases are not reported.
+ */
+class ParserEventHandler
+{
+public:
+    virtual void phraseBegin (Grammar *grammar,
+                              void    *user_data) = 0;
+
+    // 'token' is valid only for the duration of the call.
+    virtual void token (ConstMemory  token,
+                        void        *token_user_ptr,
+                        void        *user_data) = 0;
+
+    virtual void phraseEnd (Grammar *grammar,
+                            void    *user_data) = 0;
+
+    virtual ~ParserEventHandler () {}
+};
+
+// Called for each complete item of a top-level sequence, see parseItems().
+typedef void (*ParserItemFunc) (ParserElement *item_element,
+                                ParserControl *parser_control,
+                                void          *data);
+
 /*m*/
 void optimizeGrammar (Grammar * mt_nonnull grammar);
 
@@ -86,6 +185,46 @@ mt_throws Result parse (TokenStream    * mt_nonnull token_stream,
                         ParserConfig   *parser_config = NULL,
                         bool            debug_dump = false);
 
+/*m
+ * Event-driven parsing. No parse tree is kept: each time an item of a top-level
+ * sequence (a sequence which has no switch grammars above it) is complete,
+ * events for that item are delivered to @event_handler, and parser elements
+ * of the item are released. Hence memory usage does not depend on the number
+ * of top-level items in the input.
+ *
+ * Parser elements are still created and passed to match/accept callbacks,
+ * but they must not be retained by the callbacks.
+ *
+ * Operator-precedence phrases are reported flat: one phrase for the whole
+ * expression, with operand phrases and operator tokens inside it.
+ */
+mt_throws Result parseEvents (TokenStream        * mt_nonnull token_stream,
+                              LookupData         *lookup_data,
+                              void               *user_data,
+                              Grammar            * mt_nonnull grammar,
+                              ParserEventHandler * mt_nonnull event_handler,
+                              ConstMemory         default_variant = ConstMemory ("default"),
+                              ParserConfig       *parser_config = NULL,
+                              bool                debug_dump = false);
+
+/*m
+ * Incremental parsing for long inputs which are sequences of independent items,
+ * like log files or streams of statements. Each time an item of a top-level
+ * sequence is complete, @item_func is called for it. After @item_func returns,
+ * the item's parser elements, token copies and cache entries are released.
+ * See parseEvents() for the definition of top-level sequences.
+ *
+ * Parser elements must not be retained after @item_func returns.
+ */
+mt_throws Result parseItems (TokenStream    * mt_nonnull token_stream,
+                             LookupData     *lookup_data,
+                             void           *user_data,
+                             Grammar        * mt_nonnull grammar,
+                             ParserItemFunc  mt_nonnull item_func,
+                             ConstMemory     default_variant = ConstMemory ("default"),
+                             ParserConfig   *parser_config = NULL,
+                             bool            debug_dump = false);
+
 }
 
 
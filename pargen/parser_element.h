@@ -39,8 +39,16 @@ class ParserElement
 public:
     void *user_obj;
 
+    // Token stream offsets of the first byte of the element and of the byte
+    // after its last token. Filled only if ParserConfig::source_spans is set.
+    // See LineIndex for translating offsets into line numbers.
+    FileSize span_begin;
+    FileSize span_end;
+
     ParserElement ()
-	: user_obj (NULL)
+	: user_obj   (NULL),
+	  span_begin (0),
+	  span_end   (0)
     {
     }
 };
@@ -49,6 +57,8 @@ class ParserElement_Token : public ParserElement //,
 //			    public virtual SimplyReferenced
 {
 public:
+    // Points either to a copy of the token or, for streams with stable
+    // memory (see TokenStream::getStableMemory()), into the source itself.
     ConstMemory token;
 
     ParserElement_Token (ConstMemory   const token,
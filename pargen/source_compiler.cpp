@@ -149,6 +149,9 @@ compileSource_Phrase (File                     * const mt_nonnull file,
 		continue;
 	    }
 
+	    if (phrase_part->phrase_part_type == PhrasePart::t_Cut)
+		continue;
+
 	    ConstMemory name_to_set;
 	    ConstMemory type_to_set;
 	    bool any_token = false;
@@ -304,6 +307,11 @@ compileSource_Phrase (File                     * const mt_nonnull file,
         return Result::Failure;
     }
 
+    if (global_grammar) {
+	if (!file->print ("    grammar->token_classify_func = ", opts->header_name, "_classify_token;\n"))
+            return Result::Failure;
+    }
+
     if (has_begin) {
 	if (!file->print ("    grammar->begin_func = ", opts->header_name, "_", phrase_prefix, "_begin_func;\n"))
             return Result::Failure;
@@ -365,14 +373,38 @@ compileSource_Phrase (File                     * const mt_nonnull file,
 		    PhrasePart_Token * const phrase_part__token =
 			    static_cast <PhrasePart_Token*> (phrase_part.ptr());
 
-		    if (!file->print ("\n"
-                                      "        StRef<Grammar_Immediate_SingleToken> const grammar__immediate = "
-                                                       "st_grab (new (std::nothrow) Grammar_Immediate_SingleToken ("
-                                                               "\"", phrase_part__token->token, "\"));\n"))
-                    {
-                        return Result::Failure;
-                    }
+		    if (phrase_part__token->token_id != 0) {
+			if (!file->print ("\n"
+                                          "        StRef<Grammar_Immediate_SingleToken> const grammar__immediate = "
+                                                           "st_grab (new (std::nothrow) Grammar_Immediate_SingleToken (",
+                                                                   opts->header_name, "_literal_token (", phrase_part__token->token_id, ")));\n"
+                                          "        grammar__immediate->token_id = ", phrase_part__token->token_id, ";\n"))
+                        {
+                            return Result::Failure;
+                        }
+		    } else {
+			if (!file->print ("\n"
+                                          "        StRef<Grammar_Immediate_SingleToken> const grammar__immediate = "
+                                                           "st_grab (new (std::nothrow) Grammar_Immediate_SingleToken ("
+                                                                   "\"", phrase_part__token->token, "\"));\n"))
+                        {
+                            return Result::Failure;
+                        }
+		    }
 
+		    if (phrase_part__token->token_class) {
+			if (!file->print ("        grammar__immediate->token_dfa = &",
+                                                           opts->header_name, "_",
+                                                           phrase_part__token->token_class->lowercase_declaration_name,
+                                                           "_token_dfa;\n"
+                                          "        grammar__immediate->token_match_cb_name = "
+                                                           "st_grab (new (std::nothrow) String ("
+                                                                   "\"", phrase_part__token->token_match_cb, "\"));\n"
+                                          "\n"))
+                        {
+                            return Result::Failure;
+                        }
+		    } else
 		    if (phrase_part__token->token_match_cb &&
 			phrase_part__token->token_match_cb->len() > 0)
 		    {
@@ -392,6 +424,11 @@ compileSource_Phrase (File                     * const mt_nonnull file,
                             return Result::Failure;
                         }
 
+			if (phrase_part__token->token_match_cb_pure) {
+			    if (!file->print ("        grammar__immediate->token_match_cb_pure = true;\n"))
+                                return Result::Failure;
+			}
+
 			if (!file->print ("        grammar__immediate->token_match_cb_name = "
                                                            "st_grab (new (std::nothrow) String ("
                                                                    "\"", phrase_part__token->token_match_cb, "\"));\n"
@@ -456,6 +493,10 @@ compileSource_Phrase (File                     * const mt_nonnull file,
 		case PhrasePart::t_Label: {
                     unreachable ();
 		} break;
+		case PhrasePart::t_Cut: {
+		    if (!file->print ("        entry->is_cut = true;\n"))
+                        return Result::Failure;
+		} break;
 		default:
                     unreachable ();
 	    }
@@ -594,6 +635,9 @@ compileSource_Phrase (File                     * const mt_nonnull file,
 		case PhrasePart::t_Label: {
 		  // No-op
 		} break;
+		case PhrasePart::t_Cut: {
+		  // No-op
+		} break;
 		default:
                     unreachable ();
 	    }
@@ -650,6 +694,11 @@ compileSource_Alias (File                     * const mt_nonnull file,
         return Result::Failure;
     }
 
+    if (global_grammar) {
+	if (!file->print ("    grammar->token_classify_func = ", opts->header_name, "_classify_token;\n"))
+            return Result::Failure;
+    }
+
     if (has_begin) {
 	if (!file->print ("    grammar->begin_func = ", opts->header_name, "_", phrase_prefix, "_begin_func;\n"))
             return Result::Failure;
@@ -676,6 +725,490 @@ compileSource_Alias (File                     * const mt_nonnull file,
     return Result::Success;
 }
 
+static mt_throws Result
+compileSource_TokenClass (File                     * const mt_nonnull file,
+			  Declaration_TokenClass   * const mt_nonnull decl,
+			  CompilationOptions const * const mt_nonnull opts)
+{
+    ConstMemory const name = decl->lowercase_declaration_name->mem();
+
+    if (!file->print ("static Uint16 const ", opts->header_name, "_", name, "_token_dfa_tranzitions [] = {\n"))
+        return Result::Failure;
+
+    for (Size i = 0, i_end = decl->num_states * 256; i < i_end; ++i) {
+	if (!file->print ((i % 16 == 0 ? ConstMemory ("    ") : ConstMemory (" ")),
+                          (Uint32) decl->tranzitions [i],
+                          (i + 1 < i_end ? ConstMemory (",") : ConstMemory ()),
+                          (i % 16 == 15 ? ConstMemory ("\n") : ConstMemory ())))
+        {
+            return Result::Failure;
+        }
+    }
+
+    if (!file->print ("};\n"
+                      "\n"
+                      "static Byte const ", opts->header_name, "_", name, "_token_dfa_accepting [] = {"))
+    {
+        return Result::Failure;
+    }
+
+    for (Size i = 0; i < decl->num_states; ++i) {
+	if (!file->print ((i > 0 ? ConstMemory (", ") : ConstMemory (" ")), (Uint32) decl->accepting [i]))
+            return Result::Failure;
+    }
+
+    if (!file->print (" };\n"
+                      "\n"
+                      "static TokenDfa const ", opts->header_name, "_", name, "_token_dfa = {\n"
+                      "    ", decl->num_states, ",\n"
+                      "    ", opts->header_name, "_", name, "_token_dfa_tranzitions,\n"
+                      "    ", opts->header_name, "_", name, "_token_dfa_accepting,\n"
+                      "    {"))
+    {
+        return Result::Failure;
+    }
+
+    for (unsigned i = 0; i < 8; ++i) {
+	if (!file->print ((i > 0 ? ConstMemory (", ") : ConstMemory (" ")), decl->first_bytes [i]))
+            return Result::Failure;
+    }
+
+    if (!file->print (" }\n"
+                      "};\n"
+                      "\n"))
+    {
+        return Result::Failure;
+    }
+
+    return Result::Success;
+}
+
+namespace {
+class LiteralToken
+{
+public:
+    ConstMemory token;
+    Uint32 token_id;
+};
+}
+
+static bool
+literalTokenLess (LiteralToken const &left,
+		  LiteralToken const &right)
+{
+    if (left.token.len() != right.token.len())
+	return left.token.len() < right.token.len();
+
+    return memcmp (left.token.mem(), right.token.mem(), left.token.len()) < 0;
+}
+
+static mt_throws Result
+printIndent (File * const mt_nonnull file,
+	     Size   const indent)
+{
+    for (Size i = 0; i < indent; ++i) {
+	if (!file->print ("    "))
+            return Result::Failure;
+    }
+
+    return Result::Success;
+}
+
+// 'literals' [begin, end) have the same length and are sorted. Literals
+// which share the first 'pos' bytes are dispatched on byte 'pos'.
+static mt_throws Result
+compileSource_ClassifierNode (File               * const mt_nonnull file,
+			      LiteralToken const * const mt_nonnull literals,
+			      Size                 const begin,
+			      Size                 const end,
+			      Size                 const pos,
+			      Size                 const indent)
+{
+    Size const len = literals [begin].token.len();
+
+    if (end - begin == 1) {
+	if (pos < len) {
+	    if (!printIndent (file, indent) || !file->print ("if ("))
+                return Result::Failure;
+
+	    for (Size i = pos; i < len; ++i) {
+		if (!file->print ((i > pos ? ConstMemory (" && ") : ConstMemory ()),
+                                  "p [", i, "] == ", (Uint32) literals [begin].token.mem() [i]))
+                {
+                    return Result::Failure;
+                }
+	    }
+
+	    if (!file->print (")\n"))
+                return Result::Failure;
+
+	    if (!printIndent (file, indent + 1))
+                return Result::Failure;
+	} else {
+	    if (!printIndent (file, indent))
+                return Result::Failure;
+	}
+
+	if (!file->print ("return ", literals [begin].token_id, ";\n"))
+            return Result::Failure;
+
+	return Result::Success;
+    }
+
+    assert (pos < len);
+
+    if (!printIndent (file, indent) || !file->print ("switch (p [", pos, "]) {\n"))
+        return Result::Failure;
+
+    Size group_begin = begin;
+    while (group_begin < end) {
+	Byte const c = literals [group_begin].token.mem() [pos];
+
+	Size group_end = group_begin + 1;
+	while (group_end < end && literals [group_end].token.mem() [pos] == c)
+	    ++group_end;
+
+	if (!printIndent (file, indent + 1) || !file->print ("case ", (Uint32) c, ":\n"))
+            return Result::Failure;
+
+	if (!compileSource_ClassifierNode (file, literals, group_begin, group_end, pos + 1, indent + 2))
+            return Result::Failure;
+
+	if (!printIndent (file, indent + 2) || !file->print ("break;\n"))
+            return Result::Failure;
+
+	group_begin = group_end;
+    }
+
+    if (!printIndent (file, indent) || !file->print ("}\n"))
+        return Result::Failure;
+
+    return Result::Success;
+}
+
+// Generates <header_name>_classify_token(), which maps literal tokens
+// of the grammar to their ids with nested switches on token length and bytes.
+static mt_throws Result
+compileSource_TokenClassifier (File                     * const mt_nonnull file,
+			       PargenTask const         * const mt_nonnull pargen_task,
+			       CompilationOptions const * const mt_nonnull opts)
+{
+    Size const num_literals = pargen_task->literal_tokens.getNumElements();
+    LiteralToken * const literals = new (std::nothrow) LiteralToken [num_literals + 1];
+    assert (literals);
+
+    {
+	Size i = 0;
+	List< StRef<String> >::DataIterator literal_iter (pargen_task->literal_tokens);
+	while (!literal_iter.done ()) {
+	    StRef<String> &literal = literal_iter.next ();
+	    literals [i].token = literal->mem();
+	    literals [i].token_id = i + 1;
+	    ++i;
+	}
+    }
+
+    // Insertion sort: the number of literals is small.
+    for (Size i = 1; i < num_literals; ++i) {
+	LiteralToken const tmp = literals [i];
+	Size j = i;
+	while (j > 0 && literalTokenLess (tmp, literals [j - 1])) {
+	    literals [j] = literals [j - 1];
+	    --j;
+	}
+	literals [j] = tmp;
+    }
+
+    Result res = Result::Failure;
+    do {
+	if (!file->print ("static Uint32\n",
+                          opts->header_name, "_classify_token (ConstMemory const &token)\n"
+                          "{\n"
+                          "    Byte const * const p = token.mem();\n"
+                          "    (void) p;\n"
+                          "\n"
+                          "    switch (token.len()) {\n"))
+        {
+            break;
+        }
+
+	bool failed = false;
+	Size len_begin = 0;
+	while (len_begin < num_literals) {
+	    Size const len = literals [len_begin].token.len();
+
+	    Size len_end = len_begin + 1;
+	    while (len_end < num_literals && literals [len_end].token.len() == len)
+		++len_end;
+
+	    if (!file->print ("        case ", len, ":\n")
+		|| !compileSource_ClassifierNode (file, literals, len_begin, len_end, 0 /* pos */, 3 /* indent */)
+		|| !file->print ("            break;\n"))
+	    {
+		failed = true;
+		break;
+	    }
+
+	    len_begin = len_end;
+	}
+	if (failed)
+	    break;
+
+	if (!file->print ("    }\n"
+                          "\n"
+                          "    return 0;\n"
+                          "}\n"
+                          "\n"))
+        {
+            break;
+        }
+
+	res = Result::Success;
+    } while (0);
+
+    delete[] literals;
+    return res;
+}
+
+// Generates a read-only table of literal tokens indexed by token id,
+// and <header_name>_literal_token(), which returns a string shared by all
+// immediate grammars for the same literal token. Nothing is generated
+// if there are no literal tokens.
+//
+// The table is the only static part of generated grammars: Grammar objects
+// are reference-counted and hold lists and hashes which the parser fills
+// and walks at runtime. To skip grammar construction and optimizeGrammar()
+// at startup, load a grammar snapshot instead (see grammar_snapshot.h).
+static mt_throws Result
+compileSource_LiteralTokens (File                     * const mt_nonnull file,
+			     PargenTask const         * const mt_nonnull pargen_task,
+			     CompilationOptions const * const mt_nonnull opts)
+{
+    Size const num_literals = pargen_task->literal_tokens.getNumElements();
+    if (num_literals == 0)
+	return Result::Success;
+
+    if (!file->print ("static char const * const ", opts->header_name, "_literal_tokens [] = {\n"
+                      "    \"\",\n"))
+    {
+        return Result::Failure;
+    }
+
+    List< StRef<String> >::DataIterator literal_iter (pargen_task->literal_tokens);
+    while (!literal_iter.done ()) {
+	StRef<String> &literal = literal_iter.next ();
+	if (!file->print ("    \"", literal, "\",\n"))
+            return Result::Failure;
+    }
+
+    if (!file->print ("};\n"
+                      "\n"
+                      "static StRef<String>\n",
+                      opts->header_name, "_literal_token (Uint32 const token_id)\n"
+                      "{\n"
+                      "    static StRef<String> tokens [", num_literals + 1, "];\n"
+                      "    if (!tokens [token_id])\n"
+                      "        tokens [token_id] = st_grab (new (std::nothrow) String (",
+                              opts->header_name, "_literal_tokens [token_id]));\n"
+                      "\n"
+                      "    return tokens [token_id];\n"
+                      "}\n"
+                      "\n"))
+    {
+        return Result::Failure;
+    }
+
+    return Result::Success;
+}
+
+namespace {
+class SymbolRecord : public StReferenced
+{
+public:
+    StRef<String> name;
+    bool is_data;
+};
+}
+
+static void
+addSymbolRecord (List< StRef<SymbolRecord> > * const mt_nonnull symbols,
+		 StRef<String>                 const &name,
+		 bool                          const is_data)
+{
+    List< StRef<SymbolRecord> >::DataIterator iter (*symbols);
+    while (!iter.done ()) {
+	StRef<SymbolRecord> &symbol = iter.next ();
+	if (equal (symbol->name->mem(), name->mem()))
+	    return;
+    }
+
+    StRef<SymbolRecord> const symbol = st_grab (new (std::nothrow) SymbolRecord);
+    symbol->name = name;
+    symbol->is_data = is_data;
+    symbols->append (symbol);
+}
+
+// Generates register_<header_name>_symbols(), which adds the callbacks and
+// token classes of the grammar to a GrammarSymbols registry. Grammar snapshots
+// refer to them by these names. The names follow compileSource_Phrase().
+static mt_throws Result
+compileSource_Symbols (File                     * const mt_nonnull file,
+		       PargenTask const         * const mt_nonnull pargen_task,
+		       CompilationOptions const * const mt_nonnull opts)
+{
+    List< StRef<SymbolRecord> > symbols;
+    // Token match callbacks are declared within grammar creation functions.
+    List< StRef<SymbolRecord> > token_match_cbs;
+
+    addSymbolRecord (&symbols, st_makeString (opts->header_name, "_classify_token"), false /* is_data */);
+
+    List< StRef<Declaration> >::DataIterator decl_iter (pargen_task->decls);
+    while (!decl_iter.done ()) {
+	StRef<Declaration> &decl = decl_iter.next ();
+
+	if (decl->declaration_type == Declaration::t_TokenClass) {
+	    addSymbolRecord (&symbols,
+			     st_makeString (opts->header_name, "_", decl->lowercase_declaration_name, "_token_dfa"),
+			     true /* is_data */);
+	    continue;
+	}
+
+	if (decl->declaration_type != Declaration::t_Phrases)
+	    continue;
+
+	Declaration_Phrases * const decl_phrases =
+		static_cast <Declaration_Phrases*> (decl.ptr());
+
+	ConstMemory const decl_name = equal (decl->declaration_name->mem(), "*") ?
+					      ConstMemory ("Grammar") : decl->declaration_name->mem();
+
+	if (!decl_phrases->callbacks.lookup ("begin").isNull())
+	    addSymbolRecord (&symbols, st_makeString (opts->header_name, "_", decl_name, "_begin_func"), false);
+
+	if (!decl_phrases->callbacks.lookup ("match").isNull())
+	    addSymbolRecord (&symbols, st_makeString ("__pargen_", opts->header_name, "_", decl_name, "_match_func"), false);
+
+	if (!decl_phrases->callbacks.lookup ("accept").isNull())
+	    addSymbolRecord (&symbols, st_makeString ("__pargen_", opts->header_name, "_", decl_name, "_accept_func"), false);
+
+	if (decl_phrases->is_alias)
+	    continue;
+
+	bool const subtype = (decl_phrases->phrases.getNumElements() > 1);
+
+	List< StRef<Declaration_Phrases::PhraseRecord> >::DataIterator phrase_iter (decl_phrases->phrases);
+	while (!phrase_iter.done ()) {
+	    StRef<Declaration_Phrases::PhraseRecord> &phrase_record = phrase_iter.next ();
+	    Phrase * const phrase = phrase_record->phrase;
+
+	    StRef<String> const phrase_prefix = subtype ? st_makeString (decl_name, "_", phrase->phrase_name)
+							: st_makeString (decl_name);
+
+	    addSymbolRecord (&symbols, st_makeString (opts->header_name, "_", phrase_prefix, "_creation_func"), false);
+
+	    List< StRef<PhrasePart> >::DataIterator part_iter (phrase->phrase_parts);
+	    while (!part_iter.done ()) {
+		StRef<PhrasePart> &phrase_part = part_iter.next ();
+
+		switch (phrase_part->phrase_part_type) {
+		    case PhrasePart::t_Phrase: {
+			addSymbolRecord (&symbols,
+					 st_makeString (opts->header_name, "_", phrase_prefix, "_set_", phrase_part->name),
+					 false);
+		    } break;
+		    case PhrasePart::t_Token: {
+			PhrasePart_Token * const phrase_part__token =
+				static_cast <PhrasePart_Token*> (phrase_part.ptr());
+
+			if (!phrase_part__token->token ||
+			    phrase_part__token->token->len() == 0)
+			{
+			    addSymbolRecord (&symbols,
+					     st_makeString (opts->header_name, "_", phrase_prefix, "_set_any_token"),
+					     false);
+			}
+
+			if (!phrase_part__token->token_class &&
+			    phrase_part__token->token_match_cb &&
+			    phrase_part__token->token_match_cb->len() > 0)
+			{
+			    addSymbolRecord (&symbols, phrase_part__token->token_match_cb, false);
+			    addSymbolRecord (&token_match_cbs, phrase_part__token->token_match_cb, false);
+			}
+		    } break;
+		    case PhrasePart::t_AcceptCb: {
+			addSymbolRecord (&symbols,
+					 st_makeString ("__pargen_",
+							static_cast <PhrasePart_AcceptCb*> (phrase_part.ptr())->cb_name),
+					 false);
+		    } break;
+		    case PhrasePart::t_UniversalAcceptCb: {
+			addSymbolRecord (&symbols,
+					 st_makeString ("__pargen_",
+							static_cast <PhrasePart_UniversalAcceptCb*> (phrase_part.ptr())->cb_name),
+					 false);
+		    } break;
+		    case PhrasePart::t_UpwardsAnchor: {
+			PhrasePart_UpwardsAnchor * const phrase_part__upwards_anchor =
+				static_cast <PhrasePart_UpwardsAnchor*> (phrase_part.ptr());
+			if (phrase_part__upwards_anchor->jump_cb_name)
+			    addSymbolRecord (&symbols, phrase_part__upwards_anchor->jump_cb_name, false);
+		    } break;
+		    case PhrasePart::t_Label:
+		    case PhrasePart::t_Cut:
+			break;
+		    default:
+			unreachable ();
+		}
+	    }
+	}
+    }
+
+    {
+	List< StRef<SymbolRecord> >::DataIterator iter (token_match_cbs);
+	while (!iter.done ()) {
+	    StRef<SymbolRecord> &cb = iter.next ();
+	    if (!file->print ("bool ", cb->name, " (\n"
+                              "        ConstMemory const &token,\n"
+                              "        void              *token_user_ptr,\n"
+                              "        void              *user_data);\n"
+                              "\n"))
+            {
+                return Result::Failure;
+            }
+	}
+    }
+
+    if (!file->print ("void\n"
+                      "register_", opts->header_name, "_symbols (GrammarSymbols * const symbols)\n"
+                      "{\n"))
+    {
+        return Result::Failure;
+    }
+
+    {
+	List< StRef<SymbolRecord> >::DataIterator iter (symbols);
+	while (!iter.done ()) {
+	    StRef<SymbolRecord> &symbol = iter.next ();
+	    if (symbol->is_data) {
+		if (!file->print ("    symbols->addData (\"", symbol->name, "\", &", symbol->name, ");\n"))
+                    return Result::Failure;
+	    } else {
+		if (!file->print ("    symbols->addFunc (\"", symbol->name, "\", (GrammarSymbols::Func) ", symbol->name, ");\n"))
+                    return Result::Failure;
+	    }
+	}
+    }
+
+    if (!file->print ("}\n"
+                      "\n"))
+    {
+        return Result::Failure;
+    }
+
+    return Result::Success;
+}
+
 mt_throws Result
 compileSource (File                     * const mt_nonnull file,
 	       PargenTask const         * const mt_nonnull pargen_task,
@@ -712,6 +1245,24 @@ compileSource (File                     * const mt_nonnull file,
         return Result::Failure;
     }
 
+    {
+	List< StRef<Declaration> >::DataIterator decl_iter (pargen_task->decls);
+	while (!decl_iter.done ()) {
+	    StRef<Declaration> &decl = decl_iter.next ();
+	    if (decl->declaration_type != Declaration::t_TokenClass)
+		continue;
+
+	    if (!compileSource_TokenClass (file, static_cast <Declaration_TokenClass*> (decl.ptr()), opts))
+                return Result::Failure;
+	}
+    }
+
+    if (!compileSource_TokenClassifier (file, pargen_task, opts))
+        return Result::Failure;
+
+    if (!compileSource_LiteralTokens (file, pargen_task, opts))
+        return Result::Failure;
+
     {
 	List< StRef<Declaration> >::DataIterator decl_iter (pargen_task->decls);
 	while (!decl_iter.done ()) {
@@ -859,19 +1410,27 @@ compileSource (File                     * const mt_nonnull file,
                         return Result::Failure;
                 }
 
+		ConstMemory const grammar_class = decl_phrases->is_precedence ? ConstMemory ("Grammar_Precedence")
+                                                                              : ConstMemory ("Grammar_Switch");
+
 		if (!file->print ("StRef<Grammar>\n"
                                   "create_", opts->header_name, "_", (global_grammar ? ConstMemory ("grammar") : decl_name), " ()\n"
                                   "{\n"
-                                  "    static StRef<Grammar_Switch> grammar;\n"
+                                  "    static StRef<", grammar_class, "> grammar;\n"
                                   "    if (grammar)\n"
                                   "        return grammar;\n"
                                   "\n"
-                                  "    grammar = st_grab (new (std::nothrow) Grammar_Switch ());\n"
+                                  "    grammar = st_grab (new (std::nothrow) ", grammar_class, " ());\n"
                                   "    grammar->name = st_grab (new (std::nothrow) String (\"", decl_name, "\"));\n"))
                 {
                     return Result::Failure;
                 }
 
+		if (global_grammar) {
+		    if (!file->print ("    grammar->token_classify_func = ", opts->header_name, "_classify_token;\n"))
+                        return Result::Failure;
+		}
+
 		if (has_begin) {
 		    if (!file->print ("    grammar->begin_func = ", opts->header_name, "_", decl_name, "_begin_func;\n"))
                         return Result::Failure;
@@ -890,7 +1449,35 @@ compileSource (File                     * const mt_nonnull file,
 		if (!file->print ("\n"))
                     return Result::Failure;
 
-		{
+		if (decl_phrases->is_precedence) {
+		    if (!file->print ("    grammar->operand_grammar = create_", opts->header_name, "_", decl_name, "_Operand ();\n"
+                                      "    grammar->binary_grammar = create_", opts->header_name, "_", decl_name, "_Binary ();\n"
+                                      "\n"))
+                    {
+                        return Result::Failure;
+                    }
+
+		    Uint32 precedence = 0;
+		    List< StRef<Declaration_Phrases::PrecedenceLevel> >::DataIterator level_iter (decl_phrases->precedence_levels);
+		    while (!level_iter.done ()) {
+			StRef<Declaration_Phrases::PrecedenceLevel> &level = level_iter.next ();
+			++precedence;
+
+			List< StRef<String> >::DataIterator op_iter (level->operators);
+			while (!op_iter.done ()) {
+			    StRef<String> &op = op_iter.next ();
+			    if (!file->print ("    grammar->addOperator (\"", op, "\", ", precedence, ", ",
+                                                      (level->right_assoc ? ConstMemory ("true") : ConstMemory ("false")),
+                                                      " /* right_assoc */);\n"))
+                            {
+                                return Result::Failure;
+                            }
+			}
+		    }
+
+		    if (!file->print ("\n"))
+                        return Result::Failure;
+		} else {
 		    List< StRef<Declaration_Phrases::PhraseRecord> >::DataIterator phrase_iter (decl_phrases->phrases);
 		    while (!phrase_iter.done ()) {
 			StRef<Declaration_Phrases::PhraseRecord> &phrase_record = phrase_iter.next ();
@@ -1006,6 +1593,9 @@ compileSource (File                     * const mt_nonnull file,
 	}
     }
 
+    if (!compileSource_Symbols (file, pargen_task, opts))
+        return Result::Failure;
+
     if (!file->print ("}\n"
                       "\n"))
     {
@@ -0,0 +1,79 @@
+/*  Pargen - Flexible parser generator
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#ifndef PARGEN__TOKEN_DFA__H__
+#define PARGEN__TOKEN_DFA__H__
+
+
+#include <libmary/libmary.h>
+
+
+namespace Pargen {
+
+using namespace M;
+
+/*c
+ * Table-driven DFA for token classes ("name ~ pattern" in .par).
+ *
+ * Tables are generated by pargen and are statically initialized,
+ * hence this is a POD type.
+ */
+class TokenDfa
+{
+public:
+    Uint32 num_states;
+    // num_states * 256 entries: the next state + 1, 0 means no tranzition.
+    // The initial state is 0.
+    Uint16 const *tranzitions;
+    // Non-zero for accepting states.
+    Byte const *accepting;
+    // Bitmap of bytes which may start a matching token.
+    Uint32 first_bytes [8];
+
+    bool mayStartWith (Byte const c) const
+    {
+	return first_bytes [c >> 5] & ((Uint32) 1 << (c & 31));
+    }
+
+    bool match (ConstMemory const token) const
+    {
+	if (token.len() == 0)
+	    return accepting [0];
+
+	if (!mayStartWith (token.mem() [0]))
+	    return false;
+
+	Uint32 state = 0;
+	for (Size i = 0, i_end = token.len(); i < i_end; ++i) {
+	    Uint32 const next = tranzitions [state * 256 + token.mem() [i]];
+	    if (next == 0)
+		return false;
+
+	    state = next - 1;
+	}
+
+	return accepting [state];
+    }
+};
+
+}
+
+
+#endif /* PARGEN__TOKEN_DFA__H__ */
+
@@ -0,0 +1,650 @@
+/*  Pargen - Flexible parser generator
+    Copyright (C) 2011-2013 Dmitry Shatrov
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#include <pargen/parsing_exception.h>
+
+#include <pargen/token_dfa_compiler.h>
+
+
+using namespace M;
+
+namespace Pargen {
+
+namespace {
+
+class ByteSet
+{
+public:
+    Uint32 bits [8];
+
+    void clear ()
+    {
+	for (unsigned i = 0; i < 8; ++i)
+	    bits [i] = 0;
+    }
+
+    void add (unsigned const c)
+    {
+	bits [c >> 5] |= (Uint32) 1 << (c & 31);
+    }
+
+    void addRange (unsigned const from,
+		   unsigned const to)
+    {
+	for (unsigned c = from; c <= to; ++c)
+	    add (c);
+    }
+
+    void addSet (ByteSet const &set)
+    {
+	for (unsigned i = 0; i < 8; ++i)
+	    bits [i] |= set.bits [i];
+    }
+
+    void invert ()
+    {
+	for (unsigned i = 0; i < 8; ++i)
+	    bits [i] = ~bits [i];
+    }
+
+    bool contains (unsigned const c) const
+    {
+	return bits [c >> 5] & ((Uint32) 1 << (c & 31));
+    }
+};
+
+// Thompson's construction. Each state has either a byte tranzition
+// or up to two epsilon tranzitions.
+class NfaState
+{
+public:
+    ByteSet bytes;
+    bool has_bytes;
+    Size out;
+
+    Size eps [2];
+    unsigned num_eps;
+};
+
+class Nfa
+{
+public:
+    NfaState *states;
+    Size num_states;
+    Size max_states;
+
+    Size addState ()
+    {
+	if (num_states == max_states) {
+	    Size const new_max_states = (max_states ? max_states * 2 : 64);
+	    NfaState * const new_states = new (std::nothrow) NfaState [new_max_states];
+	    assert (new_states);
+	    for (Size i = 0; i < num_states; ++i)
+		new_states [i] = states [i];
+
+	    delete[] states;
+	    states = new_states;
+	    max_states = new_max_states;
+	}
+
+	NfaState * const state = &states [num_states];
+	state->bytes.clear ();
+	state->has_bytes = false;
+	state->out = 0;
+	state->num_eps = 0;
+
+	return num_states ++;
+    }
+
+    void addEpsilon (Size const from,
+		     Size const to)
+    {
+	assert (states [from].num_eps < 2);
+	states [from].eps [states [from].num_eps] = to;
+	++states [from].num_eps;
+    }
+
+    Nfa ()
+	: states (NULL),
+	  num_states (0),
+	  max_states (0)
+    {
+    }
+
+    ~Nfa ()
+    {
+	delete[] states;
+    }
+};
+
+// The end state of a fragment has no outgoing tranzitions.
+class Fragment
+{
+public:
+    Size start;
+    Size end;
+};
+
+class PatternParser
+{
+private:
+    ConstMemory const pattern;
+    FilePosition const &fpos;
+    Nfa * const nfa;
+
+    Size pos;
+
+    mt_throws Result error (ConstMemory const msg)
+    {
+	exc_throw (ParsingException, fpos, st_makeString ("bad token pattern \"", pattern, "\": ", msg));
+	return Result::Failure;
+    }
+
+    bool done () const
+    {
+	return pos >= pattern.len();
+    }
+
+    unsigned peek () const
+    {
+	return pattern.mem() [pos];
+    }
+
+    void makeByteFragment (ByteSet const &set,
+			   Fragment      * const mt_nonnull ret_frag)
+    {
+	Size const start = nfa->addState ();
+	Size const end = nfa->addState ();
+	nfa->states [start].bytes = set;
+	nfa->states [start].has_bytes = true;
+	nfa->states [start].out = end;
+
+	ret_frag->start = start;
+	ret_frag->end = end;
+    }
+
+    mt_throws Result parseEscape (ByteSet * const mt_nonnull ret_set)
+    {
+	if (done ())
+	    return error ("unfinished escape sequence");
+
+	unsigned const c = peek ();
+	++pos;
+
+	switch (c) {
+	    case 'd':
+		ret_set->addRange ('0', '9');
+		break;
+	    case 'w':
+		ret_set->addRange ('a', 'z');
+		ret_set->addRange ('A', 'Z');
+		ret_set->addRange ('0', '9');
+		ret_set->add ('_');
+		break;
+	    case 's':
+		ret_set->add (' ');
+		ret_set->add ('\t');
+		ret_set->add ('\n');
+		ret_set->add ('\r');
+		ret_set->add ('\f');
+		ret_set->add ('\v');
+		break;
+	    case 'n':
+		ret_set->add ('\n');
+		break;
+	    case 't':
+		ret_set->add ('\t');
+		break;
+	    case 'r':
+		ret_set->add ('\r');
+		break;
+	    case 'x': {
+		unsigned value = 0;
+		for (unsigned i = 0; i < 2; ++i) {
+		    if (done ())
+			return error ("two hex digits expected after \\x");
+
+		    unsigned const h = peek ();
+		    ++pos;
+		    if (h >= '0' && h <= '9')
+			value = value * 16 + (h - '0');
+		    else
+		    if (h >= 'a' && h <= 'f')
+			value = value * 16 + (h - 'a' + 10);
+		    else
+		    if (h >= 'A' && h <= 'F')
+			value = value * 16 + (h - 'A' + 10);
+		    else
+			return error ("two hex digits expected after \\x");
+		}
+		ret_set->add (value);
+	    } break;
+	    default:
+		ret_set->add (c);
+	}
+
+	return Result::Success;
+    }
+
+    mt_throws Result parseClass (ByteSet * const mt_nonnull ret_set)
+    {
+	bool negated = false;
+	if (!done () && peek () == '^') {
+	    negated = true;
+	    ++pos;
+	}
+
+	bool first = true;
+	for (;;) {
+	    if (done ())
+		return error ("']' expected");
+
+	    unsigned c = peek ();
+	    if (c == ']' && !first)
+		break;
+
+	    first = false;
+	    ++pos;
+
+	    if (c == '\\') {
+		ByteSet set;
+		set.clear ();
+		if (!parseEscape (&set))
+		    return Result::Failure;
+
+		ret_set->addSet (set);
+		continue;
+	    }
+
+	    if (pos + 1 < pattern.len() &&
+		peek () == '-' &&
+		(unsigned) pattern.mem() [pos + 1] != ']')
+	    {
+		++pos;
+		unsigned const to = peek ();
+		++pos;
+		if (to < c)
+		    return error ("bad character range");
+
+		ret_set->addRange (c, to);
+		continue;
+	    }
+
+	    ret_set->add (c);
+	}
+
+	// Skipping ']'
+	++pos;
+
+	if (negated)
+	    ret_set->invert ();
+
+	return Result::Success;
+    }
+
+    mt_throws Result parseAtom (Fragment * const mt_nonnull ret_frag)
+    {
+	unsigned const c = peek ();
+	++pos;
+
+	ByteSet set;
+	set.clear ();
+
+	switch (c) {
+	    case '(': {
+		if (!parseAlternation (ret_frag))
+		    return Result::Failure;
+
+		if (done () || peek () != ')')
+		    return error ("')' expected");
+
+		++pos;
+		return Result::Success;
+	    } break;
+	    case ')':
+		return error ("unbalanced ')'");
+	    case '*':
+	    case '+':
+	    case '?':
+		return error ("nothing to repeat");
+	    case '[':
+		if (!parseClass (&set))
+		    return Result::Failure;
+		break;
+	    case '.':
+		set.invert ();
+		break;
+	    case '\\':
+		if (!parseEscape (&set))
+		    return Result::Failure;
+		break;
+	    default:
+		set.add (c);
+	}
+
+	makeByteFragment (set, ret_frag);
+	return Result::Success;
+    }
+
+    mt_throws Result parseRepetition (Fragment * const mt_nonnull ret_frag)
+    {
+	Fragment frag;
+	if (!parseAtom (&frag))
+	    return Result::Failure;
+
+	while (!done ()) {
+	    unsigned const c = peek ();
+	    if (c == '*') {
+		Size const start = nfa->addState ();
+		Size const end = nfa->addState ();
+		nfa->addEpsilon (start, frag.start);
+		nfa->addEpsilon (start, end);
+		nfa->addEpsilon (frag.end, frag.start);
+		nfa->addEpsilon (frag.end, end);
+		frag.start = start;
+		frag.end = end;
+	    } else
+	    if (c == '+') {
+		Size const end = nfa->addState ();
+		nfa->addEpsilon (frag.end, frag.start);
+		nfa->addEpsilon (frag.end, end);
+		frag.end = end;
+	    } else
+	    if (c == '?') {
+		Size const start = nfa->addState ();
+		Size const end = nfa->addState ();
+		nfa->addEpsilon (start, frag.start);
+		nfa->addEpsilon (start, end);
+		nfa->addEpsilon (frag.end, end);
+		frag.start = start;
+		frag.end = end;
+	    } else {
+		break;
+	    }
+
+	    ++pos;
+	}
+
+	*ret_frag = frag;
+	return Result::Success;
+    }
+
+    mt_throws Result parseConcatenation (Fragment * const mt_nonnull ret_frag)
+    {
+	Fragment frag;
+	frag.start = nfa->addState ();
+	frag.end = frag.start;
+
+	while (!done () && peek () != '|' && peek () != ')') {
+	    Fragment next;
+	    if (!parseRepetition (&next))
+		return Result::Failure;
+
+	    nfa->addEpsilon (frag.end, next.start);
+	    frag.end = next.end;
+	}
+
+	*ret_frag = frag;
+	return Result::Success;
+    }
+
+public:
+    mt_throws Result parseAlternation (Fragment * const mt_nonnull ret_frag)
+    {
+	Fragment frag;
+	if (!parseConcatenation (&frag))
+	    return Result::Failure;
+
+	while (!done () && peek () == '|') {
+	    ++pos;
+
+	    Fragment alt;
+	    if (!parseConcatenation (&alt))
+		return Result::Failure;
+
+	    Size const start = nfa->addState ();
+	    Size const end = nfa->addState ();
+	    nfa->addEpsilon (start, frag.start);
+	    nfa->addEpsilon (start, alt.start);
+	    nfa->addEpsilon (frag.end, end);
+	    nfa->addEpsilon (alt.end, end);
+	    frag.start = start;
+	    frag.end = end;
+	}
+
+	*ret_frag = frag;
+	return Result::Success;
+    }
+
+    mt_throws Result parse (Fragment * const mt_nonnull ret_frag)
+    {
+	if (!parseAlternation (ret_frag))
+	    return Result::Failure;
+
+	if (!done ())
+	    return error ("unbalanced ')'");
+
+	return Result::Success;
+    }
+
+    PatternParser (ConstMemory          const pattern,
+		   FilePosition const &fpos,
+		   Nfa                * const mt_nonnull nfa)
+	: pattern (pattern),
+	  fpos (fpos),
+	  nfa (nfa),
+	  pos (0)
+    {
+    }
+};
+
+// Sets of NFA states are bitmaps of 'num_words' words.
+class SubsetBuilder
+{
+public:
+    Nfa const * const nfa;
+    Size const num_words;
+
+    Uint32 *sets;
+    Size num_sets;
+    Size max_sets;
+
+    Size *stack;
+
+    void closure (Uint32 * const mt_nonnull set)
+    {
+	Size num_stack = 0;
+	for (Size i = 0; i < nfa->num_states; ++i) {
+	    if (set [i >> 5] & ((Uint32) 1 << (i & 31)))
+		stack [num_stack ++] = i;
+	}
+
+	while (num_stack > 0) {
+	    NfaState const &state = nfa->states [stack [-- num_stack]];
+	    for (unsigned i = 0; i < state.num_eps; ++i) {
+		Size const to = state.eps [i];
+		if (!(set [to >> 5] & ((Uint32) 1 << (to & 31)))) {
+		    set [to >> 5] |= (Uint32) 1 << (to & 31);
+		    stack [num_stack ++] = to;
+		}
+	    }
+	}
+    }
+
+    // Returns the index of the set, adding it if needed.
+    Size lookupSet (Uint32 const * const mt_nonnull set)
+    {
+	for (Size i = 0; i < num_sets; ++i) {
+	    if (memcmp (sets + i * num_words, set, num_words * sizeof (Uint32)) == 0)
+		return i;
+	}
+
+	if (num_sets == max_sets) {
+	    Size const new_max_sets = (max_sets ? max_sets * 2 : 64);
+	    Uint32 * const new_sets = new (std::nothrow) Uint32 [new_max_sets * num_words];
+	    assert (new_sets);
+	    if (num_sets > 0)
+		memcpy (new_sets, sets, num_sets * num_words * sizeof (Uint32));
+
+	    delete[] sets;
+	    sets = new_sets;
+	    max_sets = new_max_sets;
+	}
+
+	memcpy (sets + num_sets * num_words, set, num_words * sizeof (Uint32));
+	return num_sets ++;
+    }
+
+    SubsetBuilder (Nfa const * const mt_nonnull nfa)
+	: nfa (nfa),
+	  num_words ((nfa->num_states + 31) / 32),
+	  sets (NULL),
+	  num_sets (0),
+	  max_sets (0)
+    {
+	// Each state is pushed at most once per closure.
+	stack = new (std::nothrow) Size [nfa->num_states];
+	assert (stack);
+    }
+
+    ~SubsetBuilder ()
+    {
+	delete[] sets;
+	delete[] stack;
+    }
+};
+
+}
+
+mt_throws Result
+compileTokenDfa (Declaration_TokenClass * const mt_nonnull decl,
+		 FilePosition const     &fpos)
+{
+    assert (decl && decl->pattern);
+
+    Nfa nfa;
+    Fragment frag;
+    {
+	PatternParser parser (decl->pattern->mem(), fpos, &nfa);
+	if (!parser.parse (&frag))
+	    return Result::Failure;
+    }
+
+    SubsetBuilder builder (&nfa);
+    Size const num_words = builder.num_words;
+
+    Uint32 * const cur_set = new (std::nothrow) Uint32 [num_words];
+    Uint32 * const next_set = new (std::nothrow) Uint32 [num_words];
+    assert (cur_set && next_set);
+
+    Uint32 *tranzitions = NULL;
+    Size max_tranzition_states = 0;
+
+    {
+	memset (cur_set, 0, num_words * sizeof (Uint32));
+	cur_set [frag.start >> 5] |= (Uint32) 1 << (frag.start & 31);
+	builder.closure (cur_set);
+	builder.lookupSet (cur_set);
+    }
+
+    for (Size dfa_state = 0; dfa_state < builder.num_sets; ++dfa_state) {
+	if (dfa_state == max_tranzition_states) {
+	    Size const new_max = (max_tranzition_states ? max_tranzition_states * 2 : 64);
+	    Uint32 * const new_tranzitions = new (std::nothrow) Uint32 [new_max * 256];
+	    assert (new_tranzitions);
+	    if (dfa_state > 0)
+		memcpy (new_tranzitions, tranzitions, dfa_state * 256 * sizeof (Uint32));
+
+	    delete[] tranzitions;
+	    tranzitions = new_tranzitions;
+	    max_tranzition_states = new_max;
+	}
+
+	// 'builder.sets' may be reallocated below.
+	memcpy (cur_set, builder.sets + dfa_state * num_words, num_words * sizeof (Uint32));
+
+	for (unsigned c = 0; c < 256; ++c) {
+	    memset (next_set, 0, num_words * sizeof (Uint32));
+	    bool got_state = false;
+	    for (Size i = 0; i < nfa.num_states; ++i) {
+		if (!(cur_set [i >> 5] & ((Uint32) 1 << (i & 31))))
+		    continue;
+
+		NfaState const &state = nfa.states [i];
+		if (state.has_bytes && state.bytes.contains (c)) {
+		    next_set [state.out >> 5] |= (Uint32) 1 << (state.out & 31);
+		    got_state = true;
+		}
+	    }
+
+	    if (!got_state) {
+		tranzitions [dfa_state * 256 + c] = 0;
+		continue;
+	    }
+
+	    builder.closure (next_set);
+	    tranzitions [dfa_state * 256 + c] = builder.lookupSet (next_set) + 1;
+	}
+
+	if (builder.num_sets >= 0xffff) {
+	    delete[] tranzitions;
+	    delete[] cur_set;
+	    delete[] next_set;
+
+	    exc_throw (ParsingException, fpos,
+		       st_makeString ("token pattern \"", decl->pattern, "\" is too complex"));
+	    return Result::Failure;
+	}
+    }
+
+    Size const num_states = builder.num_sets;
+
+    delete[] decl->tranzitions;
+    delete[] decl->accepting;
+
+    decl->num_states = num_states;
+    decl->tranzitions = new (std::nothrow) Uint16 [num_states * 256];
+    decl->accepting = new (std::nothrow) Byte [num_states];
+    assert (decl->tranzitions && decl->accepting);
+
+    for (Size i = 0; i < num_states * 256; ++i)
+	decl->tranzitions [i] = (Uint16) tranzitions [i];
+
+    for (Size i = 0; i < num_states; ++i) {
+	Uint32 const * const set = builder.sets + i * num_words;
+	decl->accepting [i] = (set [frag.end >> 5] & ((Uint32) 1 << (frag.end & 31))) ? 1 : 0;
+    }
+
+    for (unsigned i = 0; i < 8; ++i)
+	decl->first_bytes [i] = 0;
+
+    for (unsigned c = 0; c < 256; ++c) {
+	if (decl->tranzitions [c] != 0)
+	    decl->first_bytes [c >> 5] |= (Uint32) 1 << (c & 31);
+    }
+
+    delete[] tranzitions;
+    delete[] cur_set;
+    delete[] next_set;
+
+    return Result::Success;
+}
+
+}
+
@@ -127,6 +127,29 @@ public:
 
     virtual mt_throws Result getFilePosition (FilePosition *ret_fpos) = 0;
 
+    // Offsets of the first byte of the last token returned by getNextToken()
+    // and of the byte after it, in the units of PositionMarker::Body::offset.
+    // Used for source spans of parser elements (see ParserConfig::source_spans).
+    // The default implementation reports an empty span at the current position.
+    virtual void getTokenSpan (FileSize * const mt_nonnull ret_begin,
+                               FileSize * const mt_nonnull ret_end)
+    {
+        PositionMarker pmark;
+        pmark.body.offset = 0;
+        getPosition (&pmark);
+        *ret_begin = pmark.body.offset;
+        *ret_end   = pmark.body.offset;
+    }
+
+    // Memory which stays valid and unchanged while the results of parsing
+    // are in use. Tokens which lie within this memory are referenced by
+    // parser elements directly instead of being copied.
+    // Returns empty memory by default, meaning that every token is copied.
+    virtual ConstMemory getStableMemory ()
+    {
+        return ConstMemory ();
+    }
+
 #if 0
     // TODO ?
     virtual unsigned long getLine ()
@@ -0,0 +1,102 @@
+#include <cstdlib>
+
+#include <libmary/libmary.h>
+
+#include <pargen/memory_token_stream.h>
+#include <pargen/parsing_exception.h>
+#include <pargen/parser.h>
+
+#include "test_pargen.h"
+
+using namespace M;
+using namespace Pargen;
+using namespace MyModule;
+
+static char const good_input [] = "class A { } ;\n"
+                                  "class B { } ;\n";
+
+// The second declaration fails at ';' after the cut, which follows 'class'.
+static char const bad_input [] = "class A { } ;\n"
+                                 "class B ;\n";
+
+// The token stream is left right after 'B' when '{' fails to match.
+// MemoryTokenStream reports the column in FilePosition::line_pos.
+static Uint64 const expected_line     = 1;
+static Uint64 const expected_column   = 7;
+static Uint64 const expected_char_pos = 21;
+
+static mt_throws Result
+parseInput (ConstMemory const input)
+{
+    MemoryTokenStream token_stream;
+    token_stream.init (input);
+
+    ParserElement *element = NULL;
+    StRef<StReferenced> element_container;
+    return parse (&token_stream,
+                  NULL /* lookup_data */,
+                  NULL /* user_data */,
+                  create_test_grammar (),
+                  &element,
+                  &element_container);
+}
+
+static bool
+checkGoodInput ()
+{
+    if (!parseInput (ConstMemory (good_input, sizeof (good_input) - 1))) {
+        errs->println ("Parsing error: ", exc->toString());
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+checkBadInput ()
+{
+    if (parseInput (ConstMemory (bad_input, sizeof (bad_input) - 1))) {
+        errs->println ("A failure after a cut has not been reported");
+        return false;
+    }
+
+    ParsingException * const parsing_exc = dynamic_cast <ParsingException*> (exc);
+    if (!parsing_exc) {
+        errs->println ("Expected a ParsingException, got: ", exc->toString());
+        return false;
+    }
+
+    FilePosition const &fpos = parsing_exc->fpos;
+    if (fpos.line     != expected_line   ||
+        fpos.line_pos != expected_column ||
+        fpos.char_pos != expected_char_pos)
+    {
+        errs->println ("Syntax error reported at line ", fpos.line,
+                       ", column ", fpos.line_pos, ", offset ", fpos.char_pos, "; "
+                       "expected line ", expected_line,
+                       ", column ", expected_column, ", offset ", expected_char_pos);
+        return false;
+    }
+
+    return true;
+}
+
+int main (void)
+{
+    libMaryInit ();
+
+    bool ok = true;
+
+    if (!checkGoodInput ())
+        ok = false;
+
+    if (!checkBadInput ())
+        ok = false;
+
+    if (!ok)
+        return EXIT_FAILURE;
+
+    errs->println ("OK");
+    return 0;
+}
+
@@ -0,0 +1,184 @@
+#include <cstdlib>
+
+#include <libmary/libmary.h>
+
+#include <pargen/memory_token_stream.h>
+#include <pargen/parser.h>
+
+#include "test_pargen.h"
+
+using namespace M;
+using namespace Pargen;
+using namespace MyModule;
+
+static char const input [] = "let a = 1 ;\n"
+                             "let b = 2 ;\n"
+                             "let c = 3 ;\n";
+
+static char const expected_events [] =
+        "Grammar{ "
+            "Item{ let Name{ a } = 1 ; } "
+            "Item{ let Name{ b } = 2 ; } "
+            "Item{ let Name{ c } = 3 ; } "
+        "} ";
+
+static char const expected_items [] = "a=1 b=2 c=3 ";
+
+class EventRecorder : public ParserEventHandler
+{
+public:
+    StRef<String> events;
+
+    void phraseBegin (Grammar * const grammar,
+                      void    * const /* user_data */)
+    {
+        events = st_makeString (events, grammar->toString(), "{ ");
+    }
+
+    void token (ConstMemory   const token,
+                void        * const /* token_user_ptr */,
+                void        * const /* user_data */)
+    {
+        events = st_makeString (events, token, " ");
+    }
+
+    void phraseEnd (Grammar * const /* grammar */,
+                    void    * const /* user_data */)
+    {
+        events = st_makeString (events, "} ");
+    }
+
+    EventRecorder ()
+        : events (st_grab (new (std::nothrow) String))
+    {
+    }
+};
+
+static bool
+checkEvents (ParserConfig * const parser_config,
+             ConstMemory    const config_name)
+{
+    MemoryTokenStream token_stream;
+    token_stream.init (ConstMemory (input, sizeof (input) - 1));
+
+    EventRecorder recorder;
+    if (!parseEvents (&token_stream,
+                      NULL /* lookup_data */,
+                      NULL /* user_data */,
+                      create_test_grammar (),
+                      &recorder,
+                      ConstMemory ("default"),
+                      parser_config))
+    {
+        errs->println (config_name, ": parseEvents() failed: ", exc->toString());
+        return false;
+    }
+
+    if (!equal (recorder.events->mem(), ConstMemory (expected_events, sizeof (expected_events) - 1))) {
+        errs->println (config_name, ": parseEvents(): got \"", recorder.events, "\", "
+                       "expected \"", expected_events, "\"");
+        return false;
+    }
+
+    return true;
+}
+
+class ItemRecorder
+{
+public:
+    StRef<String> items;
+    bool bad_item;
+
+    ItemRecorder ()
+        : items (st_grab (new (std::nothrow) String)),
+          bad_item (false)
+    {
+    }
+};
+
+static void
+itemFunc (ParserElement * const item_element,
+          ParserControl * const /* parser_control */,
+          void          * const _recorder)
+{
+    ItemRecorder * const recorder = static_cast <ItemRecorder*> (_recorder);
+
+    TestElement * const el = static_cast <TestElement*> (item_element);
+    if (!el || el->test_element_type != TestElement::t_Item) {
+        recorder->bad_item = true;
+        return;
+    }
+
+    Test_Item * const item = static_cast <Test_Item*> (el);
+    recorder->items = st_makeString (recorder->items,
+                                     item->name->any_token->token, "=", item->any_token->token, " ");
+}
+
+static bool
+checkItems (ParserConfig * const parser_config,
+            ConstMemory    const config_name)
+{
+    MemoryTokenStream token_stream;
+    token_stream.init (ConstMemory (input, sizeof (input) - 1));
+
+    ItemRecorder recorder;
+    if (!parseItems (&token_stream,
+                     NULL /* lookup_data */,
+                     &recorder /* user_data */,
+                     create_test_grammar (),
+                     itemFunc,
+                     ConstMemory ("default"),
+                     parser_config))
+    {
+        errs->println (config_name, ": parseItems() failed: ", exc->toString());
+        return false;
+    }
+
+    if (recorder.bad_item) {
+        errs->println (config_name, ": parseItems(): unexpected item element");
+        return false;
+    }
+
+    if (!equal (recorder.items->mem(), ConstMemory (expected_items, sizeof (expected_items) - 1))) {
+        errs->println (config_name, ": parseItems(): got \"", recorder.items, "\", "
+                       "expected \"", expected_items, "\"");
+        return false;
+    }
+
+    return true;
+}
+
+int main (void)
+{
+    libMaryInit ();
+
+    StRef<ParserConfig> const deferred_config =
+            createParserConfig (true  /* upwards_jumps */,
+                                NULL  /* profile */,
+                                true  /* forward_optimization */,
+                                true  /* negative_cache */,
+                                true  /* adaptive_negative_cache */,
+                                false /* source_spans */,
+                                true  /* deferred_actions */);
+
+    bool ok = true;
+
+    if (!checkEvents (NULL /* parser_config */, ConstMemory ("default config")))
+        ok = false;
+
+    if (!checkEvents (deferred_config, ConstMemory ("deferred actions")))
+        ok = false;
+
+    if (!checkItems (NULL /* parser_config */, ConstMemory ("default config")))
+        ok = false;
+
+    if (!checkItems (deferred_config, ConstMemory ("deferred actions")))
+        ok = false;
+
+    if (!ok)
+        return EXIT_FAILURE;
+
+    errs->println ("OK");
+    return 0;
+}
+
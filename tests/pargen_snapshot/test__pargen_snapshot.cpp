@@ -0,0 +1,311 @@
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libmary/libmary.h>
+
+#include <pargen/memory_token_stream.h>
+#include <pargen/parser.h>
+#include <pargen/grammar_snapshot.h>
+
+#include "test_pargen.h"
+
+using namespace M;
+using namespace Pargen;
+using namespace MyModule;
+
+static char const input [] = "let x = 1 + 2 * y ;\n"
+                             "print x - 3 / 4 ;\n"
+                             "let if_ = x ;\n";
+
+static char const snapshot_filename [] = "test.snapshot";
+
+namespace MyModule {
+
+void
+test_Stmt_accept_func (Test_Stmt            * const stmt,
+                       Pargen::ParserControl * const /* parser_control */,
+                       void                  * const _num_accepted)
+{
+    if (!stmt)
+        return;
+
+    ++*static_cast <Size*> (_num_accepted);
+}
+
+}
+
+class EventRecorder : public ParserEventHandler
+{
+public:
+    StRef<String> events;
+
+    void phraseBegin (Grammar * const grammar,
+                      void    * const /* user_data */)
+    {
+        events = st_makeString (events, grammar->toString(), "{ ");
+    }
+
+    void token (ConstMemory   const token,
+                void        * const /* token_user_ptr */,
+                void        * const /* user_data */)
+    {
+        events = st_makeString (events, token, " ");
+    }
+
+    void phraseEnd (Grammar * const /* grammar */,
+                    void    * const /* user_data */)
+    {
+        events = st_makeString (events, "} ");
+    }
+
+    EventRecorder ()
+        : events (st_grab (new (std::nothrow) String))
+    {
+    }
+};
+
+static mt_throws Result
+parseInput (Grammar       * const mt_nonnull grammar,
+            EventRecorder * const mt_nonnull recorder,
+            Size          * const mt_nonnull ret_num_accepted)
+{
+    *ret_num_accepted = 0;
+
+    MemoryTokenStream token_stream;
+    token_stream.init (ConstMemory (input, sizeof (input) - 1));
+
+    return parseEvents (&token_stream,
+                        NULL /* lookup_data */,
+                        ret_num_accepted /* user_data */,
+                        grammar,
+                        recorder);
+}
+
+static bool
+saveSnapshot (Grammar        * const mt_nonnull grammar,
+              GrammarSymbols * const mt_nonnull symbols)
+{
+    NativeFile file;
+    if (!file.open (ConstMemory (snapshot_filename),
+                    FileOpenFlags::Create | FileOpenFlags::Truncate,
+                    FileAccessMode::ReadWrite))
+    {
+        errs->println ("Could not open ", snapshot_filename, ": ", exc->toString());
+        return false;
+    }
+
+    if (!saveGrammarSnapshot (&file, grammar, symbols)) {
+        errs->println ("saveGrammarSnapshot() failed: ", exc->toString());
+        return false;
+    }
+
+    file.close (true /* flush_data */);
+    return true;
+}
+
+// Returns the number of words read, 0 on error. The buffer is word-aligned
+// so that the snapshot can be patched in place.
+static Size
+readSnapshot (Uint32 ** const mt_nonnull ret_words)
+{
+    *ret_words = NULL;
+
+    int const fd = open (snapshot_filename, O_RDONLY);
+    if (fd == -1) {
+        errs->println ("Could not open ", snapshot_filename);
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat (fd, &st) == -1
+        || st.st_size == 0
+        || st.st_size % sizeof (Uint32) != 0)
+    {
+        errs->println ("Bad snapshot file size");
+        close (fd);
+        return 0;
+    }
+
+    Size const num_words = (Size) st.st_size / sizeof (Uint32);
+    Uint32 * const words = new (std::nothrow) Uint32 [num_words];
+    assert (words);
+
+    if (read (fd, words, (size_t) st.st_size) != (ssize_t) st.st_size) {
+        errs->println ("Could not read ", snapshot_filename);
+        delete[] words;
+        close (fd);
+        return 0;
+    }
+
+    close (fd);
+
+    *ret_words = words;
+    return num_words;
+}
+
+static bool
+checkRoundTrip (Grammar        * const mt_nonnull grammar,
+                GrammarSymbols * const mt_nonnull symbols)
+{
+    StRef<Grammar> loaded_grammar;
+    if (!loadGrammarSnapshotFile (ConstMemory (snapshot_filename), symbols, &loaded_grammar)) {
+        errs->println ("loadGrammarSnapshotFile() failed: ", exc->toString());
+        return false;
+    }
+
+    EventRecorder generated_recorder;
+    Size generated_num_accepted;
+    if (!parseInput (grammar, &generated_recorder, &generated_num_accepted)) {
+        errs->println ("Parsing with the generated grammar failed: ", exc->toString());
+        return false;
+    }
+
+    EventRecorder loaded_recorder;
+    Size loaded_num_accepted;
+    if (!parseInput (loaded_grammar, &loaded_recorder, &loaded_num_accepted)) {
+        errs->println ("Parsing with the loaded grammar failed: ", exc->toString());
+        return false;
+    }
+
+    bool ok = true;
+
+    if (generated_num_accepted != 3) {
+        errs->println ("Generated grammar: ", generated_num_accepted, " statements accepted, expected 3");
+        ok = false;
+    }
+
+    if (loaded_num_accepted != generated_num_accepted) {
+        errs->println ("Loaded grammar: ", loaded_num_accepted, " statements accepted, "
+                       "expected ", generated_num_accepted);
+        ok = false;
+    }
+
+    if (!equal (loaded_recorder.events->mem(), generated_recorder.events->mem())) {
+        errs->println ("Loaded grammar: events differ\n"
+                       "generated: ", generated_recorder.events, "\n"
+                       "loaded:    ", loaded_recorder.events);
+        ok = false;
+    }
+
+    return ok;
+}
+
+static bool
+expectLoadFailure (Uint32         * const mt_nonnull words,
+                   Size             const num_words,
+                   GrammarSymbols * const mt_nonnull symbols,
+                   ConstMemory      const what)
+{
+    StRef<Grammar> loaded_grammar;
+    if (loadGrammarSnapshot (ConstMemory ((Byte const *) words, num_words * sizeof (Uint32)),
+                             symbols,
+                             &loaded_grammar))
+    {
+        errs->println ("A snapshot with ", what, " has been loaded");
+        return false;
+    }
+
+    if (loaded_grammar) {
+        errs->println ("A grammar is returned for a snapshot with ", what);
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+checkCorruptedSnapshots (GrammarSymbols * const mt_nonnull symbols)
+{
+    Uint32 *words;
+    Size const num_words = readSnapshot (&words);
+    if (num_words == 0)
+        return false;
+
+    bool ok = true;
+
+    {
+        StRef<Grammar> loaded_grammar;
+        if (!loadGrammarSnapshot (ConstMemory ((Byte const *) words, num_words * sizeof (Uint32)),
+                                  symbols,
+                                  &loaded_grammar))
+        {
+            errs->println ("loadGrammarSnapshot() failed: ", exc->toString());
+            ok = false;
+        }
+    }
+
+    {
+        GrammarSymbols empty_symbols;
+        if (!expectLoadFailure (words, num_words, &empty_symbols, ConstMemory ("unknown symbols")))
+            ok = false;
+    }
+
+    for (Size len = 0; len < num_words; len += (len < 8 ? 1 : num_words / 8 + 1)) {
+        if (!expectLoadFailure (words, len, symbols, ConstMemory ("missing words")))
+            ok = false;
+    }
+
+    {
+        words [0] ^= 1;
+        if (!expectLoadFailure (words, num_words, symbols, ConstMemory ("bad magic")))
+            ok = false;
+
+        words [0] ^= 1;
+    }
+
+    {
+      // Skipping magic, version and the strings to get to the type
+      // of the root grammar.
+        Size pos = 2;
+        Uint32 const num_strings = words [pos++];
+        for (Uint32 i = 0; i < num_strings && pos < num_words; ++i)
+            pos += 1 + (words [pos] + sizeof (Uint32) - 1) / sizeof (Uint32);
+
+        Size const type_pos = pos + 1;
+        if (type_pos >= num_words) {
+            errs->println ("Unexpected snapshot layout");
+            ok = false;
+        } else {
+            Uint32 const type = words [type_pos];
+            words [type_pos] = 0x7fffffff;
+            if (!expectLoadFailure (words, num_words, symbols, ConstMemory ("unknown grammar type")))
+                ok = false;
+
+            words [type_pos] = type;
+        }
+    }
+
+    delete[] words;
+    return ok;
+}
+
+int main (void)
+{
+    libMaryInit ();
+
+    GrammarSymbols symbols;
+    register_test_symbols (&symbols);
+
+    StRef<Grammar> const grammar = create_test_grammar ();
+
+    if (!saveSnapshot (grammar, &symbols))
+        return EXIT_FAILURE;
+
+    bool ok = true;
+
+    if (!checkRoundTrip (grammar, &symbols))
+        ok = false;
+
+    if (!checkCorruptedSnapshots (&symbols))
+        ok = false;
+
+    if (!ok)
+        return EXIT_FAILURE;
+
+    errs->println ("OK");
+    return 0;
+}
+
@@ -0,0 +1,163 @@
+#include <cstdlib>
+#include <cstring>
+
+#include <libmary/libmary.h>
+
+#include <pargen/memory_token_stream.h>
+#include <pargen/parser.h>
+#include <pargen/grammar_snapshot.h>
+
+#include "test_pargen.h"
+
+using namespace M;
+using namespace Pargen;
+using namespace MyModule;
+
+// "if" is a literal token of the grammar and an {ident} at the same time.
+static char const input [] = "if 1 ;\n"
+                             "if = 2 ;\n"
+                             "x1 = 3 ;\n";
+
+static char const expected_stmts [] = "If(1) Assign(if=2) Assign(x1=3) ";
+
+static bool
+checkTokenDfa (GrammarSymbols * const mt_nonnull symbols)
+{
+    TokenDfa const * const ident_dfa =
+            static_cast <TokenDfa const*> (symbols->lookupData (ConstMemory ("test_ident_token_dfa")));
+    TokenDfa const * const number_dfa =
+            static_cast <TokenDfa const*> (symbols->lookupData (ConstMemory ("test_number_token_dfa")));
+    if (!ident_dfa || !number_dfa) {
+        errs->println ("Token class DFAs are not registered");
+        return false;
+    }
+
+    struct TokenCase
+    {
+        char const *token;
+        bool        is_ident;
+        bool        is_number;
+    };
+
+    static TokenCase const token_cases [] = {
+        { "if",      true,  false },
+        { "x1",      true,  false },
+        { "_",       true,  false },
+        { "a_b_9",   true,  false },
+        { "42",      false, true  },
+        { "0",       false, true  },
+        { "1x",      false, false },
+        { "X",       false, false },
+        { "=",       false, false },
+        { "",        false, false }
+    };
+
+    bool ok = true;
+    for (Size i = 0; i < sizeof (token_cases) / sizeof (token_cases [0]); ++i) {
+        TokenCase const &token_case = token_cases [i];
+        ConstMemory const token (token_case.token, strlen (token_case.token));
+
+        if (ident_dfa->match (token) != token_case.is_ident) {
+            errs->println ("ident: wrong match result for \"", token, "\"");
+            ok = false;
+        }
+
+        if (number_dfa->match (token) != token_case.is_number) {
+            errs->println ("number: wrong match result for \"", token, "\"");
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+static bool
+checkParse (ParserConfig * const parser_config,
+            ConstMemory    const config_name)
+{
+    MemoryTokenStream token_stream;
+    token_stream.init (ConstMemory (input, sizeof (input) - 1));
+
+    StRef<Grammar> const grammar = create_test_grammar ();
+
+    ParserElement *element = NULL;
+    StRef<StReferenced> element_container;
+    if (!parse (&token_stream,
+                NULL /* lookup_data */,
+                NULL /* user_data */,
+                grammar,
+                &element,
+                &element_container,
+                ConstMemory ("default"),
+                parser_config))
+    {
+        errs->println (config_name, ": parsing error: ", exc->toString());
+        return false;
+    }
+
+    if (!element) {
+        errs->println (config_name, ": no match");
+        return false;
+    }
+
+    Test_Grammar * const test_grammar = static_cast <Test_Grammar*> (element);
+
+    StRef<String> stmts = st_grab (new (std::nothrow) String);
+    IntrusiveList<Test_Stmt>::iterator stmt_iter (test_grammar->stmts);
+    while (!stmt_iter.done ()) {
+        Test_Stmt * const stmt = stmt_iter.next ();
+        switch (stmt->stmt_type) {
+            case Test_Stmt::t_If: {
+                Test_Stmt_If * const stmt_if = static_cast <Test_Stmt_If*> (stmt);
+                stmts = st_makeString (stmts, "If(", stmt_if->value->any_token->token, ") ");
+            } break;
+            case Test_Stmt::t_Assign: {
+                Test_Stmt_Assign * const stmt_assign = static_cast <Test_Stmt_Assign*> (stmt);
+                stmts = st_makeString (stmts,
+                                       "Assign(", stmt_assign->any_token->token,
+                                       "=", stmt_assign->value->any_token->token, ") ");
+            } break;
+        }
+    }
+
+    if (!equal (stmts->mem(), ConstMemory (expected_stmts, sizeof (expected_stmts) - 1))) {
+        errs->println (config_name, ": got \"", stmts, "\", expected \"", expected_stmts, "\"");
+        return false;
+    }
+
+    return true;
+}
+
+int main (void)
+{
+    libMaryInit ();
+
+    GrammarSymbols symbols;
+    register_test_symbols (&symbols);
+
+    bool ok = true;
+
+    if (!checkTokenDfa (&symbols))
+        ok = false;
+
+    // Switch prediction must not drop {ident} alternatives for tokens
+    // which are literals elsewhere in the grammar.
+    if (!checkParse (NULL /* parser_config */, ConstMemory ("default config")))
+        ok = false;
+
+    {
+        StRef<ParserConfig> const parser_config =
+                createParserConfig (true  /* upwards_jumps */,
+                                    NULL  /* profile */,
+                                    false /* forward_optimization */);
+        if (!checkParse (parser_config, ConstMemory ("no forward optimization")))
+            ok = false;
+    }
+
+    if (!ok)
+        return EXIT_FAILURE;
+
+    errs->println ("OK");
+    return 0;
+}
+